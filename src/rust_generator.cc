@@ -1,15 +1,24 @@
 #include "src/rust_generator.h"
 
+#include "absl/algorithm/container.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_join.h"
 #include "absl/strings/str_replace.h"
 #include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
 #include "absl/strings/string_view.h"
 #include <google/protobuf/compiler/rust/context.h>
 #include <google/protobuf/compiler/rust/naming.h>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/duration.pb.h>
 #include <google/protobuf/io/zero_copy_stream.h>
 #include <google/protobuf/stubs/common.h>
 
+#include "grpc/rust/options.pb.h"
+
+#include <algorithm>
+#include <initializer_list>
 #include <utility>
 #include <vector>
 
@@ -18,6 +27,7 @@ namespace protobuf = google::protobuf;
 namespace rust = protobuf::compiler::rust;
 
 using protobuf::Descriptor;
+using protobuf::FieldDescriptor;
 using protobuf::MethodDescriptor;
 using protobuf::ServiceDescriptor;
 using protobuf::SourceLocation;
@@ -72,6 +82,95 @@ public:
   /// Checks if the method is deprecated. Default is false.
   bool is_deprecated() const { return method_->options().deprecated(); }
 
+  /// The position of the method in its service, used to index per-method
+  /// state in generated code.
+  int index() const { return method_->index(); }
+
+  /// The idempotency level declared in the method options. Default is
+  /// IDEMPOTENCY_UNKNOWN.
+  protobuf::MethodOptions::IdempotencyLevel idempotency_level() const {
+    return method_->options().idempotency_level();
+  }
+
+  /// Checks if the method may safely be sent more than once.
+  bool is_idempotent() const {
+    return idempotency_level() == protobuf::MethodOptions::NO_SIDE_EFFECTS ||
+           idempotency_level() == protobuf::MethodOptions::IDEMPOTENT;
+  }
+
+  /// Checks if the method has no side effects, so its result only depends on
+  /// the request.
+  bool has_no_side_effects() const {
+    return idempotency_level() == protobuf::MethodOptions::NO_SIDE_EFFECTS;
+  }
+
+  /// The `(grpc.rust.method)` options of the method.
+  const ::grpc::rust::MethodOptions &rust_options() const {
+    return method_->options().GetExtension(::grpc::rust::method);
+  }
+
+  /// Checks if the method's streamed messages get a bounded channel, sized by
+  /// the `stream_buffer` option.
+  bool has_stream_buffer() const { return rust_options().has_stream_buffer(); }
+
+  /// Checks if large messages of the method are decoded on the blocking
+  /// pool, as set by the `offload_threshold_bytes` option.
+  bool has_offload() const {
+    return rust_options().has_offload_threshold_bytes();
+  }
+
+  /// Checks if the server limits the method's concurrent calls, as set by
+  /// the `max_in_flight` and `max_queue` options.
+  bool has_admission_limits() const {
+    return rust_options().has_max_in_flight();
+  }
+
+  /// The method's weight under fair scheduling, from the `priority` option.
+  uint32_t priority() const {
+    return rust_options().has_priority() ? rust_options().priority() : 1;
+  }
+
+  /// Checks if the method's server handler returns encoded responses, as set
+  /// by the `pre_encoded` option.
+  bool is_pre_encoded() const { return rust_options().pre_encoded(); }
+
+  /// Checks if the server runs the method's handler on the blocking pool, as
+  /// set by an `executor` option of `blocking`.
+  bool runs_blocking() const { return rust_options().executor() == "blocking"; }
+
+  /// The name of the executor pool the server runs the method's handler on,
+  /// from an `executor` option of `pool(<name>)`, or empty.
+  absl::string_view executor_pool() const {
+    absl::string_view executor = rust_options().executor();
+    if (!absl::ConsumePrefix(&executor, "pool(") ||
+        !absl::ConsumeSuffix(&executor, ")")) {
+      return "";
+    }
+    return executor;
+  }
+
+  /// Checks if the server decodes the method's requests into reused
+  /// messages, as set by the `pooled_request` option.
+  bool has_pooled_request() const { return rust_options().pooled_request(); }
+
+  /// Checks if calls of the method get a default deadline, as set by the
+  /// `timeout` option.
+  bool has_timeout() const { return rust_options().has_timeout(); }
+
+  /// Checks if the server decodes the method's streamed requests ahead of
+  /// the handler, as set by the `pipeline_depth` option.
+  bool has_pipeline() const { return rust_options().has_pipeline_depth(); }
+
+  /// The method that serves batches of this method's requests, as named by
+  /// the `batch` option, or null if the method is not batched.
+  const MethodDescriptor *batch_method() const {
+    if (!rust_options().has_batch()) {
+      return nullptr;
+    }
+    return method_->service()->FindMethodByName(
+        rust_options().batch().method());
+  }
+
   /**
    * Type name of request and response.
    * @param proto_path The path to the proto file, for context.
@@ -146,6 +245,27 @@ static std::string FormatMethodPath(const Service &service,
                          method.proto_field_name());
 }
 
+/**
+ * @brief Formats a duration option as a Rust expression.
+ * @return `Some(std::time::Duration)` if the option is set, `None` otherwise.
+ */
+static std::string FormatOptionalDuration(bool has_duration,
+                                          const protobuf::Duration &duration) {
+  if (!has_duration) {
+    return "None";
+  }
+  return absl::StrFormat("Some(std::time::Duration::new(%d, %d))",
+                         duration.seconds(), duration.nanos());
+}
+
+/**
+ * @brief The name of the accessors protobuf generates for a field, e.g.
+ * `items` for `items()`, `items_mut()` and `set_items()`.
+ */
+static std::string FieldAccessorName(const FieldDescriptor &field) {
+  return rust::FieldNameWithCollisionAvoidance(field);
+}
+
 static std::string SanitizeForRustDoc(absl::string_view raw_comment) {
   // 1. Escape the escape character itself first.
   std::string sanitized = absl::StrReplaceAll(raw_comment, {{"\\", "\\\\"}});
@@ -181,14 +301,555 @@ static std::string ProtoCommentToRustDoc(absl::string_view proto_comment) {
 
 static void GenerateDeprecated(Context &ctx) { ctx.Emit("#[deprecated]\n"); }
 
+/**
+ * Calls `emit_method` with the per-method substitution variables in scope.
+ */
+template <typename EmitMethodFn>
+static void WithMethodVars(const Service &service, const Method &method,
+                           Context &ctx, EmitMethodFn emit_method) {
+  std::pair<std::string, std::string> request_response_types =
+      method.request_response_name(ctx);
+  const std::string request_param =
+      method.is_client_streaming()
+          ? absl::StrFormat("impl tonic::IntoStreamingRequest<Message = %s>",
+                            request_response_types.first)
+          : absl::StrFormat("impl tonic::IntoRequest<%s>",
+                            request_response_types.first);
+  const std::string response_type =
+      method.is_server_streaming()
+          ? absl::StrFormat(method.has_offload() ? "OffloadedStream<%s>"
+                                                 : "tonic::codec::Streaming<%s>",
+                            request_response_types.second)
+          : request_response_types.second;
+  auto vars =
+      ctx.printer().WithVars({{"codec_name", "grpc::codec::ProtoCodec"},
+                              {"ident", method.name()},
+                              {"request", request_response_types.first},
+                              {"response", request_response_types.second},
+                              {"request_param", request_param},
+                              {"response_type", response_type},
+                              {"service_name", service.full_name()},
+                              {"path", FormatMethodPath(service, method)},
+                              {"method_name", method.proto_field_name()},
+                              {"method_id", method.index()}});
+  emit_method(method);
+}
+
+/**
+ * Emits the doc comment and attributes of every method in the service, then
+ * calls `emit_method` with the per-method substitution variables in scope.
+ */
+template <typename EmitMethodFn>
+static void ForEachMethod(const Service &service, Context &ctx,
+                          EmitMethodFn emit_method) {
+  const std::vector<Method> methods = service.methods();
+  for (const Method &method : methods) {
+    ctx.Emit(ProtoCommentToRustDoc(method.comment()));
+    if (method.is_deprecated()) {
+      GenerateDeprecated(ctx);
+    }
+    WithMethodVars(service, method, ctx, emit_method);
+    if (&method != &methods.back()) {
+      ctx.Emit("\n");
+    }
+  }
+}
+
+/**
+ * A field of a generated client or server struct that is only present when a
+ * generator option asks for it.
+ */
+struct OptionalField {
+  std::string name;
+  std::string type;
+  std::string init;
+};
+
+/**
+ * A substitution that stands on a line of its own in a template and is only
+ * generated when options ask for it.
+ */
+struct OptionalSub {
+  absl::string_view var;
+  bool present;
+};
+
+static bool IsBlankLine(absl::string_view line) {
+  return absl::StripAsciiWhitespace(line).empty();
+}
+
+/**
+ * Removes the lines of `format` that hold an absent substitution, each with
+ * a blank line that separates it from its neighbours, so that code that is
+ * not generated leaves no blank lines behind. The first and last lines of
+ * `format` are the ones `Context::Emit` strips, and stay.
+ */
+static std::string DropAbsentSubs(absl::string_view format,
+                                  std::initializer_list<OptionalSub> subs) {
+  std::vector<absl::string_view> lines = absl::StrSplit(format, '\n');
+  for (const OptionalSub &sub : subs) {
+    if (sub.present) {
+      continue;
+    }
+    const std::string placeholder = absl::StrCat("$", sub.var, "$");
+    for (size_t i = 1; i + 1 < lines.size();) {
+      if (absl::StripAsciiWhitespace(lines[i]) != placeholder) {
+        ++i;
+        continue;
+      }
+      size_t first = i;
+      size_t last = i + 1;
+      if (last + 1 < lines.size() && IsBlankLine(lines[last])) {
+        ++last;
+      } else if (first > 1 && IsBlankLine(lines[first - 1])) {
+        --first;
+      }
+      lines.erase(lines.begin() + first, lines.begin() + last);
+      i = first;
+    }
+  }
+  return absl::StrJoin(lines, "\n");
+}
+
+/**
+ * Emits `format` for each of the fields, with its `name`, `type` and `init`
+ * in scope, on lines of their own.
+ */
+static void GenerateOptionalFields(const std::vector<OptionalField> &fields,
+                                   absl::string_view format, Context &ctx) {
+  for (const OptionalField &field : fields) {
+    const std::string line = &field != &fields.back()
+                                 ? absl::StrCat(format, "\n")
+                                 : std::string(format);
+    ctx.Emit({{"name", field.name}, {"type", field.type}, {"init", field.init}},
+             line);
+  }
+}
+
+/**
+ * Emits each of `blocks`, a raw string template or a single line, dedented
+ * and on lines of their own, with no trailing newline.
+ */
+static void GenerateLines(const std::vector<std::string> &blocks,
+                          Context &ctx) {
+  for (const std::string &block : blocks) {
+    std::vector<absl::string_view> lines =
+        absl::StrSplit(absl::StripPrefix(block, "\n"), '\n');
+    size_t indent = 0;
+    for (absl::string_view line : lines) {
+      if (!IsBlankLine(line)) {
+        indent = line.find_first_not_of(' ');
+        break;
+      }
+    }
+    for (absl::string_view &line : lines) {
+      line.remove_prefix(
+          std::min({indent, line.size(), line.find_first_not_of(' ')}));
+    }
+    std::string text = absl::StrJoin(lines, "\n");
+    if (&block != &blocks.back()) {
+      text += "\n";
+    }
+    ctx.Emit(text);
+  }
+}
+
+/// The method that carries multiplexed unary calls. The leading underscores
+/// keep it clear of the CamelCase names of declared methods.
+constexpr absl::string_view kMultiplexMethod = "__Multiplex";
+
+static std::string FormatMultiplexPath(const Service &service) {
+  return absl::StrFormat("/%s/%s", service.full_name(), kMultiplexMethod);
+}
+
+static bool HasStreamBuffers(const Service &service) {
+  for (const Method &method : service.methods()) {
+    if (method.has_stream_buffer()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool HasOffload(const Service &service) {
+  for (const Method &method : service.methods()) {
+    if (method.has_offload()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool HasPipeline(const Service &service) {
+  for (const Method &method : service.methods()) {
+    if (method.has_pipeline()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool HasBatchedMethods(const Service &service) {
+  for (const Method &method : service.methods()) {
+    if (method.batch_method() != nullptr) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool HasPooledRequests(const Service &service) {
+  for (const Method &method : service.methods()) {
+    if (method.has_pooled_request()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Checks if the server memoizes the responses of the method, which takes a
+ * unary method without side effects.
+ */
+static bool IsMemoized(const GeneratorOptions &options, const Method &method) {
+  return options.memoization && method.has_no_side_effects() &&
+         !method.is_client_streaming() && !method.is_server_streaming();
+}
+
+static bool HasMemoized(const GeneratorOptions &options,
+                        const Service &service) {
+  for (const Method &method : service.methods()) {
+    if (IsMemoized(options, method)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Checks if generated code passes encoded messages around as `Bytes`, which
+ * needs the `RawCodec`.
+ */
+static bool NeedsRawCodec(const GeneratorOptions &options) {
+  return options.unary_multiplexing;
+}
+
+/**
+ * The type of the response messages that the server handlers of the method
+ * produce.
+ */
+static std::string ServerMessage(const Method &method, Context &ctx) {
+  const std::string response = method.request_response_name(ctx).second;
+  return method.is_pre_encoded() ? absl::StrFormat("Encoded<%s>", response)
+                                 : response;
+}
+
+/**
+ * The type of the response message that the route of the method sends, which
+ * is encoded for memoized methods even where the handler returns a message.
+ */
+static std::string RouteMessage(const Method &method,
+                                const GeneratorOptions &options,
+                                Context &ctx) {
+  if (IsMemoized(options, method)) {
+    return absl::StrFormat("Encoded<%s>",
+                           method.request_response_name(ctx).second);
+  }
+  return ServerMessage(method, ctx);
+}
+
+/**
+ * Emits a `<method>_channel` constructor for each streamed side of a method
+ * with a `stream_buffer` option, requests on the client and responses on the
+ * server.
+ */
+static void GenerateStreamChannelConstructors(const Service &service,
+                                              bool client, Context &ctx) {
+  for (const Method &method : service.methods()) {
+    if (!method.has_stream_buffer() ||
+        !(client ? method.is_client_streaming()
+                 : method.is_server_streaming())) {
+      continue;
+    }
+    // Responses are what the handler's stream yields, so pre-encoded ones
+    // are sent as they are.
+    const std::string item =
+        client ? method.request_response_name(ctx).first
+               : absl::StrFormat("std::result::Result<%s, tonic::Status>",
+                                 ServerMessage(method, ctx));
+    ctx.Emit("\n");
+    WithMethodVars(service, method, ctx, [&](const Method &) {
+      ctx.Emit(
+          {{"item", item},
+           {"side", client ? "requests" : "responses"},
+           {"capacity", absl::StrCat(method.rust_options().stream_buffer())}},
+          R"rs(
+            /// Creates a bounded stream for the $side$ of `$method_name$`,
+            /// holding up to $capacity$ messages.
+            pub fn $ident$_channel() -> (StreamSender<$item$>, StreamReceiver<$item$>) {
+                stream_channel($capacity$, Arc::default())
+            }
+          )rs");
+    });
+  }
+}
+
 namespace client {
 
-static void GenerateMethods(const Service &service, Context &ctx) {
+/**
+ * Emits the expression that ends a client method, which sends the call and,
+ * for methods with an `offload_threshold_bytes` option, decodes the response.
+ */
+static void GenerateCallTail(const Method &method, Context &ctx) {
+  absl::string_view call;
+  if (method.is_client_streaming()) {
+    call = method.is_server_streaming() ? "streaming" : "client_streaming";
+  } else {
+    call = method.is_server_streaming() ? "server_streaming" : "unary";
+  }
+  auto vars = ctx.printer().WithVars(
+      {{"call", call},
+       {"threshold",
+        absl::StrCat(method.rust_options().offload_threshold_bytes())}});
+  if (!method.has_offload()) {
+    ctx.Emit("self.inner.$call$(req, path, codec).await");
+  } else if (method.is_server_streaming()) {
+    ctx.Emit("Ok(self.inner.$call$(req, path, codec).await?"
+             ".map(|messages| OffloadedStream::new(messages, $threshold$)))");
+  } else {
+    ctx.Emit("decode_offloaded_response(self.inner.$call$(req, path, codec)"
+             ".await?, $threshold$).await");
+  }
+}
+
+/**
+ * Emits the call tail of a unary method under `adaptive_concurrency`, which
+ * holds a permit of the method's concurrency limit for the call.
+ */
+static void GenerateLimitedCallTail(const GeneratorOptions &options,
+                                    const Method &method, Context &ctx) {
+  if (!options.adaptive_concurrency || method.is_client_streaming() ||
+      method.is_server_streaming()) {
+    GenerateCallTail(method, ctx);
+    return;
+  }
+  ctx.Emit({{"tail", [&] { GenerateCallTail(method, ctx); }}},
+           "limit_call(self.concurrency_limits.clone(), $method_id$, "
+           "async move { $tail$ }).await");
+}
+
+static std::string TimeoutConstName(const Method &method) {
+  return absl::StrCat(absl::AsciiStrToUpper(rust::CamelToSnakeCase(
+                          std::string(method.proto_field_name()))),
+                      "_TIMEOUT");
+}
+
+/**
+ * Emits the statement that gives a call of a method with a `timeout` option
+ * its default deadline, unless the caller set one.
+ */
+static void GenerateDefaultTimeout(const Method &method, Context &ctx) {
+  ctx.Emit({{"timeout_const", TimeoutConstName(method)}},
+           "set_default_timeout(&mut req, $timeout_const$);");
+}
+
+static bool HasTimeouts(const Service &service) {
+  for (const Method &method : service.methods()) {
+    if (method.has_timeout()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void GenerateDefaultTimeoutConsts(const Service &service,
+                                         Context &ctx) {
+  for (const Method &method : service.methods()) {
+    if (!method.has_timeout()) {
+      continue;
+    }
+    const protobuf::Duration &timeout = method.rust_options().timeout();
+    ctx.Emit(
+        {{"method_name", method.proto_field_name()},
+         {"timeout_const", TimeoutConstName(method)},
+         {"seconds", absl::StrCat(timeout.seconds())},
+         {"nanos", absl::StrCat(timeout.nanos())}},
+        R"rs(
+          /// Default deadline of `$method_name$` calls, from the method's
+          /// `timeout` option. A timeout set on the request takes precedence.
+          pub const $timeout_const$: std::time::Duration = std::time::Duration::new($seconds$, $nanos$);
+        )rs");
+  }
+  ctx.Emit(R"rs(
+    /// Gives the request the default deadline of its method, unless the
+    /// caller set one.
+    fn set_default_timeout<M>(req: &mut tonic::Request<M>, timeout: std::time::Duration) {
+        if !req.metadata().contains_key("grpc-timeout") {
+            req.set_timeout(timeout);
+        }
+    }
+  )rs");
+}
+
+/**
+ * Checks if the unary method is split into a public wrapper, which applies
+ * the optional call features, and a private method that issues the call.
+ */
+static bool HasUnaryLayers(const GeneratorOptions &options,
+                           const Method &method) {
+  return (options.hedging && method.is_idempotent()) ||
+         (options.coalescing && method.has_no_side_effects()) ||
+         (options.response_cache && method.has_no_side_effects());
+}
+
+static void GenerateLayeredUnary(const GeneratorOptions &options,
+                                 const Method &method, Context &ctx) {
+  const bool hedged = options.hedging && method.is_idempotent();
+  const bool coalesced = options.coalescing && method.has_no_side_effects();
+  const bool cached = options.response_cache && method.has_no_side_effects();
+  const bool has_epilogue = coalesced || cached;
+  ctx.Emit(
+      {
+          {"client_bounds", "where T: Clone,"},
+          {"dispatch", absl::StrFormat("self.%s_%s(req).await",
+                                       hedged ? "hedged" : "call",
+                                       method.name())},
+          {"cache_ttl",
+           FormatOptionalDuration(method.rust_options().has_cache_ttl(),
+                                  method.rust_options().cache_ttl())},
+          {"prologue",
+           [&] {
+             if (cached || coalesced) {
+               std::vector<std::string> users;
+               if (cached) {
+                 users.push_back("self.response_cache.is_some()");
+               }
+               if (coalesced) {
+                 users.push_back("self.single_flight.is_some()");
+               }
+               ctx.Emit({{"users", absl::StrJoin(users, " || ")}}, R"rs(
+                 let encoded_request = if $users$ {
+                     protobuf::Serialize::serialize(req.get_ref())
+                         .ok()
+                         .map(|encoded| request_key(encoded, req.metadata()))
+                 } else {
+                     None
+                 };
+               )rs");
+             }
+             if (cached) {
+               ctx.Emit(R"rs(
+                 let response_cache = self.response_cache.clone();
+                 if let (Some(cache), Some(key)) = (response_cache.as_deref(), &encoded_request) {
+                     if let Some(response) = cache.get($method_id$, key) {
+                         return Ok(response);
+                     }
+                 }
+               )rs");
+             }
+             if (coalesced) {
+               ctx.Emit(R"rs(
+                 let single_flight = self.single_flight.clone();
+                 let leader = match (single_flight.as_deref(), &encoded_request) {
+                     (Some(flights), Some(key)) => match flights.join($method_id$, key.clone()).await {
+                         Flight::Shared(shared) => return unshare_result(&shared),
+                         Flight::Leader(leader) => Some(leader),
+                     },
+                     _ => None,
+                 };
+               )rs");
+             }
+           }},
+          {"result",
+           [&] {
+             if (!has_epilogue) {
+               ctx.Emit("$dispatch$");
+               return;
+             }
+             ctx.Emit("let result = $dispatch$;\n");
+             if (cached) {
+               ctx.Emit(R"rs(
+                 if let (Some(cache), Some(key), Ok(response)) =
+                     (response_cache.as_deref(), encoded_request, &result)
+                 {
+                     cache.insert($method_id$, key, response.get_ref(), $cache_ttl$);
+                 }
+               )rs");
+             }
+             if (coalesced) {
+               ctx.Emit(R"rs(
+                 if let Some(leader) = leader {
+                     leader.complete(share_result(&result));
+                 }
+               )rs");
+             }
+             ctx.Emit("result");
+           }},
+          {"hedged_call",
+           [&] {
+             ctx.Emit(R"rs(
+               async fn hedged_$ident$(
+                   &mut self,
+                   req: tonic::Request<$request$>,
+               ) -> std::result::Result<tonic::Response<$response$>, tonic::Status>
+               where
+                   T: Clone,
+               {
+                   match self.hedging.clone() {
+                       Some(hedging) => {
+                           hedging
+                               .run($method_id$, self.clone(), req, |mut client: Self, req| async move {
+                                   client.call_$ident$(req).await
+                               })
+                               .await
+                       }
+                       None => self.call_$ident$(req).await,
+                   }
+               }
+             )rs");
+           }},
+      },
+      DropAbsentSubs(R"rs(
+        pub async fn $ident$(
+            &mut self,
+            request: impl tonic::IntoRequest<$request$>,
+        ) -> std::result::Result<tonic::Response<$response$>, tonic::Status>
+        $client_bounds$
+        {
+            let req = request.into_request();
+            $prologue$
+            $result$
+        }
+
+        $hedged_call$
+
+        async fn call_$ident$(
+            &mut self,
+            mut req: tonic::Request<$request$>,
+        ) -> std::result::Result<tonic::Response<$response$>, tonic::Status> {
+            self.inner.ready().await.map_err(|e| {
+                tonic::Status::unknown(format!("Service was not ready: {}", e.into()))
+            })?;
+            let codec = $codec_name$::default();
+            let path = http::uri::PathAndQuery::from_static("$path$");
+            req.extensions_mut().insert(GrpcMethod::new("$service_name$", "$method_name$"));
+            $default_timeout$
+            $call_tail$
+        }
+      )rs",
+                     {{"client_bounds", hedged},
+                      {"prologue", cached || coalesced},
+                      {"hedged_call", hedged},
+                      {"default_timeout", method.has_timeout()}}));
+}
+
+static void GenerateMethods(const Service &service,
+                            const GeneratorOptions &options, Context &ctx) {
   static std::string unary_format = R"rs(
     pub async fn $ident$(
         &mut self,
         request: impl tonic::IntoRequest<$request$>,
-    ) -> std::result::Result<tonic::Response<tonic::codec::Streaming<$response$>>, tonic::Status> {
+    ) -> std::result::Result<tonic::Response<$response$>, tonic::Status> {
         self.inner.ready().await.map_err(|e| {
             tonic::Status::unknown(format!("Service was not ready: {}", e.into()))
         })?;
@@ -196,7 +857,8 @@ static void GenerateMethods(const Service &service, Context &ctx) {
         let path = http::uri::PathAndQuery::from_static("$path$");
         let mut req = request.into_request();
         req.extensions_mut().insert(GrpcMethod::new("$service_name$", "$method_name$"));
-        self.inner.server_streaming(req, path, codec).await
+        $default_timeout$
+        $call_tail$
     }
     )rs";
 
@@ -204,7 +866,7 @@ static void GenerateMethods(const Service &service, Context &ctx) {
         pub async fn $ident$(
             &mut self,
             request: impl tonic::IntoRequest<$request$>,
-        ) -> std::result::Result<tonic::Response<tonic::codec::Streaming<$response$>>, tonic::Status> {
+        ) -> std::result::Result<tonic::Response<$response_type$>, tonic::Status> {
             self.inner.ready().await.map_err(|e| {
                 tonic::Status::unknown(format!("Service was not ready: {}", e.into()))
             })?;
@@ -212,7 +874,8 @@ static void GenerateMethods(const Service &service, Context &ctx) {
             let path = http::uri::PathAndQuery::from_static("$path$");
             let mut req = request.into_request();
             req.extensions_mut().insert(GrpcMethod::new("$service_name$", "$method_name$"));
-            self.inner.server_streaming(req, path, codec).await
+            $default_timeout$
+            $call_tail$
         }
       )rs";
 
@@ -228,7 +891,9 @@ static void GenerateMethods(const Service &service, Context &ctx) {
             let path = http::uri::PathAndQuery::from_static("$path$");
             let mut req = request.into_streaming_request();
             req.extensions_mut().insert(GrpcMethod::new("$service_name$", "$method_name$"));
-            self.inner.client_streaming(req, path, codec).await
+            $default_timeout$
+            $coalesce_writes$
+            $call_tail$
         }
       )rs";
 
@@ -236,7 +901,7 @@ static void GenerateMethods(const Service &service, Context &ctx) {
         pub async fn $ident$(
             &mut self,
             request: impl tonic::IntoStreamingRequest<Message = $request$>
-        ) -> std::result::Result<tonic::Response<tonic::codec::Streaming<$response$>>, tonic::Status> {
+        ) -> std::result::Result<tonic::Response<$response_type$>, tonic::Status> {
             self.inner.ready().await.map_err(|e| {
                 tonic::Status::unknown(format!("Service was not ready: {}", e.into()))
             })?;
@@ -244,99 +909,2781 @@ static void GenerateMethods(const Service &service, Context &ctx) {
             let path = http::uri::PathAndQuery::from_static("$path$");
             let mut req = request.into_streaming_request();
             req.extensions_mut().insert(GrpcMethod::new("$service_name$", "$method_name$"));
-            self.inner.streaming(req, path, codec).await
+            $default_timeout$
+            $coalesce_writes$
+            $call_tail$
         }
       )rs";
 
-  const std::vector<Method> methods = service.methods();
-  for (const Method &method : methods) {
-    ctx.Emit(ProtoCommentToRustDoc(method.comment()));
-    if (method.is_deprecated()) {
-      GenerateDeprecated(ctx);
-    }
-    std::pair<std::string, std::string> request_response_types =
-        method.request_response_name(ctx);
-    {
-      auto vars =
-          ctx.printer().WithVars({{"codec_name", "grpc::codec::ProtoCodec"},
-                                  {"ident", method.name()},
-                                  {"request", request_response_types.first},
-                                  {"response", request_response_types.second},
-                                  {"service_name", service.full_name()},
-                                  {"path", FormatMethodPath(service, method)},
-                                  {"method_name", method.proto_field_name()}});
-
-      if (!method.is_client_streaming() && !method.is_server_streaming()) {
-        ctx.Emit(unary_format);
-      } else if (!method.is_client_streaming() &&
-                 method.is_server_streaming()) {
-        ctx.Emit(server_streaming_format);
-      } else if (method.is_client_streaming() &&
-                 !method.is_server_streaming()) {
-        ctx.Emit(client_streaming_format);
-      } else {
-        ctx.Emit(streaming_format);
-      }
-      if (&method != &methods.back()) {
-        ctx.Emit("\n");
+  const Method *current = nullptr;
+  auto vars = ctx.printer().WithVars(
+      {{"call_tail",
+        [&] { GenerateLimitedCallTail(options, *current, ctx); }},
+       {"default_timeout", [&] { GenerateDefaultTimeout(*current, ctx); }},
+       {"coalesce_writes", [&] {
+          ctx.Emit("let req = req.map(|messages| "
+                   "CoalescingStream::new(messages, self.write_coalescing));");
+        }}});
+  ForEachMethod(service, ctx, [&](const Method &method) {
+    current = &method;
+    auto codec = ctx.printer().WithVars(
+        {{"codec_name",
+          method.has_offload() ? "OffloadCodec" : "grpc::codec::ProtoCodec"}});
+    const std::string *format;
+    if (!method.is_client_streaming() && !method.is_server_streaming()) {
+      if (HasUnaryLayers(options, method)) {
+        GenerateLayeredUnary(options, method, ctx);
+        return;
       }
+      format = &unary_format;
+    } else if (!method.is_client_streaming() && method.is_server_streaming()) {
+      format = &server_streaming_format;
+    } else if (method.is_client_streaming() && !method.is_server_streaming()) {
+      format = &client_streaming_format;
+    } else {
+      format = &streaming_format;
     }
-  }
+    ctx.Emit(DropAbsentSubs(*format,
+                            {{"default_timeout", method.has_timeout()},
+                             {"coalesce_writes", options.write_coalescing}}));
+  });
 }
 
-static void generate_client(const Service &service, Context &ctx) {
-  std::string service_ident = absl::StrFormat("%sClient", service.name());
-  std::string client_mod =
-      absl::StrFormat("%s_client", rust::CamelToSnakeCase(service.name()));
+static void GeneratePoolMethods(const Service &service,
+                                const GeneratorOptions &options,
+                                const std::string &client_ident,
+                                Context &ctx) {
+  static std::string pool_format = R"rs(
+        pub async fn $ident$(
+            &self,
+            request: $request_param$,
+        ) -> std::result::Result<tonic::Response<$pool_response$>, tonic::Status> {
+            let index = self.pick();
+            $call_client$
+        }
+      )rs";
+
+  auto vars = ctx.printer().WithVars({{"client_ident", client_ident}});
+  ForEachMethod(service, ctx, [&](const Method &method) {
+    // A streaming response keeps its call in flight until it is dropped.
+    const bool streaming = method.is_server_streaming();
+    ctx.Emit(
+        {{"pool_response",
+          [&] {
+            if (streaming) {
+              ctx.Emit("InFlightStream<$response_type$>");
+            } else {
+              ctx.Emit("$response_type$");
+            }
+          }},
+         {"call_client",
+          [&] {
+            ctx.Emit({{"in_flight", streaming ? "in_flight" : "_in_flight"}},
+                     R"rs(
+                       let $in_flight$ = InFlightGuard::new(&self.state, index);
+                       let mut client: $client_ident$<T> = self.clients[index].clone();
+                     )rs");
+            if (!options.load_reports && !streaming) {
+              ctx.Emit("client.$ident$(request).await");
+              return;
+            }
+            ctx.Emit("let result = client.$ident$(request).await;\n");
+            if (options.load_reports) {
+              ctx.Emit("self.record_load(index, &result);\n");
+            }
+            if (streaming) {
+              ctx.Emit(R"rs(
+                result.map(|response| {
+                    response.map(|messages| InFlightStream { inner: messages, _in_flight: in_flight })
+                })
+              )rs");
+            } else {
+              ctx.Emit("result");
+            }
+          }}},
+        pool_format);
+  });
+}
+
+static void GeneratePoolClient(const Service &service,
+                               const GeneratorOptions &options,
+                               const std::string &client_ident,
+                               Context &ctx) {
   ctx.Emit(
       {
-          {"client_mod", client_mod},
-          {"service_ident", service_ident},
-          {"service_doc",
-           [&] { ctx.Emit(ProtoCommentToRustDoc(service.comment())); }},
-          {"methods", [&] { GenerateMethods(service, ctx); }},
+          {"client_ident", client_ident},
+          {"pool_ident", absl::StrFormat("%sPoolClient", service.name())},
+          {"pool_methods",
+           [&] { GeneratePoolMethods(service, options, client_ident, ctx); }},
+          {"load_policy",
+           [&] {
+             ctx.Emit(R"rs(
+               /// Pick two channels at random and use the one with the
+               /// lower reported load.
+               PowerOfTwoChoices,
+             )rs");
+           }},
+          {"load_state", "load: Vec<std::sync::atomic::AtomicU64>,"},
+          {"load_state_init",
+           [&] {
+             ctx.Emit(R"rs(
+               load: clients
+                   .iter()
+                   .map(|_| std::sync::atomic::AtomicU64::new(0))
+                   .collect(),
+             )rs");
+           }},
+          {"load_pick",
+           [&] {
+             ctx.Emit(R"rs(
+               PoolPolicy::PowerOfTwoChoices if len > 1 => {
+                   let random = splitmix64(ticket as u64);
+                   let first = (random % len as u64) as usize;
+                   let offset = ((random >> 32) % (len as u64 - 1)) as usize;
+                   let second = (first + 1 + offset) % len;
+                   if self.cost(first) <= self.cost(second) { first } else { second }
+               }
+               PoolPolicy::PowerOfTwoChoices => start,
+             )rs");
+           }},
+          {"load_helpers",
+           [&] {
+             ctx.Emit(R"rs(
+               /// Cheap pseudo-random mixing of the pool's call counter.
+               fn splitmix64(mut z: u64) -> u64 {
+                   z = z.wrapping_add(0x9e37_79b9_7f4a_7c15);
+                   z = (z ^ (z >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+                   z = (z ^ (z >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+                   z ^ (z >> 31)
+               }
+             )rs");
+           }},
+          {"load_methods",
+           [&] {
+             ctx.Emit(R"rs(
+               /// Reported load of the channel, scaled by the calls this
+               /// pool has in flight on it.
+               fn cost(&self, index: usize) -> f64 {
+                   let reported = f64::from_bits(
+                       self.state.load[index].load(std::sync::atomic::Ordering::Relaxed),
+                   );
+                   let in_flight =
+                       self.state.in_flight[index].load(std::sync::atomic::Ordering::Relaxed);
+                   (1.0 + reported) * (1 + in_flight) as f64
+               }
+
+               fn record_load<R>(
+                   &self,
+                   index: usize,
+                   result: &std::result::Result<tonic::Response<R>, tonic::Status>,
+               ) {
+                   let metadata = match result {
+                       Ok(response) => response.metadata(),
+                       Err(status) => status.metadata(),
+                   };
+                   if let Some(report) = LoadReport::from_metadata(metadata) {
+                       self.state.load[index].store(
+                           report.score().to_bits(),
+                           std::sync::atomic::Ordering::Relaxed,
+                       );
+                   }
+               }
+             )rs");
+           }},
       },
-      R"rs(
-      /// Generated client implementations.
-      pub mod $client_mod$ {
-          #![allow(
-              unused_variables,
-              dead_code,
-              missing_docs,
-              clippy::wildcard_imports,
-              // will trigger if compression is disabled
-              clippy::let_unit_value,
-          )]
-          use tonic::codegen::*;
-          use tonic::codegen::http::Uri;
+      DropAbsentSubs(R"rs(
+      /// How a pool client picks the channel that carries a call.
+      #[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+      pub enum PoolPolicy {
+          /// Cycle through the channels in order.
+          #[default]
+          RoundRobin,
+          /// Use the channel with the fewest calls in flight.
+          LeastInFlight,
+          $load_policy$
+      }
 
-          $service_doc$
-          #[derive(Debug, Clone)]
-          pub struct $service_ident$<T> {
-              inner: tonic::client::Grpc<T>,
-          }
+      $load_helpers$
 
-          impl<T> $service_ident$<T>
-          where
-              T: tonic::client::GrpcService<tonic::body::Body>,
-              T::Error: Into<StdError>,
-              T::ResponseBody: Body<Data = Bytes> + std::marker::Send  +
-              'static, <T::ResponseBody as Body>::Error: Into<StdError> +
-              std::marker::Send,
-          {
-              pub fn new(inner: T) -> Self {
-                  let inner = tonic::client::Grpc::new(inner);
-                  Self { inner }
-              }
+      #[derive(Debug)]
+      struct PoolState {
+          next: std::sync::atomic::AtomicUsize,
+          in_flight: Vec<std::sync::atomic::AtomicUsize>,
+          $load_state$
+      }
 
-              pub fn with_origin(inner: T, origin: Uri) -> Self {
-                  let inner = tonic::client::Grpc::with_origin(inner, origin);
-                  Self { inner }
-              }
+      /// Counts a call against a channel until the call returns, or
+      /// until its response stream is dropped.
+      struct InFlightGuard {
+          state: Arc<PoolState>,
+          index: usize,
+      }
 
-              pub fn with_interceptor<F>(inner: T, interceptor: F) ->
-              $service_ident$<InterceptedService<T, F>> where
-                  F: tonic::service::Interceptor,
+      impl InFlightGuard {
+          fn new(state: &Arc<PoolState>, index: usize) -> Self {
+              state.in_flight[index].fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+              Self { state: Arc::clone(state), index }
+          }
+      }
+
+      impl Drop for InFlightGuard {
+          fn drop(&mut self) {
+              self.state.in_flight[self.index].fetch_sub(1, std::sync::atomic::Ordering::Relaxed);
+          }
+      }
+
+      /// The response stream of a pool client's streaming call. The call
+      /// counts as in flight on its channel until the stream is dropped.
+      /// Derefs to the client's response stream.
+      pub struct InFlightStream<S> {
+          inner: S,
+          _in_flight: InFlightGuard,
+      }
+
+      impl<S> std::ops::Deref for InFlightStream<S> {
+          type Target = S;
+
+          fn deref(&self) -> &S {
+              &self.inner
+          }
+      }
+
+      impl<S> std::ops::DerefMut for InFlightStream<S> {
+          fn deref_mut(&mut self) -> &mut S {
+              &mut self.inner
+          }
+      }
+
+      impl<S: std::fmt::Debug> std::fmt::Debug for InFlightStream<S> {
+          fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+              std::fmt::Debug::fmt(&self.inner, f)
+          }
+      }
+
+      impl<S> tonic::codegen::tokio_stream::Stream for InFlightStream<S>
+      where
+          S: tonic::codegen::tokio_stream::Stream + Unpin,
+      {
+          type Item = S::Item;
+
+          fn poll_next(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+              Pin::new(&mut self.inner).poll_next(cx)
+          }
+      }
+
+      /// Spreads calls over several channels, e.g. one per HTTP/2 connection,
+      /// so that traffic is not capped by a single connection's
+      /// `MAX_CONCURRENT_STREAMS` or framing throughput.
+      #[derive(Debug, Clone)]
+      pub struct $pool_ident$<T> {
+          clients: Arc<[$client_ident$<T>]>,
+          state: Arc<PoolState>,
+          policy: PoolPolicy,
+      }
+
+      impl<T> $pool_ident$<T>
+      where
+          T: tonic::client::GrpcService<tonic::body::Body> + Clone,
+          T::Error: Into<StdError>,
+          T::ResponseBody: Body<Data = Bytes> + std::marker::Send  +
+          'static, <T::ResponseBody as Body>::Error: Into<StdError> +
+          std::marker::Send,
+      {
+          /// Creates a pool with one client per channel.
+          ///
+          /// Panics if `channels` is empty.
+          pub fn new(channels: impl IntoIterator<Item = T>) -> Self {
+              Self::from_clients(channels.into_iter().map($client_ident$::new))
+          }
+
+          /// Creates a pool from already configured clients.
+          ///
+          /// Panics if `clients` is empty.
+          pub fn from_clients(clients: impl IntoIterator<Item = $client_ident$<T>>) -> Self {
+              let clients: Arc<[$client_ident$<T>]> = clients.into_iter().collect();
+              assert!(!clients.is_empty(), "a pool client needs at least one channel");
+              let in_flight = clients
+                  .iter()
+                  .map(|_| std::sync::atomic::AtomicUsize::new(0))
+                  .collect();
+              let state = PoolState {
+                  next: std::sync::atomic::AtomicUsize::new(0),
+                  in_flight,
+                  $load_state_init$
+              };
+              Self { clients, state: Arc::new(state), policy: PoolPolicy::default() }
+          }
+
+          /// Sets the channel selection policy.
+          ///
+          /// Default: `PoolPolicy::RoundRobin`
+          #[must_use]
+          pub fn with_policy(mut self, policy: PoolPolicy) -> Self {
+              self.policy = policy;
+              self
+          }
+
+          /// The number of channels in the pool.
+          pub fn num_channels(&self) -> usize {
+              self.clients.len()
+          }
+
+          fn pick(&self) -> usize {
+              let len = self.clients.len();
+              let ticket = self.state.next.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+              let start = ticket % len;
+              match self.policy {
+                  PoolPolicy::RoundRobin => start,
+                  PoolPolicy::LeastInFlight => {
+                      // Scan from a rotating offset so ties are spread evenly.
+                      (0..len)
+                          .map(|i| (start + i) % len)
+                          .min_by_key(|&i| {
+                              self.state.in_flight[i].load(std::sync::atomic::Ordering::Relaxed)
+                          })
+                          .unwrap_or(start)
+                  }
+                  $load_pick$
+              }
+          }
+
+          $load_methods$
+
+          $pool_methods$
+      }
+      )rs",
+                     {{"load_policy", options.load_reports},
+                      {"load_helpers", options.load_reports},
+                      {"load_state", options.load_reports},
+                      {"load_state_init", options.load_reports},
+                      {"load_pick", options.load_reports},
+                      {"load_methods", options.load_reports}}));
+}
+
+static void GenerateLoadReport(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// Per-call backend utilization, carried in the `endpoint-load-metrics-bin`
+      /// header and trailer as an ORCA `xds.data.orca.v3.OrcaLoadReport`.
+      #[derive(Debug, Clone, Copy, Default, PartialEq)]
+      pub struct LoadReport {
+          /// CPU utilization of the backend, normally in `[0, 1]`.
+          pub cpu_utilization: f64,
+          /// Calls waiting to be served, sent as the `queue_depth` named metric.
+          pub queue_depth: f64,
+          /// Calls being served, sent as the `in_flight` named metric.
+          pub in_flight: f64,
+      }
+
+      impl LoadReport {
+          /// The header and trailer that carry the serialized report.
+          pub const TRAILER: &'static str = "endpoint-load-metrics-bin";
+
+          /// Serializes the report as an `OrcaLoadReport` message.
+          pub fn encode(&self) -> Vec<u8> {
+              let mut buf = Vec::with_capacity(64);
+              // cpu_utilization = 1, a double.
+              buf.push(0x09);
+              buf.extend_from_slice(&self.cpu_utilization.to_le_bytes());
+              for (name, value) in [
+                  ("queue_depth", self.queue_depth),
+                  ("in_flight", self.in_flight),
+              ] {
+                  // named_metrics = 8, a map entry of {key = 1, value = 2}.
+                  buf.push(0x42);
+                  buf.push((2 + name.len() + 9) as u8);
+                  buf.push(0x0a);
+                  buf.push(name.len() as u8);
+                  buf.extend_from_slice(name.as_bytes());
+                  buf.push(0x11);
+                  buf.extend_from_slice(&value.to_le_bytes());
+              }
+              buf
+          }
+
+          /// Parses an `OrcaLoadReport`, skipping the fields that are not tracked.
+          pub fn decode(mut buf: &[u8]) -> Option<Self> {
+              let mut report = Self::default();
+              while !buf.is_empty() {
+                  let tag = read_varint(&mut buf)?;
+                  match (tag >> 3, tag & 7) {
+                      (1, 1) => report.cpu_utilization = read_f64(&mut buf)?,
+                      (8, 2) => {
+                          let entry = read_length_delimited(&mut buf)?;
+                          let (name, value) = decode_named_metric(entry)?;
+                          match name {
+                              b"queue_depth" => report.queue_depth = value,
+                              b"in_flight" => report.in_flight = value,
+                              _ => {}
+                          }
+                      }
+                      (_, 0) => {
+                          read_varint(&mut buf)?;
+                      }
+                      (_, 1) => buf = buf.get(8..)?,
+                      (_, 2) => {
+                          read_length_delimited(&mut buf)?;
+                      }
+                      (_, 5) => buf = buf.get(4..)?,
+                      _ => return None,
+                  }
+              }
+              Some(report)
+          }
+
+          /// Reads the report attached to a response or an error, if any.
+          pub fn from_metadata(metadata: &tonic::metadata::MetadataMap) -> Option<Self> {
+              let value = metadata.get_bin(Self::TRAILER)?.to_bytes().ok()?;
+              Self::decode(&value)
+          }
+
+          /// The load used to rank backends: the calls queued and running on
+          /// the backend, scaled up by its CPU utilization. A backend that
+          /// does not report its utilization is ranked by its calls alone.
+          pub fn score(&self) -> f64 {
+              (1.0 + self.queue_depth + self.in_flight) * (1.0 + self.cpu_utilization.max(0.0))
+          }
+      }
+
+      fn read_varint(buf: &mut &[u8]) -> Option<u64> {
+          let mut value = 0u64;
+          for shift in (0..64).step_by(7) {
+              let (&byte, rest) = buf.split_first()?;
+              *buf = rest;
+              value |= u64::from(byte & 0x7f) << shift;
+              if byte & 0x80 == 0 {
+                  return Some(value);
+              }
+          }
+          None
+      }
+
+      fn read_f64(buf: &mut &[u8]) -> Option<f64> {
+          let bytes: [u8; 8] = buf.get(..8)?.try_into().ok()?;
+          *buf = &buf[8..];
+          Some(f64::from_le_bytes(bytes))
+      }
+
+      fn read_length_delimited<'a>(buf: &mut &'a [u8]) -> Option<&'a [u8]> {
+          let len = usize::try_from(read_varint(buf)?).ok()?;
+          let value = buf.get(..len)?;
+          *buf = &buf[len..];
+          Some(value)
+      }
+
+      fn decode_named_metric(mut entry: &[u8]) -> Option<(&[u8], f64)> {
+          let (mut name, mut value) = (&[][..], 0.0);
+          while !entry.is_empty() {
+              match read_varint(&mut entry)? {
+                  0x0a => name = read_length_delimited(&mut entry)?,
+                  0x11 => value = read_f64(&mut entry)?,
+                  _ => return None,
+              }
+          }
+          Some((name, value))
+      }
+  )rs");
+}
+
+static void GenerateHedging(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// When and how idempotent calls are hedged.
+      #[derive(Debug, Clone, Copy)]
+      pub struct HedgingPolicy {
+          /// The latency percentile, in `(0, 1)`, after which a second attempt
+          /// is sent.
+          pub percentile: f64,
+          /// Lower bound of the hedging delay.
+          pub min_delay: std::time::Duration,
+          /// Upper bound of the hedging delay, also used until enough
+          /// latencies have been observed.
+          pub max_delay: std::time::Duration,
+      }
+
+      impl Default for HedgingPolicy {
+          fn default() -> Self {
+              Self {
+                  percentile: 0.95,
+                  min_delay: std::time::Duration::from_millis(1),
+                  max_delay: std::time::Duration::from_millis(100),
+              }
+          }
+      }
+
+      /// Number of recent latencies the hedging delay is computed from.
+      const LATENCY_WINDOW: usize = 128;
+
+      /// How often, in calls, the hedging delay is recomputed.
+      const LATENCY_REFRESH: usize = 32;
+
+      #[derive(Debug, Default)]
+      struct LatencyWindow {
+          samples: std::sync::Mutex<Vec<u64>>,
+          recorded: std::sync::atomic::AtomicUsize,
+          delay_micros: std::sync::atomic::AtomicU64,
+      }
+
+      impl LatencyWindow {
+          fn delay(&self, policy: &HedgingPolicy) -> std::time::Duration {
+              match self.delay_micros.load(std::sync::atomic::Ordering::Relaxed) {
+                  0 => policy.max_delay,
+                  micros => std::time::Duration::from_micros(micros)
+                      .clamp(policy.min_delay, policy.max_delay),
+              }
+          }
+
+          fn record(&self, latency: std::time::Duration, policy: &HedgingPolicy) {
+              let micros = u64::try_from(latency.as_micros()).unwrap_or(u64::MAX);
+              let recorded = self.recorded.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+              let mut samples =
+                  self.samples.lock().unwrap_or_else(std::sync::PoisonError::into_inner);
+              if samples.len() < LATENCY_WINDOW {
+                  samples.push(micros);
+              } else {
+                  samples[recorded % LATENCY_WINDOW] = micros;
+              }
+              if samples.len() == LATENCY_WINDOW && recorded % LATENCY_REFRESH == 0 {
+                  let mut sorted = samples.clone();
+                  drop(samples);
+                  let rank = ((sorted.len() - 1) as f64 * policy.percentile.clamp(0.0, 1.0)) as usize;
+                  let (_, delay, _) = sorted.select_nth_unstable(rank);
+                  self.delay_micros.store((*delay).max(1), std::sync::atomic::Ordering::Relaxed);
+              }
+          }
+      }
+
+      /// Sends a second attempt of an idempotent call when the first one is
+      /// slower than the configured percentile of recent latencies, and keeps
+      /// the first successful result. The other attempt is dropped, which
+      /// cancels its stream.
+      ///
+      /// Only the latency of a first attempt that succeeds is recorded. A
+      /// winning hedge would pull the percentile towards the hedging delay
+      /// itself, and a failure says nothing about how long a call takes.
+      #[derive(Debug)]
+      struct Hedging {
+          policy: HedgingPolicy,
+          windows: Vec<LatencyWindow>,
+      }
+
+      impl Hedging {
+          fn new(policy: HedgingPolicy, methods: usize) -> Self {
+              let windows = (0..methods).map(|_| LatencyWindow::default()).collect();
+              Self { policy, windows }
+          }
+
+          async fn run<C, Req, Resp, F, Fut>(
+              &self,
+              method: usize,
+              client: C,
+              request: tonic::Request<Req>,
+              call: F,
+          ) -> std::result::Result<tonic::Response<Resp>, tonic::Status>
+          where
+              C: Clone,
+              Req: Clone,
+              F: Fn(C, tonic::Request<Req>) -> Fut,
+              Fut: std::future::Future<
+                  Output = std::result::Result<tonic::Response<Resp>, tonic::Status>,
+              >,
+          {
+              let window = &self.windows[method];
+              let started = std::time::Instant::now();
+              let hedge = tonic::Request::from_parts(
+                  request.metadata().clone(),
+                  tonic::Extensions::default(),
+                  request.get_ref().clone(),
+              );
+              let mut first = std::pin::pin!(call(client.clone(), request));
+              let first_succeeded = |result: &std::result::Result<_, _>| {
+                  if result.is_ok() {
+                      window.record(started.elapsed(), &self.policy);
+                  }
+              };
+              tokio::select! {
+                  result = &mut first => {
+                      first_succeeded(&result);
+                      result
+                  }
+                  _ = tokio::time::sleep(window.delay(&self.policy)) => {
+                      let mut second = std::pin::pin!(call(client, hedge));
+                      tokio::select! {
+                          result = &mut first => match result {
+                              Ok(_) => {
+                                  first_succeeded(&result);
+                                  result
+                              }
+                              Err(_) => second.await,
+                          },
+                          result = &mut second => match result {
+                              Ok(_) => result,
+                              Err(_) => {
+                                  let result = first.await;
+                                  first_succeeded(&result);
+                                  result
+                              }
+                          },
+                      }
+                  }
+              }
+          }
+      }
+  )rs");
+}
+
+static void GenerateAdaptiveConcurrency(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// How an adaptive concurrency limit moves after each call.
+      #[derive(Debug, Clone, Copy)]
+      pub enum LimitAlgorithm {
+          /// Additive increase, multiplicative decrease. The limit grows by
+          /// one per limit's worth of calls that finish within
+          /// `rtt_tolerance` times the shortest recent round-trip time. It is
+          /// multiplied by `backoff` after a slower call, or one that failed
+          /// with `RESOURCE_EXHAUSTED`, `UNAVAILABLE` or `DEADLINE_EXCEEDED`,
+          /// at most once per round trip.
+          Aimd { backoff: f64, rtt_tolerance: f64 },
+          /// Moves the limit towards its product with the ratio of the
+          /// shortest recent round-trip time to the latest one, plus its
+          /// square root as room for queueing. The limit shrinks as soon as
+          /// calls slow down, before the server fails any.
+          Gradient,
+      }
+
+      /// Bounds and scope of the adaptive concurrency limits of a client.
+      #[derive(Debug, Clone, Copy)]
+      pub struct AdaptiveConcurrencyPolicy {
+          pub algorithm: LimitAlgorithm,
+          /// The limit until calls have completed.
+          pub initial_limit: usize,
+          pub min_limit: usize,
+          pub max_limit: usize,
+          /// Shares one limit among all methods, as the limit of the backend,
+          /// instead of keeping one per method.
+          pub per_backend: bool,
+      }
+
+      impl AdaptiveConcurrencyPolicy {
+          /// Checks the policy, so that the limits can be clamped to it.
+          fn validate(&self) {
+              assert!(
+                  self.min_limit.max(1) <= self.max_limit,
+                  "max_limit must be at least min_limit and positive"
+              );
+              if let LimitAlgorithm::Aimd { backoff, rtt_tolerance } = self.algorithm {
+                  assert!(backoff > 0.0 && backoff <= 1.0, "backoff must be in (0, 1]");
+                  assert!(rtt_tolerance >= 1.0, "rtt_tolerance must be at least 1");
+              }
+          }
+      }
+
+      impl Default for AdaptiveConcurrencyPolicy {
+          fn default() -> Self {
+              Self {
+                  algorithm: LimitAlgorithm::Aimd { backoff: 0.9, rtt_tolerance: 2.0 },
+                  initial_limit: 20,
+                  min_limit: 1,
+                  max_limit: 1000,
+                  per_backend: false,
+              }
+          }
+      }
+
+      /// Number of calls after which the shortest round-trip time of the
+      /// older of two windows is forgotten, so the limits follow a backend
+      /// whose capacity changes.
+      const MIN_RTT_WINDOW: usize = 256;
+
+      #[derive(Debug)]
+      struct LimitState {
+          limit: f64,
+          in_flight: usize,
+          completed: usize,
+          previous_min_rtt: std::time::Duration,
+          min_rtt: std::time::Duration,
+          last_backoff: Option<std::time::Instant>,
+      }
+
+      impl LimitState {
+          fn new(limit: usize) -> Self {
+              Self {
+                  limit: limit as f64,
+                  in_flight: 0,
+                  completed: 0,
+                  previous_min_rtt: std::time::Duration::MAX,
+                  min_rtt: std::time::Duration::MAX,
+                  last_backoff: None,
+              }
+          }
+
+          fn update(
+              &mut self,
+              policy: &AdaptiveConcurrencyPolicy,
+              started: std::time::Instant,
+              rtt: std::time::Duration,
+              overloaded: bool,
+          ) {
+              self.completed += 1;
+              self.min_rtt = self.min_rtt.min(rtt);
+              let min_rtt = self.previous_min_rtt.min(self.min_rtt).as_secs_f64();
+              if self.completed % MIN_RTT_WINDOW == 0 {
+                  self.previous_min_rtt = std::mem::replace(&mut self.min_rtt, std::time::Duration::MAX);
+              }
+              let rtt = rtt.as_secs_f64().max(f64::EPSILON);
+              let limit = match policy.algorithm {
+                  LimitAlgorithm::Aimd { backoff, rtt_tolerance } => {
+                      if overloaded || rtt > min_rtt * rtt_tolerance {
+                          // Calls sent before the last backoff saw the old
+                          // limit, so they do not back off again.
+                          if self.last_backoff.is_some_and(|at| started < at) {
+                              return;
+                          }
+                          self.last_backoff = Some(std::time::Instant::now());
+                          self.limit * backoff
+                      } else {
+                          self.limit + 1.0 / self.limit
+                      }
+                  }
+                  LimitAlgorithm::Gradient => {
+                      let gradient = if overloaded { 0.5 } else { (min_rtt / rtt).clamp(0.5, 1.0) };
+                      let target = self.limit * gradient + self.limit.sqrt();
+                      self.limit * 0.8 + target * 0.2
+                  }
+              };
+              // A limit that calls do not reach says nothing about the
+              // backend, so it only grows while at least half of it is used.
+              if limit > self.limit && (self.in_flight as f64) * 2.0 < self.limit {
+                  return;
+              }
+              self.limit = limit.clamp(policy.min_limit.max(1) as f64, policy.max_limit as f64);
+          }
+      }
+
+      /// Caps the calls a client has in flight, per method or per backend,
+      /// to limits that adapt to the observed round-trip times and overload
+      /// errors. Calls over the limit fail with `RESOURCE_EXHAUSTED` without
+      /// being sent, so the client backs off before queues build up at the
+      /// server. Methods are indexed by their position in the service.
+      #[derive(Debug)]
+      struct ConcurrencyLimits {
+          policy: AdaptiveConcurrencyPolicy,
+          states: Vec<std::sync::Mutex<LimitState>>,
+      }
+
+      impl ConcurrencyLimits {
+          fn new(policy: AdaptiveConcurrencyPolicy, methods: usize) -> Self {
+              let limits = if policy.per_backend { 1 } else { methods };
+              let initial = policy.initial_limit.clamp(policy.min_limit.max(1), policy.max_limit);
+              let states = (0..limits)
+                  .map(|_| std::sync::Mutex::new(LimitState::new(initial)))
+                  .collect();
+              Self { policy, states }
+          }
+
+          fn index(&self, method: usize) -> usize {
+              if self.policy.per_backend { 0 } else { method }
+          }
+
+          /// The state of a limit. No update of it panics halfway, so it is
+          /// consistent even when the lock is poisoned.
+          fn state(&self, index: usize) -> std::sync::MutexGuard<'_, LimitState> {
+              self.states[index].lock().unwrap_or_else(std::sync::PoisonError::into_inner)
+          }
+
+          fn try_acquire(
+              self: &Arc<Self>,
+              method: usize,
+          ) -> std::result::Result<LimitPermit, tonic::Status> {
+              let index = self.index(method);
+              let mut state = self.state(index);
+              if state.in_flight as f64 >= state.limit.floor() {
+                  return Err(tonic::Status::resource_exhausted(
+                      "client concurrency limit reached",
+                  ));
+              }
+              state.in_flight += 1;
+              Ok(LimitPermit {
+                  limits: Arc::clone(self),
+                  index,
+                  started: std::time::Instant::now(),
+              })
+          }
+
+          fn limit(&self, method: usize) -> usize {
+              self.state(self.index(method)).limit as usize
+          }
+      }
+
+      /// A call counted against a concurrency limit. Dropping it without
+      /// `complete`, as when the call is cancelled, releases it without
+      /// adjusting the limit.
+      #[derive(Debug)]
+      struct LimitPermit {
+          limits: Arc<ConcurrencyLimits>,
+          index: usize,
+          started: std::time::Instant,
+      }
+
+      impl LimitPermit {
+          fn complete<R>(self, result: &std::result::Result<R, tonic::Status>) {
+              let rtt = self.started.elapsed();
+              let overloaded = matches!(
+                  result,
+                  Err(status) if matches!(
+                      status.code(),
+                      tonic::Code::ResourceExhausted
+                          | tonic::Code::Unavailable
+                          | tonic::Code::DeadlineExceeded
+                  )
+              );
+              let mut state = self.limits.state(self.index);
+              state.update(&self.limits.policy, self.started, rtt, overloaded);
+          }
+      }
+
+      impl Drop for LimitPermit {
+          fn drop(&mut self) {
+              self.limits.state(self.index).in_flight -= 1;
+          }
+      }
+
+      /// Runs a call of a method under a permit of its concurrency limit, if
+      /// the client has limits, and moves the limit by the call's outcome.
+      async fn limit_call<R>(
+          limits: Option<Arc<ConcurrencyLimits>>,
+          method: usize,
+          call: impl std::future::Future<Output = std::result::Result<R, tonic::Status>>,
+      ) -> std::result::Result<R, tonic::Status> {
+          let permit = match &limits {
+              Some(limits) => Some(limits.try_acquire(method)?),
+              None => None,
+          };
+          let result = call.await;
+          if let Some(permit) = permit {
+              permit.complete(&result);
+          }
+          result
+      }
+  )rs");
+}
+
+static void GenerateSingleFlight(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// A result shared between the callers of a coalesced call.
+      pub(crate) type SharedResult = Arc<dyn std::any::Any + std::marker::Send + std::marker::Sync>;
+
+      /// Shares one in-flight call among concurrent callers that send
+      /// byte-identical requests to the same method. Calls are keyed by the
+      /// method index and the [`request_key`] of the request.
+      #[derive(Debug)]
+      pub(crate) struct SingleFlight<V> {
+          calls: std::sync::Mutex<
+              std::collections::HashMap<
+                  (usize, Bytes),
+                  std::collections::VecDeque<tokio::sync::oneshot::Sender<Handoff<V>>>,
+              >,
+          >,
+      }
+
+      impl<V> Default for SingleFlight<V> {
+          fn default() -> Self {
+              Self { calls: Default::default() }
+          }
+      }
+
+      pub(crate) enum Flight<'a, V: Clone> {
+          /// Makes the call and shares its result.
+          Leader(FlightLeader<'a, V>),
+          /// The result the leader shared.
+          Shared(V),
+      }
+
+      /// What a follower is sent: the shared result, or the call itself when
+      /// the leader was cancelled.
+      #[derive(Debug)]
+      enum Handoff<V> {
+          Done(V),
+          Lead,
+      }
+
+      pub(crate) struct FlightLeader<'a, V: Clone> {
+          flights: &'a SingleFlight<V>,
+          key: Option<(usize, Bytes)>,
+      }
+
+      /// A follower waiting for the leader.
+      struct FlightFollower<'a, V: Clone> {
+          flights: &'a SingleFlight<V>,
+          key: Option<(usize, Bytes)>,
+          receiver: tokio::sync::oneshot::Receiver<Handoff<V>>,
+      }
+
+      impl<V: Clone> SingleFlight<V> {
+          /// Joins the call in flight for the same key and waits for its
+          /// result, or starts one. When a leader is cancelled, the call is
+          /// handed over to the follower that has waited longest, so only one
+          /// caller makes it again.
+          pub(crate) async fn join(&self, method: usize, request: Bytes) -> Flight<'_, V> {
+              let key = (method, request);
+              let receiver = {
+                  let mut calls = self.calls.lock().unwrap_or_else(std::sync::PoisonError::into_inner);
+                  match calls.get_mut(&key) {
+                      Some(followers) => {
+                          let (sender, receiver) = tokio::sync::oneshot::channel();
+                          followers.push_back(sender);
+                          receiver
+                      }
+                      None => {
+                          calls.insert(key.clone(), Default::default());
+                          return Flight::Leader(FlightLeader { flights: self, key: Some(key) });
+                      }
+                  }
+              };
+              let mut follower = FlightFollower { flights: self, key: Some(key), receiver };
+              let handoff = (&mut follower.receiver).await;
+              let key = follower.key.take();
+              match handoff {
+                  Ok(Handoff::Done(value)) => Flight::Shared(value),
+                  Ok(Handoff::Lead) => Flight::Leader(FlightLeader { flights: self, key }),
+                  // The leader panicked, so make the call without sharing it.
+                  Err(_) => Flight::Leader(FlightLeader { flights: self, key: None }),
+              }
+          }
+
+          /// Hands the call over to the first follower still waiting, or
+          /// forgets it when there is none.
+          fn hand_off(&self, key: (usize, Bytes)) {
+              let mut calls = self.calls.lock().unwrap_or_else(std::sync::PoisonError::into_inner);
+              if let Some(followers) = calls.get_mut(&key) {
+                  while let Some(follower) = followers.pop_front() {
+                      if follower.send(Handoff::Lead).is_ok() {
+                          return;
+                      }
+                  }
+              }
+              calls.remove(&key);
+          }
+      }
+
+      impl<V: Clone> FlightLeader<'_, V> {
+          /// Hands the result to every caller that joined the call.
+          pub(crate) fn complete(mut self, value: V) {
+              let Some(key) = self.key.take() else { return };
+              let followers = self
+                  .flights
+                  .calls
+                  .lock()
+                  .unwrap_or_else(std::sync::PoisonError::into_inner)
+                  .remove(&key);
+              for follower in followers.into_iter().flatten() {
+                  let _ = follower.send(Handoff::Done(value.clone()));
+              }
+          }
+      }
+
+      impl<V: Clone> Drop for FlightLeader<'_, V> {
+          fn drop(&mut self) {
+              if let Some(key) = self.key.take() {
+                  self.flights.hand_off(key);
+              }
+          }
+      }
+
+      impl<V: Clone> Drop for FlightFollower<'_, V> {
+          fn drop(&mut self) {
+              // A follower cancelled just after it was handed the call passes
+              // it on.
+              if let (Ok(Handoff::Lead), Some(key)) = (self.receiver.try_recv(), self.key.take()) {
+                  self.flights.hand_off(key);
+              }
+          }
+      }
+
+      fn share_result<R>(
+          result: &std::result::Result<tonic::Response<R>, tonic::Status>,
+      ) -> SharedResult
+      where
+          R: Clone + std::marker::Send + std::marker::Sync + 'static,
+      {
+          let shared = match result {
+              Ok(response) => Ok((response.metadata().clone(), response.get_ref().clone())),
+              Err(status) => Err(status.clone()),
+          };
+          Arc::new(shared)
+      }
+
+      fn unshare_result<R>(
+          shared: &SharedResult,
+      ) -> std::result::Result<tonic::Response<R>, tonic::Status>
+      where
+          R: Clone + 'static,
+      {
+          match shared.downcast_ref::<std::result::Result<(tonic::metadata::MetadataMap, R), tonic::Status>>() {
+              Some(Ok((metadata, message))) => Ok(tonic::Response::from_parts(
+                  metadata.clone(),
+                  message.clone(),
+                  tonic::Extensions::default(),
+              )),
+              Some(Err(status)) => Err(status.clone()),
+              None => Err(tonic::Status::internal("coalesced call returned another type")),
+          }
+      }
+  )rs");
+}
+
+static void GenerateRequestKey(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// Keys a call by its encoded request and its metadata, so that calls
+      /// that differ in credentials, tenant or any other header never share a
+      /// result. The entries are sorted, so their order does not matter, and
+      /// `grpc-timeout`, which changes with every call, is left out.
+      fn request_key(mut key: Vec<u8>, metadata: &tonic::metadata::MetadataMap) -> Bytes {
+          let request_len = key.len();
+          let mut entries: Vec<(&str, &[u8])> = metadata
+              .iter()
+              .map(|entry| match entry {
+                  tonic::metadata::KeyAndValueRef::Ascii(name, value) => {
+                      (name.as_str(), value.as_encoded_bytes())
+                  }
+                  tonic::metadata::KeyAndValueRef::Binary(name, value) => {
+                      (name.as_str(), value.as_encoded_bytes())
+                  }
+              })
+              .filter(|(name, _)| *name != "grpc-timeout")
+              .collect();
+          entries.sort_unstable();
+          for (name, value) in entries {
+              for part in [name.as_bytes(), value] {
+                  key.extend_from_slice(&(part.len() as u32).to_le_bytes());
+                  key.extend_from_slice(part);
+              }
+          }
+          key.extend_from_slice(&(request_len as u64).to_le_bytes());
+          Bytes::from(key)
+      }
+  )rs");
+}
+
+static void GenerateBatchingClient(const Service &service,
+                                   const std::string &client_ident,
+                                   Context &ctx) {
+  std::vector<Method> batched;
+  for (const Method &method : service.methods()) {
+    if (method.batch_method() != nullptr) {
+      batched.push_back(method);
+    }
+  }
+  auto batch_vars = [&](const Method &method) {
+    const MethodDescriptor *batch = method.batch_method();
+    const ::grpc::rust::BatchOptions &options = method.rust_options().batch();
+    return ctx.printer().WithVars(
+        {{"batch_ident", Method(batch).name()},
+         {"batch_request", rust::RsTypePath(ctx, *batch->input_type())},
+         {"batch_method_name", batch->name()},
+         {"request_field",
+          FieldAccessorName(*batch->input_type()->FindFieldByName(
+              options.request_field()))},
+         {"response_field",
+          FieldAccessorName(*batch->output_type()->FindFieldByName(
+              options.response_field()))}});
+  };
+  ctx.Emit(
+      {
+          {"batching_ident",
+           absl::StrFormat("%sBatchingClient", service.name())},
+          {"client_ident", client_ident},
+          {"batcher_fields",
+           [&] {
+             for (const Method &method : batched) {
+               WithMethodVars(service, method, ctx, [&](const Method &) {
+                 ctx.Emit(&method != &batched.back()
+                              ? "$ident$: Batcher<$request$, $response$>,\n"
+                              : "$ident$: Batcher<$request$, $response$>,");
+               });
+             }
+           }},
+          {"batcher_inits",
+           [&] {
+             for (const Method &method : batched) {
+               WithMethodVars(service, method, ctx, [&](const Method &) {
+                 auto vars = batch_vars(method);
+                 ctx.Emit(R"rs(
+                   $ident$: {
+                       let client = inner.clone();
+                       Batcher::spawn(config, move |requests: Vec<$request$>| {
+                           let mut client = client.clone();
+                           async move {
+                               let mut batch = $batch_request$::new();
+                               for request in requests {
+                                   batch.$request_field$_mut().push(request);
+                               }
+                               let response = client.$batch_ident$(batch).await?.into_inner();
+                               Ok(response.$response_field$().iter().map(|r| r.to_owned()).collect())
+                           }
+                       })
+                   },
+                 )rs");
+               });
+             }
+           }},
+          {"batched_methods",
+           [&] {
+             for (const Method &method : batched) {
+               // Leading comments end with a newline, which leaves a blank
+               // doc line before the note below.
+               ctx.Emit(ProtoCommentToRustDoc(method.comment()));
+               WithMethodVars(service, method, ctx, [&](const Method &) {
+                 auto vars = batch_vars(method);
+                 ctx.Emit({{"deprecated", "#[deprecated]"}},
+                          DropAbsentSubs(R"rs(
+                   /// The request is sent as part of a `$batch_method_name$`
+                   /// call, so its metadata and extensions are not sent.
+                   $deprecated$
+                   pub async fn $ident$(
+                       &self,
+                       request: $request_param$,
+                   ) -> std::result::Result<tonic::Response<$response$>, tonic::Status> {
+                       let request = request.into_request().into_inner();
+                       self.$ident$.call(request).await.map(tonic::Response::new)
+                   }
+                 )rs",
+                     {{"deprecated", method.is_deprecated()}}));
+               });
+               if (&method != &batched.back()) {
+                 ctx.Emit("\n");
+               }
+             }
+           }},
+      },
+      R"rs(
+      /// The window in which a batching client collects calls into one batch
+      /// call.
+      #[derive(Debug, Clone, Copy)]
+      pub struct BatchingConfig {
+          /// Most calls merged into one batch call.
+          pub max_batch_size: usize,
+          /// Longest a call waits for others to join its batch.
+          pub max_delay: std::time::Duration,
+      }
+
+      impl Default for BatchingConfig {
+          fn default() -> Self {
+              Self {
+                  max_batch_size: 64,
+                  max_delay: std::time::Duration::from_millis(1),
+              }
+          }
+      }
+
+      type BatchSlot<Req, Resp> = (
+          Req,
+          tokio::sync::oneshot::Sender<std::result::Result<Resp, tonic::Status>>,
+      );
+
+      /// Hands single calls to a background task that issues them as batch
+      /// calls. The task stops once every clone of the batcher is dropped.
+      #[derive(Debug)]
+      struct Batcher<Req, Resp> {
+          sender: tokio::sync::mpsc::UnboundedSender<BatchSlot<Req, Resp>>,
+      }
+
+      impl<Req, Resp> Clone for Batcher<Req, Resp> {
+          fn clone(&self) -> Self {
+              Self { sender: self.sender.clone() }
+          }
+      }
+
+      impl<Req, Resp> Batcher<Req, Resp>
+      where
+          Req: std::marker::Send + 'static,
+          Resp: std::marker::Send + 'static,
+      {
+          fn spawn<F, Fut>(config: BatchingConfig, call_batch: F) -> Self
+          where
+              F: Fn(Vec<Req>) -> Fut + std::marker::Send + 'static,
+              Fut: std::future::Future<Output = std::result::Result<Vec<Resp>, tonic::Status>>
+                  + std::marker::Send
+                  + 'static,
+          {
+              let max_batch_size = config.max_batch_size.max(1);
+              let (sender, mut receiver) = tokio::sync::mpsc::unbounded_channel();
+              tokio::spawn(async move {
+                  let mut slots: Vec<BatchSlot<Req, Resp>> = Vec::with_capacity(max_batch_size);
+                  while receiver.recv_many(&mut slots, max_batch_size).await > 0 {
+                      // The window opens with the first call of the batch.
+                      let window = tokio::time::sleep(config.max_delay);
+                      tokio::pin!(window);
+                      while slots.len() < max_batch_size {
+                          let room = max_batch_size - slots.len();
+                          tokio::select! {
+                              received = receiver.recv_many(&mut slots, room) => {
+                                  if received == 0 {
+                                      break;
+                                  }
+                              }
+                              () = &mut window => break,
+                          }
+                      }
+                      let (requests, waiters): (Vec<_>, Vec<_>) = slots.drain(..).unzip();
+                      let batch = call_batch(requests);
+                      // Batches are sent concurrently, so a slow batch does not
+                      // hold up the next window.
+                      tokio::spawn(async move {
+                          match batch.await {
+                              Ok(responses) if responses.len() == waiters.len() => {
+                                  for (waiter, response) in waiters.into_iter().zip(responses) {
+                                      let _ = waiter.send(Ok(response));
+                                  }
+                              }
+                              Ok(responses) => {
+                                  let status = tonic::Status::internal(format!(
+                                      "batch call returned {} responses for {} requests",
+                                      responses.len(),
+                                      waiters.len(),
+                                  ));
+                                  for waiter in waiters {
+                                      let _ = waiter.send(Err(status.clone()));
+                                  }
+                              }
+                              Err(status) => {
+                                  for waiter in waiters {
+                                      let _ = waiter.send(Err(status.clone()));
+                                  }
+                              }
+                          }
+                      });
+                  }
+              });
+              Self { sender }
+          }
+
+          async fn call(&self, request: Req) -> std::result::Result<Resp, tonic::Status> {
+              let (sender, receiver) = tokio::sync::oneshot::channel();
+              self.sender
+                  .send((request, sender))
+                  .map_err(|_| tonic::Status::unavailable("the batching task has stopped"))?;
+              receiver
+                  .await
+                  .map_err(|_| tonic::Status::internal("the batch call was dropped"))?
+          }
+      }
+
+      /// Merges concurrent calls of methods with a `batch` option into calls
+      /// of their batch methods. Clones share the batching windows.
+      #[derive(Debug, Clone)]
+      pub struct $batching_ident$<T> {
+          inner: $client_ident$<T>,
+          $batcher_fields$
+      }
+
+      impl<T> $batching_ident$<T>
+      where
+          T: tonic::client::GrpcService<tonic::body::Body>
+              + Clone
+              + std::marker::Send
+              + 'static,
+          T::Future: std::marker::Send,
+          T::Error: Into<StdError>,
+          T::ResponseBody: Body<Data = Bytes> + std::marker::Send  +
+          'static, <T::ResponseBody as Body>::Error: Into<StdError> +
+          std::marker::Send,
+      {
+          /// Wraps a client. Must be called from within a tokio runtime, which
+          /// runs one batching task per batched method.
+          pub fn new(inner: $client_ident$<T>, config: BatchingConfig) -> Self {
+              Self {
+                  $batcher_inits$
+                  inner,
+              }
+          }
+
+          /// The wrapped client, for the methods that are not batched.
+          pub fn get_ref(&self) -> &$client_ident$<T> {
+              &self.inner
+          }
+
+          $batched_methods$
+      }
+      )rs");
+}
+
+static void GenerateRawCodec(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// A codec for messages that are already encoded. Needs the `bytes`
+      /// crate.
+      #[derive(Debug, Clone, Copy, Default)]
+      pub(crate) struct RawCodec;
+
+      impl tonic::codec::Codec for RawCodec {
+          type Encode = Bytes;
+          type Decode = Bytes;
+          type Encoder = RawCodec;
+          type Decoder = RawCodec;
+
+          fn encoder(&mut self) -> Self::Encoder {
+              RawCodec
+          }
+
+          fn decoder(&mut self) -> Self::Decoder {
+              RawCodec
+          }
+      }
+
+      impl tonic::codec::Encoder for RawCodec {
+          type Item = Bytes;
+          type Error = tonic::Status;
+
+          fn encode(
+              &mut self,
+              item: Self::Item,
+              dst: &mut tonic::codec::EncodeBuf<'_>,
+          ) -> std::result::Result<(), Self::Error> {
+              bytes::BufMut::put(dst, item);
+              Ok(())
+          }
+      }
+
+      impl tonic::codec::Decoder for RawCodec {
+          type Item = Bytes;
+          type Error = tonic::Status;
+
+          fn decode(
+              &mut self,
+              src: &mut tonic::codec::DecodeBuf<'_>,
+          ) -> std::result::Result<Option<Self::Item>, Self::Error> {
+              let len = bytes::Buf::remaining(src);
+              Ok(Some(bytes::Buf::copy_to_bytes(src, len)))
+          }
+      }
+  )rs");
+}
+
+static void GenerateMultiplexClient(const Service &service,
+                                    const std::string &client_ident,
+                                    Context &ctx) {
+  ctx.Emit(
+      {
+          {"multiplex_ident",
+           absl::StrFormat("%sMultiplexClient", service.name())},
+          {"client_ident", client_ident},
+          {"methods",
+           [&] {
+             for (const Method &method : service.methods()) {
+               if (method.is_client_streaming() ||
+                   method.is_server_streaming()) {
+                 continue;
+               }
+               ctx.Emit("\n");
+               ctx.Emit(ProtoCommentToRustDoc(method.comment()));
+               if (method.is_deprecated()) {
+                 GenerateDeprecated(ctx);
+               }
+               WithMethodVars(service, method, ctx, [&](const Method &) {
+                 ctx.Emit({{"timeout",
+                            method.has_timeout()
+                                ? absl::StrFormat("Some(%s)",
+                                                  TimeoutConstName(method))
+                                : "None"}},
+                          R"rs(
+                   pub async fn $ident$(
+                       &self,
+                       request: impl tonic::IntoRequest<$request$>,
+                   ) -> std::result::Result<tonic::Response<$response$>, tonic::Status> {
+                       let request = request.into_request().into_inner();
+                       let payload = protobuf::Serialize::serialize(&request)
+                           .map_err(|_| tonic::Status::internal("failed to encode the request"))?;
+                       let payload = self.shared.call($method_id$, Bytes::from(payload), $timeout$).await?;
+                       let response = <$response$ as protobuf::Parse>::parse(&payload)
+                           .map_err(|_| tonic::Status::internal("failed to decode the response"))?;
+                       Ok(tonic::Response::new(response))
+                   }
+                 )rs");
+               });
+             }
+           }},
+      },
+      R"rs(
+      /// A unary call or its reply on the multiplexed stream: the call id and
+      /// method index as big-endian `u64` and `u32`, the status code as a
+      /// big-endian `i32`, then the encoded message or, for errors, the status
+      /// message. A call carries `OK`, and a call with `CANCELLED` and no
+      /// message tells the server that the caller of the call with its id
+      /// gave up.
+      #[derive(Debug, Clone)]
+      pub(crate) struct Envelope {
+          pub(crate) id: u64,
+          pub(crate) method: u32,
+          pub(crate) code: i32,
+          pub(crate) payload: Bytes,
+      }
+
+      impl Envelope {
+          const HEADER_LEN: usize = 16;
+
+          pub(crate) fn reply(
+              id: u64,
+              method: u32,
+              result: std::result::Result<Bytes, tonic::Status>,
+          ) -> Self {
+              match result {
+                  Ok(payload) => Self { id, method, code: tonic::Code::Ok as i32, payload },
+                  Err(status) => Self {
+                      id,
+                      method,
+                      code: status.code() as i32,
+                      payload: Bytes::copy_from_slice(status.message().as_bytes()),
+                  },
+              }
+          }
+
+          pub(crate) fn cancel(id: u64, method: u32) -> Self {
+              Self { id, method, code: tonic::Code::Cancelled as i32, payload: Bytes::new() }
+          }
+
+          pub(crate) fn is_cancel(&self) -> bool {
+              self.code == tonic::Code::Cancelled as i32
+          }
+
+          pub(crate) fn encode(&self) -> Bytes {
+              let mut buf = Vec::with_capacity(Self::HEADER_LEN + self.payload.len());
+              buf.extend_from_slice(&self.id.to_be_bytes());
+              buf.extend_from_slice(&self.method.to_be_bytes());
+              buf.extend_from_slice(&self.code.to_be_bytes());
+              buf.extend_from_slice(&self.payload);
+              Bytes::from(buf)
+          }
+
+          pub(crate) fn decode(mut buf: Bytes) -> std::result::Result<Self, tonic::Status> {
+              if buf.len() < Self::HEADER_LEN {
+                  return Err(tonic::Status::internal("truncated multiplexed envelope"));
+              }
+              let header = buf.split_to(Self::HEADER_LEN);
+              let (id, rest) = header.split_at(8);
+              let (method, code) = rest.split_at(4);
+              Ok(Self {
+                  id: u64::from_be_bytes(id.try_into().unwrap()),
+                  method: u32::from_be_bytes(method.try_into().unwrap()),
+                  code: i32::from_be_bytes(code.try_into().unwrap()),
+                  payload: buf,
+              })
+          }
+
+          pub(crate) fn into_result(self) -> std::result::Result<Bytes, tonic::Status> {
+              if self.code == tonic::Code::Ok as i32 {
+                  return Ok(self.payload);
+              }
+              Err(tonic::Status::new(
+                  tonic::Code::from(self.code),
+                  String::from_utf8_lossy(&self.payload),
+              ))
+          }
+      }
+
+      type ReplySender = tokio::sync::oneshot::Sender<std::result::Result<Bytes, tonic::Status>>;
+
+      #[derive(Debug, Default)]
+      struct PendingCalls {
+          calls: std::collections::HashMap<u64, ReplySender>,
+          /// Set once the stream ends; later calls fail with it.
+          closed: Option<tonic::Status>,
+      }
+
+      /// Envelopes queued for the multiplexed stream before callers wait
+      /// for room.
+      const MULTIPLEX_SEND_QUEUE: usize = 128;
+
+      #[derive(Debug)]
+      struct MultiplexShared {
+          sender: tokio::sync::mpsc::Sender<Bytes>,
+          pending: std::sync::Mutex<PendingCalls>,
+          next_id: std::sync::atomic::AtomicU64,
+          /// The task that routes replies, which holds the reply stream.
+          reader: std::sync::OnceLock<tokio::task::AbortHandle>,
+      }
+
+      impl Drop for MultiplexShared {
+          fn drop(&mut self) {
+              // Dropping the reply stream resets it, and the server aborts
+              // the calls still running.
+              if let Some(reader) = self.reader.get() {
+                  reader.abort();
+              }
+          }
+      }
+
+      /// Forgets a call whose caller stopped waiting for the reply, and has
+      /// the server abort it.
+      struct PendingCallGuard<'a> {
+          shared: &'a MultiplexShared,
+          id: u64,
+          method: u32,
+      }
+
+      impl Drop for PendingCallGuard<'_> {
+          fn drop(&mut self) {
+              // A call that got its reply, or failed with the stream, is
+              // gone already.
+              if self.shared.pending().calls.remove(&self.id).is_some() {
+                  self.shared.cancel(self.id, self.method);
+              }
+          }
+      }
+
+      impl MultiplexShared {
+          fn pending(&self) -> std::sync::MutexGuard<'_, PendingCalls> {
+              self.pending.lock().unwrap_or_else(std::sync::PoisonError::into_inner)
+          }
+
+          /// Makes a call, which fails with `DEADLINE_EXCEEDED` once
+          /// `timeout` has passed.
+          async fn call(
+              &self,
+              method: u32,
+              payload: Bytes,
+              timeout: Option<std::time::Duration>,
+          ) -> std::result::Result<Bytes, tonic::Status> {
+              let id = self.next_id.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+              let (sender, receiver) = tokio::sync::oneshot::channel();
+              {
+                  let mut pending = self.pending();
+                  if let Some(status) = &pending.closed {
+                      return Err(status.clone());
+                  }
+                  pending.calls.insert(id, sender);
+              }
+              let _guard = PendingCallGuard { shared: self, id, method };
+              let envelope = Envelope { id, method, code: tonic::Code::Ok as i32, payload };
+              let reply = async {
+                  let closed = || tonic::Status::unavailable("the multiplexed stream is closed");
+                  self.sender.send(envelope.encode()).await.map_err(|_| closed())?;
+                  receiver.await.map_err(|_| closed())?
+              };
+              match timeout {
+                  Some(timeout) => tokio::time::timeout(timeout, reply)
+                      .await
+                      .map_err(|_| tonic::Status::deadline_exceeded("the call timed out"))?,
+                  None => reply.await,
+              }
+          }
+
+          /// Sends the cancel of a call whose caller gave up. If the queue
+          /// is full, a task sends it once there is room.
+          fn cancel(&self, id: u64, method: u32) {
+              let cancel = Envelope::cancel(id, method).encode();
+              let Err(tokio::sync::mpsc::error::TrySendError::Full(cancel)) =
+                  self.sender.try_send(cancel)
+              else {
+                  return;
+              };
+              if let Ok(runtime) = tokio::runtime::Handle::try_current() {
+                  let sender = self.sender.clone();
+                  runtime.spawn(async move {
+                      let _ = sender.send(cancel).await;
+                  });
+              }
+          }
+
+          fn complete(&self, envelope: Envelope) {
+              let sender = self.pending().calls.remove(&envelope.id);
+              if let Some(sender) = sender {
+                  let _ = sender.send(envelope.into_result());
+              }
+          }
+
+          fn close(&self, status: tonic::Status) {
+              let mut pending = self.pending();
+              for (_, sender) in pending.calls.drain() {
+                  let _ = sender.send(Err(status.clone()));
+              }
+              pending.closed = Some(status);
+          }
+      }
+
+      /// Sends the unary methods of the service as tagged envelopes over one
+      /// long-lived bidi stream, which saves the per-call HTTP/2 stream setup
+      /// of tiny, frequent calls. Replies may arrive in any order.
+      ///
+      /// Per-call metadata, extensions and deadlines are not sent: handlers
+      /// get the metadata of the stream, and server interceptors see the
+      /// stream rather than each call. A call fails with
+      /// `DEADLINE_EXCEEDED` once its method's `timeout` option has passed.
+      /// A call that is dropped or times out before its reply sends a
+      /// cancel, and the server aborts it. At most 128 envelopes wait to be
+      /// sent; further callers wait for room. Open one client per
+      /// connection; once the stream ends every call fails, so reconnect by
+      /// opening a new client. Dropping the last clone closes the stream,
+      /// and the server aborts the calls still running.
+      #[derive(Debug, Clone)]
+      pub struct $multiplex_ident$ {
+          shared: Arc<MultiplexShared>,
+      }
+
+      impl $multiplex_ident$ {
+          /// Opens the multiplexed stream on the client's channel. Must be
+          /// called from within a tokio runtime, which runs the task that
+          /// routes replies to their callers.
+          pub async fn connect<T>(mut client: $client_ident$<T>) -> std::result::Result<Self, tonic::Status>
+          where
+              T: tonic::client::GrpcService<tonic::body::Body>,
+              T::Error: Into<StdError>,
+              T::ResponseBody: Body<Data = Bytes> + std::marker::Send  +
+              'static, <T::ResponseBody as Body>::Error: Into<StdError> +
+              std::marker::Send,
+          {
+              let (sender, receiver) = tokio::sync::mpsc::channel(MULTIPLEX_SEND_QUEUE);
+              let envelopes = tonic::codegen::tokio_stream::wrappers::ReceiverStream::new(receiver);
+              let mut replies = client.open_multiplex(envelopes).await?.into_inner();
+              let shared = Arc::new(MultiplexShared {
+                  sender,
+                  pending: Default::default(),
+                  next_id: std::sync::atomic::AtomicU64::new(0),
+                  reader: std::sync::OnceLock::new(),
+              });
+              let weak = Arc::downgrade(&shared);
+              let reader = tokio::spawn(async move {
+                  let status = loop {
+                      let reply = match replies.message().await {
+                          Ok(Some(reply)) => reply,
+                          Ok(None) => break tonic::Status::unavailable("the multiplexed stream ended"),
+                          Err(status) => break status,
+                      };
+                      let Some(shared) = weak.upgrade() else { return };
+                      match Envelope::decode(reply) {
+                          Ok(envelope) => shared.complete(envelope),
+                          Err(status) => break status,
+                      }
+                  };
+                  if let Some(shared) = weak.upgrade() {
+                      shared.close(status);
+                  }
+              });
+              let _ = shared.reader.set(reader.abort_handle());
+              Ok(Self { shared })
+          }
+          $methods$
+      }
+      )rs");
+}
+
+static void GenerateCoalescingStream(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// When a coalescing stream releases the messages it holds back.
+      ///
+      /// Released messages reach the encoder back to back, so it writes them
+      /// into one buffer. The encoder flushes that buffer once it passes its
+      /// yield threshold (32 KiB by default), which bounds the bytes per write.
+      #[derive(Debug, Clone, Copy)]
+      pub struct CoalescingPolicy {
+          /// Messages held back before they are released together.
+          pub max_messages: usize,
+          /// Longest the first held message waits for others.
+          pub max_delay: std::time::Duration,
+      }
+
+      impl Default for CoalescingPolicy {
+          fn default() -> Self {
+              Self {
+                  max_messages: 64,
+                  max_delay: std::time::Duration::from_micros(500),
+              }
+          }
+      }
+
+      /// Holds back the items of a stream and releases them in groups, as
+      /// set by a `CoalescingPolicy`. Without a policy, items pass through.
+      pub struct CoalescingStream<S: tonic::codegen::tokio_stream::Stream> {
+          inner: Pin<Box<S>>,
+          policy: Option<CoalescingPolicy>,
+          held: std::collections::VecDeque<S::Item>,
+          releasing: bool,
+          done: bool,
+          deadline: Option<Pin<Box<tokio::time::Sleep>>>,
+      }
+
+      impl<S: tonic::codegen::tokio_stream::Stream> CoalescingStream<S> {
+          pub fn new(inner: S, policy: Option<CoalescingPolicy>) -> Self {
+              Self {
+                  inner: Box::pin(inner),
+                  policy,
+                  held: std::collections::VecDeque::new(),
+                  releasing: false,
+                  done: false,
+                  deadline: None,
+              }
+          }
+      }
+
+      // Held items are never pinned, only the inner stream, which is boxed.
+      impl<S: tonic::codegen::tokio_stream::Stream> Unpin for CoalescingStream<S> {}
+
+      impl<S: tonic::codegen::tokio_stream::Stream> std::fmt::Debug for CoalescingStream<S> {
+          fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+              f.debug_struct("CoalescingStream")
+                  .field("policy", &self.policy)
+                  .field("held", &self.held.len())
+                  .finish_non_exhaustive()
+          }
+      }
+
+      impl<S: tonic::codegen::tokio_stream::Stream> tonic::codegen::tokio_stream::Stream
+          for CoalescingStream<S>
+      {
+          type Item = S::Item;
+
+          fn poll_next(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<S::Item>> {
+              let this = &mut *self;
+              let Some(policy) = this.policy else {
+                  return tonic::codegen::tokio_stream::Stream::poll_next(this.inner.as_mut(), cx);
+              };
+              let max_messages = policy.max_messages.max(1);
+              loop {
+                  if this.releasing {
+                      if let Some(item) = this.held.pop_front() {
+                          return Poll::Ready(Some(item));
+                      }
+                      this.releasing = false;
+                  }
+                  if this.done {
+                      return Poll::Ready(None);
+                  }
+                  while this.held.len() < max_messages {
+                      match tonic::codegen::tokio_stream::Stream::poll_next(this.inner.as_mut(), cx) {
+                          Poll::Ready(Some(item)) => {
+                              if this.held.is_empty() {
+                                  this.deadline = Some(Box::pin(tokio::time::sleep(policy.max_delay)));
+                              }
+                              this.held.push_back(item);
+                          }
+                          Poll::Ready(None) => {
+                              this.done = true;
+                              break;
+                          }
+                          Poll::Pending => break,
+                      }
+                  }
+                  if this.held.is_empty() && !this.done {
+                      return Poll::Pending;
+                  }
+                  let expired = match &mut this.deadline {
+                      Some(deadline) => {
+                          std::future::Future::poll(deadline.as_mut(), cx).is_ready()
+                      }
+                      None => true,
+                  };
+                  if !(this.done || expired || this.held.len() >= max_messages) {
+                      return Poll::Pending;
+                  }
+                  this.deadline = None;
+                  this.releasing = true;
+              }
+          }
+      }
+  )rs");
+}
+
+static void GenerateBatchReceiver(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// Receives the messages of a stream, such as a server-streaming
+      /// response or a client-streaming request, in batches: one wakeup takes
+      /// every message that has already arrived.
+      #[derive(Debug)]
+      pub struct BatchReceiver<S, T> {
+          inner: S,
+          batch: Vec<T>,
+          /// An error that arrived after messages that were still returned.
+          error: Option<tonic::Status>,
+          done: bool,
+      }
+
+      impl<S, T> BatchReceiver<S, T>
+      where
+          S: tonic::codegen::tokio_stream::Stream<Item = std::result::Result<T, tonic::Status>>
+              + Unpin,
+      {
+          pub fn new(inner: S) -> Self {
+              Self { inner, batch: Vec::new(), error: None, done: false }
+          }
+
+          /// Waits for a message, then takes the messages that are already
+          /// buffered, up to `max` in all. The returned vector is reused by
+          /// the next call, so drain it rather than collecting it. An empty
+          /// batch means the stream has ended.
+          pub async fn next_batch(
+              &mut self,
+              max: usize,
+          ) -> std::result::Result<&mut Vec<T>, tonic::Status> {
+              self.batch.clear();
+              if let Some(status) = self.error.take() {
+                  self.done = true;
+                  return Err(status);
+              }
+              if self.done {
+                  return Ok(&mut self.batch);
+              }
+              let max = max.max(1);
+              let Self { inner, batch, error, done } = self;
+              std::future::poll_fn(|cx| {
+                  while batch.len() < max {
+                      let polled =
+                          tonic::codegen::tokio_stream::Stream::poll_next(Pin::new(&mut *inner), cx);
+                      match polled {
+                          Poll::Ready(Some(Ok(message))) => batch.push(message),
+                          Poll::Ready(Some(Err(status))) => {
+                              *error = Some(status);
+                              break;
+                          }
+                          Poll::Ready(None) => {
+                              *done = true;
+                              break;
+                          }
+                          Poll::Pending if batch.is_empty() => return Poll::Pending,
+                          Poll::Pending => break,
+                      }
+                  }
+                  Poll::Ready(())
+              })
+              .await;
+              if self.batch.is_empty() {
+                  if let Some(status) = self.error.take() {
+                      self.done = true;
+                      return Err(status);
+                  }
+              }
+              Ok(&mut self.batch)
+          }
+
+          pub fn into_inner(self) -> S {
+              self.inner
+          }
+      }
+  )rs");
+}
+
+static void GenerateStreamChannel(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// Gauges of one or more bounded message streams.
+      ///
+      /// Memory held by a stream is bounded by its capacity times the
+      /// largest message the peer accepts.
+      #[derive(Debug, Default)]
+      pub struct StreamGauge {
+          queued: std::sync::atomic::AtomicUsize,
+          sent: std::sync::atomic::AtomicU64,
+          rejected: std::sync::atomic::AtomicU64,
+      }
+
+      impl StreamGauge {
+          /// Messages sent but not yet taken by the transport.
+          pub fn queued(&self) -> usize {
+              self.queued.load(std::sync::atomic::Ordering::Relaxed)
+          }
+
+          /// Messages sent so far.
+          pub fn sent(&self) -> u64 {
+              self.sent.load(std::sync::atomic::Ordering::Relaxed)
+          }
+
+          /// `try_send` calls that found the buffer full.
+          pub fn rejected(&self) -> u64 {
+              self.rejected.load(std::sync::atomic::Ordering::Relaxed)
+          }
+      }
+
+      /// The sending half of a bounded message stream. Clones send into the
+      /// same stream.
+      #[derive(Debug)]
+      pub struct StreamSender<T> {
+          sender: tokio::sync::mpsc::Sender<T>,
+          gauge: Arc<StreamGauge>,
+      }
+
+      impl<T> Clone for StreamSender<T> {
+          fn clone(&self) -> Self {
+              Self { sender: self.sender.clone(), gauge: self.gauge.clone() }
+          }
+      }
+
+      impl<T> StreamSender<T> {
+          /// Waits for room in the buffer, then queues the message. Fails,
+          /// handing the message back, once the call has ended.
+          pub async fn send(
+              &self,
+              message: T,
+          ) -> std::result::Result<(), tokio::sync::mpsc::error::SendError<T>> {
+              match self.sender.reserve().await {
+                  Ok(permit) => {
+                      self.send_with(permit, message);
+                      Ok(())
+                  }
+                  Err(_) => Err(tokio::sync::mpsc::error::SendError(message)),
+              }
+          }
+
+          /// Queues the message if there is room in the buffer.
+          pub fn try_send(
+              &self,
+              message: T,
+          ) -> std::result::Result<(), tokio::sync::mpsc::error::TrySendError<T>> {
+              match self.sender.try_reserve() {
+                  Ok(permit) => {
+                      self.send_with(permit, message);
+                      Ok(())
+                  }
+                  Err(tokio::sync::mpsc::error::TrySendError::Full(())) => {
+                      self.gauge.rejected.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+                      Err(tokio::sync::mpsc::error::TrySendError::Full(message))
+                  }
+                  Err(tokio::sync::mpsc::error::TrySendError::Closed(())) => {
+                      Err(tokio::sync::mpsc::error::TrySendError::Closed(message))
+                  }
+              }
+          }
+
+          /// Counts the message as queued before the receiver can see it,
+          /// so that taking it never drops the count below zero. Holding a
+          /// permit, the send itself cannot fail.
+          fn send_with(&self, permit: tokio::sync::mpsc::Permit<'_, T>, message: T) {
+              self.gauge.queued.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+              self.gauge.sent.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+              permit.send(message);
+          }
+
+          /// Free room in the buffer, in messages.
+          pub fn capacity(&self) -> usize {
+              self.sender.capacity()
+          }
+
+          /// Checks if the call has ended, so sends fail.
+          pub fn is_closed(&self) -> bool {
+              self.sender.is_closed()
+          }
+
+          pub fn gauge(&self) -> &Arc<StreamGauge> {
+              &self.gauge
+          }
+      }
+
+      /// The receiving half of a bounded message stream, handed to the
+      /// call as its request or response stream.
+      #[derive(Debug)]
+      pub struct StreamReceiver<T> {
+          receiver: tokio::sync::mpsc::Receiver<T>,
+          gauge: Arc<StreamGauge>,
+      }
+
+      impl<T> tonic::codegen::tokio_stream::Stream for StreamReceiver<T> {
+          type Item = T;
+
+          fn poll_next(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<T>> {
+              let polled = self.receiver.poll_recv(cx);
+              if let Poll::Ready(Some(_)) = &polled {
+                  self.gauge.queued.fetch_sub(1, std::sync::atomic::Ordering::Relaxed);
+              }
+              polled
+          }
+      }
+
+      impl<T> Drop for StreamReceiver<T> {
+          fn drop(&mut self) {
+              // Messages still buffered are dropped with the channel.
+              self.receiver.close();
+              let mut dropped = 0;
+              while self.receiver.try_recv().is_ok() {
+                  dropped += 1;
+              }
+              self.gauge.queued.fetch_sub(dropped, std::sync::atomic::Ordering::Relaxed);
+          }
+      }
+
+      /// Creates a bounded message stream that holds up to `capacity`
+      /// messages and reports to `gauge`, which may be shared by streams.
+      pub fn stream_channel<T>(
+          capacity: usize,
+          gauge: Arc<StreamGauge>,
+      ) -> (StreamSender<T>, StreamReceiver<T>) {
+          let (sender, receiver) = tokio::sync::mpsc::channel(capacity.max(1));
+          (
+              StreamSender { sender, gauge: gauge.clone() },
+              StreamReceiver { receiver, gauge },
+          )
+      }
+  )rs");
+}
+
+static void GenerateOffload(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// Encodes messages like `ProtoCodec` but leaves received messages
+      /// encoded, so that large ones can be decoded off the I/O task.
+      #[derive(Debug)]
+      pub(crate) struct OffloadCodec<E>(std::marker::PhantomData<fn(E)>);
+
+      impl<E> Default for OffloadCodec<E> {
+          fn default() -> Self {
+              Self(std::marker::PhantomData)
+          }
+      }
+
+      impl<E> tonic::codec::Codec for OffloadCodec<E>
+      where
+          E: protobuf::Serialize + std::marker::Send + 'static,
+      {
+          type Encode = E;
+          type Decode = Bytes;
+          type Encoder = Self;
+          type Decoder = Self;
+
+          fn encoder(&mut self) -> Self::Encoder {
+              Self::default()
+          }
+
+          fn decoder(&mut self) -> Self::Decoder {
+              Self::default()
+          }
+      }
+
+      impl<E: protobuf::Serialize> tonic::codec::Encoder for OffloadCodec<E> {
+          type Item = E;
+          type Error = tonic::Status;
+
+          fn encode(
+              &mut self,
+              item: Self::Item,
+              dst: &mut tonic::codec::EncodeBuf<'_>,
+          ) -> std::result::Result<(), Self::Error> {
+              let encoded = protobuf::Serialize::serialize(&item)
+                  .map_err(|_| tonic::Status::internal("failed to encode the message"))?;
+              bytes::BufMut::put_slice(dst, &encoded);
+              Ok(())
+          }
+      }
+
+      impl<E> tonic::codec::Decoder for OffloadCodec<E> {
+          type Item = Bytes;
+          type Error = tonic::Status;
+
+          fn decode(
+              &mut self,
+              src: &mut tonic::codec::DecodeBuf<'_>,
+          ) -> std::result::Result<Option<Self::Item>, Self::Error> {
+              let len = bytes::Buf::remaining(src);
+              Ok(Some(bytes::Buf::copy_to_bytes(src, len)))
+          }
+      }
+
+      fn parse_message<M: protobuf::Parse>(encoded: &[u8]) -> std::result::Result<M, tonic::Status> {
+          M::parse(encoded).map_err(|_| tonic::Status::internal("failed to decode the message"))
+      }
+
+      /// Decodes a message on the blocking pool if it has at least
+      /// `threshold` bytes, and inline otherwise.
+      pub(crate) async fn decode_offloaded<M>(
+          encoded: Bytes,
+          threshold: usize,
+      ) -> std::result::Result<M, tonic::Status>
+      where
+          M: protobuf::Parse + std::marker::Send + 'static,
+      {
+          if encoded.len() < threshold {
+              return parse_message(&encoded);
+          }
+          tokio::task::spawn_blocking(move || parse_message(&encoded))
+              .await
+              .map_err(|e| tonic::Status::internal(format!("the decode task failed: {e}")))?
+      }
+
+      async fn decode_offloaded_response<M>(
+          response: tonic::Response<Bytes>,
+          threshold: usize,
+      ) -> std::result::Result<tonic::Response<M>, tonic::Status>
+      where
+          M: protobuf::Parse + std::marker::Send + 'static,
+      {
+          let (metadata, encoded, extensions) = response.into_parts();
+          let message = decode_offloaded(encoded, threshold).await?;
+          Ok(tonic::Response::from_parts(metadata, message, extensions))
+      }
+
+      enum Decoding<M> {
+          Done(std::result::Result<M, tonic::Status>),
+          Blocking(tokio::task::JoinHandle<std::result::Result<M, tonic::Status>>),
+      }
+
+      fn start_decoding<M>(encoded: Bytes, threshold: usize) -> Decoding<M>
+      where
+          M: protobuf::Parse + std::marker::Send + 'static,
+      {
+          if encoded.len() < threshold {
+              return Decoding::Done(parse_message(&encoded));
+          }
+          Decoding::Blocking(tokio::task::spawn_blocking(move || parse_message(&encoded)))
+      }
+
+      /// Polls the decode held by `slot`, emptying the slot once it is done.
+      fn poll_decoding<M>(
+          slot: &mut Option<Decoding<M>>,
+          cx: &mut Context<'_>,
+      ) -> Poll<std::result::Result<M, tonic::Status>> {
+          match slot.take().expect("no decode in progress") {
+              Decoding::Done(result) => Poll::Ready(result),
+              Decoding::Blocking(mut handle) => {
+                  match std::future::Future::poll(Pin::new(&mut handle), cx) {
+                      Poll::Ready(joined) => Poll::Ready(joined.unwrap_or_else(|e| {
+                          Err(tonic::Status::internal(format!("the decode task failed: {e}")))
+                      })),
+                      Poll::Pending => {
+                          *slot = Some(Decoding::Blocking(handle));
+                          Poll::Pending
+                      }
+                  }
+              }
+          }
+      }
+
+      /// The response stream of a method with an `offload_threshold_bytes`
+      /// option. While the caller handles one message, the next one that has
+      /// already arrived is decoded on the blocking pool.
+      pub struct OffloadedStream<M> {
+          inner: tonic::codec::Streaming<Bytes>,
+          threshold: usize,
+          next: Option<Decoding<M>>,
+          done: bool,
+      }
+
+      // Decoded messages are never pinned.
+      impl<M> Unpin for OffloadedStream<M> {}
+
+      impl<M> std::fmt::Debug for OffloadedStream<M> {
+          fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+              f.debug_struct("OffloadedStream")
+                  .field("threshold", &self.threshold)
+                  .finish_non_exhaustive()
+          }
+      }
+
+      impl<M> OffloadedStream<M>
+      where
+          M: protobuf::Parse + std::marker::Send + 'static,
+      {
+          pub(crate) fn new(inner: tonic::codec::Streaming<Bytes>, threshold: usize) -> Self {
+              Self { inner, threshold, next: None, done: false }
+          }
+
+          /// Fetch the next message from this stream, like
+          /// `Streaming::message`.
+          pub async fn message(&mut self) -> std::result::Result<Option<M>, tonic::Status> {
+              std::future::poll_fn(|cx| {
+                  tonic::codegen::tokio_stream::Stream::poll_next(Pin::new(&mut *self), cx)
+              })
+              .await
+              .transpose()
+          }
+
+          /// Starts decoding the next message if it has already arrived.
+          fn prefetch(&mut self, cx: &mut Context<'_>) {
+              if self.done || self.next.is_some() {
+                  return;
+              }
+              match tonic::codegen::tokio_stream::Stream::poll_next(Pin::new(&mut self.inner), cx) {
+                  Poll::Ready(Some(Ok(encoded))) => {
+                      self.next = Some(start_decoding(encoded, self.threshold))
+                  }
+                  Poll::Ready(Some(Err(status))) => self.next = Some(Decoding::Done(Err(status))),
+                  Poll::Ready(None) => self.done = true,
+                  Poll::Pending => {}
+              }
+          }
+      }
+
+      impl<M> tonic::codegen::tokio_stream::Stream for OffloadedStream<M>
+      where
+          M: protobuf::Parse + std::marker::Send + 'static,
+      {
+          type Item = std::result::Result<M, tonic::Status>;
+
+          fn poll_next(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+              let this = &mut *self;
+              this.prefetch(cx);
+              if this.next.is_none() {
+                  return if this.done { Poll::Ready(None) } else { Poll::Pending };
+              }
+              let result = match poll_decoding(&mut this.next, cx) {
+                  Poll::Ready(result) => result,
+                  Poll::Pending => return Poll::Pending,
+              };
+              if result.is_ok() {
+                  this.prefetch(cx);
+              }
+              Poll::Ready(Some(result))
+          }
+      }
+  )rs");
+}
+
+static void GenerateDecodePipeline(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// The request stream of a method with a `pipeline_depth` option. A
+      /// reader task takes messages off the connection and starts decoding
+      /// them on the blocking pool, up to `depth` messages ahead of the
+      /// handler, so that decoding overlaps with handling.
+      pub struct DecodePipeline<M> {
+          decoded: tokio::sync::mpsc::Receiver<Decoding<M>>,
+          next: Option<Decoding<M>>,
+          reader: tokio::task::JoinHandle<()>,
+      }
+
+      // Decoded messages are never pinned.
+      impl<M> Unpin for DecodePipeline<M> {}
+
+      impl<M> std::fmt::Debug for DecodePipeline<M> {
+          fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+              f.debug_struct("DecodePipeline").finish_non_exhaustive()
+          }
+      }
+
+      impl<M> DecodePipeline<M>
+      where
+          M: protobuf::Parse + std::marker::Send + 'static,
+      {
+          pub(crate) fn new(
+              inner: tonic::codec::Streaming<Bytes>,
+              depth: usize,
+              threshold: usize,
+          ) -> Self {
+              let (sender, decoded) = tokio::sync::mpsc::channel(depth);
+              let reader = tokio::spawn(read_ahead(inner, threshold, sender));
+              Self { decoded, next: None, reader }
+          }
+
+          /// Fetch the next message from this stream, like
+          /// `Streaming::message`.
+          pub async fn message(&mut self) -> std::result::Result<Option<M>, tonic::Status> {
+              std::future::poll_fn(|cx| {
+                  tonic::codegen::tokio_stream::Stream::poll_next(Pin::new(&mut *self), cx)
+              })
+              .await
+              .transpose()
+          }
+      }
+
+      async fn read_ahead<M>(
+          mut inner: tonic::codec::Streaming<Bytes>,
+          threshold: usize,
+          sender: tokio::sync::mpsc::Sender<Decoding<M>>,
+      ) where
+          M: protobuf::Parse + std::marker::Send + 'static,
+      {
+          // Reserving a slot before reading leaves unread messages to the
+          // transport's flow control once the pipeline is full.
+          while let Ok(slot) = sender.reserve().await {
+              let next = std::future::poll_fn(|cx| {
+                  tonic::codegen::tokio_stream::Stream::poll_next(Pin::new(&mut inner), cx)
+              })
+              .await;
+              match next {
+                  Some(Ok(encoded)) => slot.send(start_decoding(encoded, threshold)),
+                  Some(Err(status)) => return slot.send(Decoding::Done(Err(status))),
+                  None => return,
+              }
+          }
+      }
+
+      impl<M> Drop for DecodePipeline<M> {
+          fn drop(&mut self) {
+              self.reader.abort();
+          }
+      }
+
+      impl<M> tonic::codegen::tokio_stream::Stream for DecodePipeline<M>
+      where
+          M: protobuf::Parse + std::marker::Send + 'static,
+      {
+          type Item = std::result::Result<M, tonic::Status>;
+
+          fn poll_next(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+              let this = &mut *self;
+              if this.next.is_none() {
+                  match this.decoded.poll_recv(cx) {
+                      Poll::Ready(Some(decoding)) => this.next = Some(decoding),
+                      Poll::Ready(None) => return Poll::Ready(None),
+                      Poll::Pending => return Poll::Pending,
+                  }
+              }
+              poll_decoding(&mut this.next, cx).map(Some)
+          }
+      }
+  )rs");
+}
+
+static void GenerateUnixClient(Context &ctx) {
+  ctx.Emit(R"rs(
+      #[cfg(unix)]
+      impl $service_ident$<tonic::transport::Channel> {
+          /// Connects to a server listening on the Unix domain socket at
+          /// `path`, for peers on the same host.
+          pub async fn connect_unix(
+              path: impl AsRef<std::path::Path>,
+          ) -> std::result::Result<Self, tonic::transport::Error> {
+              // The endpoint needs a URI, but it is never resolved.
+              let channel = tonic::transport::Endpoint::from_static("http://localhost")
+                  .connect_with_connector(UnixConnector(path.as_ref().to_path_buf()))
+                  .await?;
+              Ok(Self::new(channel))
+          }
+      }
+
+      #[cfg(unix)]
+      #[derive(Debug, Clone)]
+      struct UnixConnector(std::path::PathBuf);
+
+      #[cfg(unix)]
+      impl tonic::codegen::Service<Uri> for UnixConnector {
+          type Response = hyper_util::rt::TokioIo<tokio::net::UnixStream>;
+          type Error = std::io::Error;
+          type Future = BoxFuture<Self::Response, Self::Error>;
+
+          fn poll_ready(&mut self, _cx: &mut Context<'_>) -> Poll<std::result::Result<(), Self::Error>> {
+              Poll::Ready(Ok(()))
+          }
+
+          fn call(&mut self, _uri: Uri) -> Self::Future {
+              let path = self.0.clone();
+              Box::pin(async move {
+                  tokio::net::UnixStream::connect(path)
+                      .await
+                      .map(hyper_util::rt::TokioIo::new)
+              })
+          }
+      }
+  )rs");
+}
+
+static void GenerateResponseCache(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// Sizing of a response cache.
+      #[derive(Debug, Clone, Copy)]
+      pub struct ResponseCacheConfig {
+          /// Number of independently locked shards.
+          pub shards: usize,
+          /// Upper bound on the encoded requests and responses held by the cache.
+          pub max_bytes: usize,
+          /// How long responses of methods without a `cache_ttl` option are kept.
+          pub default_ttl: std::time::Duration,
+      }
+
+      impl Default for ResponseCacheConfig {
+          fn default() -> Self {
+              Self {
+                  shards: 16,
+                  max_bytes: 64 << 20,
+                  default_ttl: std::time::Duration::from_secs(1),
+              }
+          }
+      }
+
+      /// Counters of a response cache.
+      #[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+      pub struct ResponseCacheStats {
+          pub hits: u64,
+          pub misses: u64,
+          pub evictions: u64,
+          pub entries: u64,
+          /// Encoded bytes of the cached requests and responses.
+          pub bytes: u64,
+      }
+
+      #[derive(Debug)]
+      struct CacheEntry {
+          response: Bytes,
+          expires: std::time::Instant,
+          last_use: u64,
+      }
+
+      #[derive(Debug, Default)]
+      struct CacheShard {
+          entries: std::collections::HashMap<(usize, Bytes), CacheEntry>,
+          /// Keys ordered by last use, oldest first.
+          lru: std::collections::BTreeMap<u64, (usize, Bytes)>,
+          clock: u64,
+          bytes: usize,
+      }
+
+      impl CacheShard {
+          fn remove(&mut self, key: &(usize, Bytes)) -> Option<CacheEntry> {
+              let entry = self.entries.remove(key)?;
+              self.lru.remove(&entry.last_use);
+              self.bytes -= key.1.len() + entry.response.len();
+              Some(entry)
+          }
+      }
+
+      /// A bounded, sharded LRU cache of encoded responses, keyed by the
+      /// method index and the encoded request.
+      #[derive(Debug)]
+      pub(crate) struct ResponseCache {
+          shards: Vec<std::sync::Mutex<CacheShard>>,
+          shard_capacity: usize,
+          default_ttl: std::time::Duration,
+          hasher: std::collections::hash_map::RandomState,
+          hits: std::sync::atomic::AtomicU64,
+          misses: std::sync::atomic::AtomicU64,
+          evictions: std::sync::atomic::AtomicU64,
+          entries: std::sync::atomic::AtomicU64,
+          bytes: std::sync::atomic::AtomicU64,
+      }
+
+      impl ResponseCache {
+          pub(crate) fn new(config: ResponseCacheConfig) -> Self {
+              let shards = config.shards.max(1);
+              Self {
+                  shards: (0..shards).map(|_| Default::default()).collect(),
+                  shard_capacity: config.max_bytes / shards,
+                  default_ttl: config.default_ttl,
+                  hasher: Default::default(),
+                  hits: Default::default(),
+                  misses: Default::default(),
+                  evictions: Default::default(),
+                  entries: Default::default(),
+                  bytes: Default::default(),
+              }
+          }
+
+          fn shard(&self, key: &(usize, Bytes)) -> &std::sync::Mutex<CacheShard> {
+              use std::hash::BuildHasher;
+              let hash = self.hasher.hash_one(key);
+              &self.shards[(hash % self.shards.len() as u64) as usize]
+          }
+
+          fn lookup(&self, method: usize, request: &Bytes) -> Option<Bytes> {
+              let key = (method, request.clone());
+              let mut shard =
+                  self.shard(&key).lock().unwrap_or_else(std::sync::PoisonError::into_inner);
+              let shard = &mut *shard;
+              let expired = match shard.entries.get_mut(&key) {
+                  None => return None,
+                  Some(entry) if entry.expires <= std::time::Instant::now() => true,
+                  Some(entry) => {
+                      shard.clock += 1;
+                      shard.lru.remove(&entry.last_use);
+                      entry.last_use = shard.clock;
+                      shard.lru.insert(shard.clock, key.clone());
+                      return Some(entry.response.clone());
+                  }
+              };
+              if expired {
+                  if let Some(entry) = shard.remove(&key) {
+                      self.forget(&key, &entry);
+                  }
+              }
+              None
+          }
+
+          /// Returns the cached response to the request, if any and fresh.
+          pub(crate) fn get<R: protobuf::Parse>(
+              &self,
+              method: usize,
+              request: &Bytes,
+          ) -> Option<tonic::Response<R>> {
+              let response = self
+                  .lookup(method, request)
+                  .and_then(|encoded| R::parse(&encoded).ok());
+              self.count(response.is_some());
+              response.map(tonic::Response::new)
+          }
+
+          /// Returns the cached encoded response to the request, if any and
+          /// fresh.
+          pub(crate) fn get_encoded(&self, method: usize, request: &Bytes) -> Option<Bytes> {
+              let response = self.lookup(method, request);
+              self.count(response.is_some());
+              response
+          }
+
+          fn count(&self, hit: bool) {
+              let counter = if hit { &self.hits } else { &self.misses };
+              counter.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+          }
+
+          /// Caches the response to the request for `ttl`, or for the default
+          /// TTL if the method sets none.
+          pub(crate) fn insert<R: protobuf::Serialize>(
+              &self,
+              method: usize,
+              request: Bytes,
+              response: &R,
+              ttl: Option<std::time::Duration>,
+          ) {
+              let Ok(encoded) = protobuf::Serialize::serialize(response) else { return };
+              self.insert_encoded(method, request, Bytes::from(encoded), ttl);
+          }
+
+          pub(crate) fn insert_encoded(
+              &self,
+              method: usize,
+              request: Bytes,
+              response: Bytes,
+              ttl: Option<std::time::Duration>,
+          ) {
+              let size = request.len() + response.len();
+              if size > self.shard_capacity {
+                  return;
+              }
+              let key = (method, request);
+              let expires = std::time::Instant::now() + ttl.unwrap_or(self.default_ttl);
+              let mut shard =
+                  self.shard(&key).lock().unwrap_or_else(std::sync::PoisonError::into_inner);
+              if let Some(entry) = shard.remove(&key) {
+                  self.forget(&key, &entry);
+              }
+              while shard.bytes + size > self.shard_capacity {
+                  let Some((_, oldest)) = shard.lru.pop_first() else { break };
+                  let entry = shard.entries.remove(&oldest).expect("lru and entries agree");
+                  shard.bytes -= oldest.1.len() + entry.response.len();
+                  self.forget(&oldest, &entry);
+                  self.evictions.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+              }
+              shard.clock += 1;
+              let last_use = shard.clock;
+              shard.lru.insert(last_use, key.clone());
+              shard.bytes += size;
+              shard.entries.insert(key, CacheEntry { response, expires, last_use });
+              self.entries.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+              self.bytes.fetch_add(size as u64, std::sync::atomic::Ordering::Relaxed);
+          }
+
+          fn forget(&self, key: &(usize, Bytes), entry: &CacheEntry) {
+              let size = (key.1.len() + entry.response.len()) as u64;
+              self.entries.fetch_sub(1, std::sync::atomic::Ordering::Relaxed);
+              self.bytes.fetch_sub(size, std::sync::atomic::Ordering::Relaxed);
+          }
+
+          pub(crate) fn stats(&self) -> ResponseCacheStats {
+              let load = |counter: &std::sync::atomic::AtomicU64| {
+                  counter.load(std::sync::atomic::Ordering::Relaxed)
+              };
+              ResponseCacheStats {
+                  hits: load(&self.hits),
+                  misses: load(&self.misses),
+                  evictions: load(&self.evictions),
+                  entries: load(&self.entries),
+                  bytes: load(&self.bytes),
+              }
+          }
+      }
+  )rs");
+}
+
+static void generate_client(const Service &service,
+                            const GeneratorOptions &options, Context &ctx) {
+  std::string service_ident = absl::StrFormat("%sClient", service.name());
+  std::string client_mod =
+      absl::StrFormat("%s_client", rust::CamelToSnakeCase(service.name()));
+  std::vector<OptionalField> extra_fields;
+  if (options.hedging) {
+    extra_fields.push_back({"hedging", "Option<Arc<Hedging>>", "None"});
+  }
+  if (options.coalescing) {
+    extra_fields.push_back({"single_flight",
+                            "Option<Arc<SingleFlight<SharedResult>>>", "None"});
+  }
+  if (options.response_cache) {
+    extra_fields.push_back(
+        {"response_cache", "Option<Arc<ResponseCache>>", "None"});
+  }
+  if (options.write_coalescing) {
+    extra_fields.push_back(
+        {"write_coalescing", "Option<CoalescingPolicy>", "None"});
+  }
+  if (options.adaptive_concurrency) {
+    extra_fields.push_back(
+        {"concurrency_limits", "Option<Arc<ConcurrencyLimits>>", "None"});
+  }
+  std::string self_init = "Self { inner }";
+  if (!extra_fields.empty()) {
+    std::vector<std::string> inits = {"inner"};
+    for (const OptionalField &field : extra_fields) {
+      inits.push_back(absl::StrCat(field.name, ": ", field.init));
+    }
+    self_init = absl::StrCat("Self { ", absl::StrJoin(inits, ", "), " }");
+  }
+  ctx.Emit(
+      {
+          {"client_mod", client_mod},
+          {"service_ident", service_ident},
+          {"method_count", service.methods().size()},
+          {"self_init", self_init},
+          {"extra_fields",
+           [&] {
+             GenerateOptionalFields(extra_fields, "$name$: $type$,", ctx);
+           }},
+          {"with_hedging",
+           [&] {
+             ctx.Emit(R"rs(
+               /// Hedges the idempotent unary methods of this service.
+               #[must_use]
+               pub fn with_hedging(mut self, policy: HedgingPolicy) -> Self {
+                   self.hedging = Some(Arc::new(Hedging::new(policy, $method_count$)));
+                   self
+               }
+             )rs");
+           }},
+          {"with_coalescing",
+           [&] {
+             ctx.Emit(R"rs(
+               /// Lets concurrent calls with byte-identical requests to
+               /// methods without side effects share one call.
+               #[must_use]
+               pub fn with_coalescing(mut self) -> Self {
+                   self.single_flight = Some(Arc::default());
+                   self
+               }
+             )rs");
+           }},
+          {"with_write_coalescing",
+           [&] {
+             ctx.Emit(R"rs(
+               /// Holds back the messages of client-streaming and bidi
+               /// requests so that several are sent in one write.
+               #[must_use]
+               pub fn with_write_coalescing(mut self, policy: CoalescingPolicy) -> Self {
+                   self.write_coalescing = Some(policy);
+                   self
+               }
+             )rs");
+           }},
+          {"open_multiplex",
+           [&] {
+             ctx.Emit({{"multiplex_path", FormatMultiplexPath(service)},
+                       {"service_name", service.full_name()},
+                       {"multiplex_method", kMultiplexMethod}},
+                      R"rs(
+               /// Opens the bidi stream that carries multiplexed unary calls.
+               async fn open_multiplex(
+                   &mut self,
+                   envelopes: impl tonic::IntoStreamingRequest<Message = Bytes>,
+               ) -> std::result::Result<tonic::Response<tonic::codec::Streaming<Bytes>>, tonic::Status> {
+                   self.inner.ready().await.map_err(|e| {
+                       tonic::Status::unknown(format!("Service was not ready: {}", e.into()))
+                   })?;
+                   let path = http::uri::PathAndQuery::from_static("$multiplex_path$");
+                   let mut req = envelopes.into_streaming_request();
+                   req.extensions_mut()
+                       .insert(GrpcMethod::new("$service_name$", "$multiplex_method$"));
+                   self.inner.streaming(req, path, RawCodec).await
+               }
+             )rs");
+           }},
+          {"with_response_cache",
+           [&] {
+             ctx.Emit(R"rs(
+               /// Caches the responses of methods without side effects.
+               /// Clones of the client share the cache.
+               #[must_use]
+               pub fn with_response_cache(mut self, config: ResponseCacheConfig) -> Self {
+                   self.response_cache = Some(Arc::new(ResponseCache::new(config)));
+                   self
+               }
+
+               /// Counters of the response cache, if one is configured.
+               pub fn response_cache_stats(&self) -> Option<ResponseCacheStats> {
+                   self.response_cache.as_deref().map(ResponseCache::stats)
+               }
+             )rs");
+           }},
+          {"with_adaptive_concurrency",
+           [&] {
+             ctx.Emit(R"rs(
+               /// Limits the unary calls in flight to limits that adapt to
+               /// the observed round-trip times. Clones of the client share
+               /// the limits.
+               ///
+               /// Panics if `max_limit` is below `min_limit` or zero, or if
+               /// an AIMD `backoff` is outside of (0, 1] or its
+               /// `rtt_tolerance` below 1.
+               #[must_use]
+               pub fn with_adaptive_concurrency(mut self, policy: AdaptiveConcurrencyPolicy) -> Self {
+                   policy.validate();
+                   self.concurrency_limits = Some(Arc::new(ConcurrencyLimits::new(policy, $method_count$)));
+                   self
+               }
+
+               /// The current concurrency limit of each method, in the
+               /// order of the service definition, if limits are configured.
+               pub fn concurrency_limits(&self) -> Option<Vec<usize>> {
+                   let limits = self.concurrency_limits.as_deref()?;
+                   Some((0..$method_count$).map(|method| limits.limit(method)).collect())
+               }
+             )rs");
+           }},
+          {"service_doc",
+           [&] { ctx.Emit(ProtoCommentToRustDoc(service.comment())); }},
+          {"methods", [&] { GenerateMethods(service, options, ctx); }},
+          {"hedging", [&] { GenerateHedging(ctx); }},
+          {"adaptive_concurrency", [&] { GenerateAdaptiveConcurrency(ctx); }},
+          {"single_flight", [&] { GenerateSingleFlight(ctx); }},
+          {"request_key", [&] { GenerateRequestKey(ctx); }},
+          {"response_cache", [&] { GenerateResponseCache(ctx); }},
+          {"default_timeouts",
+           [&] { GenerateDefaultTimeoutConsts(service, ctx); }},
+          {"load_report", [&] { GenerateLoadReport(ctx); }},
+          {"pool_client",
+           [&] { GeneratePoolClient(service, options, service_ident, ctx); }},
+          {"batching_client",
+           [&] { GenerateBatchingClient(service, service_ident, ctx); }},
+          {"coalescing_stream", [&] { GenerateCoalescingStream(ctx); }},
+          {"batch_receiver", [&] { GenerateBatchReceiver(ctx); }},
+          {"stream_channel",
+           [&] {
+             GenerateStreamChannel(ctx);
+             GenerateStreamChannelConstructors(service, /*client=*/true, ctx);
+           }},
+          {"offload", [&] { GenerateOffload(ctx); }},
+          {"decode_pipeline", [&] { GenerateDecodePipeline(ctx); }},
+          {"raw_codec", [&] { GenerateRawCodec(ctx); }},
+          {"multiplex_client",
+           [&] { GenerateMultiplexClient(service, service_ident, ctx); }},
+          {"local_transport", [&] { GenerateUnixClient(ctx); }},
+      },
+      DropAbsentSubs(R"rs(
+      /// Generated client implementations.
+      pub mod $client_mod$ {
+          #![allow(
+              unused_variables,
+              dead_code,
+              missing_docs,
+              clippy::wildcard_imports,
+              // will trigger if compression is disabled
+              clippy::let_unit_value,
+          )]
+          use tonic::codegen::*;
+          use tonic::codegen::http::Uri;
+
+          $service_doc$
+          #[derive(Debug, Clone)]
+          pub struct $service_ident$<T> {
+              inner: tonic::client::Grpc<T>,
+              $extra_fields$
+          }
+
+          impl<T> $service_ident$<T>
+          where
+              T: tonic::client::GrpcService<tonic::body::Body>,
+              T::Error: Into<StdError>,
+              T::ResponseBody: Body<Data = Bytes> + std::marker::Send  +
+              'static, <T::ResponseBody as Body>::Error: Into<StdError> +
+              std::marker::Send,
+          {
+              pub fn new(inner: T) -> Self {
+                  let inner = tonic::client::Grpc::new(inner);
+                  $self_init$
+              }
+
+              pub fn with_origin(inner: T, origin: Uri) -> Self {
+                  let inner = tonic::client::Grpc::with_origin(inner, origin);
+                  $self_init$
+              }
+
+              pub fn with_interceptor<F>(inner: T, interceptor: F) ->
+              $service_ident$<InterceptedService<T, F>> where
+                  F: tonic::service::Interceptor,
                   T::ResponseBody: Default,
                   T: tonic::codegen::Service<
                       http::Request<tonic::body::Body>,
@@ -347,25 +3694,3339 @@ static void generate_client(const Service &service, Context &ctx) {
                   tonic::codegen::Service<http::Request<tonic::body::Body>>>::Error:
                   Into<StdError> + std::marker::Send + std::marker::Sync,
               {
-                  $service_ident$::new(InterceptedService::new(inner, interceptor))
+                  $service_ident$::new(InterceptedService::new(inner, interceptor))
+              }
+
+              /// Compress requests with the given encoding.
+              ///
+              /// This requires the server to support it otherwise it might respond with an
+              /// error.
+              #[must_use]
+              pub fn send_compressed(mut self, encoding: CompressionEncoding)
+              -> Self {
+                  self.inner = self.inner.send_compressed(encoding);
+                  self
+              }
+
+              /// Enable decompressing responses.
+              #[must_use]
+              pub fn accept_compressed(mut self, encoding:
+              CompressionEncoding) -> Self {
+                  self.inner = self.inner.accept_compressed(encoding);
+                  self
+              }
+
+              /// Limits the maximum size of a decoded message.
+              ///
+              /// Default: `4MB`
+              #[must_use]
+              pub fn max_decoding_message_size(mut self, limit: usize) ->
+              Self {
+                  self.inner = self.inner.max_decoding_message_size(limit);
+                  self
+              }
+
+              /// Limits the maximum size of an encoded message.
+              ///
+              /// Default: `usize::MAX`
+              #[must_use]
+              pub fn max_encoding_message_size(mut self, limit: usize) ->
+              Self {
+                  self.inner = self.inner.max_encoding_message_size(limit);
+                  self
+              }
+
+              $with_hedging$
+
+              $with_coalescing$
+
+              $with_write_coalescing$
+
+              $open_multiplex$
+
+              $with_response_cache$
+
+              $with_adaptive_concurrency$
+
+              $methods$
+          }
+
+          $default_timeouts$
+
+          $load_report$
+
+          $hedging$
+
+          $adaptive_concurrency$
+
+          $single_flight$
+
+          $request_key$
+
+          $response_cache$
+
+          $pool_client$
+
+          $batching_client$
+
+          $coalescing_stream$
+
+          $batch_receiver$
+
+          $stream_channel$
+
+          $offload$
+
+          $decode_pipeline$
+
+          $raw_codec$
+
+          $multiplex_client$
+
+          $local_transport$
+      })rs",
+                     {{"extra_fields", !extra_fields.empty()},
+                      {"with_hedging", options.hedging},
+                      {"with_coalescing", options.coalescing},
+                      {"with_write_coalescing", options.write_coalescing},
+                      {"open_multiplex", options.unary_multiplexing},
+                      {"with_response_cache", options.response_cache},
+                      {"with_adaptive_concurrency",
+                       options.adaptive_concurrency},
+                      {"default_timeouts", HasTimeouts(service)},
+                      {"load_report", options.load_reports},
+                      {"hedging", options.hedging},
+                      {"adaptive_concurrency", options.adaptive_concurrency},
+                      {"single_flight",
+                       options.coalescing || HasMemoized(options, service)},
+                      {"request_key",
+                       options.coalescing || options.response_cache},
+                      {"response_cache",
+                       options.response_cache || HasMemoized(options, service)},
+                      {"pool_client", options.pool_client},
+                      {"batching_client",
+                       options.batching && HasBatchedMethods(service)},
+                      {"coalescing_stream", options.write_coalescing},
+                      {"batch_receiver", options.batch_receive},
+                      {"stream_channel", HasStreamBuffers(service)},
+                      {"offload",
+                       HasOffload(service) || HasPipeline(service) ||
+                           HasMemoized(options, service) ||
+                           HasPooledRequests(service)},
+                      {"decode_pipeline", HasPipeline(service)},
+                      {"raw_codec", NeedsRawCodec(options)},
+                      {"multiplex_client", options.unary_multiplexing},
+                      {"local_transport", options.local_transport}}));
+}
+
+} // namespace client
+
+namespace server {
+
+static void GenerateOverloadedResponse(Context &ctx) {
+  ctx.Emit(R"rs(
+      fn overloaded_response() -> http::Response<tonic::body::Body> {
+          let mut response = http::Response::new(tonic::body::Body::default());
+          let headers = response.headers_mut();
+          headers.insert(
+              tonic::Status::GRPC_STATUS,
+              (tonic::Code::ResourceExhausted as i32).into(),
+          );
+          headers.insert(
+              tonic::Status::GRPC_MESSAGE,
+              http::HeaderValue::from_static("too many calls to the method"),
+          );
+          headers.insert(
+              http::header::CONTENT_TYPE,
+              tonic::metadata::GRPC_CONTENT_TYPE,
+          );
+          response
+      }
+      )rs");
+}
+
+static void GenerateFairScheduler(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// Runs handlers in a fixed number of slots. Calls waiting for a slot
+      /// get it in weighted fair order among flows, which are the calls of
+      /// one method from one tenant, so that a busy flow cannot starve the
+      /// others. A method's weight is its `priority` option.
+      #[derive(Debug)]
+      struct FairScheduler {
+          tenant_header: Option<http::HeaderName>,
+          state: std::sync::Mutex<FairState>,
+      }
+
+      #[derive(Debug, Default)]
+      struct FairState {
+          free: usize,
+          /// Finish tag of the call that got a slot last.
+          virtual_time: f64,
+          /// Finish tag of the latest call of each flow.
+          flows: std::collections::HashMap<(usize, Vec<u8>), f64>,
+          waiting: std::collections::BinaryHeap<FairWaiter>,
+          next_seq: u64,
+      }
+
+      impl FairState {
+          /// Tags a new call of a flow with the virtual time at which it
+          /// would finish if the flow got its share of the slots.
+          fn finish_tag(&mut self, method: usize, tenant: Vec<u8>, weight: u32) -> f64 {
+              let now = self.virtual_time;
+              // Flows that are not ahead of the virtual time behave like new ones.
+              if self.flows.len() >= 4096 {
+                  self.flows.retain(|_, finish| *finish > now);
+              }
+              let last = self.flows.entry((method, tenant)).or_insert(now);
+              *last = last.max(now) + 1.0 / f64::from(weight);
+              *last
+          }
+      }
+
+      #[derive(Debug)]
+      struct FairWaiter {
+          finish: f64,
+          seq: u64,
+          wake: tokio::sync::oneshot::Sender<()>,
+      }
+
+      impl PartialEq for FairWaiter {
+          fn eq(&self, other: &Self) -> bool {
+              self.cmp(other).is_eq()
+          }
+      }
+
+      impl Eq for FairWaiter {}
+
+      impl PartialOrd for FairWaiter {
+          fn partial_cmp(&self, other: &Self) -> Option<std::cmp::Ordering> {
+              Some(self.cmp(other))
+          }
+      }
+
+      impl Ord for FairWaiter {
+          // Reversed, so that the heap pops the earliest finish tag first.
+          fn cmp(&self, other: &Self) -> std::cmp::Ordering {
+              other
+                  .finish
+                  .total_cmp(&self.finish)
+                  .then(other.seq.cmp(&self.seq))
+          }
+      }
+
+      impl FairScheduler {
+          fn new(slots: usize, tenant_header: Option<http::HeaderName>) -> Self {
+              Self {
+                  tenant_header,
+                  state: std::sync::Mutex::new(FairState {
+                      free: slots,
+                      ..Default::default()
+                  }),
+              }
+          }
+
+          /// The scheduler state. No update of it panics halfway, so it is
+          /// consistent even when the lock is poisoned.
+          fn state(&self) -> std::sync::MutexGuard<'_, FairState> {
+              self.state.lock().unwrap_or_else(std::sync::PoisonError::into_inner)
+          }
+
+          fn tenant(&self, headers: &http::HeaderMap) -> Vec<u8> {
+              self.tenant_header
+                  .as_ref()
+                  .and_then(|name| headers.get(name))
+                  .map(|value| value.as_bytes().to_vec())
+                  .unwrap_or_default()
+          }
+
+          async fn acquire(self: Arc<Self>, method: usize, weight: u32, tenant: Vec<u8>) -> FairTurn {
+              let woken = {
+                  let mut state = self.state();
+                  let finish = state.finish_tag(method, tenant, weight);
+                  if state.free > 0 && state.waiting.is_empty() {
+                      state.free -= 1;
+                      state.virtual_time = finish;
+                      None
+                  } else {
+                      let (wake, woken) = tokio::sync::oneshot::channel();
+                      let seq = state.next_seq;
+                      state.next_seq += 1;
+                      state.waiting.push(FairWaiter { finish, seq, wake });
+                      Some(woken)
+                  }
+              };
+              if let Some(woken) = woken {
+                  let mut pending = PendingTurn {
+                      scheduler: Arc::clone(&self),
+                      woken: Some(woken),
+                  };
+                  if let Some(woken) = pending.woken.as_mut() {
+                      // The scheduler only drops a waiter after waking it.
+                      let _ = woken.await;
+                  }
+                  pending.woken = None;
+              }
+              FairTurn(self)
+          }
+
+          /// Hands a freed slot to the next waiter that is still there.
+          fn release(&self) {
+              let mut state = self.state();
+              while let Some(waiter) = state.waiting.pop() {
+                  if waiter.wake.send(()).is_ok() {
+                      state.virtual_time = waiter.finish;
+                      return;
+                  }
+              }
+              state.free += 1;
+          }
+      }
+
+      /// A running slot, given back when dropped.
+      struct FairTurn(Arc<FairScheduler>);
+
+      impl Drop for FairTurn {
+          fn drop(&mut self) {
+              self.0.release();
+          }
+      }
+
+      /// A call waiting for a slot. If it is dropped after being handed one,
+      /// the slot goes on to the next waiter.
+      struct PendingTurn {
+          scheduler: Arc<FairScheduler>,
+          woken: Option<tokio::sync::oneshot::Receiver<()>>,
+      }
+
+      impl Drop for PendingTurn {
+          fn drop(&mut self) {
+              let Some(mut woken) = self.woken.take() else {
+                  return;
+              };
+              // Under the lock, so that no slot is handed over in between.
+              let state = self.scheduler.state();
+              let handed_over = woken.try_recv().is_ok();
+              drop(woken);
+              drop(state);
+              if handed_over {
+                  self.scheduler.release();
+              }
+          }
+      }
+  )rs");
+}
+
+static void GenerateCodel(const Service &service, Context &ctx) {
+  ctx.Emit({{"method_count", absl::StrCat(service.methods().size())}}, R"rs(
+      /// CoDel state of one method. Once even the shortest wait of the calls
+      /// started in an interval exceeds the target, the method sheds new
+      /// calls, more often the longer the overload lasts, until an interval
+      /// passes with a short enough wait.
+      #[derive(Debug)]
+      struct Codel {
+          epoch: std::time::Instant,
+          target: u64,
+          interval: u64,
+          /// End of the current interval, in nanoseconds since `epoch`.
+          interval_end: std::sync::atomic::AtomicU64,
+          /// Shortest wait of the calls started in the current interval.
+          min_sojourn: std::sync::atomic::AtomicU64,
+          /// Calls shed since the overload began, or zero without overload.
+          shed_count: std::sync::atomic::AtomicU64,
+          /// When the next call may be shed, in nanoseconds since `epoch`.
+          shed_next: std::sync::atomic::AtomicU64,
+      }
+
+      impl Codel {
+          fn new(epoch: std::time::Instant, target: std::time::Duration, interval: std::time::Duration) -> Self {
+              let interval = interval.as_nanos() as u64;
+              Self {
+                  epoch,
+                  target: target.as_nanos() as u64,
+                  interval,
+                  interval_end: std::sync::atomic::AtomicU64::new(interval),
+                  min_sojourn: std::sync::atomic::AtomicU64::new(u64::MAX),
+                  shed_count: std::sync::atomic::AtomicU64::new(0),
+                  shed_next: std::sync::atomic::AtomicU64::new(0),
+              }
+          }
+
+          fn nanos(&self, at: std::time::Instant) -> u64 {
+              at.saturating_duration_since(self.epoch).as_nanos() as u64
+          }
+
+          /// Checks if a call arriving at `arrival` is to be shed. The state
+          /// holds no memory besides itself, so relaxed ordering is enough.
+          fn should_shed(&self, arrival: std::time::Instant) -> bool {
+              use std::sync::atomic::Ordering::Relaxed;
+              let count = self.shed_count.load(Relaxed);
+              if count == 0 {
+                  return false;
+              }
+              let now = self.nanos(arrival);
+              let next = self.shed_next.load(Relaxed);
+              if now < next {
+                  return false;
+              }
+              // The CoDel control law: shed at a rate growing with the
+              // square root of the calls shed so far.
+              let gap = (self.interval as f64 / ((count + 1) as f64).sqrt()) as u64;
+              // Of racing arrivals, only the one that moves `shed_next` is shed.
+              if self.shed_next.compare_exchange(next, now + gap, Relaxed, Relaxed).is_err() {
+                  return false;
+              }
+              self.shed_count
+                  .fetch_update(Relaxed, Relaxed, |count| (count > 0).then_some(count + 1))
+                  .is_ok()
+          }
+
+          /// Records that a call which the server routed at `arrival` had its
+          /// handler start at `started`, and closes the interval once it is
+          /// over.
+          fn record(&self, arrival: std::time::Instant, started: std::time::Instant) {
+              use std::sync::atomic::Ordering::Relaxed;
+              let sojourn = started.saturating_duration_since(arrival).as_nanos() as u64;
+              self.min_sojourn.fetch_min(sojourn, Relaxed);
+              let now = self.nanos(started);
+              let end = self.interval_end.load(Relaxed);
+              if now < end
+                  || self
+                      .interval_end
+                      .compare_exchange(end, now + self.interval, Relaxed, Relaxed)
+                      .is_err()
+              {
+                  return;
+              }
+              if self.min_sojourn.swap(u64::MAX, Relaxed) <= self.target {
+                  self.shed_count.store(0, Relaxed);
+              } else if self.shed_count.load(Relaxed) == 0 {
+                  self.shed_next.store(now, Relaxed);
+                  self.shed_count.store(1, Relaxed);
+              }
+          }
+      }
+
+      fn codel_states(target: std::time::Duration, interval: std::time::Duration) -> Arc<[Codel]> {
+          let epoch = std::time::Instant::now();
+          (0..$method_count$)
+              .map(|_| Codel::new(epoch, target, interval))
+              .collect()
+      }
+  )rs");
+}
+
+static bool HasAdmissionLimits(const Service &service) {
+  for (const Method &method : service.methods()) {
+    if (method.has_admission_limits()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Checks if the server holds a guard in the body of a streamed response,
+ * for admission limits or fair scheduling of a server-streaming method.
+ */
+static bool HoldsResponseGuards(const Service &service,
+                                const GeneratorOptions &options) {
+  for (const Method &method : service.methods()) {
+    if (method.is_server_streaming() &&
+        (method.has_admission_limits() || options.fair_scheduling)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void GenerateGuardedBody(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// A response body that holds a guard until it is dropped, which is
+      /// once the response stream has ended or the client went away.
+      ///
+      /// Frames are `http_body::Frame`s, so the `http-body` crate must be a
+      /// dependency when a server-streaming method has admission limits or
+      /// is fairly scheduled.
+      struct GuardedBody<G> {
+          inner: tonic::body::Body,
+          _guard: G,
+      }
+
+      impl<G: Unpin> Body for GuardedBody<G> {
+          type Data = Bytes;
+          type Error = tonic::Status;
+
+          fn poll_frame(
+              mut self: Pin<&mut Self>,
+              cx: &mut Context<'_>,
+          ) -> Poll<Option<std::result::Result<http_body::Frame<Bytes>, Self::Error>>> {
+              Pin::new(&mut self.inner).poll_frame(cx)
+          }
+
+          fn is_end_stream(&self) -> bool {
+              self.inner.is_end_stream()
+          }
+
+          fn size_hint(&self) -> http_body::SizeHint {
+              self.inner.size_hint()
+          }
+      }
+  )rs");
+}
+
+/**
+ * Emits the per-method admission state, indexed by method index, and the
+ * guard that counts a call against it.
+ */
+static void GenerateAdmission(const Service &service, Context &ctx) {
+  ctx.Emit(
+      {{"limits",
+        [&] {
+          for (const Method &method : service.methods()) {
+            const ::grpc::rust::MethodOptions &options = method.rust_options();
+            if (!method.has_admission_limits()) {
+              ctx.Emit("Admission::unlimited(),\n");
+              continue;
+            }
+            ctx.Emit({{"max_in_flight", absl::StrCat(options.max_in_flight())},
+                      {"max_queue", absl::StrCat(options.max_queue())}},
+                     "Admission::new($max_in_flight$, $max_queue$),\n");
+          }
+        }}},
+      R"rs(
+        /// Admission state of one method, from its `max_in_flight` and
+        /// `max_queue` options.
+        #[derive(Debug)]
+        struct Admission {
+            /// Calls running or waiting for a running slot.
+            admitted: std::sync::atomic::AtomicUsize,
+            /// The most calls `admitted` may count.
+            limit: usize,
+            /// Running slots, when calls may wait for one.
+            slots: Option<Arc<tokio::sync::Semaphore>>,
+        }
+
+        impl Admission {
+            fn new(max_in_flight: usize, max_queue: usize) -> Self {
+                Self {
+                    admitted: std::sync::atomic::AtomicUsize::new(0),
+                    limit: max_in_flight.saturating_add(max_queue),
+                    slots: (max_queue > 0).then(|| Arc::new(tokio::sync::Semaphore::new(max_in_flight))),
+                }
+            }
+
+            fn unlimited() -> Self {
+                Self::new(usize::MAX, 0)
+            }
+        }
+
+        fn admission_limits() -> Arc<[Admission]> {
+            Arc::new([
+                $limits$
+            ])
+        }
+
+        /// A call counted against the admission limits of its method until
+        /// it is dropped. A streamed response holds it until the stream ends.
+        struct Admitted {
+            admissions: Arc<[Admission]>,
+            index: usize,
+            /// The running slot, once `wait_turn` got one.
+            slot: Option<tokio::sync::OwnedSemaphorePermit>,
+        }
+
+        impl Admitted {
+            fn try_new(admissions: &Arc<[Admission]>, index: usize) -> Option<Self> {
+                let admission = &admissions[index];
+                // The counter guards no other memory, so relaxed ordering is
+                // enough.
+                let admitted = admission
+                    .admitted
+                    .fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+                if admitted >= admission.limit {
+                    admission
+                        .admitted
+                        .fetch_sub(1, std::sync::atomic::Ordering::Relaxed);
+                    return None;
+                }
+                Some(Self {
+                    admissions: Arc::clone(admissions),
+                    index,
+                    slot: None,
+                })
+            }
+
+            /// Waits for a running slot, if the method lets calls queue.
+            async fn wait_turn(&mut self) {
+                if let Some(slots) = &self.admissions[self.index].slots {
+                    self.slot = Arc::clone(slots).acquire_owned().await.ok();
+                }
+            }
+        }
+
+        impl Drop for Admitted {
+            fn drop(&mut self) {
+                self.admissions[self.index]
+                    .admitted
+                    .fetch_sub(1, std::sync::atomic::Ordering::Relaxed);
+            }
+        }
+      )rs");
+}
+
+/**
+ * Checks if the server receives the request of a unary or server-streaming
+ * method encoded, to decode it on the blocking pool or after a memoization
+ * miss.
+ */
+static bool DecodesOffloaded(const Service &service,
+                             const GeneratorOptions &options) {
+  for (const Method &method : service.methods()) {
+    if ((method.has_offload() && !method.is_client_streaming()) ||
+        IsMemoized(options, method)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * The type of the request that the server handlers of the method receive.
+ */
+static std::string ServerRequest(const Method &method, Context &ctx) {
+  const std::string request = method.request_response_name(ctx).first;
+  if (method.is_client_streaming()) {
+    return absl::StrCat(method.has_pipeline() ? "DecodePipeline<"
+                                              : "tonic::Streaming<",
+                        request, ">");
+  }
+  return method.has_pooled_request() ? absl::StrCat("Pooled<", request, ">")
+                                     : request;
+}
+
+/**
+ * The name of the thread-local pool that a method with the `pooled_request`
+ * option decodes its requests into.
+ */
+static std::string RequestPoolName(const Method &method) {
+  return absl::StrCat(absl::AsciiStrToUpper(rust::CamelToSnakeCase(
+                          std::string(method.proto_field_name()))),
+                      "_REQUEST_POOL");
+}
+
+static bool HasPreEncoded(const Service &service) {
+  for (const Method &method : service.methods()) {
+    if (method.is_pre_encoded()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void GenerateTraitMethods(const Service &service, Context &ctx) {
+  static std::string stream_type_format = R"rs(
+        /// Server streaming response type for the $method_name$ method.
+        type $stream_type$: tonic::codegen::tokio_stream::Stream<
+                Item = std::result::Result<$server_message$, tonic::Status>,
+            >
+            + std::marker::Send
+            + 'static;
+      )rs";
+
+  static std::string method_format = R"rs(
+        async fn $ident$(
+            &self,
+            request: tonic::Request<$server_request$>,
+        ) -> std::result::Result<tonic::Response<$server_response$>, tonic::Status>;
+      )rs";
+
+  const std::vector<Method> methods = service.methods();
+  for (const Method &method : methods) {
+    WithMethodVars(service, method, ctx, [&](const Method &method) {
+      const std::string stream_type =
+          absl::StrCat(method.proto_field_name(), "Stream");
+      const std::string server_message = ServerMessage(method, ctx);
+      auto vars = ctx.printer().WithVars({
+          {"stream_type", stream_type},
+          {"server_message", server_message},
+          {"server_request", ServerRequest(method, ctx)},
+          {"server_response", method.is_server_streaming()
+                                  ? absl::StrCat("Self::", stream_type)
+                                  : server_message},
+      });
+      if (method.is_server_streaming()) {
+        ctx.Emit(stream_type_format);
+        ctx.Emit("\n");
+      }
+      ctx.Emit(ProtoCommentToRustDoc(method.comment()));
+      if (method.is_deprecated()) {
+        GenerateDeprecated(ctx);
+      }
+      ctx.Emit(method_format);
+    });
+    if (&method != &methods.back()) {
+      ctx.Emit("\n");
+    }
+  }
+}
+
+/**
+ * The fair scheduler of the server and the tenant of the incoming request
+ * `req`, if fair scheduling is configured.
+ */
+static constexpr absl::string_view kFairFlow =
+    "self.fair_scheduler.as_ref().map(|scheduler| "
+    "(Arc::clone(scheduler), scheduler.tenant(req.headers())))";
+
+/**
+ * The server state that multiplexed calls of the unary methods use, as the
+ * fields of `MultiplexState` and their values in the route.
+ */
+static std::vector<OptionalField>
+MultiplexStateFields(const Service &service, const GeneratorOptions &options) {
+  bool unary = false;
+  bool admission = false;
+  bool memoized = false;
+  bool executors = false;
+  for (const Method &method : service.methods()) {
+    if (method.is_client_streaming() || method.is_server_streaming()) {
+      continue;
+    }
+    unary = true;
+    admission = admission || method.has_admission_limits();
+    memoized = memoized || IsMemoized(options, method);
+    executors = executors || !method.executor_pool().empty();
+  }
+  std::vector<OptionalField> fields;
+  if (admission) {
+    fields.push_back(
+        {"admission", "Arc<[Admission]>", "Arc::clone(&self.admission)"});
+  }
+  if (unary && options.fair_scheduling) {
+    fields.push_back({"fair_flow", "Option<(Arc<FairScheduler>, Vec<u8>)>",
+                      std::string(kFairFlow)});
+  }
+  if (unary && options.codel) {
+    fields.push_back({"codel", "Arc<[Codel]>", "Arc::clone(&self.codel)"});
+  }
+  if (memoized) {
+    fields.push_back(
+        {"memoizer", "Option<Arc<Memoizer>>", "self.memoizer.clone()"});
+  }
+  if (executors) {
+    fields.push_back({"executor_pools", "Arc<[Option<ExecutorPool>]>",
+                      "Arc::clone(&self.executor_pools)"});
+  }
+  return fields;
+}
+
+/**
+ * A value that the route of a method passes to the method's handler
+ * function: the parameter's name and type, how the route captures it from
+ * the server, if it does, and how a multiplexed call gets it.
+ */
+struct HandlerState {
+  std::string name;
+  std::string type;
+  std::string capture;
+  std::string multiplexed;
+};
+
+/**
+ * How the server receives and runs the calls of a method, which its route
+ * and, for a unary method, the multiplexed stream share.
+ */
+struct ServerPipeline {
+  bool memoized;
+  // Streamed requests reach the handler as `tonic::Streaming`, which decodes
+  // them itself, unless they are pipelined.
+  bool decodes_offloaded;
+  bool pipelined;
+  // Pooled requests arrive encoded too, and are decoded into a message of
+  // the worker thread's pool.
+  bool pooled;
+  bool coalesced;
+  bool receives_encoded;
+  std::vector<HandlerState> states;
+};
+
+static ServerPipeline MethodPipeline(const Method &method,
+                                     const GeneratorOptions &options) {
+  ServerPipeline pipeline;
+  pipeline.memoized = IsMemoized(options, method);
+  pipeline.decodes_offloaded =
+      (method.has_offload() && !method.is_client_streaming()) ||
+      pipeline.memoized;
+  pipeline.pipelined = method.has_pipeline();
+  pipeline.pooled = method.has_pooled_request();
+  pipeline.coalesced =
+      options.write_coalescing && method.is_server_streaming();
+  pipeline.receives_encoded =
+      pipeline.decodes_offloaded || pipeline.pipelined || pipeline.pooled;
+  if (pipeline.coalesced) {
+    // Only streamed responses are coalesced, and those are not multiplexed.
+    pipeline.states.push_back(
+        {"write_coalescing", "Option<CoalescingPolicy>",
+         "let write_coalescing = self.write_coalescing;", ""});
+  }
+  if (pipeline.memoized) {
+    pipeline.states.push_back({"memoizer", "Option<Arc<Memoizer>>",
+                               "let memoizer = self.memoizer.clone();",
+                               "state.memoizer.clone()"});
+  }
+  if (!method.executor_pool().empty()) {
+    pipeline.states.push_back(
+        {"executor", "Option<ExecutorPool>",
+         absl::StrFormat("let executor = self.executor_pools[%d].clone();",
+                         method.index()),
+         absl::StrFormat("state.executor_pools[%d].clone()",
+                         method.index())});
+  }
+  if (options.codel) {
+    // The wait ends when the handler starts, after any queueing for a slot,
+    // decoding, or an executor. Both are captured where the call is
+    // admitted.
+    pipeline.states.push_back(
+        {"codel", "Arc<[Codel]>", "", "Arc::clone(&state.codel)"});
+    pipeline.states.push_back(
+        {"arrival", "std::time::Instant", "", "arrival"});
+  }
+  return pipeline;
+}
+
+/**
+ * The name of the function that runs the calls of a method, from the request
+ * its route received to the handler's response.
+ */
+static std::string HandlerFnName(const Method &method) {
+  return absl::StrCat("handle_", rust::CamelToSnakeCase(std::string(
+                                     method.proto_field_name())));
+}
+
+/**
+ * Emits `line` for each handler state, with its fields in scope, on lines of
+ * their own.
+ */
+static void GenerateHandlerStates(const std::vector<HandlerState> &states,
+                                  absl::string_view line, Context &ctx) {
+  std::vector<OptionalField> fields;
+  for (const HandlerState &state : states) {
+    fields.push_back({state.name, state.type, state.capture});
+  }
+  GenerateOptionalFields(fields, line, ctx);
+}
+
+/**
+ * Emits the function of each method that runs its calls through the stages
+ * its options ask for: recording the deadline, attaching the cancellation,
+ * memoization, decoding, the executor, and wrapping streamed responses.
+ */
+static void GenerateMethodHandlers(const Service &service,
+                                   const GeneratorOptions &options,
+                                   const std::string &server_trait,
+                                   Context &ctx) {
+  static std::string handler_format = R"rs(
+        /// Runs one `$method_name$` call, from the request its route
+        /// received to the handler's response.
+        $allow_deprecated$
+        async fn $handle_fn$<T: $server_trait$>(
+            inner: Arc<T>,
+            $params$
+            request: tonic::Request<$handler_request$>,
+        ) -> std::result::Result<tonic::Response<$handler_response$>, tonic::Status> {
+            $record_deadline$
+            $attach_cancellation$
+            $body$
+        }
+      )rs";
+
+  static std::string body_format = R"rs(
+        $decode_request$
+        $handle$)rs";
+
+  // Hits are answered from the encoded request, so the handler and the
+  // decoding run inside `handled`, which only leaders await.
+  static std::string memoized_body_format = R"rs(
+        let memoized = memoizer.map(|memoizer| {
+            let key = memoizer.key(request.metadata(), request.get_ref());
+            (memoizer, key)
+        });
+        let handled = async move {
+            $decode_request$
+            $encoded_response$
+        };
+        match memoized {
+            Some((memoizer, key)) => memoizer.call($method_id$, key, $cache_ttl$, handled).await,
+            None => handled.await,
+        })rs";
+
+  auto vars = ctx.printer().WithVars({{"server_trait", server_trait}});
+  const std::vector<Method> methods = service.methods();
+  for (const Method &method : methods) {
+    WithMethodVars(service, method, ctx, [&](const Method &method) {
+      const ServerPipeline pipeline = MethodPipeline(method, options);
+      // Server-streaming responses are wrapped from the inside out.
+      std::string response_stream =
+          absl::StrFormat("T::%sStream", method.proto_field_name());
+      std::string wrap_messages = "messages";
+      if (options.cancellation) {
+        response_stream =
+            absl::StrFormat("CancellableStream<%s>", response_stream);
+        wrap_messages = absl::StrFormat(
+            "CancellableStream::new(%s, cancel_on_drop)", wrap_messages);
+      }
+      if (options.write_coalescing) {
+        response_stream =
+            absl::StrFormat("CoalescingStream<%s>", response_stream);
+        wrap_messages = absl::StrFormat(
+            "CoalescingStream::new(%s, write_coalescing)", wrap_messages);
+      }
+      std::string svc_request = pipeline.receives_encoded
+                                    ? "Bytes"
+                                    : method.request_response_name(ctx).first;
+      if (method.is_client_streaming()) {
+        svc_request = absl::StrFormat("tonic::Streaming<%s>", svc_request);
+      }
+      const bool decodes = pipeline.pooled || pipeline.decodes_offloaded ||
+                           pipeline.pipelined;
+      auto handler_vars = ctx.printer().WithVars(
+          {{"handle_fn", HandlerFnName(method)},
+           {"handler_request", svc_request},
+           {"handler_response", method.is_server_streaming()
+                                    ? response_stream
+                                    : RouteMessage(method, options, ctx)},
+           // Memoized requests arrive encoded, but only offloaded ones are
+           // decoded on the blocking pool.
+           {"threshold",
+            pipeline.memoized && !method.has_offload()
+                ? "usize::MAX"
+                : absl::StrCat(
+                      method.rust_options().offload_threshold_bytes())},
+           {"cache_ttl",
+            FormatOptionalDuration(method.rust_options().has_cache_ttl(),
+                                   method.rust_options().cache_ttl())},
+           {"depth", absl::StrCat(method.rust_options().pipeline_depth())},
+           {"allow_deprecated", "#[allow(deprecated)]"},
+           {"params",
+            [&] {
+              GenerateHandlerStates(pipeline.states, "$name$: $type$,", ctx);
+            }},
+           {"record_deadline", "let request = record_deadline(request);"},
+           {"attach_cancellation",
+            "let (request, cancel_on_drop) = attach_cancellation(request);"},
+           {"record_start",
+            absl::StrFormat(
+                "codel[%d].record(arrival, std::time::Instant::now());",
+                method.index())},
+           {"invoke",
+            [&] {
+              if (method.runs_blocking()) {
+                ctx.Emit(DropAbsentSubs(R"rs(
+                  run_blocking(async move {
+                      $record_start$
+                      <T as $server_trait$>::$ident$(&inner, request).await
+                  })
+                  .await)rs",
+                                        {{"record_start", options.codel}}));
+              } else if (!method.executor_pool().empty()) {
+                ctx.Emit(DropAbsentSubs(R"rs(
+                  {
+                      let handler = async move {
+                          $record_start$
+                          <T as $server_trait$>::$ident$(&inner, request).await
+                      };
+                      match executor {
+                          Some(pool) => pool.run(handler).await,
+                          None => handler.await,
+                      }
+                  })rs",
+                                        {{"record_start", options.codel}}));
+              } else if (options.codel) {
+                ctx.Emit(R"rs(
+                  {
+                      $record_start$
+                      <T as $server_trait$>::$ident$(&inner, request).await
+                  })rs");
+              } else {
+                ctx.Emit(
+                    "<T as $server_trait$>::$ident$(&inner, request).await");
+              }
+            }},
+           {"decode_request",
+            [&] {
+              if (pipeline.pooled) {
+                ctx.Emit({{"pool", RequestPoolName(method)}},
+                         "let request = decode_pooled_request(request, "
+                         "&$pool$)?;");
+              } else if (pipeline.decodes_offloaded) {
+                ctx.Emit("let request = decode_offloaded_request(request, "
+                         "$threshold$).await?;");
+              } else if (pipeline.pipelined) {
+                ctx.Emit("let request = request.map(|messages| "
+                         "DecodePipeline::new(messages, $depth$, "
+                         "$threshold$));");
+              }
+            }},
+           {"handle",
+            [&] {
+              if (options.cancellation && method.is_server_streaming()) {
+                // The call goes on until the response stream ends.
+                ctx.Emit({{"wrap_messages", wrap_messages}}, R"rs(
+                  match $invoke$ {
+                      Ok(response) => Ok(response.map(|messages| $wrap_messages$)),
+                      Err(status) => {
+                          cancel_on_drop.finish();
+                          Err(status)
+                      }
+                  })rs");
+              } else if (options.cancellation) {
+                ctx.Emit(R"rs(
+                  let result = $invoke$;
+                  cancel_on_drop.finish();
+                  result)rs");
+              } else if (pipeline.coalesced) {
+                ctx.Emit({{"wrap_messages", wrap_messages}},
+                         "$invoke$.map(|response| response.map(|messages| "
+                         "$wrap_messages$))");
+              } else {
+                ctx.Emit("$invoke$");
+              }
+            }},
+           {"encoded_response",
+            [&] {
+              if (method.is_pre_encoded()) {
+                ctx.Emit("$handle$");
+                return;
+              }
+              ctx.Emit(R"rs(
+                let response = {
+                    $handle$
+                };
+                encode_response(response))rs");
+            }},
+           {"body", [&] {
+              ctx.Emit(DropAbsentSubs(pipeline.memoized ? memoized_body_format
+                                                        : body_format,
+                                      {{"decode_request", decodes}}));
+            }}});
+      ctx.Emit(DropAbsentSubs(
+          handler_format,
+          {{"allow_deprecated", method.is_deprecated()},
+           {"params", !pipeline.states.empty()},
+           {"record_deadline", options.deadline_propagation},
+           {"attach_cancellation", options.cancellation}}));
+    });
+    if (&method != &methods.back()) {
+      ctx.Emit("\n");
+    }
+  }
+}
+
+static void GenerateRoutes(const Service &service,
+                           const GeneratorOptions &options,
+                           const std::string &server_trait, Context &ctx) {
+  static std::string unary_format = R"rs(
+        "$path$" => {
+            #[allow(non_camel_case_types)]
+            struct $svc_ident$<T: $server_trait$>(pub Arc<T>$svc_state$);
+            impl<T: $server_trait$> tonic::server::UnaryService<$svc_request$>
+            for $svc_ident$<T> {
+                type Response = $server_message$;
+                type Future = BoxFuture<tonic::Response<Self::Response>, tonic::Status>;
+                fn call(&mut self, request: tonic::Request<$svc_request$>) -> Self::Future {
+                    Box::pin($handle_fn$(Arc::clone(&self.0)$svc_fields$, request))
+                }
+            }
+            let accept_compression_encodings = self.accept_compression_encodings;
+            let send_compression_encodings = self.send_compression_encodings;
+            let max_decoding_message_size = self.max_decoding_message_size;
+            let max_encoding_message_size = self.max_encoding_message_size;
+            let inner = self.inner.clone();
+            $capture_state$
+            $admit$
+            let fut = async move {
+                $wait_turn$
+                let method = $svc_ident$(inner$svc_args$);
+                let codec = $codec$;
+                let mut grpc = tonic::server::Grpc::new(codec)
+                    .apply_compression_config(
+                        accept_compression_encodings,
+                        send_compression_encodings,
+                    )
+                    .apply_max_message_size_config(
+                        max_decoding_message_size,
+                        max_encoding_message_size,
+                    );
+                let res = grpc.unary(method, req).await;
+                Ok(res)
+            };
+            Box::pin(fut)
+        }
+      )rs";
+
+  static std::string server_streaming_format = R"rs(
+        "$path$" => {
+            #[allow(non_camel_case_types)]
+            struct $svc_ident$<T: $server_trait$>(pub Arc<T>$svc_state$);
+            impl<T: $server_trait$> tonic::server::ServerStreamingService<$svc_request$>
+            for $svc_ident$<T> {
+                type Response = $server_message$;
+                type ResponseStream = $response_stream$;
+                type Future = BoxFuture<tonic::Response<Self::ResponseStream>, tonic::Status>;
+                fn call(&mut self, request: tonic::Request<$svc_request$>) -> Self::Future {
+                    Box::pin($handle_fn$(Arc::clone(&self.0)$svc_fields$, request))
+                }
+            }
+            let accept_compression_encodings = self.accept_compression_encodings;
+            let send_compression_encodings = self.send_compression_encodings;
+            let max_decoding_message_size = self.max_decoding_message_size;
+            let max_encoding_message_size = self.max_encoding_message_size;
+            let inner = self.inner.clone();
+            $capture_state$
+            $admit$
+            let fut = async move {
+                $wait_turn$
+                let method = $svc_ident$(inner$svc_args$);
+                let codec = $codec$;
+                let mut grpc = tonic::server::Grpc::new(codec)
+                    .apply_compression_config(
+                        accept_compression_encodings,
+                        send_compression_encodings,
+                    )
+                    .apply_max_message_size_config(
+                        max_decoding_message_size,
+                        max_encoding_message_size,
+                    );
+                let res = grpc.server_streaming(method, req).await;
+                $hold_guards$
+                Ok(res)
+            };
+            Box::pin(fut)
+        }
+      )rs";
+
+  static std::string client_streaming_format = R"rs(
+        "$path$" => {
+            #[allow(non_camel_case_types)]
+            struct $svc_ident$<T: $server_trait$>(pub Arc<T>$svc_state$);
+            impl<T: $server_trait$> tonic::server::ClientStreamingService<$svc_request$>
+            for $svc_ident$<T> {
+                type Response = $server_message$;
+                type Future = BoxFuture<tonic::Response<Self::Response>, tonic::Status>;
+                fn call(
+                    &mut self,
+                    request: tonic::Request<tonic::Streaming<$svc_request$>>,
+                ) -> Self::Future {
+                    Box::pin($handle_fn$(Arc::clone(&self.0)$svc_fields$, request))
+                }
+            }
+            let accept_compression_encodings = self.accept_compression_encodings;
+            let send_compression_encodings = self.send_compression_encodings;
+            let max_decoding_message_size = self.max_decoding_message_size;
+            let max_encoding_message_size = self.max_encoding_message_size;
+            let inner = self.inner.clone();
+            $capture_state$
+            $admit$
+            let fut = async move {
+                $wait_turn$
+                let method = $svc_ident$(inner$svc_args$);
+                let codec = $codec$;
+                let mut grpc = tonic::server::Grpc::new(codec)
+                    .apply_compression_config(
+                        accept_compression_encodings,
+                        send_compression_encodings,
+                    )
+                    .apply_max_message_size_config(
+                        max_decoding_message_size,
+                        max_encoding_message_size,
+                    );
+                let res = grpc.client_streaming(method, req).await;
+                Ok(res)
+            };
+            Box::pin(fut)
+        }
+      )rs";
+
+  static std::string streaming_format = R"rs(
+        "$path$" => {
+            #[allow(non_camel_case_types)]
+            struct $svc_ident$<T: $server_trait$>(pub Arc<T>$svc_state$);
+            impl<T: $server_trait$> tonic::server::StreamingService<$svc_request$>
+            for $svc_ident$<T> {
+                type Response = $server_message$;
+                type ResponseStream = $response_stream$;
+                type Future = BoxFuture<tonic::Response<Self::ResponseStream>, tonic::Status>;
+                fn call(
+                    &mut self,
+                    request: tonic::Request<tonic::Streaming<$svc_request$>>,
+                ) -> Self::Future {
+                    Box::pin($handle_fn$(Arc::clone(&self.0)$svc_fields$, request))
+                }
+            }
+            let accept_compression_encodings = self.accept_compression_encodings;
+            let send_compression_encodings = self.send_compression_encodings;
+            let max_decoding_message_size = self.max_decoding_message_size;
+            let max_encoding_message_size = self.max_encoding_message_size;
+            let inner = self.inner.clone();
+            $capture_state$
+            $admit$
+            let fut = async move {
+                $wait_turn$
+                let method = $svc_ident$(inner$svc_args$);
+                let codec = $codec$;
+                let mut grpc = tonic::server::Grpc::new(codec)
+                    .apply_compression_config(
+                        accept_compression_encodings,
+                        send_compression_encodings,
+                    )
+                    .apply_max_message_size_config(
+                        max_decoding_message_size,
+                        max_encoding_message_size,
+                    );
+                let res = grpc.streaming(method, req).await;
+                $hold_guards$
+                Ok(res)
+            };
+            Box::pin(fut)
+        }
+      )rs";
+
+  auto vars = ctx.printer().WithVars({{"server_trait", server_trait}});
+  for (const Method &method : service.methods()) {
+    WithMethodVars(service, method, ctx, [&](const Method &method) {
+      const ServerPipeline pipeline = MethodPipeline(method, options);
+      std::string svc_state;
+      std::string svc_args;
+      std::string svc_fields;
+      std::vector<HandlerState> captured;
+      for (size_t i = 0; i < pipeline.states.size(); ++i) {
+        const HandlerState &state = pipeline.states[i];
+        absl::StrAppend(&svc_state, ", ", state.type);
+        absl::StrAppend(&svc_args, ", ", state.name);
+        absl::StrAppendFormat(&svc_fields, ", self.%d.clone()", i + 1);
+        if (!state.capture.empty()) {
+          captured.push_back(state);
+        }
+      }
+      std::string response_stream =
+          absl::StrFormat("T::%sStream", method.proto_field_name());
+      if (options.cancellation) {
+        response_stream =
+            absl::StrFormat("CancellableStream<%s>", response_stream);
+      }
+      if (options.write_coalescing) {
+        response_stream =
+            absl::StrFormat("CoalescingStream<%s>", response_stream);
+      }
+      std::string codec = absl::StrCat(pipeline.receives_encoded
+                                           ? "OffloadCodec"
+                                           : "grpc::codec::ProtoCodec",
+                                       "::default()");
+      if (method.is_pre_encoded() || pipeline.memoized) {
+        codec = absl::StrFormat("EncodedCodec(%s)", codec);
+      }
+      // A streamed response counts against the limits and holds its slot
+      // until it ends, which is long after the call future returned.
+      std::vector<std::string> guards;
+      if (method.is_server_streaming() && method.has_admission_limits()) {
+        guards.push_back("admitted");
+      }
+      if (method.is_server_streaming() && options.fair_scheduling) {
+        guards.push_back("fair_turn");
+      }
+      auto vars = ctx.printer().WithVars(
+          {{"codec", codec},
+           {"server_message", RouteMessage(method, options, ctx)},
+           {"svc_ident", absl::StrCat(method.proto_field_name(), "Svc")},
+           {"handle_fn", HandlerFnName(method)},
+           {"response_stream", response_stream},
+           {"svc_state", svc_state},
+           {"svc_args", svc_args},
+           {"svc_fields", svc_fields},
+           {"capture_state",
+            [&] { GenerateHandlerStates(captured, "$init$", ctx); }},
+           {"admit",
+            [&] {
+              std::vector<std::string> checks;
+              if (options.codel) {
+                checks.push_back(R"rs(
+                  let arrival = std::time::Instant::now();
+                  if self.codel[$method_id$].should_shed(arrival) {
+                      return Box::pin(async move { Ok(overloaded_response()) });
+                  }
+                  let codel = Arc::clone(&self.codel);)rs");
+              }
+              if (method.has_admission_limits()) {
+                checks.push_back(R"rs(
+                  let Some(mut admitted) = Admitted::try_new(&self.admission, $method_id$) else {
+                      return Box::pin(async move { Ok(overloaded_response()) });
+                  };)rs");
+              }
+              if (options.fair_scheduling) {
+                checks.push_back(absl::StrCat("let fair_flow = ", kFairFlow,
+                                              ";"));
+              }
+              GenerateLines(checks, ctx);
+            }},
+           {"wait_turn",
+            [&] {
+              std::vector<std::string> waits;
+              if (method.has_admission_limits()) {
+                waits.push_back("admitted.wait_turn().await;");
+              }
+              if (options.fair_scheduling) {
+                waits.push_back(absl::StrFormat(
+                    R"rs(
+                  let %s = match fair_flow {
+                      Some((scheduler, tenant)) => {
+                          Some(scheduler.acquire($method_id$, %d, tenant).await)
+                      }
+                      None => None,
+                  };)rs",
+                    guards.empty() ? "_fair_turn" : "fair_turn",
+                    method.priority()));
+              }
+              GenerateLines(waits, ctx);
+            }},
+           {"hold_guards",
+            [&] {
+              ctx.Emit({{"guard", guards.size() == 1
+                                      ? guards[0]
+                                      : absl::StrCat("(", absl::StrJoin(
+                                                              guards, ", "),
+                                                     ")")}},
+                       R"rs(
+                let res = res.map(|inner| {
+                    tonic::body::Body::new(GuardedBody { inner, _guard: $guard$ })
+                });)rs");
+            }},
+           {"svc_request", pipeline.receives_encoded
+                               ? "Bytes"
+                               : method.request_response_name(ctx).first}});
+      const std::string *format = &streaming_format;
+      if (!method.is_client_streaming() && !method.is_server_streaming()) {
+        format = &unary_format;
+      } else if (!method.is_client_streaming() &&
+                 method.is_server_streaming()) {
+        format = &server_streaming_format;
+      } else if (method.is_client_streaming() &&
+                 !method.is_server_streaming()) {
+        format = &client_streaming_format;
+      }
+      ctx.Emit(DropAbsentSubs(
+          *format,
+          {{"capture_state", !captured.empty()},
+           {"admit", options.codel || method.has_admission_limits() ||
+                         options.fair_scheduling},
+           {"wait_turn",
+            method.has_admission_limits() || options.fair_scheduling},
+           {"hold_guards", !guards.empty()}}));
+    });
+  }
+  if (options.unary_multiplexing) {
+    const std::vector<OptionalField> state_fields =
+        MultiplexStateFields(service, options);
+    ctx.Emit({{"multiplex_path", FormatMultiplexPath(service)},
+              {"state_fields",
+               [&] {
+                 GenerateOptionalFields(state_fields, "$name$: $init$,", ctx);
+               }}},
+             DropAbsentSubs(R"rs(
+      "$multiplex_path$" => {
+          #[allow(non_camel_case_types)]
+          struct MultiplexSvc<T: $server_trait$>(pub Arc<T>, MultiplexState, usize);
+          impl<T: $server_trait$> tonic::server::StreamingService<Bytes>
+          for MultiplexSvc<T> {
+              type Response = Bytes;
+              type ResponseStream = tonic::codegen::tokio_stream::wrappers::ReceiverStream<
+                  std::result::Result<Bytes, tonic::Status>,
+              >;
+              type Future = BoxFuture<tonic::Response<Self::ResponseStream>, tonic::Status>;
+              fn call(
+                  &mut self,
+                  request: tonic::Request<tonic::Streaming<Bytes>>,
+              ) -> Self::Future {
+                  let inner = Arc::clone(&self.0);
+                  let state = self.1.clone();
+                  let max_calls = self.2;
+                  let fut = async move {
+                      let (metadata, _, requests) = request.into_parts();
+                      let replies = serve_multiplexed(inner, state, metadata, requests, max_calls);
+                      Ok(tonic::Response::new(replies))
+                  };
+                  Box::pin(fut)
+              }
+          }
+          let accept_compression_encodings = self.accept_compression_encodings;
+          let send_compression_encodings = self.send_compression_encodings;
+          let max_decoding_message_size = self.max_decoding_message_size;
+          let max_encoding_message_size = self.max_encoding_message_size;
+          let inner = self.inner.clone();
+          let state = MultiplexState {
+              $state_fields$
+          };
+          let max_multiplexed_calls = self.max_multiplexed_calls;
+          let fut = async move {
+              let method = MultiplexSvc(inner, state, max_multiplexed_calls);
+              let mut grpc = tonic::server::Grpc::new(RawCodec)
+                  .apply_compression_config(
+                      accept_compression_encodings,
+                      send_compression_encodings,
+                  )
+                  .apply_max_message_size_config(
+                      max_decoding_message_size,
+                      max_encoding_message_size,
+                  );
+              let res = grpc.streaming(method, req).await;
+              Ok(res)
+          };
+          Box::pin(fut)
+      }
+    )rs",
+                            {{"state_fields", !state_fields.empty()}}));
+  }
+}
+
+static void GenerateEncoded(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// A response message that is already encoded, returned by the
+      /// handlers of methods with the `pre_encoded` option. Clones share the
+      /// encoding, so a response served to many calls is encoded once and
+      /// written as it is. Writing copies it into the call's send buffer.
+      pub struct Encoded<M> {
+          bytes: Bytes,
+          message: std::marker::PhantomData<fn() -> M>,
+      }
+
+      impl<M: protobuf::Serialize> Encoded<M> {
+          /// Encodes `message`.
+          pub fn new(message: &M) -> std::result::Result<Self, tonic::Status> {
+              let encoded = protobuf::Serialize::serialize(message)
+                  .map_err(|_| tonic::Status::internal("failed to encode the message"))?;
+              Ok(Self::from_bytes(Bytes::from(encoded)))
+          }
+      }
+
+      impl<M> Encoded<M> {
+          /// Wraps bytes that hold an encoded `M`. They are sent unchecked.
+          pub fn from_bytes(bytes: Bytes) -> Self {
+              Self {
+                  bytes,
+                  message: std::marker::PhantomData,
+              }
+          }
+
+          pub fn as_bytes(&self) -> &Bytes {
+              &self.bytes
+          }
+
+          pub fn into_bytes(self) -> Bytes {
+              self.bytes
+          }
+      }
+
+      impl<M> Clone for Encoded<M> {
+          fn clone(&self) -> Self {
+              Self::from_bytes(self.bytes.clone())
+          }
+      }
+
+      impl<M> std::fmt::Debug for Encoded<M> {
+          fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+              f.debug_struct("Encoded").field("len", &self.bytes.len()).finish()
+          }
+      }
+
+      /// Decodes requests with the wrapped codec and writes `Encoded`
+      /// responses as they are.
+      #[derive(Debug)]
+      struct EncodedCodec<C>(C);
+
+      impl<C: tonic::codec::Codec> tonic::codec::Codec for EncodedCodec<C> {
+          type Encode = Encoded<C::Encode>;
+          type Decode = C::Decode;
+          type Encoder = EncodedEncoder<C::Encode>;
+          type Decoder = C::Decoder;
+
+          fn encoder(&mut self) -> Self::Encoder {
+              EncodedEncoder(std::marker::PhantomData)
+          }
+
+          fn decoder(&mut self) -> Self::Decoder {
+              self.0.decoder()
+          }
+      }
+
+      /// Copies the encoding into the buffer tonic frames and compresses
+      /// messages in, which costs a memcpy but no serialization. Tonic's
+      /// encoders cannot hand it `Bytes` to send as they are.
+      #[derive(Debug)]
+      struct EncodedEncoder<M>(std::marker::PhantomData<fn(M)>);
+
+      impl<M> tonic::codec::Encoder for EncodedEncoder<M> {
+          type Item = Encoded<M>;
+          type Error = tonic::Status;
+
+          fn encode(
+              &mut self,
+              item: Self::Item,
+              dst: &mut tonic::codec::EncodeBuf<'_>,
+          ) -> std::result::Result<(), Self::Error> {
+              bytes::BufMut::put(dst, item.bytes);
+              Ok(())
+          }
+      }
+  )rs");
+}
+
+static void GenerateMemoizer(Context &ctx) {
+  ctx.Emit(R"rs(
+      pub use super::$client_mod$::{ResponseCacheConfig, ResponseCacheStats};
+      use super::$client_mod$::{Flight, ResponseCache, SingleFlight};
+
+      /// Shares one handler run among identical concurrent calls of a method
+      /// without side effects, and memoizes its encoded response. Calls are
+      /// keyed by the method index, the values of the key headers and the
+      /// encoded request, so a hit is answered without decoding. Errors are
+      /// shared with the concurrent calls but not memoized. Only the message
+      /// is shared: hits and the calls that joined a running one get no
+      /// response metadata.
+      #[derive(Debug)]
+      struct Memoizer {
+          cache: ResponseCache,
+          flights: SingleFlight<std::result::Result<Bytes, tonic::Status>>,
+          key_headers: Vec<http::HeaderName>,
+      }
+
+      impl Memoizer {
+          fn new(config: ResponseCacheConfig, key_headers: Vec<http::HeaderName>) -> Self {
+              Self {
+                  cache: ResponseCache::new(config),
+                  flights: SingleFlight::default(),
+                  key_headers,
+              }
+          }
+
+          /// The key of a call: the first value of each key header, or its
+          /// absence, then the encoded request.
+          fn key(&self, metadata: &tonic::metadata::MetadataMap, request: &Bytes) -> Bytes {
+              if self.key_headers.is_empty() {
+                  return request.clone();
+              }
+              let mut key = Vec::new();
+              for name in &self.key_headers {
+                  let name = name.as_str();
+                  let value = if name.ends_with("-bin") {
+                      metadata.get_bin(name).map(|value| value.as_encoded_bytes())
+                  } else {
+                      metadata.get(name).map(|value| value.as_encoded_bytes())
+                  };
+                  match value {
+                      Some(value) => {
+                          key.push(1);
+                          key.extend_from_slice(&(value.len() as u32).to_le_bytes());
+                          key.extend_from_slice(value);
+                      }
+                      None => key.push(0),
+                  }
+              }
+              key.extend_from_slice(request);
+              Bytes::from(key)
+          }
+
+          fn stats(&self) -> ResponseCacheStats {
+              self.cache.stats()
+          }
+
+          async fn call<M>(
+              &self,
+              method: usize,
+              key: Bytes,
+              ttl: Option<std::time::Duration>,
+              handled: impl std::future::Future<
+                  Output = std::result::Result<tonic::Response<Encoded<M>>, tonic::Status>,
+              >,
+          ) -> std::result::Result<tonic::Response<Encoded<M>>, tonic::Status> {
+              let respond = |encoded: Bytes| tonic::Response::new(Encoded::from_bytes(encoded));
+              if let Some(encoded) = self.cache.get_encoded(method, &key) {
+                  return Ok(respond(encoded));
+              }
+              let leader = match self.flights.join(method, key.clone()).await {
+                  Flight::Shared(result) => return result.map(respond),
+                  Flight::Leader(leader) => leader,
+              };
+              let result = handled.await;
+              let shared = match &result {
+                  Ok(response) => {
+                      let encoded = response.get_ref().as_bytes().clone();
+                      self.cache.insert_encoded(method, key, encoded.clone(), ttl);
+                      Ok(encoded)
+                  }
+                  Err(status) => Err(status.clone()),
+              };
+              leader.complete(shared);
+              result
+          }
+      }
+
+      fn encode_response<M: protobuf::Serialize>(
+          response: std::result::Result<tonic::Response<M>, tonic::Status>,
+      ) -> std::result::Result<tonic::Response<Encoded<M>>, tonic::Status> {
+          let (metadata, message, extensions) = response?.into_parts();
+          Ok(tonic::Response::from_parts(metadata, Encoded::new(&message)?, extensions))
+      }
+  )rs");
+}
+
+static bool HasBlockingHandlers(const Service &service) {
+  for (const Method &method : service.methods()) {
+    if (method.runs_blocking()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool HasExecutorPools(const Service &service) {
+  for (const Method &method : service.methods()) {
+    if (!method.executor_pool().empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * The executor pool named by each method's `executor` option, as an array of
+ * `Option<&str>` indexed by method.
+ */
+static std::string ExecutorPoolNames(const Service &service) {
+  std::vector<std::string> names;
+  for (const Method &method : service.methods()) {
+    names.push_back(method.executor_pool().empty()
+                        ? "None"
+                        : absl::StrFormat("Some(\"%s\")",
+                                          method.executor_pool()));
+  }
+  return absl::StrCat("[", absl::StrJoin(names, ", "), "]");
+}
+
+static void GenerateRunBlocking(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// Runs a handler on tokio's blocking pool, for methods whose
+      /// `executor` option is `blocking`. The handler can still await I/O
+      /// on the server's runtime.
+      ///
+      /// Nothing here bounds the handlers: the pool is shared with the
+      /// rest of the process, and once its threads (`max_blocking_threads`,
+      /// 512 by default) are busy, further handlers queue without limit.
+      /// The method's `max_in_flight` and `max_queue` bound them.
+      ///
+      /// Dropping the call, as happens when the client cancels it or its
+      /// deadline passes, drops the handler at its next `.await`. A
+      /// handler that blocks without awaiting keeps its thread until it
+      /// next awaits or returns.
+      async fn run_blocking<R>(
+          handler: impl std::future::Future<Output = std::result::Result<R, tonic::Status>>
+              + std::marker::Send
+              + 'static,
+      ) -> std::result::Result<R, tonic::Status>
+      where
+          R: std::marker::Send + 'static,
+      {
+          // Closed when this future is dropped with its call.
+          let (_call, call_dropped) = tokio::sync::oneshot::channel::<()>();
+          let runtime = tokio::runtime::Handle::current();
+          tokio::task::spawn_blocking(move || {
+              runtime.block_on(async move {
+                  tokio::select! {
+                      result = handler => result,
+                      _ = call_dropped => Err(tonic::Status::cancelled("the call was dropped")),
+                  }
+              })
+          })
+          .await
+          .map_err(|e| tonic::Status::internal(format!("the handler task failed: {e}")))?
+      }
+  )rs");
+}
+
+static void GenerateExecutorPool(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// Sizing of an `ExecutorPool`.
+      #[derive(Debug, Clone)]
+      pub struct ExecutorPoolConfig {
+          pub threads: usize,
+          /// Most handlers waiting for or running on the pool. Further calls
+          /// fail with `RESOURCE_EXHAUSTED`.
+          pub max_pending: usize,
+          /// Cores the worker threads are pinned to, in turn, on Linux.
+          /// Threads that the pool starts for blocking work keep the
+          /// affinity of the thread that created it. Empty leaves the
+          /// threads unpinned.
+          pub cores: Vec<usize>,
+      }
+
+      impl Default for ExecutorPoolConfig {
+          fn default() -> Self {
+              Self {
+                  threads: std::thread::available_parallelism().map_or(1, |n| n.get()),
+                  max_pending: 1024,
+                  cores: Vec::new(),
+              }
+          }
+      }
+
+      /// Threads that run the handlers of methods whose `executor` option
+      /// names the pool, so CPU-heavy handlers do not hold up the I/O
+      /// tasks. Clones share the threads, which stop once the last clone is
+      /// dropped.
+      #[derive(Debug, Clone)]
+      pub struct ExecutorPool {
+          runtime: Arc<PoolRuntime>,
+          pending: Arc<tokio::sync::Semaphore>,
+      }
+
+      #[derive(Debug)]
+      struct PoolRuntime(Option<tokio::runtime::Runtime>);
+
+      impl Drop for PoolRuntime {
+          fn drop(&mut self) {
+              // The last handle may be dropped on an async task, where a
+              // blocking shutdown would panic.
+              if let Some(runtime) = self.0.take() {
+                  runtime.shutdown_background();
+              }
+          }
+      }
+
+      /// Aborts a handler on the pool when its call is dropped.
+      struct AbortOnDrop(tokio::task::AbortHandle);
+
+      impl Drop for AbortOnDrop {
+          fn drop(&mut self) {
+              self.0.abort();
+          }
+      }
+
+      impl ExecutorPool {
+          /// Starts the threads of a pool, named `<name>-<n>`.
+          ///
+          /// Fails with `InvalidInput` if a core does not fit in a
+          /// `cpu_set_t`, and with the OS error if a worker cannot be
+          /// pinned to its core.
+          pub fn new(name: &str, config: ExecutorPoolConfig) -> std::io::Result<Self> {
+              let threads = config.threads.max(1);
+              let cores = config
+                  .cores
+                  .into_iter()
+                  .map(CoreSet::of)
+                  .collect::<std::io::Result<Vec<_>>>()?;
+              let named = std::sync::atomic::AtomicUsize::new(0);
+              let thread_name = name.to_owned();
+              let mut builder = tokio::runtime::Builder::new_multi_thread();
+              builder
+                  .worker_threads(threads)
+                  .thread_name_fn(move || {
+                      let n = named.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+                      format!("{thread_name}-{n}")
+                  })
+                  .enable_all();
+              let pinning = if cores.is_empty() {
+                  None
+              } else {
+                  let pinning = Arc::new(WorkerPinning::new(cores, threads)?);
+                  let on_start = Arc::clone(&pinning);
+                  builder.on_thread_start(move || on_start.thread_started());
+                  Some(pinning)
+              };
+              let runtime = PoolRuntime(Some(builder.build()?));
+              if let Some(pinning) = pinning {
+                  pinning.wait()?;
+              }
+              Ok(Self {
+                  runtime: Arc::new(runtime),
+                  pending: Arc::new(tokio::sync::Semaphore::new(config.max_pending)),
+              })
+          }
+
+          async fn run<R>(
+              &self,
+              handler: impl std::future::Future<Output = std::result::Result<R, tonic::Status>>
+                  + std::marker::Send
+                  + 'static,
+          ) -> std::result::Result<R, tonic::Status>
+          where
+              R: std::marker::Send + 'static,
+          {
+              let Ok(permit) = Arc::clone(&self.pending).try_acquire_owned() else {
+                  return Err(tonic::Status::resource_exhausted("the executor pool is full"));
+              };
+              let Some(runtime) = self.runtime.0.as_ref() else {
+                  return Err(tonic::Status::unavailable("the executor pool has stopped"));
+              };
+              let task = runtime.spawn(async move {
+                  let _permit = permit;
+                  handler.await
+              });
+              let _abort = AbortOnDrop(task.abort_handle());
+              task.await
+                  .map_err(|e| tonic::Status::internal(format!("the handler task failed: {e}")))?
+          }
+      }
+
+      /// Pins the worker threads of a pool to its cores, in turn. The
+      /// runtime starts all of its workers while it is built, before it runs
+      /// anything that could start a blocking thread, so the first `workers`
+      /// threads to start are the workers. Later threads are started by a
+      /// pinned worker and would inherit its core, so they get the affinity
+      /// of the thread that built the pool back.
+      struct WorkerPinning {
+          cores: Vec<CoreSet>,
+          unpinned: CoreSet,
+          workers: usize,
+          started: std::sync::atomic::AtomicUsize,
+          all_pinned: std::sync::Barrier,
+          error: std::sync::Mutex<Option<std::io::Error>>,
+      }
+
+      impl WorkerPinning {
+          fn new(cores: Vec<CoreSet>, workers: usize) -> std::io::Result<Self> {
+              Ok(Self {
+                  cores,
+                  unpinned: CoreSet::current()?,
+                  workers,
+                  started: std::sync::atomic::AtomicUsize::new(0),
+                  all_pinned: std::sync::Barrier::new(workers + 1),
+                  error: std::sync::Mutex::new(None),
+              })
+          }
+
+          fn thread_started(&self) {
+              let n = self.started.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+              if n >= self.workers {
+                  // The pool is running by now, with no one to report to; a
+                  // thread left on its worker's core is only slower.
+                  let _ = self.unpinned.apply();
+                  return;
+              }
+              if let Err(e) = self.cores[n % self.cores.len()].apply() {
+                  self.error
+                      .lock()
+                      .unwrap_or_else(std::sync::PoisonError::into_inner)
+                      .get_or_insert(e);
+              }
+              self.all_pinned.wait();
+          }
+
+          /// Waits until every worker has been pinned, and returns the first
+          /// error.
+          fn wait(&self) -> std::io::Result<()> {
+              self.all_pinned.wait();
+              match self.error.lock().unwrap_or_else(std::sync::PoisonError::into_inner).take() {
+                  Some(e) => Err(e),
+                  None => Ok(()),
+              }
+          }
+      }
+
+      /// Cores that a thread may run on.
+      #[cfg(target_os = "linux")]
+      struct CoreSet(libc::cpu_set_t);
+
+      #[cfg(target_os = "linux")]
+      impl CoreSet {
+          /// The single core `core`.
+          fn of(core: usize) -> std::io::Result<Self> {
+              if core >= libc::CPU_SETSIZE as usize {
+                  return Err(std::io::Error::new(
+                      std::io::ErrorKind::InvalidInput,
+                      format!("core {core} is not below CPU_SETSIZE ({})", libc::CPU_SETSIZE),
+                  ));
+              }
+              // SAFETY: a zeroed `cpu_set_t` is empty, and `core` is in range.
+              unsafe {
+                  let mut set: libc::cpu_set_t = std::mem::zeroed();
+                  libc::CPU_SET(core, &mut set);
+                  Ok(Self(set))
+              }
+          }
+
+          /// The cores the calling thread may run on.
+          fn current() -> std::io::Result<Self> {
+              // SAFETY: `set` is a plain bit set that outlives the call, and
+              // pid 0 is the calling thread.
+              unsafe {
+                  let mut set: libc::cpu_set_t = std::mem::zeroed();
+                  if libc::sched_getaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &mut set)
+                      != 0
+                  {
+                      return Err(std::io::Error::last_os_error());
+                  }
+                  Ok(Self(set))
+              }
+          }
+
+          /// Restricts the calling thread to the cores of the set.
+          fn apply(&self) -> std::io::Result<()> {
+              // SAFETY: as in `current`.
+              let result = unsafe {
+                  libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &self.0)
+              };
+              if result != 0 {
+                  return Err(std::io::Error::last_os_error());
+              }
+              Ok(())
+          }
+      }
+
+      /// Pinning is Linux-only; elsewhere the cores are ignored.
+      #[cfg(not(target_os = "linux"))]
+      struct CoreSet;
+
+      #[cfg(not(target_os = "linux"))]
+      impl CoreSet {
+          fn of(_core: usize) -> std::io::Result<Self> {
+              Ok(Self)
+          }
+
+          fn current() -> std::io::Result<Self> {
+              Ok(Self)
+          }
+
+          fn apply(&self) -> std::io::Result<()> {
+              Ok(())
+          }
+      }
+  )rs");
+}
+
+/**
+ * Checks if a server-streaming method of the service returns encoded
+ * messages, which a `Broadcaster` can fan out. Other server-streaming methods
+ * get none: their handlers return messages that tonic encodes per stream, so
+ * a broadcaster could only hand each subscriber a clone to encode again, the
+ * per-subscriber cost it exists to remove.
+ */
+static bool HasBroadcasts(const Service &service) {
+  for (const Method &method : service.methods()) {
+    if (method.is_pre_encoded() && method.is_server_streaming()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void GenerateBroadcaster(const Service &service, Context &ctx) {
+  ctx.Emit(
+      {{"aliases",
+        [&] {
+          for (const Method &method : service.methods()) {
+            if (!method.is_pre_encoded() || !method.is_server_streaming()) {
+              continue;
+            }
+            ctx.Emit(
+                {{"method_name", method.proto_field_name()},
+                 {"response", method.request_response_name(ctx).second}},
+                R"rs(
+                  /// Fans out the messages of `$method_name$` subscriptions.
+                  pub type $method_name$Broadcaster = Broadcaster<$response$>;
+                )rs");
+          }
+        }}},
+      R"rs(
+        /// What a subscriber that fell more than the broadcast capacity
+        /// behind gets.
+        #[derive(Debug, Clone, Copy, PartialEq, Eq)]
+        pub enum LagPolicy {
+            /// The oldest messages it missed are skipped, and it goes on
+            /// with the oldest one still queued.
+            Drop,
+            /// Its stream ends with `RESOURCE_EXHAUSTED`.
+            Disconnect,
+            /// It skips to the latest message, for streams where only the
+            /// newest state matters.
+            Coalesce,
+        }
+
+        /// Sends every message to all current subscribers, encoded once.
+        /// Subscribers share a queue of the last `capacity` messages, so a
+        /// slow subscriber holds no copies of its own.
+        #[derive(Debug)]
+        pub struct Broadcaster<M> {
+            sender: tokio::sync::broadcast::Sender<Encoded<M>>,
+            policy: LagPolicy,
+        }
+
+        impl<M> Clone for Broadcaster<M> {
+            fn clone(&self) -> Self {
+                Self {
+                    sender: self.sender.clone(),
+                    policy: self.policy,
+                }
+            }
+        }
+
+        impl<M: protobuf::Serialize + 'static> Broadcaster<M> {
+            /// Encodes `message` and sends it to every subscriber. Returns
+            /// the number of subscribers.
+            pub fn send(&self, message: &M) -> std::result::Result<usize, tonic::Status> {
+                Ok(self.send_encoded(Encoded::new(message)?))
+            }
+        }
+
+        impl<M: 'static> Broadcaster<M> {
+            pub fn new(capacity: usize, policy: LagPolicy) -> Self {
+                let (sender, _) = tokio::sync::broadcast::channel(capacity.max(1));
+                Self { sender, policy }
+            }
+
+            /// Sends an encoded message to every subscriber. Returns the
+            /// number of subscribers.
+            pub fn send_encoded(&self, message: Encoded<M>) -> usize {
+                self.sender.send(message).unwrap_or(0)
+            }
+
+            /// A stream of the messages sent from now on, to return from a
+            /// server-streaming handler. It ends once every clone of the
+            /// broadcaster is dropped.
+            pub fn subscribe(&self) -> Subscription<M> {
+                Subscription {
+                    next: tokio_util::sync::ReusableBoxFuture::new(receive_broadcast(self.sender.subscribe())),
+                    policy: self.policy,
+                    done: false,
+                }
+            }
+
+            pub fn subscriber_count(&self) -> usize {
+                self.sender.receiver_count()
+            }
+        }
+
+        type Received<M> = (
+            std::result::Result<Encoded<M>, tokio::sync::broadcast::error::RecvError>,
+            tokio::sync::broadcast::Receiver<Encoded<M>>,
+        );
+
+        async fn receive_broadcast<M>(mut receiver: tokio::sync::broadcast::Receiver<Encoded<M>>) -> Received<M> {
+            let received = receiver.recv().await;
+            (received, receiver)
+        }
+
+        /// The newest queued message after a lag, if any.
+        fn skip_to_latest<M>(receiver: &mut tokio::sync::broadcast::Receiver<Encoded<M>>) -> Option<Encoded<M>> {
+            let mut latest = None;
+            loop {
+                match receiver.try_recv() {
+                    Ok(message) => latest = Some(message),
+                    Err(tokio::sync::broadcast::error::TryRecvError::Lagged(_)) => {}
+                    Err(_) => return latest,
+                }
+            }
+        }
+
+        /// The messages of a `Broadcaster` for one subscriber.
+        pub struct Subscription<M> {
+            /// Receives the next message. Each receive reuses the allocation
+            /// of the one before.
+            next: tokio_util::sync::ReusableBoxFuture<'static, Received<M>>,
+            policy: LagPolicy,
+            done: bool,
+        }
+
+        impl<M> std::fmt::Debug for Subscription<M> {
+            fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+                f.debug_struct("Subscription")
+                    .field("policy", &self.policy)
+                    .field("done", &self.done)
+                    .finish()
+            }
+        }
+
+        impl<M: 'static> tonic::codegen::tokio_stream::Stream for Subscription<M> {
+            type Item = std::result::Result<Encoded<M>, tonic::Status>;
+
+            fn poll_next(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+                use tokio::sync::broadcast::error::RecvError;
+                let this = self.get_mut();
+                loop {
+                    if this.done {
+                        return Poll::Ready(None);
+                    }
+                    let (received, mut receiver) = match this.next.poll(cx) {
+                        Poll::Ready(received) => received,
+                        Poll::Pending => return Poll::Pending,
+                    };
+                    let message = match received {
+                        Ok(message) => Some(message),
+                        Err(RecvError::Closed) => {
+                            this.done = true;
+                            return Poll::Ready(None);
+                        }
+                        Err(RecvError::Lagged(missed)) => match this.policy {
+                            LagPolicy::Drop => None,
+                            LagPolicy::Disconnect => {
+                                this.done = true;
+                                return Poll::Ready(Some(Err(tonic::Status::resource_exhausted(
+                                    format!("the subscriber fell {missed} messages behind"),
+                                ))));
+                            }
+                            LagPolicy::Coalesce => skip_to_latest(&mut receiver),
+                        },
+                    };
+                    this.next.set(receive_broadcast(receiver));
+                    if let Some(message) = message {
+                        return Poll::Ready(Some(Ok(message)));
+                    }
+                }
+            }
+        }
+
+        $aliases$
+      )rs");
+}
+
+static void GenerateRequestPool(const Service &service, Context &ctx) {
+  ctx.Emit(
+      {{"pools",
+        [&] {
+          for (const Method &method : service.methods()) {
+            if (!method.has_pooled_request()) {
+              continue;
+            }
+            ctx.Emit({{"pool", RequestPoolName(method)},
+                      {"request", method.request_response_name(ctx).first}},
+                     R"rs(
+                       static $pool$: std::cell::RefCell<RequestPool<$request$>> =
+                           std::cell::RefCell::new(RequestPool::new());
+                     )rs");
+          }
+        }}},
+      R"rs(
+        /// A request decoded into a message of the worker thread's pool,
+        /// received by the handlers of methods with the `pooled_request`
+        /// option. Dropping it returns the message to the pool of the thread
+        /// that decoded it: at once on that thread, and through the pool's
+        /// queue of returned messages on others, such as the threads of an
+        /// `ExecutorPool`.
+        pub struct Pooled<M: 'static> {
+            message: Option<M>,
+            len: usize,
+            decoded: usize,
+            pool: &'static std::thread::LocalKey<std::cell::RefCell<RequestPool<M>>>,
+            home: Arc<ReturnedRequests<M>>,
+        }
+
+        impl<M: 'static> Pooled<M> {
+            /// Takes the message out of the pool, for a handler that keeps it.
+            pub fn into_inner(mut self) -> M {
+                self.message.take().unwrap()
+            }
+        }
+
+        impl<M: 'static> std::ops::Deref for Pooled<M> {
+            type Target = M;
+
+            fn deref(&self) -> &M {
+                self.message.as_ref().unwrap()
+            }
+        }
+
+        impl<M: 'static> std::ops::DerefMut for Pooled<M> {
+            fn deref_mut(&mut self) -> &mut M {
+                self.message.as_mut().unwrap()
+            }
+        }
+
+        impl<M: 'static> Drop for Pooled<M> {
+            fn drop(&mut self) {
+                let Some(message) = self.message.take() else {
+                    return;
+                };
+                let (len, decoded) = (self.len, self.decoded);
+                let mut message = Some(message);
+                // The pool is gone while the thread exits.
+                let _ = self.pool.try_with(|pool| {
+                    if let Ok(mut pool) = pool.try_borrow_mut() {
+                        if Arc::ptr_eq(&pool.returned, &self.home) {
+                            pool.give(message.take().unwrap(), len, decoded);
+                        }
+                    }
+                });
+                if let Some(message) = message {
+                    self.home.give(message, len, decoded);
+                }
+            }
+        }
+
+        impl<M: std::fmt::Debug + 'static> std::fmt::Debug for Pooled<M> {
+            fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+                std::fmt::Debug::fmt(&**self, f)
+            }
+        }
+
+        /// The request messages that a thread keeps for reuse. A message is
+        /// cleared before each decode, but keeps the memory it grew, which
+        /// under upb is an arena that only grows. So each message is retired
+        /// once the bytes decoded into it exceed a budget of
+        /// `REQUEST_POOL_REUSES` recent requests, which also retires a
+        /// message that held an outlier.
+        struct RequestPool<M> {
+            free: Vec<(M, usize)>,
+            average_len: usize,
+            returned: Arc<ReturnedRequests<M>>,
+        }
+
+        /// Messages of a thread's pool that were dropped on other threads,
+        /// with the `len` and `decoded` of each, until the thread takes them
+        /// back. Holds up to `REQUEST_POOL_CAPACITY`; further ones are freed.
+        struct ReturnedRequests<M>(std::sync::Mutex<Vec<(M, usize, usize)>>);
+
+        impl<M> ReturnedRequests<M> {
+            fn messages(&self) -> std::sync::MutexGuard<'_, Vec<(M, usize, usize)>> {
+                // No update of it panics halfway, so it is consistent even when
+                // the lock is poisoned.
+                self.0.lock().unwrap_or_else(std::sync::PoisonError::into_inner)
+            }
+
+            fn give(&self, message: M, len: usize, decoded: usize) {
+                let mut messages = self.messages();
+                if messages.len() < REQUEST_POOL_CAPACITY {
+                    messages.push((message, len, decoded));
+                }
+            }
+        }
+
+        /// Messages that a thread keeps per method.
+        const REQUEST_POOL_CAPACITY: usize = 64;
+
+        /// Recent requests, on average, that a pooled message is reused for.
+        const REQUEST_POOL_REUSES: usize = 64;
+
+        /// Smallest budget of a pooled message, in decoded bytes.
+        const REQUEST_POOL_MIN_BUDGET: usize = 64 * 1024;
+
+        impl<M: Default> RequestPool<M> {
+            /// Takes a message, with the bytes already decoded into it. Once
+            /// the free messages run out, those returned by other threads are
+            /// taken back, so the queue is locked once per batch of them.
+            fn take(&mut self) -> (M, usize) {
+                if self.free.is_empty() {
+                    let returned = std::mem::take(&mut *self.returned.messages());
+                    for (message, len, decoded) in returned {
+                        self.give(message, len, decoded);
+                    }
+                }
+                self.free.pop().unwrap_or_default()
+            }
+        }
+
+        impl<M> RequestPool<M> {
+            fn new() -> Self {
+                Self {
+                    free: Vec::new(),
+                    average_len: 0,
+                    returned: Arc::new(ReturnedRequests(std::sync::Mutex::new(Vec::new()))),
+                }
+            }
+
+            /// Returns a message that `len` bytes were last decoded into,
+            /// and `decoded` bytes in all.
+            fn give(&mut self, message: M, len: usize, decoded: usize) {
+                // The budget follows the requests before this one, so that
+                // an outlier retires the message it grew.
+                let budget = (self.average_len * REQUEST_POOL_REUSES).max(REQUEST_POOL_MIN_BUDGET);
+                // An exponentially weighted average of the last 16 or so.
+                self.average_len = self.average_len - self.average_len / 16 + len / 16;
+                if decoded <= budget && self.free.len() < REQUEST_POOL_CAPACITY {
+                    self.free.push((message, decoded));
+                }
+            }
+        }
+
+        thread_local! {
+            $pools$
+        }
+
+        fn decode_pooled<M>(
+            pool: &'static std::thread::LocalKey<std::cell::RefCell<RequestPool<M>>>,
+            encoded: &[u8],
+        ) -> std::result::Result<Pooled<M>, tonic::Status>
+        where
+            M: protobuf::ClearAndParse + Default,
+        {
+            let (mut message, decoded, home) = pool.with(|pool| {
+                let mut pool = pool.borrow_mut();
+                let (message, decoded) = pool.take();
+                (message, decoded, Arc::clone(&pool.returned))
+            });
+            protobuf::ClearAndParse::clear_and_parse(&mut message, encoded)
+                .map_err(|_| tonic::Status::internal("failed to decode the message"))?;
+            Ok(Pooled {
+                message: Some(message),
+                len: encoded.len(),
+                decoded: decoded + encoded.len(),
+                pool,
+                home,
+            })
+        }
+
+        fn decode_pooled_request<M>(
+            request: tonic::Request<Bytes>,
+            pool: &'static std::thread::LocalKey<std::cell::RefCell<RequestPool<M>>>,
+        ) -> std::result::Result<tonic::Request<Pooled<M>>, tonic::Status>
+        where
+            M: protobuf::ClearAndParse + Default,
+        {
+            let (metadata, extensions, encoded) = request.into_parts();
+            let message = decode_pooled(pool, &encoded)?;
+            Ok(tonic::Request::from_parts(metadata, extensions, message))
+        }
+      )rs");
+}
+
+static void GenerateServePerCore(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// Serves the service on `threads` threads. Each thread runs its own
+      /// single-threaded runtime and accept loop, on a listener bound to
+      /// `addr` with `SO_REUSEPORT`. The kernel spreads new connections
+      /// over the listeners, and every connection stays on the thread that
+      /// accepted it. `make_server` is called once on each thread. The
+      /// threads are not pinned to cores; the OS schedules them like any
+      /// other thread.
+      ///
+      /// Returns once all threads have stopped, with the first error. Fails
+      /// at once if `threads` is zero, or if `addr` has port 0, which would
+      /// give each listener an ephemeral port of its own.
+      #[cfg(unix)]
+      pub fn serve_per_core<T, F>(
+          addr: std::net::SocketAddr,
+          threads: usize,
+          make_server: F,
+      ) -> std::result::Result<(), StdError>
+      where
+          T: $server_trait$,
+          F: Fn() -> $server_ident$<T> + std::marker::Send + std::marker::Sync + 'static,
+      {
+          if threads == 0 {
+              return Err("serve_per_core needs at least one thread".into());
+          }
+          if addr.port() == 0 {
+              return Err("serve_per_core needs a fixed port, not port 0".into());
+          }
+          let make_server = Arc::new(make_server);
+          let mut workers = Vec::with_capacity(threads);
+          for n in 0..threads {
+              // Binding up front reports a taken address before any thread starts.
+              let socket = if addr.is_ipv4() {
+                  tokio::net::TcpSocket::new_v4()?
+              } else {
+                  tokio::net::TcpSocket::new_v6()?
+              };
+              socket.set_reuseport(true)?;
+              socket.bind(addr)?;
+              let make_server = Arc::clone(&make_server);
+              let worker = std::thread::Builder::new()
+                  .name(format!("$server_mod$-{n}"))
+                  .spawn(move || -> std::result::Result<(), StdError> {
+                      let runtime = tokio::runtime::Builder::new_current_thread()
+                          .enable_all()
+                          .build()?;
+                      runtime.block_on(async move { serve_listener(socket, make_server()).await })
+                  })?;
+              workers.push(worker);
+          }
+          let mut result = Ok(());
+          for worker in workers {
+              let stopped = worker
+                  .join()
+                  .unwrap_or_else(|_| Err("a server thread panicked".into()));
+              if result.is_ok() {
+                  result = stopped;
+              }
+          }
+          result
+      }
+
+      #[cfg(unix)]
+      async fn serve_listener<T: $server_trait$>(
+          socket: tokio::net::TcpSocket,
+          server: $server_ident$<T>,
+      ) -> std::result::Result<(), StdError> {
+          let listener = socket.listen(1024)?;
+          tonic::transport::Server::builder()
+              .add_service(server)
+              .serve_with_incoming(Accept(listener))
+              .await?;
+          Ok(())
+      }
+
+      /// The connections accepted by one thread's listener.
+      #[cfg(unix)]
+      struct Accept(tokio::net::TcpListener);
+
+      #[cfg(unix)]
+      impl tonic::codegen::tokio_stream::Stream for Accept {
+          type Item = std::io::Result<tokio::net::TcpStream>;
+
+          fn poll_next(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+              self.0.poll_accept(cx).map(|accepted| {
+                  Some(accepted.and_then(|(stream, _)| {
+                      stream.set_nodelay(true)?;
+                      Ok(stream)
+                  }))
+              })
+          }
+      }
+  )rs");
+}
+
+static void GenerateDeadlinePropagation(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// When an incoming call has to finish, from its `grpc-timeout` header.
+      #[derive(Debug, Clone, Copy)]
+      struct CallDeadline(std::time::Instant);
+
+      fn record_deadline<M>(mut request: tonic::Request<M>) -> tonic::Request<M> {
+          if let Some(timeout) = request_timeout(&request) {
+              let deadline = CallDeadline(std::time::Instant::now() + timeout);
+              request.extensions_mut().insert(deadline);
+          }
+          request
+      }
+
+      fn request_timeout<M>(request: &tonic::Request<M>) -> Option<std::time::Duration> {
+          let value = request.metadata().get("grpc-timeout")?.to_str().ok()?;
+          let (amount, unit) = value.split_at(value.len().checked_sub(1)?);
+          // The header allows at most eight digits.
+          if amount.is_empty() || amount.len() > 8 {
+              return None;
+          }
+          let amount: u64 = amount.parse().ok()?;
+          match unit {
+              "H" => Some(std::time::Duration::from_secs(amount * 3600)),
+              "M" => Some(std::time::Duration::from_secs(amount * 60)),
+              "S" => Some(std::time::Duration::from_secs(amount)),
+              "m" => Some(std::time::Duration::from_millis(amount)),
+              "u" => Some(std::time::Duration::from_micros(amount)),
+              "n" => Some(std::time::Duration::from_nanos(amount)),
+              _ => None,
+          }
+      }
+
+      /// The deadline the caller set on an incoming call, if any.
+      pub fn deadline<M>(request: &tonic::Request<M>) -> Option<std::time::Instant> {
+          request.extensions().get::<CallDeadline>().map(|deadline| deadline.0)
+      }
+
+      /// Limits the timeout of `outbound` to the time left until the
+      /// deadline of the incoming call, so that the downstream work is
+      /// abandoned once the caller has given up.
+      pub fn propagate_deadline<M, N>(
+          incoming: &tonic::Request<M>,
+          outbound: &mut tonic::Request<N>,
+      ) {
+          let Some(deadline) = deadline(incoming) else {
+              return;
+          };
+          let left = deadline.saturating_duration_since(std::time::Instant::now());
+          if request_timeout(outbound).map_or(true, |timeout| timeout > left) {
+              outbound.set_timeout(left);
+          }
+      }
+  )rs");
+}
+
+static void GenerateCancellation(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// Tells a handler that its call was abandoned before the handler
+      /// finished: the client reset the stream, the deadline passed, or the
+      /// connection closed. Work the handler started elsewhere, such as on
+      /// the blocking pool, can poll or await it to stop early.
+      #[derive(Debug, Clone, Default)]
+      pub struct CallCancellation(Arc<CancellationState>);
+
+      #[derive(Debug, Default)]
+      struct CancellationState {
+          cancelled: std::sync::atomic::AtomicBool,
+          notify: tokio::sync::Notify,
+      }
+
+      impl CallCancellation {
+          /// The cancellation of the call that `request` belongs to. Requests
+          /// that did not come through the generated server are never
+          /// cancelled.
+          pub fn of<M>(request: &tonic::Request<M>) -> Self {
+              request.extensions().get::<Self>().cloned().unwrap_or_default()
+          }
+
+          pub fn is_cancelled(&self) -> bool {
+              self.0.cancelled.load(std::sync::atomic::Ordering::Acquire)
+          }
+
+          /// Waits until the call is cancelled.
+          pub async fn cancelled(&self) {
+              let notified = self.0.notify.notified();
+              let mut notified = std::pin::pin!(notified);
+              // Registering before the check keeps a concurrent cancel from
+              // being missed.
+              notified.as_mut().enable();
+              if !self.is_cancelled() {
+                  notified.await;
+              }
+          }
+      }
+
+      /// Cancels its call when dropped, unless the call finished first.
+      struct CancelOnDrop(Option<CallCancellation>);
+
+      impl CancelOnDrop {
+          fn finish(mut self) {
+              self.0 = None;
+          }
+      }
+
+      impl Drop for CancelOnDrop {
+          fn drop(&mut self) {
+              if let Some(cancellation) = self.0.take() {
+                  let state = &cancellation.0;
+                  state.cancelled.store(true, std::sync::atomic::Ordering::Release);
+                  state.notify.notify_waiters();
+              }
+          }
+      }
+
+      fn attach_cancellation<M>(mut request: tonic::Request<M>) -> (tonic::Request<M>, CancelOnDrop) {
+          let cancellation = CallCancellation::default();
+          request.extensions_mut().insert(cancellation.clone());
+          (request, CancelOnDrop(Some(cancellation)))
+      }
+
+      /// A server-streaming response that cancels its call if it is dropped
+      /// before the handler's stream ends.
+      pub struct CancellableStream<S> {
+          inner: Pin<Box<S>>,
+          cancel_on_drop: Option<CancelOnDrop>,
+      }
+
+      impl<S> CancellableStream<S> {
+          fn new(inner: S, cancel_on_drop: CancelOnDrop) -> Self {
+              Self {
+                  inner: Box::pin(inner),
+                  cancel_on_drop: Some(cancel_on_drop),
+              }
+          }
+      }
+
+      // Only the inner stream is pinned, and it is boxed.
+      impl<S> Unpin for CancellableStream<S> {}
+
+      impl<S> std::fmt::Debug for CancellableStream<S> {
+          fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+              f.debug_struct("CancellableStream").finish_non_exhaustive()
+          }
+      }
+
+      impl<S: tonic::codegen::tokio_stream::Stream> tonic::codegen::tokio_stream::Stream
+          for CancellableStream<S>
+      {
+          type Item = S::Item;
+
+          fn poll_next(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+              let this = &mut *self;
+              let next = this.inner.as_mut().poll_next(cx);
+              if let Poll::Ready(None) = next {
+                  if let Some(cancel_on_drop) = this.cancel_on_drop.take() {
+                      cancel_on_drop.finish();
+                  }
+              }
+              next
+          }
+      }
+  )rs");
+}
+
+static void GenerateServeUnix(Context &ctx) {
+  ctx.Emit(R"rs(
+      /// Serves the service on a Unix domain socket created at `path`, for
+      /// peers on the same host. The path must not exist yet.
+      #[cfg(unix)]
+      pub async fn serve_unix<T: $server_trait$>(
+          path: impl AsRef<std::path::Path>,
+          server: $server_ident$<T>,
+      ) -> std::result::Result<(), StdError> {
+          let listener = tokio::net::UnixListener::bind(path)?;
+          tonic::transport::Server::builder()
+              .add_service(server)
+              .serve_with_incoming(UnixAccept(listener))
+              .await?;
+          Ok(())
+      }
+
+      /// The connections accepted by a Unix domain socket listener.
+      #[cfg(unix)]
+      struct UnixAccept(tokio::net::UnixListener);
+
+      #[cfg(unix)]
+      impl tonic::codegen::tokio_stream::Stream for UnixAccept {
+          type Item = std::io::Result<tokio::net::UnixStream>;
+
+          fn poll_next(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+              self.0
+                  .poll_accept(cx)
+                  .map(|accepted| Some(accepted.map(|(stream, _)| stream)))
+          }
+      }
+  )rs");
+}
+
+static void GenerateMultiplexDispatch(const Service &service,
+                                      const GeneratorOptions &options,
+                                      const std::string &server_trait,
+                                      Context &ctx) {
+  static std::string arm_format = R"rs(
+        $method_id$ => {
+            $shed$
+            $admit$
+            $parse_request$
+            let request = tonic::Request::from_parts(metadata.clone(), tonic::Extensions::default(), $message$);
+            let response = $handle_fn$(inner$handler_args$, request).await?;
+            $encode_response$
+        })rs";
+
+  const std::vector<OptionalField> state_fields =
+      MultiplexStateFields(service, options);
+  std::vector<Method> unary_methods;
+  for (const Method &method : service.methods()) {
+    if (!method.is_client_streaming() && !method.is_server_streaming()) {
+      unary_methods.push_back(method);
+    }
+  }
+  ctx.Emit(
+      {
+          {"server_trait", server_trait},
+          {"state_fields",
+           [&] {
+             GenerateOptionalFields(state_fields, "$name$: $type$,", ctx);
+           }},
+          {"arms",
+           [&] {
+             for (const Method &method : unary_methods) {
+               WithMethodVars(service, method, ctx, [&](const Method &method) {
+                 const ServerPipeline pipeline =
+                     MethodPipeline(method, options);
+                 std::string handler_args;
+                 for (const HandlerState &state : pipeline.states) {
+                   absl::StrAppend(&handler_args, ", ", state.multiplexed);
+                 }
+                 std::vector<std::string> admit;
+                 if (method.has_admission_limits()) {
+                   admit.push_back(R"rs(
+                     let Some(mut admitted) = Admitted::try_new(&state.admission, $method_id$) else {
+                         return Err(tonic::Status::resource_exhausted("too many calls to the method"));
+                     };
+                     admitted.wait_turn().await;)rs");
+                 }
+                 if (options.fair_scheduling) {
+                   admit.push_back(absl::StrFormat(R"rs(
+                     let _fair_turn = match &state.fair_flow {
+                         Some((scheduler, tenant)) => Some(
+                             Arc::clone(scheduler)
+                                 .acquire($method_id$, %d, tenant.clone())
+                                 .await,
+                         ),
+                         None => None,
+                     };)rs",
+                                                   method.priority()));
+                 }
+                 std::string format = DropAbsentSubs(
+                     arm_format,
+                     {{"shed", options.codel},
+                      {"admit", !admit.empty()},
+                      {"parse_request", !pipeline.receives_encoded}});
+                 if (&method != &unary_methods.back()) {
+                   format += "\n";
+                 }
+                 ctx.Emit(
+                     {{"handle_fn", HandlerFnName(method)},
+                      {"handler_args", handler_args},
+                      {"message",
+                       pipeline.receives_encoded ? "payload" : "request"},
+                      {"shed",
+                       [&] {
+                         ctx.Emit(R"rs(
+                           let arrival = std::time::Instant::now();
+                           if state.codel[$method_id$].should_shed(arrival) {
+                               return Err(tonic::Status::resource_exhausted("too many calls to the method"));
+                           })rs");
+                       }},
+                      {"admit", [&] { GenerateLines(admit, ctx); }},
+                      {"parse_request",
+                       [&] {
+                         ctx.Emit(R"rs(
+                           let request = <$request$ as protobuf::Parse>::parse(&payload)
+                               .map_err(|_| tonic::Status::invalid_argument("failed to decode the request"))?;)rs");
+                       }},
+                      {"encode_response",
+                       [&] {
+                         if (method.is_pre_encoded() || pipeline.memoized) {
+                           ctx.Emit("Ok(response.into_inner().into_bytes())");
+                           return;
+                         }
+                         ctx.Emit(R"rs(
+                           protobuf::Serialize::serialize(response.get_ref())
+                               .map(Bytes::from)
+                               .map_err(|_| tonic::Status::internal("failed to encode the response")))rs");
+                       }}},
+                     format);
+               });
+             }
+           }},
+      },
+      DropAbsentSubs(R"rs(
+      use super::$client_mod$::Envelope;
+
+      /// Calls of one multiplexed stream that run at once, unless set with
+      /// `with_max_multiplexed_calls`.
+      pub const DEFAULT_MAX_MULTIPLEXED_CALLS: usize = 100;
+
+      /// The server state that multiplexed calls go through the stages of
+      /// their method with, as far as the unary methods have them.
+      #[derive(Clone)]
+      struct MultiplexState {
+          $state_fields$
+      }
+
+      /// Runs the calls of a multiplexed stream concurrently and replies in
+      /// the order they complete. At most `max_calls` run at once, and a
+      /// call keeps its slot until its reply is queued. While every slot
+      /// is taken, up to `max_calls` more calls are read and wait for a
+      /// slot; then the stream is read no further, so a client that sends
+      /// faster, or reads slower, is held back by flow control. A cancel
+      /// envelope aborts its call, or drops it while it waits, so a call
+      /// whose caller gave up frees its slot. The replies end once the
+      /// request stream has ended and every call has replied. Dropping
+      /// the reply stream, as happens when the client goes away, aborts
+      /// the calls still running.
+      ///
+      /// Each call goes through the route stages of its method, as a call
+      /// of its own would: CoDel, admission limits, fair scheduling as the
+      /// tenant of the stream, memoization, decoding, cancellation and the
+      /// method's executor. Its request carries the metadata of the stream,
+      /// less the `grpc-timeout`, which bounds the stream rather than each
+      /// call.
+      fn serve_multiplexed<T: $server_trait$>(
+          inner: Arc<T>,
+          state: MultiplexState,
+          mut metadata: tonic::metadata::MetadataMap,
+          mut requests: tonic::Streaming<Bytes>,
+          max_calls: usize,
+      ) -> tonic::codegen::tokio_stream::wrappers::ReceiverStream<
+          std::result::Result<Bytes, tonic::Status>,
+      > {
+          metadata.remove("grpc-timeout");
+          let metadata = Arc::new(metadata);
+          let (sender, receiver) = tokio::sync::mpsc::channel(max_calls);
+          tokio::spawn(async move {
+              let mut calls = tokio::task::JoinSet::new();
+              // The calls still running by id, for the cancels of the client.
+              let mut running = std::collections::HashMap::new();
+              // Calls read while every slot is taken, oldest first.
+              let mut waiting = std::collections::VecDeque::<Envelope>::new();
+              let mut ended = false;
+              loop {
+                  while calls.len() < max_calls {
+                      let Some(envelope) = waiting.pop_front() else {
+                          break;
+                      };
+                      let id = envelope.id;
+                      let inner = Arc::clone(&inner);
+                      let state = state.clone();
+                      let metadata = Arc::clone(&metadata);
+                      let sender = sender.clone();
+                      let call = calls.spawn(async move {
+                          let result = dispatch_multiplexed(
+                              inner,
+                              &state,
+                              &metadata,
+                              envelope.method,
+                              envelope.payload,
+                          )
+                          .await;
+                          let reply = Envelope::reply(envelope.id, envelope.method, result);
+                          let _ = sender.send(Ok(reply.encode())).await;
+                          envelope.id
+                      });
+                      running.insert(id, call);
+                  }
+                  if ended && calls.is_empty() {
+                      return;
+                  }
+                  let message = tokio::select! {
+                      _ = sender.closed() => return,
+                      Some(finished) = calls.join_next(), if !calls.is_empty() => {
+                          match finished {
+                              Ok(id) => {
+                                  running.remove(&id);
+                              }
+                              // Aborted calls are gone already, and a call
+                              // that panicked is found by its handle.
+                              Err(_) => running.retain(|_, call: &mut tokio::task::AbortHandle| {
+                                  !call.is_finished()
+                              }),
+                          }
+                          continue;
+                      }
+                      message = requests.message(), if !ended && waiting.len() < max_calls => message,
+                  };
+                  let envelope = match message.map(|r| r.map(Envelope::decode)) {
+                      Ok(Some(Ok(envelope))) => envelope,
+                      Ok(None) => {
+                          ended = true;
+                          continue;
+                      }
+                      Ok(Some(Err(status))) | Err(status) => {
+                          let _ = sender.send(Err(status)).await;
+                          return;
+                      }
+                  };
+                  if !envelope.is_cancel() {
+                      waiting.push_back(envelope);
+                  } else if let Some(call) = running.remove(&envelope.id) {
+                      call.abort();
+                  } else {
+                      waiting.retain(|call| call.id != envelope.id);
+                  }
+              }
+          });
+          tonic::codegen::tokio_stream::wrappers::ReceiverStream::new(receiver)
+      }
+
+      async fn dispatch_multiplexed<T: $server_trait$>(
+          inner: Arc<T>,
+          state: &MultiplexState,
+          metadata: &tonic::metadata::MetadataMap,
+          method: u32,
+          payload: Bytes,
+      ) -> std::result::Result<Bytes, tonic::Status> {
+          match method {
+              $arms$
+              _ => Err(tonic::Status::unimplemented(format!(
+                  "no unary method with index {method}"
+              ))),
+          }
+      }
+      )rs",
+                     {{"state_fields", !state_fields.empty()},
+                      {"arms", !unary_methods.empty()}}));
+}
+
+static std::vector<OptionalField>
+ServerFields(const Service &service, const GeneratorOptions &options) {
+  std::vector<OptionalField> fields;
+  if (HasAdmissionLimits(service)) {
+    fields.push_back({"admission", "Arc<[Admission]>", "admission_limits()"});
+  }
+  if (options.fair_scheduling) {
+    fields.push_back(
+        {"fair_scheduler", "Option<Arc<FairScheduler>>", "None"});
+  }
+  if (options.codel) {
+    fields.push_back({"codel", "Arc<[Codel]>",
+                      "codel_states(std::time::Duration::from_millis(5), "
+                      "std::time::Duration::from_millis(100))"});
+  }
+  if (options.load_reports) {
+    fields.push_back({"load_tracker", "Option<Arc<LoadTracker>>", "None"});
+  }
+  if (options.write_coalescing) {
+    fields.push_back(
+        {"write_coalescing", "Option<CoalescingPolicy>", "None"});
+  }
+  if (options.unary_multiplexing) {
+    fields.push_back({"max_multiplexed_calls", "usize",
+                      "DEFAULT_MAX_MULTIPLEXED_CALLS"});
+  }
+  if (HasMemoized(options, service)) {
+    fields.push_back({"memoizer", "Option<Arc<Memoizer>>", "None"});
+  }
+  if (HasExecutorPools(service)) {
+    fields.push_back(
+        {"executor_pools", "Arc<[Option<ExecutorPool>]>",
+         absl::StrFormat("vec![None; %d].into()", service.methods().size())});
+  }
+  return fields;
+}
+
+static void GenerateLoadReporting(const std::string &client_mod,
+                                  Context &ctx) {
+  ctx.Emit({{"client_mod", client_mod}}, R"rs(
+      pub use super::$client_mod$::LoadReport;
+
+      struct LoadTracker {
+          reporter: Box<dyn Fn() -> LoadReport + std::marker::Send + std::marker::Sync>,
+          in_flight: std::sync::atomic::AtomicUsize,
+      }
+
+      impl std::fmt::Debug for LoadTracker {
+          fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+              f.debug_struct("LoadTracker")
+                  .field("in_flight", &self.in_flight)
+                  .finish_non_exhaustive()
+          }
+      }
+
+      /// Counts a call as in flight until it is dropped.
+      struct LoadReportGuard(Arc<LoadTracker>);
+
+      impl LoadReportGuard {
+          fn new(tracker: Arc<LoadTracker>) -> Self {
+              tracker.in_flight.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+              Self(tracker)
+          }
+
+          /// The current load, excluding the call that carries the report.
+          fn report(&self) -> http::HeaderMap {
+              let mut report = (self.0.reporter)();
+              let in_flight = self.0.in_flight.load(std::sync::atomic::Ordering::Relaxed);
+              report.in_flight = in_flight.saturating_sub(1) as f64;
+              let mut metadata = tonic::metadata::MetadataMap::new();
+              metadata.insert_bin(
+                  LoadReport::TRAILER,
+                  tonic::metadata::MetadataValue::from_bytes(&report.encode()),
+              );
+              metadata.into_headers()
+          }
+      }
+
+      impl Drop for LoadReportGuard {
+          fn drop(&mut self) {
+              self.0.in_flight.fetch_sub(1, std::sync::atomic::Ordering::Relaxed);
+          }
+      }
+
+      /// Appends a load report to the trailers of a response body.
+      ///
+      /// Frames are `http_body::Frame`s, so the `http-body` crate must be a
+      /// dependency when load reports are enabled.
+      struct LoadReportBody {
+          inner: tonic::body::Body,
+          guard: Option<LoadReportGuard>,
+      }
+
+      impl Body for LoadReportBody {
+          type Data = Bytes;
+          type Error = tonic::Status;
+
+          fn poll_frame(
+              mut self: Pin<&mut Self>,
+              cx: &mut Context<'_>,
+          ) -> Poll<Option<std::result::Result<http_body::Frame<Bytes>, Self::Error>>> {
+              let this = &mut *self;
+              let frame = match Pin::new(&mut this.inner).poll_frame(cx) {
+                  Poll::Ready(Some(Ok(frame))) => frame,
+                  other => return other,
+              };
+              let frame = match frame.into_trailers() {
+                  Ok(mut trailers) => {
+                      if let Some(guard) = this.guard.take() {
+                          trailers.extend(guard.report());
+                      }
+                      http_body::Frame::trailers(trailers)
+                  }
+                  Err(frame) => frame,
+              };
+              Poll::Ready(Some(Ok(frame)))
+          }
+
+          fn is_end_stream(&self) -> bool {
+              self.inner.is_end_stream()
+          }
+
+          fn size_hint(&self) -> http_body::SizeHint {
+              self.inner.size_hint()
+          }
+      }
+
+      /// Attaches the load report to a response: in the headers, which is
+      /// all a client of a streaming method sees before the stream ends, and
+      /// again in the trailers, unless the response is trailers-only.
+      async fn report_load(
+          response: BoxFuture<http::Response<tonic::body::Body>, std::convert::Infallible>,
+          guard: LoadReportGuard,
+      ) -> std::result::Result<http::Response<tonic::body::Body>, std::convert::Infallible> {
+          let mut response = response.await?;
+          response.headers_mut().extend(guard.report());
+          if response.headers().contains_key(tonic::Status::GRPC_STATUS) {
+              return Ok(response);
+          }
+          Ok(response.map(|inner| {
+              tonic::body::Body::new(LoadReportBody { inner, guard: Some(guard) })
+          }))
+      }
+  )rs");
+}
+
+static void generate_server(const Service &service,
+                            const GeneratorOptions &options, Context &ctx) {
+  std::string server_trait = service.name();
+  std::string server_ident = absl::StrFormat("%sServer", service.name());
+  std::string server_mod =
+      absl::StrFormat("%s_server", rust::CamelToSnakeCase(service.name()));
+  std::string client_mod =
+      absl::StrFormat("%s_client", rust::CamelToSnakeCase(service.name()));
+  const std::vector<OptionalField> extra_fields =
+      ServerFields(service, options);
+  const bool has_call_hooks = options.load_reports;
+  const bool has_builder_methods =
+      options.load_reports || options.fair_scheduling || options.codel ||
+      HasMemoized(options, service) || options.unary_multiplexing ||
+      options.write_coalescing || HasExecutorPools(service);
+  ctx.Emit(
+      {
+          {"extra_fields",
+           [&] {
+             GenerateOptionalFields(extra_fields, "$name$: $type$,", ctx);
+           }},
+          {"extra_field_inits",
+           [&] {
+             GenerateOptionalFields(extra_fields, "$name$: $init$,", ctx);
+           }},
+          {"extra_field_clones",
+           [&] {
+             GenerateOptionalFields(extra_fields,
+                                    "$name$: self.$name$.clone(),", ctx);
+           }},
+          {"builder_methods",
+           [&] {
+             if (options.load_reports) {
+               ctx.Emit(R"rs(
+                 /// Attaches an ORCA load report to every response. The
+                 /// reporter supplies CPU utilization and queue depth, the
+                 /// server fills in the calls in flight.
+                 #[must_use]
+                 pub fn with_load_reporter<F>(mut self, reporter: F) -> Self
+                 where
+                     F: Fn() -> LoadReport + std::marker::Send + std::marker::Sync + 'static,
+                 {
+                     self.load_tracker = Some(Arc::new(LoadTracker {
+                         reporter: Box::new(reporter),
+                         in_flight: std::sync::atomic::AtomicUsize::new(0),
+                     }));
+                     self
+                 }
+               )rs");
+             }
+             if (options.fair_scheduling) {
+               ctx.Emit(R"rs(
+                 /// Runs at most `slots` handlers at once. Waiting calls get
+                 /// slots in weighted fair order per method and tenant, the
+                 /// tenant being the value of `tenant_header`. A streamed
+                 /// response holds its slot until it ends.
+                 ///
+                 /// Panics if `slots` is zero.
+                 #[must_use]
+                 pub fn with_fair_scheduling(
+                     mut self,
+                     slots: usize,
+                     tenant_header: Option<http::HeaderName>,
+                 ) -> Self {
+                     assert!(slots > 0, "fair scheduling needs at least one slot");
+                     self.fair_scheduler = Some(Arc::new(FairScheduler::new(slots, tenant_header)));
+                     self
+                 }
+               )rs");
+             }
+             if (options.codel) {
+               ctx.Emit(R"rs(
+                 /// Sets when methods start shedding calls: once the calls
+                 /// started within an `interval` all waited longer than
+                 /// `target`. The defaults are 5ms and 100ms.
+                 #[must_use]
+                 pub fn with_codel(
+                     mut self,
+                     target: std::time::Duration,
+                     interval: std::time::Duration,
+                 ) -> Self {
+                     self.codel = codel_states(target, interval);
+                     self
+                 }
+               )rs");
+             }
+             if (HasMemoized(options, service)) {
+               ctx.Emit(R"rs(
+                 /// Runs one handler for identical concurrent calls of
+                 /// methods without side effects, and keeps their encoded
+                 /// responses for the method's `cache_ttl`, or the
+                 /// configured default.
+                 ///
+                 /// Calls are identical if their encoded requests and the
+                 /// values of `key_headers` are. Other metadata is ignored,
+                 /// so every header that a response depends on, such as
+                 /// `authorization` or a tenant header, must be listed, or
+                 /// one caller's response is served to another.
+                 ///
+                 /// Only the response message is kept. The call that ran
+                 /// the handler gets the metadata it set, but hits and the
+                 /// calls that shared its run get none.
+                 #[must_use]
+                 pub fn with_memoization(
+                     mut self,
+                     config: ResponseCacheConfig,
+                     key_headers: Vec<http::HeaderName>,
+                 ) -> Self {
+                     self.memoizer = Some(Arc::new(Memoizer::new(config, key_headers)));
+                     self
+                 }
+
+                 /// Counters of the memoized responses, if memoization is on.
+                 pub fn memoization_stats(&self) -> Option<ResponseCacheStats> {
+                     self.memoizer.as_deref().map(Memoizer::stats)
+                 }
+               )rs");
+             }
+             if (HasExecutorPools(service)) {
+               ctx.Emit({{"pool_names", ExecutorPoolNames(service)}}, R"rs(
+                 /// Runs the handlers of the methods whose `executor` option
+                 /// is `pool(<name>)` on `pool`. Until a pool is added under
+                 /// their name, they run inline.
+                 #[must_use]
+                 pub fn with_executor_pool(mut self, name: &str, pool: ExecutorPool) -> Self {
+                     let mut pools = self.executor_pools.to_vec();
+                     for (method, pool_name) in $pool_names$.into_iter().enumerate() {
+                         if pool_name == Some(name) {
+                             pools[method] = Some(pool.clone());
+                         }
+                     }
+                     self.executor_pools = pools.into();
+                     self
+                 }
+               )rs");
+             }
+             if (options.unary_multiplexing) {
+               ctx.Emit(R"rs(
+                 /// Limits the calls of one multiplexed stream that run at
+                 /// once. Default: [`DEFAULT_MAX_MULTIPLEXED_CALLS`].
+                 ///
+                 /// Panics if `limit` is zero.
+                 #[must_use]
+                 pub fn with_max_multiplexed_calls(mut self, limit: usize) -> Self {
+                     assert!(limit > 0, "max_multiplexed_calls must be positive");
+                     self.max_multiplexed_calls = limit;
+                     self
+                 }
+               )rs");
+             }
+             if (options.write_coalescing) {
+               ctx.Emit(R"rs(
+                 /// Holds back the messages of server-streaming and bidi
+                 /// responses so that several are sent in one write.
+                 #[must_use]
+                 pub fn with_write_coalescing(mut self, policy: CoalescingPolicy) -> Self {
+                     self.write_coalescing = Some(policy);
+                     self
+                 }
+               )rs");
+             }
+           }},
+          {"call_prologue",
+           [&] {
+             if (has_call_hooks) {
+               ctx.Emit("let fut: Self::Future = ");
+             }
+           }},
+          {"call_epilogue",
+           [&] {
+             if (!has_call_hooks) {
+               return;
+             }
+             ctx.Emit(";\n");
+             if (options.load_reports) {
+               ctx.Emit(R"rs(
+                 let fut: Self::Future = match self.load_tracker.clone() {
+                     Some(tracker) => Box::pin(report_load(fut, LoadReportGuard::new(tracker))),
+                     None => fut,
+                 };
+               )rs");
+             }
+             ctx.Emit("fut\n");
+           }},
+          {"support",
+           [&] {
+             GenerateMethodHandlers(service, options, server_trait, ctx);
+             if (options.load_reports) {
+               GenerateLoadReporting(client_mod, ctx);
+             }
+             if (NeedsRawCodec(options)) {
+               ctx.Emit("use super::$client_mod$::RawCodec;\n");
+             }
+             if (HasPipeline(service)) {
+               ctx.Emit("pub use super::$client_mod$::DecodePipeline;\n");
+             }
+             if (DecodesOffloaded(service, options) || HasPipeline(service) ||
+                 HasPooledRequests(service)) {
+               ctx.Emit("use super::$client_mod$::OffloadCodec;\n");
+             }
+             if (DecodesOffloaded(service, options)) {
+               ctx.Emit(R"rs(
+                 use super::$client_mod$::decode_offloaded;
+
+                 async fn decode_offloaded_request<M>(
+                     request: tonic::Request<Bytes>,
+                     threshold: usize,
+                 ) -> std::result::Result<tonic::Request<M>, tonic::Status>
+                 where
+                     M: protobuf::Parse + std::marker::Send + 'static,
+                 {
+                     let (metadata, extensions, encoded) = request.into_parts();
+                     let message = decode_offloaded(encoded, threshold).await?;
+                     Ok(tonic::Request::from_parts(metadata, extensions, message))
+                 }
+               )rs");
+             }
+             if (options.write_coalescing) {
+               ctx.Emit(
+                   "pub use super::$client_mod$::{CoalescingPolicy, "
+                   "CoalescingStream};\n");
+             }
+             if (options.batch_receive) {
+               ctx.Emit("pub use super::$client_mod$::BatchReceiver;\n");
+             }
+             if (HasStreamBuffers(service)) {
+               ctx.Emit(
+                   "pub use super::$client_mod$::{stream_channel, StreamGauge, "
+                   "StreamReceiver, StreamSender};\n");
+               GenerateStreamChannelConstructors(service, /*client=*/false,
+                                                 ctx);
+             }
+             if (HasPreEncoded(service) || HasMemoized(options, service)) {
+               GenerateEncoded(ctx);
+             }
+             if (HasMemoized(options, service)) {
+               GenerateMemoizer(ctx);
+             }
+             if (HasBlockingHandlers(service)) {
+               GenerateRunBlocking(ctx);
+             }
+             if (HasExecutorPools(service)) {
+               GenerateExecutorPool(ctx);
+             }
+             if (HasBroadcasts(service)) {
+               GenerateBroadcaster(service, ctx);
+             }
+             if (HasPooledRequests(service)) {
+               GenerateRequestPool(service, ctx);
+             }
+             if (options.unary_multiplexing) {
+               GenerateMultiplexDispatch(service, options, server_trait, ctx);
+             }
+             if (options.thread_per_core) {
+               GenerateServePerCore(ctx);
+             }
+             if (options.local_transport) {
+               GenerateServeUnix(ctx);
+             }
+             if (options.deadline_propagation) {
+               GenerateDeadlinePropagation(ctx);
+             }
+             if (options.cancellation) {
+               GenerateCancellation(ctx);
+             }
+             if (HasAdmissionLimits(service)) {
+               GenerateAdmission(service, ctx);
+             }
+             if (HoldsResponseGuards(service, options)) {
+               GenerateGuardedBody(ctx);
+             }
+             if (options.codel) {
+               GenerateCodel(service, ctx);
+             }
+             if (options.fair_scheduling) {
+               GenerateFairScheduler(ctx);
+             }
+             if (HasAdmissionLimits(service) || options.codel) {
+               GenerateOverloadedResponse(ctx);
+             }
+           }},
+          {"server_mod", server_mod},
+          {"client_mod", client_mod},
+          {"server_trait", server_trait},
+          {"server_ident", server_ident},
+          {"service_name", service.full_name()},
+          {"service_doc",
+           [&] { ctx.Emit(ProtoCommentToRustDoc(service.comment())); }},
+          {"trait_methods", [&] { GenerateTraitMethods(service, ctx); }},
+          {"routes",
+           [&] { GenerateRoutes(service, options, server_trait, ctx); }},
+      },
+      DropAbsentSubs(R"rs(
+      /// Generated server implementations.
+      pub mod $server_mod$ {
+          #![allow(
+              unused_variables,
+              dead_code,
+              missing_docs,
+              clippy::wildcard_imports,
+              // will trigger if compression is disabled
+              clippy::let_unit_value,
+          )]
+          use tonic::codegen::*;
+
+          /// Generated trait containing gRPC methods that should be implemented for
+          /// use with $server_ident$.
+          #[async_trait]
+          pub trait $server_trait$: std::marker::Send + std::marker::Sync + 'static {
+              $trait_methods$
+          }
+
+          $service_doc$
+          #[derive(Debug)]
+          pub struct $server_ident$<T> {
+              inner: Arc<T>,
+              accept_compression_encodings: EnabledCompressionEncodings,
+              send_compression_encodings: EnabledCompressionEncodings,
+              max_decoding_message_size: Option<usize>,
+              max_encoding_message_size: Option<usize>,
+              $extra_fields$
+          }
+
+          impl<T> $server_ident$<T> {
+              pub fn new(inner: T) -> Self {
+                  Self::from_arc(Arc::new(inner))
+              }
+
+              pub fn from_arc(inner: Arc<T>) -> Self {
+                  Self {
+                      inner,
+                      accept_compression_encodings: Default::default(),
+                      send_compression_encodings: Default::default(),
+                      max_decoding_message_size: None,
+                      max_encoding_message_size: None,
+                      $extra_field_inits$
+                  }
+              }
+
+              pub fn with_interceptor<F>(inner: T, interceptor: F) ->
+              InterceptedService<Self, F>
+              where
+                  F: tonic::service::Interceptor,
+              {
+                  InterceptedService::new(Self::new(inner), interceptor)
               }
 
-              /// Compress requests with the given encoding.
-              ///
-              /// This requires the server to support it otherwise it might respond with an
-              /// error.
+              /// Enable decompressing requests with the given encoding.
               #[must_use]
-              pub fn send_compressed(mut self, encoding: CompressionEncoding)
+              pub fn accept_compressed(mut self, encoding: CompressionEncoding)
               -> Self {
-                  self.inner = self.inner.send_compressed(encoding);
+                  self.accept_compression_encodings.enable(encoding);
                   self
               }
 
-              /// Enable decompressing responses.
+              /// Compress responses with the given encoding, if the client supports it.
               #[must_use]
-              pub fn accept_compressed(mut self, encoding:
-              CompressionEncoding) -> Self {
-                  self.inner = self.inner.accept_compressed(encoding);
+              pub fn send_compressed(mut self, encoding: CompressionEncoding) ->
+              Self {
+                  self.send_compression_encodings.enable(encoding);
                   self
               }
 
@@ -373,9 +7034,8 @@ static void generate_client(const Service &service, Context &ctx) {
               ///
               /// Default: `4MB`
               #[must_use]
-              pub fn max_decoding_message_size(mut self, limit: usize) ->
-              Self {
-                  self.inner = self.inner.max_decoding_message_size(limit);
+              pub fn max_decoding_message_size(mut self, limit: usize) -> Self {
+                  self.max_decoding_message_size = Some(limit);
                   self
               }
 
@@ -383,27 +7043,367 @@ static void generate_client(const Service &service, Context &ctx) {
               ///
               /// Default: `usize::MAX`
               #[must_use]
-              pub fn max_encoding_message_size(mut self, limit: usize) ->
-              Self {
-                  self.inner = self.inner.max_encoding_message_size(limit);
+              pub fn max_encoding_message_size(mut self, limit: usize) -> Self {
+                  self.max_encoding_message_size = Some(limit);
                   self
               }
 
-              $methods$
+              $builder_methods$
+          }
+
+          impl<T, B> tonic::codegen::Service<http::Request<B>> for $server_ident$<T>
+          where
+              T: $server_trait$,
+              B: Body + std::marker::Send + 'static,
+              B::Error: Into<StdError> + std::marker::Send + 'static,
+          {
+              type Response = http::Response<tonic::body::Body>;
+              type Error = std::convert::Infallible;
+              type Future = BoxFuture<Self::Response, Self::Error>;
+
+              fn poll_ready(
+                  &mut self,
+                  _cx: &mut Context<'_>,
+              ) -> Poll<std::result::Result<(), Self::Error>> {
+                  Poll::Ready(Ok(()))
+              }
+
+              fn call(&mut self, req: http::Request<B>) -> Self::Future {
+                  $call_prologue$match req.uri().path() {
+                      $routes$
+                      _ => {
+                          Box::pin(async move {
+                              let mut response = http::Response::new(
+                                  tonic::body::Body::default(),
+                              );
+                              let headers = response.headers_mut();
+                              headers.insert(
+                                  tonic::Status::GRPC_STATUS,
+                                  (tonic::Code::Unimplemented as i32).into(),
+                              );
+                              headers.insert(
+                                  http::header::CONTENT_TYPE,
+                                  tonic::metadata::GRPC_CONTENT_TYPE,
+                              );
+                              Ok(response)
+                          })
+                      }
+                  }$call_epilogue$
+              }
+          }
+
+          impl<T> Clone for $server_ident$<T> {
+              fn clone(&self) -> Self {
+                  let inner = self.inner.clone();
+                  Self {
+                      inner,
+                      accept_compression_encodings: self.accept_compression_encodings,
+                      send_compression_encodings: self.send_compression_encodings,
+                      max_decoding_message_size: self.max_decoding_message_size,
+                      max_encoding_message_size: self.max_encoding_message_size,
+                      $extra_field_clones$
+                  }
+              }
+          }
+
+          /// Generated gRPC service name
+          pub const SERVICE_NAME: &str = "$service_name$";
+
+          impl<T> tonic::server::NamedService for $server_ident$<T> {
+              const NAME: &'static str = SERVICE_NAME;
           }
-      })rs");
+
+          $support$
+      })rs",
+                     {{"extra_fields", !extra_fields.empty()},
+                      {"extra_field_inits", !extra_fields.empty()},
+                      {"extra_field_clones", !extra_fields.empty()},
+                      {"builder_methods", has_builder_methods}}));
 }
 
-} // namespace client
+} // namespace server
+
+static constexpr std::pair<absl::string_view, bool GeneratorOptions::*>
+    kBoolOptions[] = {
+        {"server", &GeneratorOptions::server},
+        {"pool_client", &GeneratorOptions::pool_client},
+        {"load_reports", &GeneratorOptions::load_reports},
+        {"hedging", &GeneratorOptions::hedging},
+        {"coalescing", &GeneratorOptions::coalescing},
+        {"response_cache", &GeneratorOptions::response_cache},
+        {"batching", &GeneratorOptions::batching},
+        {"unary_multiplexing", &GeneratorOptions::unary_multiplexing},
+        {"write_coalescing", &GeneratorOptions::write_coalescing},
+        {"batch_receive", &GeneratorOptions::batch_receive},
+        {"thread_per_core", &GeneratorOptions::thread_per_core},
+        {"local_transport", &GeneratorOptions::local_transport},
+        {"deadline_propagation", &GeneratorOptions::deadline_propagation},
+        {"cancellation", &GeneratorOptions::cancellation},
+        {"codel", &GeneratorOptions::codel},
+        {"fair_scheduling", &GeneratorOptions::fair_scheduling},
+        {"adaptive_concurrency", &GeneratorOptions::adaptive_concurrency},
+        {"memoization", &GeneratorOptions::memoization},
+};
+
+// Whether the server module is generated: with the `server` option, or with
+// any option that only changes the server.
+static bool WantsServer(const GeneratorOptions &options) {
+  return options.server || options.thread_per_core ||
+         options.deadline_propagation || options.cancellation ||
+         options.codel || options.fair_scheduling || options.memoization;
+}
+
+bool ParseGeneratorOptions(
+    const std::vector<std::pair<std::string, std::string>> &parameters,
+    GeneratorOptions *options, std::string *error) {
+  for (const auto &[key, value] : parameters) {
+    for (const auto &[name, field] : kBoolOptions) {
+      if (key != name) {
+        continue;
+      }
+      // A bare key, as in `--grpc-rust_opt=pool_client`, enables the feature.
+      if (value.empty() || value == "true") {
+        options->*field = true;
+      } else if (value == "false") {
+        options->*field = false;
+      } else {
+        *error = absl::StrFormat(
+            "Invalid value '%s' for %s, expected 'true' or 'false'", value,
+            key);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool ValidateBatchOption(const MethodDescriptor *method,
+                                std::string *error) {
+  const Method wrapper(method);
+  if (!wrapper.rust_options().has_batch()) {
+    return true;
+  }
+  const ServiceDescriptor *service = method->service();
+  const ::grpc::rust::BatchOptions &batch = wrapper.rust_options().batch();
+  const MethodDescriptor *batch_method = wrapper.batch_method();
+  auto fail = [&](absl::string_view reason) {
+    *error = absl::StrFormat("%s: invalid batch option: %s",
+                             method->full_name(), reason);
+    return false;
+  };
+  if (method->client_streaming() || method->server_streaming()) {
+    return fail("only unary methods can be batched");
+  }
+  if (batch_method == nullptr) {
+    return fail(absl::StrFormat("no method named '%s' in %s",
+                                batch.method(), service->full_name()));
+  }
+  if (batch_method == method || batch_method->client_streaming() ||
+      batch_method->server_streaming()) {
+    return fail("the batch method must be another unary method");
+  }
+  const FieldDescriptor *request_field =
+      batch_method->input_type()->FindFieldByName(batch.request_field());
+  if (request_field == nullptr || !request_field->is_repeated() ||
+      request_field->message_type() != method->input_type()) {
+    return fail(absl::StrFormat("%s has no repeated %s field named '%s'",
+                                batch_method->input_type()->full_name(),
+                                method->input_type()->full_name(),
+                                batch.request_field()));
+  }
+  const FieldDescriptor *response_field =
+      batch_method->output_type()->FindFieldByName(batch.response_field());
+  if (response_field == nullptr || !response_field->is_repeated() ||
+      response_field->message_type() != method->output_type()) {
+    return fail(absl::StrFormat("%s has no repeated %s field named '%s'",
+                                batch_method->output_type()->full_name(),
+                                method->output_type()->full_name(),
+                                batch.response_field()));
+  }
+  return true;
+}
+
+static bool ValidateStreamBuffer(const MethodDescriptor *method,
+                                 std::string *error) {
+  const ::grpc::rust::MethodOptions &options = Method(method).rust_options();
+  if (!options.has_stream_buffer()) {
+    return true;
+  }
+  if (!method->client_streaming() && !method->server_streaming()) {
+    *error = absl::StrFormat(
+        "%s: stream_buffer is only valid on streaming methods",
+        method->full_name());
+    return false;
+  }
+  if (options.stream_buffer() == 0) {
+    *error = absl::StrFormat("%s: stream_buffer must be positive",
+                             method->full_name());
+    return false;
+  }
+  return true;
+}
+
+static bool ValidatePipelineDepth(const MethodDescriptor *method,
+                                  std::string *error) {
+  const ::grpc::rust::MethodOptions &options = Method(method).rust_options();
+  if (!options.has_pipeline_depth()) {
+    return true;
+  }
+  if (!method->client_streaming()) {
+    *error = absl::StrFormat(
+        "%s: pipeline_depth is only valid on client-streaming methods",
+        method->full_name());
+    return false;
+  }
+  if (options.pipeline_depth() == 0) {
+    *error = absl::StrFormat("%s: pipeline_depth must be positive",
+                             method->full_name());
+    return false;
+  }
+  return true;
+}
+
+static bool IsPositiveDuration(const protobuf::Duration &duration) {
+  return duration.seconds() >= 0 && duration.nanos() >= 0 &&
+         duration.nanos() < 1000000000 &&
+         (duration.seconds() > 0 || duration.nanos() > 0);
+}
+
+static bool ValidateTimeout(const MethodDescriptor *method,
+                            std::string *error) {
+  const ::grpc::rust::MethodOptions &options = Method(method).rust_options();
+  if (!options.has_timeout()) {
+    return true;
+  }
+  if (!IsPositiveDuration(options.timeout())) {
+    *error = absl::StrFormat("%s: timeout must be positive",
+                             method->full_name());
+    return false;
+  }
+  return true;
+}
+
+static bool ValidateCacheTtl(const MethodDescriptor *method,
+                             std::string *error) {
+  const Method rust_method(method);
+  const ::grpc::rust::MethodOptions &options = rust_method.rust_options();
+  if (!options.has_cache_ttl()) {
+    return true;
+  }
+  if (method->client_streaming() || method->server_streaming() ||
+      !rust_method.has_no_side_effects()) {
+    *error = absl::StrFormat(
+        "%s: cache_ttl is only valid on unary methods with "
+        "idempotency_level NO_SIDE_EFFECTS",
+        method->full_name());
+    return false;
+  }
+  if (!IsPositiveDuration(options.cache_ttl())) {
+    *error = absl::StrFormat("%s: cache_ttl must be positive",
+                             method->full_name());
+    return false;
+  }
+  return true;
+}
+
+static bool ValidateAdmissionLimits(const MethodDescriptor *method,
+                                    std::string *error) {
+  const ::grpc::rust::MethodOptions &options = Method(method).rust_options();
+  if (options.has_max_queue() && !options.has_max_in_flight()) {
+    *error = absl::StrFormat("%s: max_queue requires max_in_flight",
+                             method->full_name());
+    return false;
+  }
+  if (options.has_max_in_flight() && options.max_in_flight() == 0) {
+    *error = absl::StrFormat("%s: max_in_flight must be positive",
+                             method->full_name());
+    return false;
+  }
+  return true;
+}
 
-namespace server {} // namespace server
+static bool ValidatePriority(const MethodDescriptor *method,
+                             std::string *error) {
+  const ::grpc::rust::MethodOptions &options = Method(method).rust_options();
+  if (options.has_priority() && options.priority() == 0) {
+    *error = absl::StrFormat("%s: priority must be positive",
+                             method->full_name());
+    return false;
+  }
+  return true;
+}
+
+static bool ValidateExecutor(const MethodDescriptor *method,
+                             std::string *error) {
+  const Method rust_method(method);
+  const std::string &executor = rust_method.rust_options().executor();
+  if (executor.empty() || executor == "inline" || rust_method.runs_blocking()) {
+    return true;
+  }
+  const absl::string_view pool = rust_method.executor_pool();
+  if (pool.empty() || !absl::c_all_of(pool, [](char c) {
+        return absl::ascii_isalnum(c) || c == '_' || c == '-' || c == '.';
+      })) {
+    *error = absl::StrFormat(
+        "%s: executor must be \"inline\", \"blocking\" or \"pool(<name>)\", "
+        "got \"%s\"",
+        method->full_name(), executor);
+    return false;
+  }
+  return true;
+}
+
+static bool ValidatePooledRequest(const MethodDescriptor *method,
+                                  std::string *error) {
+  const ::grpc::rust::MethodOptions &options = Method(method).rust_options();
+  if (!options.pooled_request()) {
+    return true;
+  }
+  if (method->client_streaming()) {
+    *error = absl::StrFormat(
+        "%s: pooled_request is only valid on unary and server-streaming "
+        "methods",
+        method->full_name());
+    return false;
+  }
+  if (options.has_offload_threshold_bytes()) {
+    *error = absl::StrFormat(
+        "%s: pooled_request cannot be combined with offload_threshold_bytes",
+        method->full_name());
+    return false;
+  }
+  return true;
+}
+
+bool ValidateService(const ServiceDescriptor *service, std::string *error) {
+  for (int i = 0; i < service->method_count(); ++i) {
+    const MethodDescriptor *method = service->method(i);
+    if (!ValidateBatchOption(method, error) ||
+        !ValidateStreamBuffer(method, error) ||
+        !ValidatePipelineDepth(method, error) ||
+        !ValidateTimeout(method, error) ||
+        !ValidateCacheTtl(method, error) ||
+        !ValidateAdmissionLimits(method, error) ||
+        !ValidatePriority(method, error) ||
+        !ValidateExecutor(method, error) ||
+        !ValidatePooledRequest(method, error)) {
+      return false;
+    }
+  }
+  return true;
+}
 
 // Writes the generated service interface into the given
 // ZeroCopyOutputStream.
 void GenerateService(Context &rust_generator_context,
-                     const ServiceDescriptor *service_desc) {
+                     const ServiceDescriptor *service_desc,
+                     const GeneratorOptions &options) {
   const Service service = Service(service_desc);
-  client::generate_client(service, rust_generator_context);
+  client::generate_client(service, options, rust_generator_context);
+  if (WantsServer(options)) {
+    rust_generator_context.Emit("\n\n");
+    server::generate_server(service, options, rust_generator_context);
+  }
 }
 
 std::string GetRsGrpcFile(const protobuf::FileDescriptor &file) {
@@ -19,6 +19,9 @@
 
 #include <iostream>
 #include <stdlib.h> // for abort()
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <google/protobuf/compiler/rust/context.h>
 #include <google/protobuf/descriptor.h>
@@ -51,10 +54,82 @@ namespace impl {
 namespace protobuf = google::protobuf;
 } // namespace impl
 
+// Optional code generation features, enabled through `--grpc-rust_opt`.
+// Every feature is off by default so the plain output stays unchanged.
+struct GeneratorOptions {
+  // Emit the `<service>_server` module. The options that only change the
+  // server (thread_per_core, deadline_propagation, cancellation, codel,
+  // fair_scheduling and memoization) emit it as well.
+  bool server = false;
+  // Emit a `<Service>PoolClient` that spreads calls over several channels.
+  bool pool_client = false;
+  // Attach ORCA load reports to server responses and let pool clients pick
+  // the less loaded of two random channels.
+  bool load_reports = false;
+  // Let clients hedge idempotent unary methods, sending a second attempt when
+  // the first is slower than a percentile of recent latencies.
+  bool hedging = false;
+  // Let clients share one in-flight call among concurrent callers that send
+  // byte-identical requests to a method without side effects.
+  bool coalescing = false;
+  // Let clients cache encoded responses of methods without side effects,
+  // honoring the `cache_ttl` method option.
+  bool response_cache = false;
+  // Emit a `<Service>BatchingClient` that sends concurrent calls of a unary
+  // method with a `batch` option as one call of its batch method.
+  bool batching = false;
+  // Let clients send unary calls as tagged envelopes over one long-lived
+  // bidi stream, which the server dispatches to the unary handlers.
+  bool unary_multiplexing = false;
+  // Let clients hold back streamed requests, and servers streamed responses,
+  // so that several small messages are encoded into one DATA frame.
+  bool write_coalescing = false;
+  // Emit `BatchReceiver`, which takes all already received messages of a
+  // stream in one call.
+  bool batch_receive = false;
+  // Emit `serve_per_core`, which runs one single-threaded runtime and
+  // SO_REUSEPORT accept loop per thread.
+  bool thread_per_core = false;
+  // Emit constructors that connect clients and serve servers over Unix
+  // domain sockets.
+  bool local_transport = false;
+  // Record the deadline of incoming calls so that handlers can pass the
+  // time left on to outbound calls.
+  bool deadline_propagation = false;
+  // Hand server handlers a `CallCancellation` that fires when their call is
+  // abandoned.
+  bool cancellation = false;
+  // Let servers shed calls of a method while the time calls wait before
+  // they start stays above a target (CoDel).
+  bool codel = false;
+  // Let servers run handlers in a fixed number of slots, handed out in
+  // weighted fair order per method and tenant.
+  bool fair_scheduling = false;
+  // Let clients limit their calls in flight per method, or per backend, to a
+  // limit that adapts to the observed round-trip times and overload errors.
+  bool adaptive_concurrency = false;
+  // Let servers run one handler for identical concurrent calls of
+  // NO_SIDE_EFFECTS unary methods, and memoize their encoded responses.
+  bool memoization = false;
+};
+
+// Fills `options` from the parsed generator parameter. The parameter is shared
+// with the protobuf rust options, so unknown keys are ignored. Returns false
+// and sets `error` if a known key has an invalid value.
+bool ParseGeneratorOptions(
+    const std::vector<std::pair<std::string, std::string>> &parameters,
+    GeneratorOptions *options, std::string *error);
+
+// Checks the `(grpc.rust.method)` options of the service's methods. Returns
+// false and sets `error` if an option is not valid on its method.
+bool ValidateService(const impl::protobuf::ServiceDescriptor *service,
+                     std::string *error);
+
 // Writes the generated service interface into the given ZeroCopyOutputStream
 void GenerateService(
     impl::protobuf::compiler::rust::Context &rust_generator_context,
-    const impl::protobuf::ServiceDescriptor *service);
+    const impl::protobuf::ServiceDescriptor *service,
+    const GeneratorOptions &options);
 
 std::string GetRsGrpcFile(const impl::protobuf::FileDescriptor &file);
 } // namespace rust_grpc_generator
@@ -36,8 +36,19 @@ public:
     if (file->service_count() == 0) {
       return true;
     }
+    for (int i = 0; i < file->service_count(); ++i) {
+      if (!rust_grpc_generator::ValidateService(file->service(i), error)) {
+        return false;
+      }
+    }
+
     std::vector<std::pair<std::string, std::string>> options;
     protobuf::compiler::ParseGeneratorParameter(parameter, &options);
+    rust_grpc_generator::GeneratorOptions grpc_options;
+    if (!rust_grpc_generator::ParseGeneratorOptions(options, &grpc_options,
+                                                    error)) {
+      return false;
+    }
 
     // Copied from protobuf rust's generator.cc.
     absl::StatusOr<rust::Options> opts = rust::Options::Parse(parameter);
@@ -70,7 +81,7 @@ public:
 
     for (int i = 0; i < file->service_count(); ++i) {
       const protobuf::ServiceDescriptor *service = file->service(i);
-      rust_grpc_generator::GenerateService(ctx, service);
+      rust_grpc_generator::GenerateService(ctx, service, grpc_options);
     }
     return true;
   }
@@ -0,0 +1,80 @@
+//! Generates the messages of the test service once, and the service once per
+//! set of generator options, into `OUT_DIR`.
+//!
+//! The gRPC plugin is taken from `PROTOC_GEN_RUST_GRPC`, or from the Bazel
+//! output tree of `bazel build //src:protoc_gen_rust_grpc`.
+
+use std::path::{Path, PathBuf};
+use std::process::Command;
+
+/// The `--grpc-rust_opt` options of each module in `src/lib.rs`.
+const OPTION_SETS: &[(&str, &[&str])] = &[
+    ("plain", &[]),
+    (
+        "full",
+        &[
+            "server",
+            "pool_client",
+            "load_reports",
+            "hedging",
+            "coalescing",
+            "response_cache",
+            "batching",
+            "unary_multiplexing",
+            "write_coalescing",
+            "batch_receive",
+            "thread_per_core",
+            "local_transport",
+            "deadline_propagation",
+            "cancellation",
+            "codel",
+            "fair_scheduling",
+            "adaptive_concurrency",
+            "memoization",
+        ],
+    ),
+];
+
+fn main() {
+    let root = Path::new(env!("CARGO_MANIFEST_DIR")).join("../..");
+    let out_dir = PathBuf::from(std::env::var("OUT_DIR").unwrap());
+    let plugin = std::env::var("PROTOC_GEN_RUST_GRPC").map_or_else(
+        |_| root.join("bazel-bin/src/protoc_gen_rust_grpc"),
+        PathBuf::from,
+    );
+    println!("cargo:rerun-if-env-changed=PROTOC_GEN_RUST_GRPC");
+    println!("cargo:rerun-if-changed={}", plugin.display());
+    for proto in [
+        "test/fixture.proto",
+        "test/messages.proto",
+        "proto/grpc/rust/options.proto",
+    ] {
+        println!("cargo:rerun-if-changed={}", root.join(proto).display());
+    }
+
+    protobuf_codegen::CodeGen::new()
+        .include(&root)
+        .input("test/messages.proto")
+        .generate_and_compile()
+        .unwrap();
+
+    for (name, options) in OPTION_SETS {
+        let dir = out_dir.join(name);
+        std::fs::create_dir_all(&dir).unwrap();
+        let mut grpc_options = String::from("experimental-codegen=enabled,kernel=upb");
+        for option in *options {
+            grpc_options.push(',');
+            grpc_options.push_str(option);
+        }
+        let status = Command::new("protoc")
+            .arg(format!("--plugin=protoc-gen-grpc-rust={}", plugin.display()))
+            .arg(format!("--grpc-rust_opt={grpc_options}"))
+            .arg(format!("--grpc-rust_out={}", dir.display()))
+            .arg(format!("-I{}", root.display()))
+            .arg(format!("-I{}", root.join("proto").display()))
+            .arg("test/fixture.proto")
+            .status()
+            .expect("failed to run protoc");
+        assert!(status.success(), "protoc failed for the {name} options");
+    }
+}
@@ -0,0 +1,25 @@
+//! The test service of `test/fixture.proto`, generated once per set of
+//! generator options in `build.rs`. Each module holds the messages and the
+//! `demo_client` and `demo_server` modules generated with its options.
+
+pub mod messages {
+    include!(concat!(env!("OUT_DIR"), "/protobuf_generated/generated.rs"));
+}
+
+macro_rules! generated {
+    ($name:ident) => {
+        pub mod $name {
+            pub use crate::messages::*;
+
+            include!(concat!(
+                env!("OUT_DIR"),
+                "/",
+                stringify!($name),
+                "/test/fixture_grpc.pb.rs"
+            ));
+        }
+    };
+}
+
+generated!(plain);
+generated!(full);
@@ -0,0 +1,147 @@
+//! Tests of adaptive client concurrency limits, from the
+//! `adaptive_concurrency` option.
+
+mod common;
+
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, Capacity, TestService};
+use rust_grpc_generator_tests::full::demo_client::{
+    AdaptiveConcurrencyPolicy, DemoClient, LimitAlgorithm,
+};
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+use tonic::transport::Endpoint;
+
+const AIMD: LimitAlgorithm = LimitAlgorithm::Aimd { backoff: 0.9, rtt_tolerance: 2.0 };
+
+#[tokio::test]
+#[should_panic(expected = "max_limit must be at least min_limit and positive")]
+async fn limits_out_of_order_are_rejected() {
+    let policy = AdaptiveConcurrencyPolicy { min_limit: 8, max_limit: 4, ..Default::default() };
+    let _ = DemoClient::new(Endpoint::from_static("http://[::1]:1").connect_lazy())
+        .with_adaptive_concurrency(policy);
+}
+
+#[tokio::test]
+#[should_panic(expected = "backoff must be in (0, 1]")]
+async fn a_backoff_that_grows_the_limit_is_rejected() {
+    let algorithm = LimitAlgorithm::Aimd { backoff: 1.5, rtt_tolerance: 2.0 };
+    let policy = AdaptiveConcurrencyPolicy { algorithm, ..Default::default() };
+    let _ = DemoClient::new(Endpoint::from_static("http://[::1]:1").connect_lazy())
+        .with_adaptive_concurrency(policy);
+}
+
+#[tokio::test]
+async fn calls_over_the_limit_fail_without_being_sent() {
+    let service = Arc::new(TestService::with_delay(Duration::from_millis(100)));
+    let channel = connect(serve(DemoServer::from_arc(Arc::clone(&service))).await).await;
+    let policy = AdaptiveConcurrencyPolicy { initial_limit: 2, ..Default::default() };
+    let client = DemoClient::new(channel).with_adaptive_concurrency(policy);
+    let mut calls = tokio::task::JoinSet::new();
+    for _ in 0..10 {
+        let mut client = client.clone();
+        calls.spawn(async move { client.get(request("key")).await });
+    }
+    let mut rejected = 0;
+    while let Some(call) = calls.join_next().await {
+        if let Err(status) = call.unwrap() {
+            assert_eq!(status.code(), tonic::Code::ResourceExhausted);
+            rejected += 1;
+        }
+    }
+    assert_eq!(rejected, 8);
+    assert_eq!(service.gets.load(Ordering::Relaxed), 2);
+}
+
+/// Runs 64 callers against a backend that serves 5ms Get calls `capacities`
+/// at a time, each for `phase`. Returns the Get limit at the end of each
+/// phase and the latencies of the calls served. Callers over the limit back
+/// off for 2ms.
+async fn simulate(
+    policy: Option<AdaptiveConcurrencyPolicy>,
+    capacities: &[usize],
+    phase: Duration,
+) -> (Vec<usize>, Vec<Duration>) {
+    let capacity = Arc::new(Capacity::new(capacities[0]));
+    let service = TestService {
+        delay: Duration::from_millis(5),
+        capacity: Some(Arc::clone(&capacity)),
+        ..Default::default()
+    };
+    let channel = connect(serve(DemoServer::new(service)).await).await;
+    let client = match policy {
+        Some(policy) => DemoClient::new(channel).with_adaptive_concurrency(policy),
+        None => DemoClient::new(channel),
+    };
+    let stop = Arc::new(AtomicBool::new(false));
+    let latencies = Arc::new(Mutex::new(Vec::new()));
+    let mut callers = tokio::task::JoinSet::new();
+    for _ in 0..64 {
+        let (mut client, stop, latencies) =
+            (client.clone(), Arc::clone(&stop), Arc::clone(&latencies));
+        callers.spawn(async move {
+            while !stop.load(Ordering::Relaxed) {
+                let call = Instant::now();
+                match client.get(request("key")).await {
+                    Ok(_) => latencies.lock().unwrap().push(call.elapsed()),
+                    Err(_) => tokio::time::sleep(Duration::from_millis(2)).await,
+                }
+            }
+        });
+    }
+    let mut limits = Vec::new();
+    for &phase_capacity in capacities {
+        capacity.set(phase_capacity).await;
+        tokio::time::sleep(phase).await;
+        limits.push(client.concurrency_limits().map_or(0, |limits| limits[0]));
+    }
+    stop.store(true, Ordering::Relaxed);
+    while let Some(caller) = callers.join_next().await {
+        caller.unwrap();
+    }
+    let latencies = std::mem::take(&mut *latencies.lock().unwrap());
+    (limits, latencies)
+}
+
+#[tokio::test(flavor = "multi_thread")]
+async fn limits_follow_a_backend_whose_capacity_changes() {
+    for algorithm in [AIMD, LimitAlgorithm::Gradient] {
+        let policy =
+            AdaptiveConcurrencyPolicy { algorithm, initial_limit: 8, ..Default::default() };
+        let (limits, _) =
+            simulate(Some(policy), &[8, 32, 4], Duration::from_millis(1500)).await;
+        println!("{algorithm:?}: limits {limits:?} at capacities 8, 32 and 4");
+        assert!(limits[1] > limits[0], "{algorithm:?} did not grow: {limits:?}");
+        assert!(limits[2] < limits[1], "{algorithm:?} did not shrink: {limits:?}");
+    }
+}
+
+/// Capacity changes: the p99 latency of Get calls while the backend's
+/// capacity goes from 8 to 32 to 4, without limits and with each
+/// algorithm. Run with
+/// `cargo test --release --test adaptive_concurrency -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn p99_while_capacity_changes() {
+    let policies = [
+        None,
+        Some(AdaptiveConcurrencyPolicy { algorithm: AIMD, ..Default::default() }),
+        Some(AdaptiveConcurrencyPolicy {
+            algorithm: LimitAlgorithm::Gradient,
+            ..Default::default()
+        }),
+    ];
+    for policy in policies {
+        let (limits, mut latencies) =
+            simulate(policy, &[8, 32, 4], Duration::from_secs(3)).await;
+        println!(
+            "{:?}: {} served, p50 {:?}, p99 {:?}, limits {limits:?}",
+            policy.map(|policy| policy.algorithm),
+            latencies.len(),
+            common::quantile(&mut latencies, 0.5),
+            common::quantile(&mut latencies, 0.99),
+        );
+    }
+}
@@ -0,0 +1,143 @@
+//! Tests of the `max_in_flight` and `max_queue` method options.
+
+mod common;
+
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::{DemoClient, DemoMultiplexClient};
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+use rust_grpc_generator_tests::full::BatchRequest;
+
+/// A batch of one request.
+fn batch() -> BatchRequest {
+    let mut batch = BatchRequest::new();
+    batch.requests_mut().push(request("key"));
+    batch
+}
+
+/// Counts the calls that succeeded and those rejected as overloaded.
+fn tally<T>(results: Vec<Result<T, tonic::Status>>) -> (usize, usize) {
+    let mut tally = (0, 0);
+    for result in results {
+        match result {
+            Ok(_) => tally.0 += 1,
+            Err(status) if status.code() == tonic::Code::ResourceExhausted => tally.1 += 1,
+            Err(status) => panic!("{status:?}"),
+        }
+    }
+    tally
+}
+
+#[tokio::test]
+async fn calls_over_the_running_and_queued_limits_are_rejected() {
+    let addr = serve(DemoServer::new(TestService::with_delay(Duration::from_millis(200)))).await;
+    let client = DemoClient::new(connect(addr).await);
+    let mut calls = tokio::task::JoinSet::new();
+    for _ in 0..30 {
+        let mut client = client.clone();
+        calls.spawn(async move { client.batch_get(batch()).await });
+    }
+    let mut results = Vec::new();
+    while let Some(call) = calls.join_next().await {
+        results.push(call.unwrap());
+    }
+    // BatchGet runs 4 calls and queues 16.
+    assert_eq!(tally(results), (20, 10));
+}
+
+#[tokio::test]
+async fn a_stream_counts_until_it_ends() {
+    let addr = serve(DemoServer::new(TestService::default())).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    // Watch runs 16 streams.
+    let mut watches = Vec::new();
+    for _ in 0..16 {
+        let mut watch = client.watch(request("key")).await.unwrap().into_inner();
+        assert!(watch.message().await.unwrap().is_some());
+        watches.push(watch);
+    }
+    let status = match client.watch(request("key")).await {
+        Ok(mut watch) => watch.message().await.unwrap_err(),
+        Err(status) => status,
+    };
+    assert_eq!(status.code(), tonic::Code::ResourceExhausted);
+    drop(watches.pop());
+    let deadline = Instant::now() + Duration::from_secs(5);
+    loop {
+        if let Ok(mut watch) = client.watch(request("key")).await {
+            if watch.get_mut().message().await.is_ok() {
+                break;
+            }
+        }
+        assert!(Instant::now() < deadline, "the dropped stream still counts");
+        tokio::time::sleep(Duration::from_millis(10)).await;
+    }
+}
+
+#[tokio::test]
+async fn multiplexed_calls_count_against_their_method() {
+    let addr = serve(DemoServer::new(TestService::with_delay(Duration::from_millis(200)))).await;
+    let client = DemoMultiplexClient::connect(DemoClient::new(connect(addr).await)).await.unwrap();
+    let mut calls = tokio::task::JoinSet::new();
+    for _ in 0..30 {
+        let client = client.clone();
+        calls.spawn(async move { client.batch_get(batch()).await });
+    }
+    let mut results = Vec::new();
+    while let Some(call) = calls.join_next().await {
+        results.push(call.unwrap());
+    }
+    assert_eq!(tally(results), (20, 10));
+}
+
+/// Load test: 256 callers overload a method that takes 10ms, without
+/// limits (Get) and with 4 running and 16 queued calls (BatchGet). Run with
+/// `cargo test --release --test admission -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn overload_with_and_without_limits() {
+    const CALLERS: usize = 256;
+    const RUN_FOR: Duration = Duration::from_secs(5);
+    let addr = serve(DemoServer::new(TestService::with_delay(Duration::from_millis(10)))).await;
+    for limited in [false, true] {
+        let started = Instant::now();
+        let mut callers = tokio::task::JoinSet::new();
+        for _ in 0..CALLERS {
+            let mut client = DemoClient::new(connect(addr).await);
+            callers.spawn(async move {
+                let (mut latencies, mut rejected) = (Vec::new(), 0);
+                while started.elapsed() < RUN_FOR {
+                    let call = Instant::now();
+                    let result = if limited {
+                        client.batch_get(batch()).await.map(drop)
+                    } else {
+                        client.get(request("key")).await.map(drop)
+                    };
+                    match result {
+                        Ok(()) => latencies.push(call.elapsed()),
+                        Err(_) => {
+                            rejected += 1;
+                            // A rejected caller backs off before it retries.
+                            tokio::time::sleep(Duration::from_millis(10)).await;
+                        }
+                    }
+                }
+                (latencies, rejected)
+            });
+        }
+        let (mut latencies, mut rejected) = (Vec::<Duration>::new(), 0);
+        while let Some(caller) = callers.join_next().await {
+            let (caller_latencies, caller_rejected) = caller.unwrap();
+            latencies.extend(caller_latencies);
+            rejected += caller_rejected;
+        }
+        println!(
+            "{}: {:.0} calls/s served, {rejected} rejected, p50 {:?}, p99 {:?}",
+            if limited { "4 running + 16 queued" } else { "unlimited" },
+            latencies.len() as f64 / started.elapsed().as_secs_f64(),
+            common::quantile(&mut latencies, 0.5),
+            common::quantile(&mut latencies, 0.99),
+        );
+    }
+}
@@ -0,0 +1,93 @@
+//! Tests of `BatchReceiver`, from the `batch_receive` option.
+
+mod common;
+
+use std::time::Instant;
+
+use common::{connect, request, response, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::{BatchReceiver, DemoClient};
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+
+#[tokio::test]
+async fn takes_every_buffered_message_up_to_max() {
+    let messages = (0..10).map(|i| Ok(response(&i.to_string())));
+    let mut receiver = BatchReceiver::new(tokio_stream::iter(messages));
+    let batch = receiver.next_batch(4).await.unwrap();
+    assert_eq!(batch.len(), 4);
+    assert_eq!(batch[0].value().to_string(), "0");
+    assert_eq!(receiver.next_batch(100).await.unwrap().len(), 6);
+    assert!(receiver.next_batch(100).await.unwrap().is_empty());
+}
+
+#[tokio::test]
+async fn an_error_follows_the_messages_before_it() {
+    let messages = vec![
+        Ok(response("a")),
+        Ok(response("b")),
+        Err(tonic::Status::aborted("gone")),
+        Ok(response("c")),
+    ];
+    let mut receiver = BatchReceiver::new(tokio_stream::iter(messages));
+    assert_eq!(receiver.next_batch(100).await.unwrap().len(), 2);
+    assert_eq!(receiver.next_batch(100).await.unwrap_err().code(), tonic::Code::Aborted);
+    assert!(receiver.next_batch(100).await.unwrap().is_empty());
+}
+
+#[tokio::test]
+#[allow(deprecated)]
+async fn receives_a_bidi_response_stream() {
+    let addr = serve(DemoServer::new(TestService::default())).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    let requests = tokio_stream::iter((0..500).map(|i| request(&i.to_string())));
+    let responses = client.chat(requests).await.unwrap().into_inner();
+    let mut receiver = BatchReceiver::new(responses);
+    let mut received = 0;
+    loop {
+        let batch = receiver.next_batch(64).await.unwrap();
+        if batch.is_empty() {
+            break;
+        }
+        for message in batch.drain(..) {
+            assert_eq!(message.value().to_string(), received.to_string());
+            received += 1;
+        }
+    }
+    assert_eq!(received, 500);
+}
+
+/// Load test: receives a bidi stream message by message, then in batches.
+/// Run with `cargo test --release --test batch_receive -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+#[allow(deprecated)]
+async fn batched_receive_throughput() {
+    const MESSAGES: usize = 500_000;
+    let addr = serve(DemoServer::new(TestService::default())).await;
+    for batched in [false, true] {
+        let mut client = DemoClient::new(connect(addr).await);
+        let requests = tokio_stream::iter(std::iter::repeat(request("key")).take(MESSAGES));
+        let started = Instant::now();
+        let mut responses = client.chat(requests).await.unwrap().into_inner();
+        let mut received = 0;
+        if batched {
+            let mut receiver = BatchReceiver::new(responses);
+            loop {
+                let batch = receiver.next_batch(256).await.unwrap();
+                if batch.is_empty() {
+                    break;
+                }
+                received += batch.drain(..).count();
+            }
+        } else {
+            while responses.message().await.unwrap().is_some() {
+                received += 1;
+            }
+        }
+        assert_eq!(received, MESSAGES);
+        println!(
+            "{}: {:.0} messages/s",
+            if batched { "next_batch(256)" } else { "message()" },
+            MESSAGES as f64 / started.elapsed().as_secs_f64(),
+        );
+    }
+}
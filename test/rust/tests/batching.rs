@@ -0,0 +1,103 @@
+//! Tests of `<Service>BatchingClient`, from the `batching` option.
+
+mod common;
+
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::{BatchingConfig, DemoBatchingClient, DemoClient};
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+
+#[tokio::test]
+async fn concurrent_calls_are_sent_as_one_batch() {
+    let service = Arc::new(TestService::default());
+    let channel = connect(serve(DemoServer::from_arc(Arc::clone(&service))).await).await;
+    let client = DemoBatchingClient::new(
+        DemoClient::new(channel),
+        BatchingConfig { max_batch_size: 8, max_delay: Duration::from_millis(50) },
+    );
+    let mut calls = tokio::task::JoinSet::new();
+    for i in 0..8 {
+        let client = client.clone();
+        calls.spawn(async move {
+            let key = i.to_string();
+            let response = client.get(request(&key)).await.unwrap();
+            assert_eq!(response.get_ref().value().to_string(), key);
+        });
+    }
+    while let Some(call) = calls.join_next().await {
+        call.unwrap();
+    }
+    assert_eq!(service.batch_gets.load(Ordering::Relaxed), 1);
+    assert_eq!(service.gets.load(Ordering::Relaxed), 0);
+}
+
+#[tokio::test]
+async fn a_lone_call_is_sent_after_the_delay() {
+    let service = Arc::new(TestService::default());
+    let channel = connect(serve(DemoServer::from_arc(Arc::clone(&service))).await).await;
+    let client = DemoBatchingClient::new(DemoClient::new(channel), BatchingConfig::default());
+    client.get(request("key")).await.unwrap();
+    assert_eq!(service.batch_gets.load(Ordering::Relaxed), 1);
+}
+
+/// Benchmark: calls/s and latency of concurrent gets, sent one by one and
+/// batched over windows of several lengths. Run with
+/// `cargo test --release --test batching -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn throughput_and_latency_by_batch_window() {
+    const CALLERS: usize = 256;
+    const CALLS_PER_CALLER: usize = 100;
+    let service = Arc::new(TestService::default());
+    let channel = connect(serve(DemoServer::from_arc(Arc::clone(&service))).await).await;
+    let windows = [
+        None,
+        Some(Duration::from_micros(100)),
+        Some(Duration::from_millis(1)),
+        Some(Duration::from_millis(5)),
+    ];
+    for window in windows {
+        let batching = window.map(|max_delay| {
+            DemoBatchingClient::new(
+                DemoClient::new(channel.clone()),
+                BatchingConfig { max_batch_size: 64, max_delay },
+            )
+        });
+        let batches = service.batch_gets.load(Ordering::Relaxed);
+        let started = Instant::now();
+        let mut callers = tokio::task::JoinSet::new();
+        for _ in 0..CALLERS {
+            let mut client = DemoClient::new(channel.clone());
+            let batching = batching.clone();
+            callers.spawn(async move {
+                let mut latencies = Vec::with_capacity(CALLS_PER_CALLER);
+                for _ in 0..CALLS_PER_CALLER {
+                    let call = Instant::now();
+                    match &batching {
+                        Some(batching) => batching.get(request("key")).await.unwrap(),
+                        None => client.get(request("key")).await.unwrap(),
+                    };
+                    latencies.push(call.elapsed());
+                }
+                latencies
+            });
+        }
+        let mut latencies: Vec<Duration> = Vec::new();
+        while let Some(caller) = callers.join_next().await {
+            latencies.extend(caller.unwrap());
+        }
+        let elapsed = started.elapsed();
+        let calls = latencies.len();
+        println!(
+            "{}: {:.0} calls/s in {} batch calls, p50 {:?}, p99 {:?}",
+            window.map_or("unbatched".to_string(), |window| format!("{window:?} window")),
+            calls as f64 / elapsed.as_secs_f64(),
+            service.batch_gets.load(Ordering::Relaxed) - batches,
+            common::quantile(&mut latencies, 0.5),
+            common::quantile(&mut latencies, 0.99),
+        );
+    }
+}
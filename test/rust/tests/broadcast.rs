@@ -0,0 +1,135 @@
+//! Tests of the encode-once `<Method>Broadcaster`, for the pre-encoded
+//! server-streaming Watch.
+
+mod common;
+
+use std::time::{Duration, Instant};
+
+use common::{resident_bytes, response};
+use rust_grpc_generator_tests::full::demo_server::{Encoded, LagPolicy, WatchBroadcaster};
+use rust_grpc_generator_tests::full::Response;
+use tokio_stream::StreamExt;
+
+fn value(message: Encoded<Response>) -> String {
+    <Response as protobuf::Parse>::parse(message.as_bytes()).unwrap().value().to_string()
+}
+
+/// Sends the values 0 to 9 through a broadcaster that queues 4, then
+/// returns what a subscriber that was not polled meanwhile receives.
+async fn lagging(policy: LagPolicy) -> Vec<Result<String, tonic::Code>> {
+    let broadcaster = WatchBroadcaster::new(4, policy);
+    let subscription = broadcaster.subscribe();
+    for i in 0..10 {
+        broadcaster.send(&response(&i.to_string())).unwrap();
+    }
+    drop(broadcaster);
+    subscription.map(|message| message.map(value).map_err(|status| status.code())).collect().await
+}
+
+#[tokio::test]
+async fn every_subscriber_gets_one_shared_encoding() {
+    let broadcaster = WatchBroadcaster::new(16, LagPolicy::Drop);
+    let mut subscriptions: Vec<_> = (0..3).map(|_| broadcaster.subscribe()).collect();
+    assert_eq!(broadcaster.subscriber_count(), 3);
+    assert_eq!(broadcaster.send(&response("event")).unwrap(), 3);
+    let mut pointers = Vec::new();
+    for subscription in &mut subscriptions {
+        let message = subscription.next().await.unwrap().unwrap();
+        pointers.push(message.as_bytes().as_ptr());
+        assert_eq!(value(message), "event");
+    }
+    assert!(pointers.iter().all(|&pointer| pointer == pointers[0]));
+    drop(subscriptions.pop());
+    assert_eq!(broadcaster.subscriber_count(), 2);
+}
+
+#[tokio::test]
+async fn a_subscription_ends_with_the_broadcaster() {
+    let broadcaster = WatchBroadcaster::new(16, LagPolicy::Drop);
+    let mut subscription = broadcaster.subscribe();
+    let waiting = tokio::spawn(async move { subscription.next().await.is_none() });
+    tokio::time::sleep(Duration::from_millis(10)).await;
+    drop(broadcaster);
+    assert!(waiting.await.unwrap());
+}
+
+#[tokio::test]
+async fn a_lagging_subscriber_skips_what_it_missed() {
+    let expected: Vec<_> = (6..10).map(|i| Ok(i.to_string())).collect();
+    assert_eq!(lagging(LagPolicy::Drop).await, expected);
+}
+
+#[tokio::test]
+async fn a_lagging_subscriber_is_disconnected() {
+    assert_eq!(lagging(LagPolicy::Disconnect).await, [Err(tonic::Code::ResourceExhausted)]);
+}
+
+#[tokio::test]
+async fn a_lagging_subscriber_skips_to_the_newest() {
+    assert_eq!(lagging(LagPolicy::Coalesce).await, [Ok("9".to_owned())]);
+}
+
+/// Fan-out: 32 messages of 1KiB to 10k local subscribers, through a
+/// broadcaster that encodes each message once, and through a channel per
+/// subscriber that each message is encoded for. Reports the time until
+/// every subscriber has every message, and how much the resident set grew
+/// while the messages were queued. Run with
+/// `cargo test --release --test broadcast -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn ten_thousand_subscribers() {
+    const SUBSCRIBERS: usize = 10_000;
+    const MESSAGES: usize = 32;
+    let message = response(&"x".repeat(1024));
+    let report = |name: &str, before: Option<usize>, queued: Option<usize>, started: Instant| {
+        let grown = match (before, queued) {
+            (Some(before), Some(queued)) => format!("{}MiB", queued.saturating_sub(before) >> 20),
+            _ => "by an unknown amount".to_owned(),
+        };
+        println!(
+            "{name}: {:.0} deliveries/s, resident set grew {grown}",
+            (SUBSCRIBERS * MESSAGES) as f64 / started.elapsed().as_secs_f64(),
+        );
+    };
+
+    let before = resident_bytes();
+    let started = Instant::now();
+    let broadcaster = WatchBroadcaster::new(MESSAGES, LagPolicy::Disconnect);
+    let subscriptions: Vec<_> = (0..SUBSCRIBERS).map(|_| broadcaster.subscribe()).collect();
+    for _ in 0..MESSAGES {
+        broadcaster.send(&message).unwrap();
+    }
+    let queued = resident_bytes();
+    drop(broadcaster);
+    let mut subscribers = tokio::task::JoinSet::new();
+    for subscription in subscriptions {
+        subscribers.spawn(async move {
+            subscription.fold(0, |received, message| received + usize::from(message.is_ok())).await
+        });
+    }
+    while let Some(received) = subscribers.join_next().await {
+        assert_eq!(received.unwrap(), MESSAGES);
+    }
+    report("broadcaster", before, queued, started);
+
+    let before = resident_bytes();
+    let started = Instant::now();
+    let (senders, receivers): (Vec<_>, Vec<_>) =
+        (0..SUBSCRIBERS).map(|_| tokio::sync::mpsc::channel(MESSAGES)).unzip();
+    for _ in 0..MESSAGES {
+        for sender in &senders {
+            sender.try_send(Encoded::new(&message).unwrap()).unwrap();
+        }
+    }
+    let queued = resident_bytes();
+    drop(senders);
+    let mut subscribers = tokio::task::JoinSet::new();
+    for receiver in receivers {
+        let messages = tokio_stream::wrappers::ReceiverStream::new(receiver);
+        subscribers.spawn(async move { messages.fold(0, |received, _| received + 1).await });
+    }
+    while let Some(received) = subscribers.join_next().await {
+        assert_eq!(received.unwrap(), MESSAGES);
+    }
+    report("encoded per subscriber", before, queued, started);
+}
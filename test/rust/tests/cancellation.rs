@@ -0,0 +1,83 @@
+//! Tests of `CallCancellation`, from the `cancellation` option.
+
+mod common;
+
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::time::Duration;
+
+use common::{connect, request, serve, TestService, SPIN};
+use rust_grpc_generator_tests::full::demo_client::{DemoClient, DemoMultiplexClient};
+use rust_grpc_generator_tests::full::demo_server::{CallCancellation, DemoServer};
+
+/// Waits until `service` has spun on a blocking thread, then returns how
+/// long it keeps spinning after `abandon` gives up on the call.
+async fn spun_after(
+    service: &TestService,
+    abandon: impl std::future::Future<Output = ()>,
+) -> usize {
+    while service.spins.load(Ordering::Relaxed) == 0 {
+        tokio::time::sleep(Duration::from_millis(1)).await;
+    }
+    abandon.await;
+    let at_cancel = service.spins.load(Ordering::Relaxed);
+    // The spinning thread notices the cancellation within a millisecond or
+    // so, and then stops counting.
+    tokio::time::sleep(Duration::from_millis(100)).await;
+    let settled = service.spins.load(Ordering::Relaxed);
+    tokio::time::sleep(Duration::from_millis(100)).await;
+    assert_eq!(service.spins.load(Ordering::Relaxed), settled, "still spinning");
+    settled - at_cancel
+}
+
+#[tokio::test]
+async fn dropping_a_call_stops_the_work_it_started() {
+    let service = Arc::new(TestService::default());
+    let addr = serve(DemoServer::from_arc(Arc::clone(&service))).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    let call = tokio::spawn(async move { client.get(request(SPIN)).await });
+    let wasted = spun_after(&service, async {
+        call.abort();
+        let _ = call.await;
+    })
+    .await;
+    assert!(wasted < 50, "spun {wasted}ms after the call was dropped");
+}
+
+#[tokio::test]
+async fn an_expired_deadline_stops_the_work_it_started() {
+    let service = Arc::new(TestService::default());
+    let addr = serve(DemoServer::from_arc(Arc::clone(&service))).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    let mut call = tonic::Request::new(request(SPIN));
+    call.set_timeout(Duration::from_millis(100));
+    let call = tokio::spawn(async move { client.get(call).await });
+    let wasted = spun_after(&service, async {
+        assert!(call.await.unwrap().is_err());
+    })
+    .await;
+    assert!(wasted < 50, "spun {wasted}ms after the deadline");
+}
+
+#[tokio::test]
+async fn dropping_a_multiplex_client_stops_the_work_of_its_calls() {
+    let service = Arc::new(TestService::default());
+    let addr = serve(DemoServer::from_arc(Arc::clone(&service))).await;
+    let client = DemoMultiplexClient::connect(DemoClient::new(connect(addr).await)).await.unwrap();
+    let call = tokio::spawn({
+        let client = client.clone();
+        async move { client.get(request(SPIN)).await }
+    });
+    let wasted = spun_after(&service, async {
+        call.abort();
+        let _ = call.await;
+        drop(client);
+    })
+    .await;
+    assert!(wasted < 50, "spun {wasted}ms after the client was dropped");
+}
+
+#[test]
+fn requests_from_elsewhere_are_never_cancelled() {
+    assert!(!CallCancellation::of(&tonic::Request::new(())).is_cancelled());
+}
@@ -0,0 +1,74 @@
+//! Tests of coalesced calls, from the `coalescing` option.
+
+mod common;
+
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::time::Duration;
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::DemoClient;
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+use rust_grpc_generator_tests::full::Request;
+use tonic::transport::Channel;
+
+async fn client(service: &Arc<TestService>) -> DemoClient<Channel> {
+    let channel = connect(serve(DemoServer::from_arc(Arc::clone(service))).await).await;
+    DemoClient::new(channel).with_coalescing()
+}
+
+/// A request for `key` with `user` as its credentials.
+fn request_as(key: &str, user: &'static str) -> tonic::Request<Request> {
+    let mut request = tonic::Request::new(request(key));
+    request.metadata_mut().insert("authorization", user.parse().unwrap());
+    request
+}
+
+#[tokio::test]
+async fn identical_concurrent_calls_share_one_call() {
+    let service = Arc::new(TestService::with_delay(Duration::from_millis(50)));
+    let client = client(&service).await;
+    let mut calls = tokio::task::JoinSet::new();
+    for _ in 0..10 {
+        let mut client = client.clone();
+        calls.spawn(async move { client.get(request_as("key", "alice")).await });
+    }
+    while let Some(call) = calls.join_next().await {
+        assert_eq!(call.unwrap().unwrap().get_ref().value().to_string(), "key");
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), 1);
+}
+
+#[tokio::test]
+async fn calls_with_other_metadata_are_not_shared() {
+    let service = Arc::new(TestService::with_delay(Duration::from_millis(50)));
+    let client = client(&service).await;
+    let (mut alice, mut bob) = (client.clone(), client.clone());
+    let (first, second) = tokio::join!(
+        alice.get(request_as("key", "alice")),
+        bob.get(request_as("key", "bob")),
+    );
+    first.unwrap();
+    second.unwrap();
+    assert_eq!(service.gets.load(Ordering::Relaxed), 2);
+}
+
+#[tokio::test]
+async fn a_cancelled_leader_is_replaced_by_one_follower() {
+    let service = Arc::new(TestService::with_delay(Duration::from_millis(50)));
+    let client = client(&service).await;
+    let mut leader = client.clone();
+    let leader = tokio::spawn(async move { leader.get(request_as("key", "alice")).await });
+    tokio::time::sleep(Duration::from_millis(10)).await;
+    let mut followers = tokio::task::JoinSet::new();
+    for _ in 0..10 {
+        let mut client = client.clone();
+        followers.spawn(async move { client.get(request_as("key", "alice")).await });
+    }
+    tokio::time::sleep(Duration::from_millis(10)).await;
+    leader.abort();
+    while let Some(follower) = followers.join_next().await {
+        follower.unwrap().unwrap();
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), 2);
+}
@@ -0,0 +1,110 @@
+//! Tests of CoDel load shedding, from the `codel` option.
+
+mod common;
+
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::DemoClient;
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+use rust_grpc_generator_tests::full::BatchRequest;
+use tonic::transport::Channel;
+
+fn batch() -> BatchRequest {
+    let mut batch = BatchRequest::new();
+    batch.requests_mut().push(request("key"));
+    batch
+}
+
+/// The latencies of the calls that succeeded, and the number shed.
+type Outcome = (Vec<Duration>, usize);
+
+/// Keeps BatchGet, which runs 4 calls and queues 16, full with 20 callers
+/// for `run_for`. A shed caller backs off for `backoff`.
+async fn overload(client: &DemoClient<Channel>, run_for: Duration, backoff: Duration) -> Outcome {
+    let started = Instant::now();
+    let mut callers = tokio::task::JoinSet::new();
+    for _ in 0..20 {
+        let mut client = client.clone();
+        callers.spawn(async move {
+            let (mut latencies, mut shed) = (Vec::new(), 0);
+            while started.elapsed() < run_for {
+                let call = Instant::now();
+                match client.batch_get(batch()).await {
+                    Ok(_) => latencies.push(call.elapsed()),
+                    Err(status) => {
+                        assert_eq!(status.code(), tonic::Code::ResourceExhausted);
+                        shed += 1;
+                        tokio::time::sleep(backoff).await;
+                    }
+                }
+            }
+            (latencies, shed)
+        });
+    }
+    let (mut latencies, mut shed) = (Vec::new(), 0);
+    while let Some(caller) = callers.join_next().await {
+        let (caller_latencies, caller_shed) = caller.unwrap();
+        latencies.extend(caller_latencies);
+        shed += caller_shed;
+    }
+    (latencies, shed)
+}
+
+async fn client(target: Duration) -> DemoClient<Channel> {
+    let service = TestService::with_delay(Duration::from_millis(20));
+    let server = DemoServer::new(service).with_codel(target, Duration::from_millis(50));
+    DemoClient::new(connect(serve(server).await).await)
+}
+
+#[tokio::test(flavor = "multi_thread")]
+async fn sheds_a_standing_queue_and_recovers() {
+    let client = client(Duration::from_millis(5)).await;
+    // Twenty callers never exceed the admission limits, so only CoDel
+    // sheds. Queued calls wait up to 80ms for one of 4 running slots.
+    let (_, shed) = overload(&client, Duration::from_secs(1), Duration::from_millis(20)).await;
+    assert!(shed > 0);
+    tokio::time::sleep(Duration::from_millis(200)).await;
+    let mut succeeded = 0;
+    for _ in 0..50 {
+        match client.clone().batch_get(batch()).await {
+            Ok(_) => succeeded += 1,
+            Err(_) => succeeded = 0,
+        }
+        if succeeded == 5 {
+            return;
+        }
+    }
+    panic!("still shedding without load");
+}
+
+#[tokio::test(flavor = "multi_thread")]
+async fn a_short_wait_sheds_nothing() {
+    let client = client(Duration::from_secs(10)).await;
+    let (latencies, shed) =
+        overload(&client, Duration::from_millis(500), Duration::from_millis(20)).await;
+    assert_eq!(shed, 0);
+    assert!(!latencies.is_empty());
+}
+
+/// Overload test: the p99 latency of the calls served under a standing
+/// queue, without shedding and with CoDel's 5ms target. Run with
+/// `cargo test --release --test codel -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn p99_under_overload() {
+    let mut p99s = Vec::new();
+    for target in [Duration::from_secs(10), Duration::from_millis(5)] {
+        let client = client(target).await;
+        let (mut latencies, shed) =
+            overload(&client, Duration::from_secs(5), Duration::from_millis(20)).await;
+        let p99 = common::quantile(&mut latencies, 0.99);
+        println!(
+            "target {target:?}: {} served, {shed} shed, p50 {:?}, p99 {p99:?}",
+            latencies.len(),
+            common::quantile(&mut latencies, 0.5),
+        );
+        p99s.push(p99);
+    }
+    assert!(p99s[1] < p99s[0], "CoDel did not cut the p99: {p99s:?}");
+}
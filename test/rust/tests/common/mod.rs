@@ -0,0 +1,306 @@
+//! A server for the tests, generated with every option, and helpers to
+//! start it and connect to it.
+
+#![allow(dead_code)]
+
+use std::net::SocketAddr;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+use rust_grpc_generator_tests::full::demo_server::{
+    propagate_deadline, watch_channel, CallCancellation, DecodePipeline, Demo, DemoServer, Encoded,
+    Pooled, StreamReceiver,
+};
+use rust_grpc_generator_tests::full::{BatchRequest, BatchResponse, Request, Response};
+use tonic::transport::{Channel, Endpoint};
+
+/// Answers every request with its key, counting the calls of each method.
+/// `get` fails at once with `UNAVAILABLE` when the key is [`FAIL`], and
+/// busies a blocking thread until the call is cancelled when it is [`SPIN`].
+/// Other `get` calls wait for one of the [`Capacity`] slots, if set.
+/// `batch_get` answers [`AFFINITY`] and [`BLOCKING_AFFINITY`] with the cores
+/// that threads may run on.
+#[derive(Debug, Default)]
+pub struct TestService {
+    pub gets: AtomicUsize,
+    pub puts: AtomicUsize,
+    pub batch_gets: AtomicUsize,
+    pub watches: AtomicUsize,
+    /// Upload handlers that have started and not yet returned or been
+    /// dropped.
+    pub uploads_running: Arc<AtomicUsize>,
+    /// Milliseconds that blocking threads spent on [`SPIN`] calls.
+    pub spins: Arc<AtomicUsize>,
+    /// The `grpc-timeout` that the last `put` passed on to an outbound
+    /// request with `propagate_deadline`, if any.
+    pub propagated_timeout: Mutex<Option<String>>,
+    /// How long `get` and `batch_get` wait before they answer.
+    pub delay: Duration,
+    /// How long `batch_get` keeps its thread busy before it waits.
+    pub burn: Duration,
+    /// Whether `get` takes its request out of the pool, as a handler that
+    /// keeps it would, so that every call decodes into a new message.
+    pub unpooled_requests: bool,
+    pub capacity: Option<Arc<Capacity>>,
+    pub put_response: PutResponse,
+}
+
+/// What `put` answers with.
+#[derive(Debug, Default)]
+pub enum PutResponse {
+    /// The key of the request.
+    #[default]
+    Key,
+    /// A message that it encodes for every call.
+    EncodeEachCall(Response),
+    /// A message encoded once.
+    EncodedOnce(Encoded<Response>),
+}
+
+impl TestService {
+    pub fn with_delay(delay: Duration) -> Self {
+        Self { delay, ..Default::default() }
+    }
+}
+
+/// A number of calls that a backend serves at once, which can change. Calls
+/// over it queue.
+#[derive(Debug)]
+pub struct Capacity {
+    slots: Arc<tokio::sync::Semaphore>,
+    capacity: Mutex<usize>,
+}
+
+impl Capacity {
+    pub fn new(capacity: usize) -> Self {
+        let slots = Arc::new(tokio::sync::Semaphore::new(capacity));
+        Self { slots, capacity: Mutex::new(capacity) }
+    }
+
+    /// Waits until `capacity` calls run at once at most.
+    pub async fn set(&self, capacity: usize) {
+        let old = std::mem::replace(&mut *self.capacity.lock().unwrap(), capacity);
+        if capacity > old {
+            self.slots.add_permits(capacity - old);
+        } else {
+            self.slots.acquire_many((old - capacity) as u32).await.unwrap().forget();
+        }
+    }
+}
+
+/// The key `get` fails for.
+pub const FAIL: &str = "fail";
+
+/// The key `get` works on until its call is cancelled.
+pub const SPIN: &str = "spin";
+
+/// The key `batch_get` answers with the cores its thread may run on.
+pub const AFFINITY: &str = "affinity";
+
+/// The key `batch_get` answers with the cores that a blocking thread it
+/// starts may run on.
+pub const BLOCKING_AFFINITY: &str = "blocking-affinity";
+
+/// Counts a handler as running until it is dropped.
+struct Running(Arc<AtomicUsize>);
+
+impl Running {
+    fn start(running: &Arc<AtomicUsize>) -> Self {
+        running.fetch_add(1, Ordering::Relaxed);
+        Self(Arc::clone(running))
+    }
+}
+
+impl Drop for Running {
+    fn drop(&mut self) {
+        self.0.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+pub fn response(value: &str) -> Response {
+    let mut response = Response::new();
+    response.set_value(value);
+    response
+}
+
+pub fn request(key: &str) -> Request {
+    let mut request = Request::new();
+    request.set_key(key);
+    request
+}
+
+#[tonic::async_trait]
+impl Demo for TestService {
+    async fn get(
+        &self,
+        request: tonic::Request<Pooled<Request>>,
+    ) -> Result<tonic::Response<Response>, tonic::Status> {
+        self.gets.fetch_add(1, Ordering::Relaxed);
+        if request.get_ref().key().to_string() == FAIL {
+            return Err(tonic::Status::unavailable(FAIL));
+        }
+        if request.get_ref().key().to_string() == SPIN {
+            let cancellation = CallCancellation::of(&request);
+            let spins = Arc::clone(&self.spins);
+            let worker = cancellation.clone();
+            tokio::task::spawn_blocking(move || {
+                while !worker.is_cancelled() {
+                    std::thread::sleep(Duration::from_millis(1));
+                    spins.fetch_add(1, Ordering::Relaxed);
+                }
+            });
+            cancellation.cancelled().await;
+            return Err(tonic::Status::cancelled(SPIN));
+        }
+        let _slot = match &self.capacity {
+            Some(capacity) => Some(capacity.slots.acquire().await.unwrap()),
+            None => None,
+        };
+        tokio::time::sleep(self.delay).await;
+        let key = request.get_ref().key().to_string();
+        if self.unpooled_requests {
+            drop(request.into_inner().into_inner());
+        }
+        Ok(tonic::Response::new(response(&key)))
+    }
+
+    async fn put(
+        &self,
+        request: tonic::Request<Pooled<Request>>,
+    ) -> Result<tonic::Response<Encoded<Response>>, tonic::Status> {
+        self.puts.fetch_add(1, Ordering::Relaxed);
+        let mut outbound = tonic::Request::new(());
+        propagate_deadline(&request, &mut outbound);
+        *self.propagated_timeout.lock().unwrap() = outbound
+            .metadata()
+            .get("grpc-timeout")
+            .map(|timeout| timeout.to_str().unwrap().to_owned());
+        let response = match &self.put_response {
+            PutResponse::Key => Encoded::new(&response(&request.get_ref().key().to_string()))?,
+            PutResponse::EncodeEachCall(response) => Encoded::new(response)?,
+            PutResponse::EncodedOnce(response) => response.clone(),
+        };
+        Ok(tonic::Response::new(response))
+    }
+
+    async fn batch_get(
+        &self,
+        request: tonic::Request<BatchRequest>,
+    ) -> Result<tonic::Response<BatchResponse>, tonic::Status> {
+        self.batch_gets.fetch_add(1, Ordering::Relaxed);
+        let started = std::time::Instant::now();
+        while started.elapsed() < self.burn {
+            std::hint::spin_loop();
+        }
+        tokio::time::sleep(self.delay).await;
+        let mut batch = BatchResponse::new();
+        for request in request.get_ref().requests() {
+            let value = match request.key().to_string().as_str() {
+                AFFINITY => thread_affinity(),
+                BLOCKING_AFFINITY => tokio::task::spawn_blocking(thread_affinity).await.unwrap(),
+                key => key.to_owned(),
+            };
+            batch.responses_mut().push(response(&value));
+        }
+        Ok(tonic::Response::new(batch))
+    }
+
+    type WatchStream = StreamReceiver<Result<Encoded<Response>, tonic::Status>>;
+
+    /// Sends the key every 10ms until the call is dropped.
+    async fn watch(
+        &self,
+        request: tonic::Request<Request>,
+    ) -> Result<tonic::Response<Self::WatchStream>, tonic::Status> {
+        self.watches.fetch_add(1, Ordering::Relaxed);
+        let (sender, receiver) = watch_channel();
+        let value = Encoded::new(&response(&request.get_ref().key().to_string()))?;
+        tokio::spawn(async move {
+            while sender.send(Ok(value.clone())).await.is_ok() {
+                tokio::time::sleep(Duration::from_millis(10)).await;
+            }
+        });
+        Ok(tonic::Response::new(receiver))
+    }
+
+    async fn upload(
+        &self,
+        request: tonic::Request<DecodePipeline<Request>>,
+    ) -> Result<tonic::Response<Response>, tonic::Status> {
+        let _running = Running::start(&self.uploads_running);
+        let mut requests = request.into_inner();
+        let mut count = 0;
+        while requests.message().await?.is_some() {
+            count += 1;
+        }
+        Ok(tonic::Response::new(response(&count.to_string())))
+    }
+
+    type ChatStream = tokio_stream::wrappers::ReceiverStream<Result<Response, tonic::Status>>;
+
+    #[allow(deprecated)]
+    async fn chat(
+        &self,
+        request: tonic::Request<DecodePipeline<Request>>,
+    ) -> Result<tonic::Response<Self::ChatStream>, tonic::Status> {
+        let mut requests = request.into_inner();
+        let (sender, receiver) = tokio::sync::mpsc::channel(16);
+        tokio::spawn(async move {
+            while let Ok(Some(request)) = requests.message().await {
+                let reply = Ok(response(&request.key().to_string()));
+                if sender.send(reply).await.is_err() {
+                    return;
+                }
+            }
+        });
+        Ok(tonic::Response::new(tokio_stream::wrappers::ReceiverStream::new(receiver)))
+    }
+}
+
+/// Serves `server` on a free loopback port until the test ends.
+pub async fn serve<T: Demo>(server: DemoServer<T>) -> SocketAddr {
+    let listener = tokio::net::TcpListener::bind("127.0.0.1:0").await.unwrap();
+    let addr = listener.local_addr().unwrap();
+    tokio::spawn(
+        tonic::transport::Server::builder()
+            .add_service(server)
+            .serve_with_incoming(tokio_stream::wrappers::TcpListenerStream::new(listener)),
+    );
+    addr
+}
+
+/// Opens a new connection to `addr`.
+pub async fn connect(addr: SocketAddr) -> Channel {
+    Endpoint::from_shared(format!("http://{addr}"))
+        .unwrap()
+        .connect()
+        .await
+        .unwrap()
+}
+
+/// The `q` quantile of `samples`, which it sorts.
+pub fn quantile(samples: &mut [Duration], q: f64) -> Duration {
+    samples.sort_unstable();
+    let index = ((samples.len() as f64 * q) as usize).min(samples.len() - 1);
+    samples[index]
+}
+
+/// The resident set size of the process, where `/proc` tells it.
+pub fn resident_bytes() -> Option<usize> {
+    let statm = std::fs::read_to_string("/proc/self/statm").ok()?;
+    let pages: usize = statm.split_whitespace().nth(1)?.parse().ok()?;
+    // SAFETY: sysconf has no preconditions.
+    let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) };
+    Some(pages * usize::try_from(page_size).ok()?)
+}
+
+/// The cores the calling thread may run on, as `/proc` lists them, such as
+/// `0-3,6`. Empty where `/proc` does not tell.
+pub fn thread_affinity() -> String {
+    let status = std::fs::read_to_string("/proc/thread-self/status").unwrap_or_default();
+    status
+        .lines()
+        .find_map(|line| line.strip_prefix("Cpus_allowed_list:"))
+        .map_or_else(String::new, |cores| cores.trim().to_owned())
+}
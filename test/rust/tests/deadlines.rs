@@ -0,0 +1,87 @@
+//! Tests of default timeouts, from the `timeout` method option, and of
+//! deadline propagation, from the `deadline_propagation` option.
+
+mod common;
+
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::{DemoClient, PUT_TIMEOUT, UPLOAD_TIMEOUT};
+use rust_grpc_generator_tests::full::demo_server::{deadline, propagate_deadline, DemoServer};
+
+/// Parses a `grpc-timeout` header value.
+fn parse_timeout(value: &str) -> Duration {
+    let (amount, unit) = value.split_at(value.len() - 1);
+    let amount: u64 = amount.parse().unwrap();
+    match unit {
+        "H" => Duration::from_secs(amount * 3600),
+        "M" => Duration::from_secs(amount * 60),
+        "S" => Duration::from_secs(amount),
+        "m" => Duration::from_millis(amount),
+        "u" => Duration::from_micros(amount),
+        "n" => Duration::from_nanos(amount),
+        _ => panic!("bad grpc-timeout {value}"),
+    }
+}
+
+/// The timeout the last `put` passed on to its outbound request.
+fn propagated(service: &TestService) -> Option<Duration> {
+    service.propagated_timeout.lock().unwrap().as_deref().map(parse_timeout)
+}
+
+#[test]
+fn timeouts_come_from_the_method_options() {
+    assert_eq!(PUT_TIMEOUT, Duration::from_millis(1500));
+    assert_eq!(UPLOAD_TIMEOUT, Duration::from_secs(30));
+}
+
+#[tokio::test]
+async fn calls_carry_their_default_timeout_to_outbound_requests() {
+    let service = Arc::new(TestService::default());
+    let addr = serve(DemoServer::from_arc(Arc::clone(&service))).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    client.put(request("key")).await.unwrap();
+    let left = propagated(&service).unwrap();
+    assert!(left <= PUT_TIMEOUT && left > PUT_TIMEOUT - Duration::from_millis(500), "{left:?}");
+}
+
+#[tokio::test]
+async fn a_timeout_set_by_the_caller_wins() {
+    let service = Arc::new(TestService::default());
+    let addr = serve(DemoServer::from_arc(Arc::clone(&service))).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    let mut call = tonic::Request::new(request("key"));
+    call.set_timeout(Duration::from_secs(10));
+    client.put(call).await.unwrap();
+    let left = propagated(&service).unwrap();
+    assert!(left > PUT_TIMEOUT && left <= Duration::from_secs(10), "{left:?}");
+}
+
+#[test]
+fn requests_without_a_deadline_are_left_alone() {
+    let incoming = tonic::Request::new(());
+    assert_eq!(deadline(&incoming), None);
+    let mut outbound = tonic::Request::new(());
+    propagate_deadline(&incoming, &mut outbound);
+    assert!(outbound.metadata().get("grpc-timeout").is_none());
+    outbound.set_timeout(Duration::from_secs(1));
+    propagate_deadline(&incoming, &mut outbound);
+    assert_eq!(outbound.metadata().get("grpc-timeout").unwrap(), "1000000u");
+}
+
+#[tokio::test]
+async fn an_expired_deadline_fails_the_call_promptly() {
+    let addr = serve(DemoServer::new(TestService::with_delay(Duration::from_secs(60)))).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    let mut call = tonic::Request::new(request("key"));
+    call.set_timeout(Duration::from_millis(50));
+    let started = Instant::now();
+    let status = client.get(call).await.unwrap_err();
+    // tonic's server reports an expired deadline as cancelled.
+    assert!(
+        matches!(status.code(), tonic::Code::Cancelled | tonic::Code::DeadlineExceeded),
+        "{status:?}"
+    );
+    assert!(started.elapsed() < Duration::from_secs(5));
+}
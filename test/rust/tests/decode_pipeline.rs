@@ -0,0 +1,79 @@
+//! Tests of `DecodePipeline`, from the `pipeline_depth` method option.
+
+mod common;
+
+use std::time::Instant;
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::DemoClient;
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+use rust_grpc_generator_tests::full::Request;
+
+/// A request for `key` carrying `size` bytes of payload.
+fn sized(key: &str, size: usize) -> Request {
+    let mut message = request(key);
+    message.set_payload(&*vec![7u8; size]);
+    message
+}
+
+#[tokio::test]
+async fn uploads_messages_from_1kb_to_1mb() {
+    let addr = serve(DemoServer::new(TestService::default())).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    // Upload decodes messages of 4KiB and more on the blocking pool, and the
+    // rest inline.
+    let sizes = [1 << 10, 4 << 10, 64 << 10, 1 << 20, 1 << 10, 256 << 10];
+    let requests = tokio_stream::iter(sizes.into_iter().cycle().take(30).map(|n| sized("k", n)));
+    let response = client.upload(requests).await.unwrap();
+    assert_eq!(response.get_ref().value().to_string(), "30");
+}
+
+#[tokio::test]
+async fn uploads_an_empty_stream() {
+    let addr = serve(DemoServer::new(TestService::default())).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    let response = client.upload(tokio_stream::iter(Vec::<Request>::new())).await.unwrap();
+    assert_eq!(response.get_ref().value().to_string(), "0");
+}
+
+#[tokio::test]
+#[allow(deprecated)]
+async fn answers_bidi_requests_in_order() {
+    let addr = serve(DemoServer::new(TestService::default())).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    // Small and large messages interleave, so later ones decode first.
+    let requests = tokio_stream::iter(
+        (0..200).map(|i| sized(&i.to_string(), if i % 3 == 0 { 256 << 10 } else { 16 })),
+    );
+    let mut responses = client.chat(requests).await.unwrap().into_inner();
+    for i in 0..200 {
+        let message = responses.message().await.unwrap().unwrap();
+        assert_eq!(message.value().to_string(), i.to_string());
+    }
+    assert!(responses.message().await.unwrap().is_none());
+}
+
+/// Load test: uploads 256MiB in messages of 1KiB to 1MiB, decoded while the
+/// handler takes the previous ones. Run with
+/// `cargo test --release --test decode_pipeline -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn upload_throughput_by_message_size() {
+    const TOTAL: usize = 256 << 20;
+    let addr = serve(DemoServer::new(TestService::default())).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    for size in [1 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20] {
+        let messages = TOTAL / size;
+        let requests = tokio_stream::iter(std::iter::repeat(sized("k", size)).take(messages));
+        let started = Instant::now();
+        let response = client.upload(requests).await.unwrap();
+        let elapsed = started.elapsed().as_secs_f64();
+        assert_eq!(response.get_ref().value().to_string(), messages.to_string());
+        println!(
+            "{:>5}KiB messages: {:.0} messages/s, {:.0}MiB/s",
+            size >> 10,
+            messages as f64 / elapsed,
+            (TOTAL >> 20) as f64 / elapsed,
+        );
+    }
+}
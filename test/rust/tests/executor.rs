@@ -0,0 +1,166 @@
+//! Tests of the `executor` method option. BatchGet runs on the `cpu` pool,
+//! Upload on the blocking pool.
+
+mod common;
+
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::DemoClient;
+use rust_grpc_generator_tests::full::demo_server::{DemoServer, ExecutorPool, ExecutorPoolConfig};
+use rust_grpc_generator_tests::full::BatchRequest;
+use tokio_stream::StreamExt;
+use tonic::transport::Channel;
+
+/// A batch of a request for each of `keys`.
+fn batch(keys: &[&str]) -> BatchRequest {
+    let mut batch = BatchRequest::new();
+    for key in keys {
+        batch.requests_mut().push(request(key));
+    }
+    batch
+}
+
+/// A client of a server that runs the `cpu` methods on `pool`, if any.
+async fn client(service: TestService, pool: Option<ExecutorPool>) -> DemoClient<Channel> {
+    let server = DemoServer::new(service);
+    let server = match pool {
+        Some(pool) => server.with_executor_pool("cpu", pool),
+        None => server,
+    };
+    DemoClient::new(connect(serve(server).await).await)
+}
+
+#[cfg(target_os = "linux")]
+#[test]
+fn cores_beyond_cpu_setsize_are_rejected() {
+    let config = ExecutorPoolConfig { cores: vec![1 << 20], ..Default::default() };
+    let error = ExecutorPool::new("cpu", config).unwrap_err();
+    assert_eq!(error.kind(), std::io::ErrorKind::InvalidInput);
+}
+
+#[cfg(target_os = "linux")]
+#[tokio::test]
+async fn workers_are_pinned_and_blocking_threads_are_not() {
+    let unpinned = common::thread_affinity();
+    let first_core = unpinned.split([',', '-']).next().unwrap().parse::<usize>().unwrap();
+    let config = ExecutorPoolConfig { threads: 2, cores: vec![first_core], ..Default::default() };
+    let pool = ExecutorPool::new("cpu", config).unwrap();
+    let mut client = client(TestService::default(), Some(pool)).await;
+    let keys = [common::AFFINITY, common::BLOCKING_AFFINITY];
+    for _ in 0..4 {
+        let response = client.batch_get(batch(&keys)).await.unwrap().into_inner();
+        let affinities: Vec<String> =
+            response.responses().iter().map(|response| response.value().to_string()).collect();
+        assert_eq!(affinities, [first_core.to_string(), unpinned.clone()]);
+    }
+}
+
+#[tokio::test]
+async fn calls_over_max_pending_fail() {
+    let config = ExecutorPoolConfig { threads: 1, max_pending: 2, ..Default::default() };
+    let pool = ExecutorPool::new("cpu", config).unwrap();
+    let client = client(TestService::with_delay(Duration::from_millis(100)), Some(pool)).await;
+    let mut calls = tokio::task::JoinSet::new();
+    for _ in 0..6 {
+        let mut client = client.clone();
+        calls.spawn(async move { client.batch_get(batch(&["key"])).await });
+    }
+    let mut rejected = 0;
+    while let Some(call) = calls.join_next().await {
+        if let Err(status) = call.unwrap() {
+            assert_eq!(status.code(), tonic::Code::ResourceExhausted);
+            rejected += 1;
+        }
+    }
+    assert_eq!(rejected, 4);
+}
+
+#[tokio::test]
+async fn blocking_handlers_answer() {
+    let mut client = client(TestService::default(), None).await;
+    let uploads = tokio_stream::iter(["a", "b", "c"].map(request));
+    let response = client.upload(uploads).await.unwrap();
+    assert_eq!(response.get_ref().value().to_string(), "3");
+}
+
+#[tokio::test]
+async fn dropped_blocking_calls_stop_their_handler() {
+    let service = Arc::new(TestService::default());
+    let server = DemoServer::from_arc(Arc::clone(&service));
+    let mut client = DemoClient::new(connect(serve(server).await).await);
+    // The upload never ends, so its handler waits for the next message.
+    let uploads = tokio_stream::iter([request("a")]).chain(tokio_stream::pending());
+    let call = tokio::spawn(async move { client.upload(uploads).await });
+    while service.uploads_running.load(Ordering::Relaxed) == 0 {
+        tokio::time::sleep(Duration::from_millis(1)).await;
+    }
+    call.abort();
+    let started = Instant::now();
+    while service.uploads_running.load(Ordering::Relaxed) != 0 {
+        assert!(started.elapsed() < Duration::from_secs(5), "the handler still runs");
+        tokio::time::sleep(Duration::from_millis(1)).await;
+    }
+}
+
+/// Latency test: 8 callers keep BatchGet handlers that hold their thread
+/// for 5ms busy, while one caller makes Get calls. The server runs on 2
+/// threads, with BatchGet inline and on a pool of 2 threads of its own.
+/// Run with `cargo test --release --test executor -- --ignored --nocapture`.
+#[test]
+#[ignore]
+fn get_latency_beside_cpu_heavy_handlers() {
+    const RUN_FOR: Duration = Duration::from_secs(5);
+    let runtime = tokio::runtime::Builder::new_multi_thread()
+        .worker_threads(2)
+        .enable_all()
+        .build()
+        .unwrap();
+    let callers = tokio::runtime::Runtime::new().unwrap();
+    for pooled in [false, true] {
+        let service = TestService { burn: Duration::from_millis(5), ..Default::default() };
+        let pool = pooled.then(|| {
+            let config = ExecutorPoolConfig { threads: 2, ..Default::default() };
+            ExecutorPool::new("cpu", config).unwrap()
+        });
+        let server = DemoServer::new(service);
+        let server = match pool {
+            Some(pool) => server.with_executor_pool("cpu", pool),
+            None => server,
+        };
+        let addr = runtime.block_on(serve(server));
+        callers.block_on(async {
+            let channel = connect(addr).await;
+            let started = Instant::now();
+            let mut heavy = tokio::task::JoinSet::new();
+            for _ in 0..8 {
+                let mut client = DemoClient::new(channel.clone());
+                heavy.spawn(async move {
+                    while started.elapsed() < RUN_FOR {
+                        client.batch_get(batch(&["key"])).await.unwrap();
+                    }
+                });
+            }
+            let mut client = DemoClient::new(channel);
+            let mut latencies = Vec::new();
+            while started.elapsed() < RUN_FOR {
+                let call = Instant::now();
+                client.get(request("key")).await.unwrap();
+                latencies.push(call.elapsed());
+                tokio::time::sleep(Duration::from_millis(1)).await;
+            }
+            while let Some(caller) = heavy.join_next().await {
+                caller.unwrap();
+            }
+            println!(
+                "BatchGet {}: Get p50 {:?}, p99 {:?}, max {:?}",
+                if pooled { "on a pool" } else { "inline" },
+                common::quantile(&mut latencies, 0.5),
+                common::quantile(&mut latencies, 0.99),
+                common::quantile(&mut latencies, 1.0),
+            );
+        });
+    }
+}
@@ -0,0 +1,166 @@
+//! Tests of weighted fair scheduling, from the `fair_scheduling` option.
+//! Get has priority 8, the other methods the default of 1.
+
+mod common;
+
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::{DemoClient, DemoMultiplexClient};
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+use rust_grpc_generator_tests::full::{BatchRequest, Request};
+use tonic::transport::Channel;
+
+const TENANT: &str = "x-tenant";
+
+/// A batch of one request.
+fn batch() -> BatchRequest {
+    let mut batch = BatchRequest::new();
+    batch.requests_mut().push(request("key"));
+    batch
+}
+
+/// A request for `key` from `tenant`.
+fn request_from(key: &str, tenant: &'static str) -> tonic::Request<Request> {
+    let mut request = tonic::Request::new(request(key));
+    request.metadata_mut().insert(TENANT, tenant.parse().unwrap());
+    request
+}
+
+/// A client of a server that runs `slots` handlers at once, each of which
+/// takes `delay`.
+async fn client(slots: usize, delay: Duration) -> DemoClient<Channel> {
+    let server = DemoServer::new(TestService::with_delay(delay))
+        .with_fair_scheduling(slots, Some(http::HeaderName::from_static(TENANT)));
+    DemoClient::new(connect(serve(server).await).await)
+}
+
+#[test]
+#[should_panic(expected = "fair scheduling needs at least one slot")]
+fn zero_slots_are_rejected() {
+    let _ = DemoServer::new(TestService::default()).with_fair_scheduling(0, None);
+}
+
+#[tokio::test]
+async fn an_interactive_call_overtakes_queued_bulk_calls() {
+    let client = client(1, Duration::from_millis(20)).await;
+    let mut bulk = tokio::task::JoinSet::new();
+    for _ in 0..15 {
+        let mut client = client.clone();
+        bulk.spawn(async move { client.batch_get(batch()).await });
+    }
+    tokio::time::sleep(Duration::from_millis(10)).await;
+    let started = Instant::now();
+    client.clone().get(request("key")).await.unwrap();
+    // In arrival order it would wait for the 15 bulk calls, 300ms.
+    assert!(started.elapsed() < Duration::from_millis(150), "waited {:?}", started.elapsed());
+    while let Some(call) = bulk.join_next().await {
+        call.unwrap().unwrap();
+    }
+}
+
+#[tokio::test]
+async fn a_busy_tenant_does_not_starve_another() {
+    let client = client(1, Duration::from_millis(20)).await;
+    let mut busy = tokio::task::JoinSet::new();
+    for _ in 0..15 {
+        let mut client = client.clone();
+        busy.spawn(async move { client.get(request_from("key", "busy")).await });
+    }
+    tokio::time::sleep(Duration::from_millis(10)).await;
+    let started = Instant::now();
+    client.clone().get(request_from("key", "quiet")).await.unwrap();
+    assert!(started.elapsed() < Duration::from_millis(150), "waited {:?}", started.elapsed());
+    while let Some(call) = busy.join_next().await {
+        call.unwrap().unwrap();
+    }
+}
+
+#[tokio::test]
+async fn a_stream_holds_its_slot_until_it_ends() {
+    let mut client = client(1, Duration::ZERO).await;
+    let mut watch = client.watch(request("key")).await.unwrap().into_inner();
+    assert!(watch.message().await.unwrap().is_some());
+    let mut get = client.clone();
+    let get = tokio::spawn(async move { get.get(request("key")).await });
+    tokio::time::sleep(Duration::from_millis(100)).await;
+    assert!(!get.is_finished(), "the call ran beside the stream");
+    drop(watch);
+    tokio::time::timeout(Duration::from_secs(5), get).await.unwrap().unwrap().unwrap();
+}
+
+#[tokio::test]
+async fn multiplexed_calls_wait_for_a_slot() {
+    let mut client = client(1, Duration::ZERO).await;
+    let multiplexed = DemoMultiplexClient::connect(client.clone()).await.unwrap();
+    let mut watch = client.watch(request("key")).await.unwrap().into_inner();
+    assert!(watch.message().await.unwrap().is_some());
+    let get = tokio::spawn(async move { multiplexed.get(request("key")).await });
+    tokio::time::sleep(Duration::from_millis(100)).await;
+    assert!(!get.is_finished(), "the multiplexed call ran beside the stream");
+    drop(watch);
+    tokio::time::timeout(Duration::from_secs(5), get).await.unwrap().unwrap().unwrap();
+}
+
+/// Mixed traffic: 12 bulk callers keep 2 slots busy with 10ms BatchGet
+/// calls while 4 interactive callers make 10ms calls, first as BatchGet,
+/// which competes equally with the bulk traffic, then as Get, which
+/// weighs 8 times as much. Run with
+/// `cargo test --release --test fair_scheduling -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn mixed_interactive_and_bulk_traffic() {
+    const RUN_FOR: Duration = Duration::from_secs(5);
+    let client = client(2, Duration::from_millis(10)).await;
+    let mut p99s = Vec::new();
+    for weighted in [false, true] {
+        let started = Instant::now();
+        let mut bulk = tokio::task::JoinSet::new();
+        for _ in 0..12 {
+            let mut client = client.clone();
+            bulk.spawn(async move {
+                let mut served = 0;
+                while started.elapsed() < RUN_FOR {
+                    client.batch_get(batch()).await.unwrap();
+                    served += 1;
+                }
+                served
+            });
+        }
+        let mut interactive = tokio::task::JoinSet::new();
+        for _ in 0..4 {
+            let mut client = client.clone();
+            interactive.spawn(async move {
+                let mut latencies = Vec::new();
+                while started.elapsed() < RUN_FOR {
+                    let call = Instant::now();
+                    if weighted {
+                        client.get(request("key")).await.map(drop).unwrap();
+                    } else {
+                        client.batch_get(batch()).await.map(drop).unwrap();
+                    }
+                    latencies.push(call.elapsed());
+                }
+                latencies
+            });
+        }
+        let mut latencies = Vec::new();
+        while let Some(caller) = interactive.join_next().await {
+            latencies.extend(caller.unwrap());
+        }
+        let mut bulk_served = 0;
+        while let Some(caller) = bulk.join_next().await {
+            bulk_served += caller.unwrap();
+        }
+        let p99 = common::quantile(&mut latencies, 0.99);
+        println!(
+            "interactive {}: {} served, p50 {:?}, p99 {p99:?}; bulk {:.0} calls/s",
+            if weighted { "as Get (weight 8)" } else { "as BatchGet (weight 1)" },
+            latencies.len(),
+            common::quantile(&mut latencies, 0.5),
+            bulk_served as f64 / started.elapsed().as_secs_f64(),
+        );
+        p99s.push(p99);
+    }
+    assert!(p99s[1] < p99s[0], "weighting did not cut the interactive p99: {p99s:?}");
+}
@@ -0,0 +1,45 @@
+//! Tests of hedged calls, from the `hedging` option.
+
+mod common;
+
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::time::Duration;
+
+use common::{connect, request, serve, TestService, FAIL};
+use rust_grpc_generator_tests::full::demo_client::{DemoClient, HedgingPolicy};
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+
+#[tokio::test]
+async fn slow_calls_are_hedged() {
+    let service = Arc::new(TestService::with_delay(Duration::from_millis(50)));
+    let channel = connect(serve(DemoServer::from_arc(Arc::clone(&service))).await).await;
+    let client = DemoClient::new(channel).with_hedging(HedgingPolicy {
+        max_delay: Duration::from_millis(5),
+        ..Default::default()
+    });
+    client.get(request("key")).await.unwrap();
+    assert_eq!(service.gets.load(Ordering::Relaxed), 2);
+}
+
+#[tokio::test]
+async fn failures_do_not_shorten_the_hedging_delay() {
+    let service = Arc::new(TestService::with_delay(Duration::from_millis(20)));
+    let channel = connect(serve(DemoServer::from_arc(Arc::clone(&service))).await).await;
+    let client = DemoClient::new(channel).with_hedging(HedgingPolicy {
+        percentile: 0.5,
+        min_delay: Duration::from_millis(1),
+        max_delay: Duration::from_millis(200),
+    });
+
+    // Enough fast failures to fill the latency window several times over. Had
+    // they been recorded, every later call would be hedged after 1ms.
+    const FAILURES: usize = 512;
+    for _ in 0..FAILURES {
+        client.get(request(FAIL)).await.unwrap_err();
+    }
+    for _ in 0..10 {
+        client.get(request("key")).await.unwrap();
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), FAILURES + 10);
+}
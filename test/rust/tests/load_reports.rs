@@ -0,0 +1,48 @@
+//! Tests of the ORCA load reports, from the `load_reports` option.
+
+mod common;
+
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::{DemoPoolClient, LoadReport, PoolPolicy};
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+
+#[test]
+fn score_ranks_backends_that_do_not_report_cpu() {
+    let idle = LoadReport::default();
+    let queued = LoadReport { queue_depth: 10.0, ..Default::default() };
+    let busy = LoadReport { queue_depth: 10.0, cpu_utilization: 0.9, ..Default::default() };
+    assert!(idle.score() > 0.0);
+    assert!(idle.score() < queued.score());
+    assert!(queued.score() < busy.score());
+}
+
+#[test]
+fn report_round_trips() {
+    let report = LoadReport { cpu_utilization: 0.5, queue_depth: 3.0, in_flight: 2.0 };
+    assert_eq!(LoadReport::decode(&report.encode()), Some(report));
+}
+
+#[tokio::test]
+async fn power_of_two_choices_avoids_loaded_streaming_backends() {
+    let services = [Arc::new(TestService::default()), Arc::new(TestService::default())];
+    let queue_depths = [10.0, 0.0];
+    let mut channels = Vec::new();
+    for (service, queue_depth) in services.iter().zip(queue_depths) {
+        let server = DemoServer::from_arc(Arc::clone(service))
+            .with_load_reporter(move || LoadReport { queue_depth, ..Default::default() });
+        channels.push(connect(serve(server).await).await);
+    }
+    let pool = DemoPoolClient::new(channels).with_policy(PoolPolicy::PowerOfTwoChoices);
+
+    // Only streaming calls are made, so the pool learns the load from their
+    // response headers.
+    for _ in 0..20 {
+        let mut watch = pool.watch(request("key")).await.unwrap().into_inner();
+        assert!(watch.message().await.unwrap().is_some());
+    }
+    assert!(services[0].watches.load(Ordering::Relaxed) <= 1);
+    assert!(services[1].watches.load(Ordering::Relaxed) >= 19);
+}
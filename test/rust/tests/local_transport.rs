@@ -0,0 +1,165 @@
+//! Tests of `serve_unix` and `connect_unix`, from the `local_transport`
+//! option.
+
+#![cfg(unix)]
+
+mod common;
+
+use std::path::PathBuf;
+use std::time::{Duration, Instant};
+
+use common::{request, TestService};
+use rust_grpc_generator_tests::full::demo_client::DemoClient;
+use rust_grpc_generator_tests::full::demo_server::{serve_unix, DemoServer};
+use tonic::transport::Channel;
+
+/// A socket path of its own for each test.
+fn socket_path(name: &str) -> PathBuf {
+    let path = std::env::temp_dir().join(format!("demo-{}-{name}.sock", std::process::id()));
+    let _ = std::fs::remove_file(&path);
+    path
+}
+
+/// Serves a default service at `path` and connects to it.
+async fn serve_and_connect(path: &PathBuf) -> DemoClient<Channel> {
+    tokio::spawn(serve_unix(path.clone(), DemoServer::new(TestService::default())));
+    loop {
+        match DemoClient::connect_unix(path).await {
+            Ok(client) => return client,
+            Err(_) => tokio::time::sleep(Duration::from_millis(5)).await,
+        }
+    }
+}
+
+#[tokio::test]
+async fn serves_unary_and_streaming_calls() {
+    let path = socket_path("calls");
+    let mut client = serve_and_connect(&path).await;
+    let response = client.get(request("key")).await.unwrap();
+    assert_eq!(response.get_ref().value().to_string(), "key");
+    let mut watch = client.watch(request("key")).await.unwrap().into_inner();
+    assert_eq!(watch.message().await.unwrap().unwrap().value().to_string(), "key");
+    let requests = tokio_stream::iter(std::iter::repeat(request("key")).take(10));
+    assert_eq!(client.upload(requests).await.unwrap().get_ref().value().to_string(), "10");
+    let _ = std::fs::remove_file(path);
+}
+
+#[tokio::test]
+async fn an_existing_path_is_an_error() {
+    let path = socket_path("taken");
+    std::fs::write(&path, b"").unwrap();
+    assert!(serve_unix(&path, DemoServer::new(TestService::default())).await.is_err());
+    let _ = std::fs::remove_file(path);
+}
+
+#[tokio::test]
+async fn connecting_to_a_missing_socket_is_an_error() {
+    assert!(DemoClient::connect_unix(socket_path("missing")).await.is_err());
+}
+
+/// Where `benchmark_server` listens, when the benchmark starts it.
+const SERVE_UNIX: &str = "DEMO_BENCHMARK_SERVE_UNIX";
+const SERVE_TCP: &str = "DEMO_BENCHMARK_SERVE_TCP";
+
+/// The server process of `unix_socket_versus_loopback_tcp`. Does nothing
+/// when run on its own.
+#[tokio::test]
+#[ignore]
+async fn benchmark_server() {
+    let server = DemoServer::new(TestService::default());
+    if let Ok(path) = std::env::var(SERVE_UNIX) {
+        serve_unix(path, server).await.unwrap();
+    } else if let Ok(addr) = std::env::var(SERVE_TCP) {
+        tonic::transport::Server::builder()
+            .add_service(server)
+            .serve(addr.parse().unwrap())
+            .await
+            .unwrap();
+    }
+}
+
+/// Kills the server process when the benchmark is done with it.
+struct ServerProcess(std::process::Child);
+
+impl Drop for ServerProcess {
+    fn drop(&mut self) {
+        let _ = self.0.kill();
+        let _ = self.0.wait();
+    }
+}
+
+/// Load test: calls a server in another process over a Unix domain socket,
+/// then over loopback TCP, with small and 1MiB messages. Run with
+/// `cargo test --release --test local_transport -- --ignored --nocapture unix_socket`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn unix_socket_versus_loopback_tcp() {
+    const CALLERS: usize = 16;
+    for payload in [0, 1 << 20] {
+        let calls_per_caller = if payload == 0 { 2000 } else { 50 };
+        for unix in [true, false] {
+            let path = socket_path("benchmark");
+            let addr = std::net::TcpListener::bind("127.0.0.1:0").unwrap().local_addr().unwrap();
+            let (variable, value) = if unix {
+                (SERVE_UNIX, path.display().to_string())
+            } else {
+                (SERVE_TCP, addr.to_string())
+            };
+            let _server = ServerProcess(
+                std::process::Command::new(std::env::current_exe().unwrap())
+                    .args(["--ignored", "--exact", "benchmark_server"])
+                    .env(variable, value)
+                    .stdout(std::process::Stdio::null())
+                    .spawn()
+                    .unwrap(),
+            );
+            let client = loop {
+                let client = if unix {
+                    DemoClient::connect_unix(&path).await.ok()
+                } else {
+                    tonic::transport::Endpoint::from_shared(format!("http://{addr}"))
+                        .unwrap()
+                        .connect()
+                        .await
+                        .ok()
+                        .map(DemoClient::new)
+                };
+                match client {
+                    Some(client) => break client,
+                    None => tokio::time::sleep(Duration::from_millis(10)).await,
+                }
+            };
+            let mut message = request("key");
+            message.set_payload(&*vec![7u8; payload]);
+            let started = Instant::now();
+            let mut callers = tokio::task::JoinSet::new();
+            for _ in 0..CALLERS {
+                let (mut client, message) = (client.clone(), message.clone());
+                callers.spawn(async move {
+                    let mut latencies = Vec::with_capacity(calls_per_caller);
+                    for _ in 0..calls_per_caller {
+                        let call = Instant::now();
+                        client.put(message.clone()).await.unwrap();
+                        latencies.push(call.elapsed());
+                    }
+                    latencies
+                });
+            }
+            let mut latencies: Vec<Duration> = Vec::new();
+            while let Some(caller) = callers.join_next().await {
+                latencies.extend(caller.unwrap());
+            }
+            let elapsed = started.elapsed().as_secs_f64();
+            println!(
+                "{} with {}KiB payloads: {:.0} calls/s, {:.0}MiB/s, p50 {:?}, p99 {:?}",
+                if unix { "Unix socket" } else { "loopback TCP" },
+                payload >> 10,
+                latencies.len() as f64 / elapsed,
+                (latencies.len() * payload) as f64 / elapsed / (1 << 20) as f64,
+                common::quantile(&mut latencies, 0.5),
+                common::quantile(&mut latencies, 0.99),
+            );
+            let _ = std::fs::remove_file(path);
+        }
+    }
+}
@@ -0,0 +1,138 @@
+//! Tests of server-side memoization, from the `memoization` option. Get
+//! has no side effects and a `cache_ttl` of 2.5s.
+
+mod common;
+
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::DemoClient;
+use rust_grpc_generator_tests::full::demo_server::{DemoServer, ResponseCacheConfig};
+use rust_grpc_generator_tests::full::Request;
+use tonic::transport::Channel;
+
+/// A client of a server that memoizes calls, keyed by `key_headers`.
+async fn client(service: &Arc<TestService>, key_headers: &[&'static str]) -> DemoClient<Channel> {
+    let key_headers = key_headers.iter().map(|&name| http::HeaderName::from_static(name)).collect();
+    let server = DemoServer::from_arc(Arc::clone(service))
+        .with_memoization(ResponseCacheConfig::default(), key_headers);
+    DemoClient::new(connect(serve(server).await).await)
+}
+
+/// A request for `key` with `user` as its credentials.
+fn request_as(key: &str, user: &'static str) -> tonic::Request<Request> {
+    let mut request = tonic::Request::new(request(key));
+    request.metadata_mut().insert("authorization", user.parse().unwrap());
+    request
+}
+
+#[tokio::test]
+async fn identical_concurrent_calls_run_the_handler_once() {
+    let service = Arc::new(TestService::with_delay(Duration::from_millis(50)));
+    let client = client(&service, &[]).await;
+    let mut calls = tokio::task::JoinSet::new();
+    for _ in 0..10 {
+        let mut client = client.clone();
+        calls.spawn(async move { client.get(request("key")).await });
+    }
+    while let Some(call) = calls.join_next().await {
+        assert_eq!(call.unwrap().unwrap().get_ref().value().to_string(), "key");
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), 1);
+}
+
+#[tokio::test]
+async fn later_calls_are_answered_from_the_memo() {
+    let service = Arc::new(TestService::default());
+    let mut client = client(&service, &[]).await;
+    for _ in 0..5 {
+        client.get(request("key")).await.unwrap();
+    }
+    client.get(request("other")).await.unwrap();
+    assert_eq!(service.gets.load(Ordering::Relaxed), 2);
+}
+
+#[tokio::test]
+async fn key_headers_keep_callers_apart() {
+    let service = Arc::new(TestService::default());
+    let mut client = client(&service, &["authorization"]).await;
+    for user in ["alice", "bob", "alice"] {
+        client.get(request_as("key", user)).await.unwrap();
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), 2);
+}
+
+#[tokio::test]
+async fn other_metadata_is_ignored() {
+    let service = Arc::new(TestService::default());
+    let mut client = client(&service, &[]).await;
+    for user in ["alice", "bob"] {
+        client.get(request_as("key", user)).await.unwrap();
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), 1);
+}
+
+#[tokio::test]
+async fn errors_are_not_memoized() {
+    let service = Arc::new(TestService::default());
+    let mut client = client(&service, &[]).await;
+    for _ in 0..2 {
+        client.get(request(common::FAIL)).await.unwrap_err();
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), 2);
+}
+
+/// Hot keys: 64 callers make 500 calls each to a Get that takes 1ms. Nine
+/// calls in ten ask for one of 8 hot keys, the rest for one of 10,000. Run
+/// with `cargo test --release --test memoization -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn hot_keys() {
+    const CALLERS: u64 = 64;
+    const CALLS_PER_CALLER: usize = 500;
+    for memoized in [false, true] {
+        let service = Arc::new(TestService::with_delay(Duration::from_millis(1)));
+        let client = if memoized {
+            client(&service, &[]).await
+        } else {
+            DemoClient::new(connect(serve(DemoServer::from_arc(Arc::clone(&service))).await).await)
+        };
+        let started = Instant::now();
+        let mut callers = tokio::task::JoinSet::new();
+        for caller in 0..CALLERS {
+            let mut client = client.clone();
+            callers.spawn(async move {
+                let mut state = caller * 2 + 1;
+                let mut latencies = Vec::with_capacity(CALLS_PER_CALLER);
+                for _ in 0..CALLS_PER_CALLER {
+                    // A 64-bit LCG, which is plenty for picking keys.
+                    state = state.wrapping_mul(6_364_136_223_846_793_005).wrapping_add(1);
+                    let random = state >> 33;
+                    let key = if random % 10 < 9 {
+                        format!("hot-{}", (random >> 8) % 8)
+                    } else {
+                        format!("cold-{}", (random >> 8) % 10_000)
+                    };
+                    let call = Instant::now();
+                    client.get(request(&key)).await.unwrap();
+                    latencies.push(call.elapsed());
+                }
+                latencies
+            });
+        }
+        let mut latencies: Vec<Duration> = Vec::new();
+        while let Some(caller) = callers.join_next().await {
+            latencies.extend(caller.unwrap());
+        }
+        println!(
+            "{}: {:.0} calls/s, p50 {:?}, p99 {:?}, {} handler runs",
+            if memoized { "memoized" } else { "not memoized" },
+            latencies.len() as f64 / started.elapsed().as_secs_f64(),
+            common::quantile(&mut latencies, 0.5),
+            common::quantile(&mut latencies, 0.99),
+            service.gets.load(Ordering::Relaxed),
+        );
+    }
+}
@@ -0,0 +1,196 @@
+//! Tests of `<Service>MultiplexClient`, from the `unary_multiplexing` option.
+//! Put has a `timeout` of 1.5s, and BatchGet runs on the `cpu` pool.
+
+mod common;
+
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService, SPIN};
+use rust_grpc_generator_tests::full::demo_client::{DemoClient, DemoMultiplexClient};
+use rust_grpc_generator_tests::full::demo_server::{
+    Demo, DemoServer, ExecutorPool, ExecutorPoolConfig, ResponseCacheConfig,
+};
+use rust_grpc_generator_tests::full::{BatchRequest, Response};
+use tokio::task::JoinHandle;
+
+async fn client<T: Demo>(server: DemoServer<T>) -> DemoMultiplexClient {
+    let channel = connect(serve(server).await).await;
+    DemoMultiplexClient::connect(DemoClient::new(channel)).await.unwrap()
+}
+
+/// Starts a Get call that runs until it is cancelled, and waits until its
+/// handler has started.
+async fn spin(
+    client: &DemoMultiplexClient,
+    service: &TestService,
+) -> JoinHandle<Result<tonic::Response<Response>, tonic::Status>> {
+    let gets = service.gets.load(Ordering::Relaxed);
+    let client = client.clone();
+    let call = tokio::spawn(async move { client.get(request(SPIN)).await });
+    while service.gets.load(Ordering::Relaxed) == gets {
+        tokio::time::sleep(Duration::from_millis(1)).await;
+    }
+    call
+}
+
+#[tokio::test]
+async fn concurrent_calls_share_one_stream() {
+    let service = Arc::new(TestService::with_delay(Duration::from_millis(10)));
+    let channel = connect(serve(DemoServer::from_arc(Arc::clone(&service))).await).await;
+    let client = DemoMultiplexClient::connect(DemoClient::new(channel)).await.unwrap();
+    let mut calls = tokio::task::JoinSet::new();
+    for i in 0..20 {
+        let client = client.clone();
+        calls.spawn(async move {
+            let key = i.to_string();
+            let response = client.get(request(&key)).await.unwrap();
+            assert_eq!(response.get_ref().value().to_string(), key);
+        });
+    }
+    while let Some(call) = calls.join_next().await {
+        call.unwrap();
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), 20);
+}
+
+#[tokio::test]
+async fn the_server_bounds_the_calls_it_runs_at_once() {
+    let service = Arc::new(TestService::with_delay(Duration::from_millis(50)));
+    let server = DemoServer::from_arc(Arc::clone(&service)).with_max_multiplexed_calls(2);
+    let channel = connect(serve(server).await).await;
+    let client = DemoMultiplexClient::connect(DemoClient::new(channel)).await.unwrap();
+    let started = Instant::now();
+    let mut calls = tokio::task::JoinSet::new();
+    for _ in 0..8 {
+        let client = client.clone();
+        calls.spawn(async move { client.get(request("key")).await.unwrap() });
+    }
+    while let Some(call) = calls.join_next().await {
+        call.unwrap();
+    }
+    // Eight calls of 50ms, two at a time.
+    assert!(started.elapsed() >= Duration::from_millis(200));
+}
+
+#[tokio::test]
+async fn a_dropped_call_is_cancelled_and_frees_its_slot() {
+    let service = Arc::new(TestService::default());
+    let server = DemoServer::from_arc(Arc::clone(&service)).with_max_multiplexed_calls(1);
+    let client = client(server).await;
+    let call = spin(&client, &service).await;
+    call.abort();
+    let response = tokio::time::timeout(Duration::from_secs(5), client.get(request("key")))
+        .await
+        .expect("the dropped call still holds the only slot");
+    assert_eq!(response.unwrap().get_ref().value().to_string(), "key");
+    // The handler saw its cancellation, so its blocking work stopped too.
+    let spins = service.spins.load(Ordering::Relaxed);
+    tokio::time::sleep(Duration::from_millis(50)).await;
+    assert!(service.spins.load(Ordering::Relaxed) <= spins + 1);
+}
+
+#[tokio::test]
+async fn calls_time_out_after_the_timeout_of_their_method() {
+    let service = Arc::new(TestService::default());
+    let server = DemoServer::from_arc(Arc::clone(&service)).with_max_multiplexed_calls(1);
+    let client = client(server).await;
+    let spinning = spin(&client, &service).await;
+    // The Put waits for the slot that the spinning Get holds.
+    let started = Instant::now();
+    let status = client.put(request("key")).await.unwrap_err();
+    assert_eq!(status.code(), tonic::Code::DeadlineExceeded);
+    assert!(started.elapsed() >= Duration::from_millis(1500));
+    assert_eq!(service.puts.load(Ordering::Relaxed), 0);
+    spinning.abort();
+}
+
+#[tokio::test]
+async fn calls_are_memoized() {
+    let service = Arc::new(TestService::with_delay(Duration::from_millis(50)));
+    let server = DemoServer::from_arc(Arc::clone(&service))
+        .with_memoization(ResponseCacheConfig::default(), Vec::new());
+    let client = client(server).await;
+    let mut calls = tokio::task::JoinSet::new();
+    for _ in 0..10 {
+        let client = client.clone();
+        calls.spawn(async move { client.get(request("key")).await });
+    }
+    while let Some(call) = calls.join_next().await {
+        assert_eq!(call.unwrap().unwrap().get_ref().value().to_string(), "key");
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), 1);
+}
+
+#[tokio::test]
+async fn calls_run_on_the_executor_pool_of_their_method() {
+    let config = ExecutorPoolConfig { threads: 1, max_pending: 2, ..Default::default() };
+    let pool = ExecutorPool::new("cpu", config).unwrap();
+    let service = TestService::with_delay(Duration::from_millis(100));
+    let client = client(DemoServer::new(service).with_executor_pool("cpu", pool)).await;
+    let mut calls = tokio::task::JoinSet::new();
+    for _ in 0..6 {
+        let client = client.clone();
+        calls.spawn(async move {
+            let mut batch = BatchRequest::new();
+            batch.requests_mut().push(request("key"));
+            client.batch_get(batch).await
+        });
+    }
+    let mut rejected = 0;
+    while let Some(call) = calls.join_next().await {
+        if let Err(status) = call.unwrap() {
+            assert_eq!(status.code(), tonic::Code::ResourceExhausted);
+            rejected += 1;
+        }
+    }
+    assert_eq!(rejected, 4);
+}
+
+/// Benchmark: calls/s and latency of small unary calls, each on its own
+/// HTTP/2 stream and multiplexed over one stream. Run with
+/// `cargo test --release --test multiplexing -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn multiplexed_versus_standard_unary() {
+    const CALLERS: usize = 256;
+    const CALLS_PER_CALLER: usize = 200;
+    let server = DemoServer::new(TestService::default()).with_max_multiplexed_calls(CALLERS);
+    let channel = connect(serve(server).await).await;
+    let multiplex = DemoMultiplexClient::connect(DemoClient::new(channel.clone())).await.unwrap();
+    for multiplexed in [false, true] {
+        let started = Instant::now();
+        let mut callers = tokio::task::JoinSet::new();
+        for _ in 0..CALLERS {
+            let mut client = DemoClient::new(channel.clone());
+            let multiplex = multiplex.clone();
+            callers.spawn(async move {
+                let mut latencies = Vec::with_capacity(CALLS_PER_CALLER);
+                for _ in 0..CALLS_PER_CALLER {
+                    let call = Instant::now();
+                    if multiplexed {
+                        multiplex.get(request("key")).await.unwrap();
+                    } else {
+                        client.get(request("key")).await.unwrap();
+                    }
+                    latencies.push(call.elapsed());
+                }
+                latencies
+            });
+        }
+        let mut latencies: Vec<Duration> = Vec::new();
+        while let Some(caller) = callers.join_next().await {
+            latencies.extend(caller.unwrap());
+        }
+        let elapsed = started.elapsed();
+        let calls = latencies.len();
+        println!(
+            "{}: {:.0} calls/s, p50 {:?}, p99 {:?}",
+            if multiplexed { "multiplexed" } else { "one stream per call" },
+            calls as f64 / elapsed.as_secs_f64(),
+            common::quantile(&mut latencies, 0.5),
+            common::quantile(&mut latencies, 0.99),
+        );
+    }
+}
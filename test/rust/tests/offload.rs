@@ -0,0 +1,101 @@
+//! Tests of decoding large messages off the I/O task, from the
+//! `offload_threshold_bytes` method option.
+
+mod common;
+
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::DemoClient;
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+use rust_grpc_generator_tests::full::{BatchRequest, BatchResponse};
+use tonic::transport::Channel;
+
+/// A batch of `count` requests whose keys are `size` bytes long, answered
+/// with a response of about the same size.
+fn batch(count: usize, size: usize) -> BatchRequest {
+    let mut batch = BatchRequest::new();
+    for i in 0..count {
+        let mut key = i.to_string();
+        key.extend(std::iter::repeat('k').take(size));
+        batch.requests_mut().push(request(&key));
+    }
+    batch
+}
+
+#[tokio::test]
+async fn large_responses_are_decoded() {
+    let addr = serve(DemoServer::new(TestService::default())).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    // 4MiB, above BatchGet's 1MiB threshold.
+    let response = client.batch_get(batch(64, 64 << 10)).await.unwrap().into_inner();
+    assert_eq!(response.responses().len(), 64);
+    assert!(response.responses().get(3).unwrap().value().to_string().starts_with("3k"));
+    // And below it.
+    let response = client.batch_get(batch(2, 16)).await.unwrap().into_inner();
+    assert_eq!(response.responses().len(), 2);
+}
+
+/// `BatchGet` as it was called before offloading: decoded inline, on the
+/// task that polls the call.
+async fn batch_get_inline(
+    channel: Channel,
+    batch: BatchRequest,
+) -> Result<tonic::Response<BatchResponse>, tonic::Status> {
+    let mut grpc = tonic::client::Grpc::new(channel);
+    grpc.ready().await.map_err(|e| tonic::Status::unknown(e.to_string()))?;
+    let path = http::uri::PathAndQuery::from_static("/grpc.rust.test.Demo/BatchGet");
+    grpc.unary(tonic::Request::new(batch), path, grpc::codec::ProtoCodec::default()).await
+}
+
+/// Latency test: small calls share one runtime thread with calls that
+/// return 16MiB, decoded inline or offloaded. The server runs on a runtime
+/// of its own. Run with
+/// `cargo test --release --test offload -- --ignored --nocapture`.
+#[test]
+#[ignore]
+fn small_call_latency_beside_huge_responses() {
+    let (addr_sender, addr_receiver) = std::sync::mpsc::channel();
+    std::thread::spawn(move || {
+        tokio::runtime::Runtime::new().unwrap().block_on(async {
+            addr_sender.send(serve(DemoServer::new(TestService::default())).await).unwrap();
+            std::future::pending::<()>().await
+        })
+    });
+    let addr = addr_receiver.recv().unwrap();
+    let runtime = tokio::runtime::Builder::new_current_thread().enable_all().build().unwrap();
+    runtime.block_on(async {
+        let huge = batch(256, 64 << 10);
+        for offloaded in [false, true] {
+            let channel = connect(addr).await;
+            let mut small = DemoClient::new(channel.clone());
+            let background = tokio::spawn({
+                let (channel, huge) = (channel.clone(), huge.clone());
+                async move {
+                    loop {
+                        if offloaded {
+                            DemoClient::new(channel.clone()).batch_get(huge.clone()).await.unwrap();
+                        } else {
+                            batch_get_inline(channel.clone(), huge.clone()).await.unwrap();
+                        }
+                    }
+                }
+            });
+            let mut latencies = Vec::with_capacity(2000);
+            for _ in 0..2000 {
+                let call = Instant::now();
+                small.get(request("key")).await.unwrap();
+                latencies.push(call.elapsed());
+                tokio::time::sleep(Duration::from_micros(500)).await;
+            }
+            background.abort();
+            println!(
+                "{}: small call p50 {:?}, p99 {:?}, max {:?}",
+                if offloaded { "offloaded" } else { "inline" },
+                common::quantile(&mut latencies, 0.5),
+                common::quantile(&mut latencies, 0.99),
+                common::quantile(&mut latencies, 1.0),
+            );
+        }
+    });
+}
@@ -0,0 +1,97 @@
+//! Tests of `<Service>PoolClient`, from the `pool_client` option.
+
+mod common;
+
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::{DemoPoolClient, PoolPolicy};
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+
+#[tokio::test]
+async fn round_robin_spreads_calls_evenly() {
+    let services = [Arc::new(TestService::default()), Arc::new(TestService::default())];
+    let mut channels = Vec::new();
+    for service in &services {
+        channels.push(connect(serve(DemoServer::from_arc(Arc::clone(service))).await).await);
+    }
+    let pool = DemoPoolClient::new(channels);
+    for _ in 0..10 {
+        pool.get(request("key")).await.unwrap();
+    }
+    assert_eq!(services[0].gets.load(Ordering::Relaxed), 5);
+    assert_eq!(services[1].gets.load(Ordering::Relaxed), 5);
+}
+
+#[tokio::test]
+async fn least_in_flight_counts_open_response_streams() {
+    let services = [Arc::new(TestService::default()), Arc::new(TestService::default())];
+    let mut channels = Vec::new();
+    for service in &services {
+        channels.push(connect(serve(DemoServer::from_arc(Arc::clone(service))).await).await);
+    }
+    let pool = DemoPoolClient::new(channels).with_policy(PoolPolicy::LeastInFlight);
+
+    // The stream stays in flight on the first channel while it is open, even
+    // though its call returned once the response headers arrived.
+    let mut watch = pool.watch(request("key")).await.unwrap().into_inner();
+    assert!(watch.message().await.unwrap().is_some());
+    assert_eq!(services[0].watches.load(Ordering::Relaxed), 1);
+    for _ in 0..4 {
+        pool.get(request("key")).await.unwrap();
+    }
+    assert_eq!(services[0].gets.load(Ordering::Relaxed), 0);
+    assert_eq!(services[1].gets.load(Ordering::Relaxed), 4);
+
+    drop(watch);
+    for _ in 0..4 {
+        pool.get(request("key")).await.unwrap();
+    }
+    assert!(services[0].gets.load(Ordering::Relaxed) > 0);
+}
+
+/// Load test: many concurrent callers over one connection, then over a pool
+/// of several. Run with
+/// `cargo test --release --test pool_client -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn pool_throughput_scales_with_channels() {
+    const CALLERS: usize = 256;
+    const CALLS_PER_CALLER: usize = 200;
+    let addr = serve(DemoServer::new(TestService::default())).await;
+    for channels in [1, 2, 4, 8] {
+        let mut pool_channels = Vec::new();
+        for _ in 0..channels {
+            pool_channels.push(connect(addr).await);
+        }
+        let pool = DemoPoolClient::new(pool_channels).with_policy(PoolPolicy::LeastInFlight);
+        let started = Instant::now();
+        let mut callers = tokio::task::JoinSet::new();
+        for _ in 0..CALLERS {
+            let pool = pool.clone();
+            callers.spawn(async move {
+                let mut latencies = Vec::with_capacity(CALLS_PER_CALLER);
+                for _ in 0..CALLS_PER_CALLER {
+                    let call = Instant::now();
+                    pool.get(request("key")).await.unwrap();
+                    latencies.push(call.elapsed());
+                }
+                latencies
+            });
+        }
+        let mut latencies: Vec<Duration> = Vec::new();
+        while let Some(caller) = callers.join_next().await {
+            latencies.extend(caller.unwrap());
+        }
+        let elapsed = started.elapsed();
+        let calls = latencies.len();
+        println!(
+            "{channels} channel(s): {:.0} calls/s, p50 {:?}, p99 {:?}",
+            calls as f64 / elapsed.as_secs_f64(),
+            common::quantile(&mut latencies, 0.5),
+            common::quantile(&mut latencies, 0.99),
+        );
+    }
+}
@@ -0,0 +1,142 @@
+//! Tests of pooled request messages, from the `pooled_request` method
+//! option. Get and Put receive pooled requests.
+
+mod common;
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Arc;
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::DemoClient;
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+use tonic::transport::Channel;
+
+/// The system allocator, counting what Rust code allocates. upb allocates
+/// its arenas with `malloc` from C, which only [`heap_in_use`] sees.
+struct Counting;
+
+static ALLOCATIONS: AtomicUsize = AtomicUsize::new(0);
+static ALLOCATED: AtomicUsize = AtomicUsize::new(0);
+
+// SAFETY: every call is passed on to `System` unchanged.
+unsafe impl GlobalAlloc for Counting {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        ALLOCATED.fetch_add(layout.size(), Ordering::Relaxed);
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        ALLOCATED.fetch_add(new_size, Ordering::Relaxed);
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: Counting = Counting;
+
+/// The bytes that `malloc` has handed out and not taken back, from Rust and
+/// from C, where glibc tells.
+fn heap_in_use() -> Option<usize> {
+    #[cfg(all(target_os = "linux", target_env = "gnu"))]
+    {
+        // SAFETY: mallinfo2 has no preconditions.
+        Some(unsafe { libc::mallinfo2() }.uordblks)
+    }
+    #[cfg(not(all(target_os = "linux", target_env = "gnu")))]
+    {
+        None
+    }
+}
+
+/// How much `after` exceeds `before`, if both are known.
+fn growth(before: Option<usize>, after: Option<usize>) -> String {
+    match (before, after) {
+        (Some(before), Some(after)) => format!("{}KiB", (after as isize - before as isize) >> 10),
+        _ => "an unknown amount".to_owned(),
+    }
+}
+
+async fn client(service: &Arc<TestService>) -> DemoClient<Channel> {
+    DemoClient::new(connect(serve(DemoServer::from_arc(Arc::clone(service))).await).await)
+}
+
+/// Makes `calls` Get calls from 16 callers, each with the key that `key`
+/// gives for the call's number.
+async fn call_concurrently(client: &DemoClient<Channel>, calls: usize, key: fn(usize) -> String) {
+    let mut callers = tokio::task::JoinSet::new();
+    for caller in 0..16 {
+        let mut client = client.clone();
+        callers.spawn(async move {
+            for call in (caller..calls).step_by(16) {
+                let key = key(call);
+                let response = client.get(request(&key)).await.unwrap();
+                assert_eq!(response.get_ref().value().to_string(), key);
+            }
+        });
+    }
+    while let Some(caller) = callers.join_next().await {
+        caller.unwrap();
+    }
+}
+
+#[tokio::test(flavor = "multi_thread", worker_threads = 4)]
+async fn requests_are_answered_when_tasks_move_between_threads() {
+    let service = Arc::new(TestService::default());
+    call_concurrently(&client(&service).await, 2000, |call| format!("{call:0>64}")).await;
+    assert_eq!(service.gets.load(Ordering::Relaxed), 2000);
+}
+
+#[tokio::test]
+async fn a_handler_can_take_its_request_out_of_the_pool() {
+    let service = Arc::new(TestService { unpooled_requests: true, ..Default::default() });
+    call_concurrently(&client(&service).await, 100, |call| call.to_string()).await;
+    assert_eq!(service.gets.load(Ordering::Relaxed), 100);
+}
+
+/// Allocations: 20,000 Get calls from 16 callers with 1KiB keys, with 64KiB
+/// keys, and with 1KiB keys and a 2MiB one every 500 calls, with messages
+/// reused from the pool and with a new message for each call. Reports the
+/// allocations and bytes that Rust code made per call, and how much the heap
+/// in use and the resident set grew. Run with
+/// `cargo test --release --test pooled_request -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn allocations_and_resident_set() {
+    const CALLS: usize = 20_000;
+    let workloads: [(&str, fn(usize) -> String); 3] = [
+        ("1KiB", |call| format!("{call:0>1024}")),
+        ("64KiB", |call| format!("{call:0>65536}")),
+        ("1KiB with 2MiB outliers", |call| {
+            let len = if call % 500 == 0 { 2 << 20 } else { 1024 };
+            format!("{call:0>len$}")
+        }),
+    ];
+    for (workload, key) in workloads {
+        for unpooled_requests in [false, true] {
+            let service = Arc::new(TestService { unpooled_requests, ..Default::default() });
+            let client = client(&service).await;
+            // Warms up the connection and the pools.
+            call_concurrently(&client, 1000, key).await;
+            let (heap, resident) = (heap_in_use(), common::resident_bytes());
+            let allocations = ALLOCATIONS.load(Ordering::Relaxed);
+            let allocated = ALLOCATED.load(Ordering::Relaxed);
+            call_concurrently(&client, CALLS, key).await;
+            println!(
+                "{workload}, {}: {:.1} allocations and {}B from Rust per call, heap in use \
+                 grew {}, resident set grew {}",
+                if unpooled_requests { "a new message per call" } else { "pooled" },
+                (ALLOCATIONS.load(Ordering::Relaxed) - allocations) as f64 / CALLS as f64,
+                (ALLOCATED.load(Ordering::Relaxed) - allocated) / CALLS,
+                growth(heap, heap_in_use()),
+                growth(resident, common::resident_bytes()),
+            );
+        }
+    }
+}
@@ -0,0 +1,93 @@
+//! Tests of pre-encoded responses, from the `pre_encoded` method option.
+//! Put and Watch are pre-encoded.
+
+mod common;
+
+use std::time::{Duration, Instant};
+
+use common::{connect, request, response, serve, PutResponse, TestService};
+use rust_grpc_generator_tests::full::demo_client::DemoClient;
+use rust_grpc_generator_tests::full::demo_server::{watch_channel, DemoServer, Encoded};
+use rust_grpc_generator_tests::full::Response;
+use tonic::transport::Channel;
+
+async fn client(put_response: PutResponse) -> DemoClient<Channel> {
+    let service = TestService { put_response, ..Default::default() };
+    DemoClient::new(connect(serve(DemoServer::new(service)).await).await)
+}
+
+#[test]
+fn clones_share_the_encoding() {
+    let encoded = Encoded::new(&response("value")).unwrap();
+    let clone = encoded.clone();
+    assert_eq!(encoded.as_bytes().as_ptr(), clone.as_bytes().as_ptr());
+    let bytes = protobuf::Serialize::serialize(&response("value")).unwrap();
+    assert_eq!(clone.into_bytes(), bytes);
+}
+
+#[tokio::test]
+async fn a_response_encoded_once_is_served_to_every_call() {
+    let encoded = Encoded::new(&response("config")).unwrap();
+    let client = client(PutResponse::EncodedOnce(encoded)).await;
+    for key in ["a", "b", "c"] {
+        let response = client.clone().put(request(key)).await.unwrap();
+        assert_eq!(response.get_ref().value().to_string(), "config");
+    }
+}
+
+#[tokio::test]
+async fn bytes_encoded_elsewhere_are_sent_as_they_are() {
+    let bytes = protobuf::Serialize::serialize(&response("elsewhere")).unwrap();
+    let encoded = Encoded::<Response>::from_bytes(bytes.into());
+    let response = client(PutResponse::EncodedOnce(encoded)).await.put(request("key")).await;
+    assert_eq!(response.unwrap().get_ref().value().to_string(), "elsewhere");
+}
+
+#[tokio::test]
+async fn a_streamed_response_channel_carries_encoded_messages() {
+    let (sender, mut receiver) = watch_channel();
+    let encoded = Encoded::new(&response("event")).unwrap();
+    sender.send(Ok(encoded.clone())).await.unwrap();
+    let received = tokio_stream::StreamExt::next(&mut receiver).await.unwrap().unwrap();
+    assert_eq!(received.as_bytes(), encoded.as_bytes());
+
+    let mut client = client(PutResponse::Key).await;
+    let mut watch = client.watch(request("key")).await.unwrap().into_inner();
+    assert_eq!(watch.message().await.unwrap().unwrap().value().to_string(), "key");
+}
+
+/// Throughput of a 1MiB Put response to 32 callers, encoded for every call
+/// and encoded once. Run with
+/// `cargo test --release --test pre_encoded -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn one_mib_response_throughput() {
+    const RUN_FOR: Duration = Duration::from_secs(5);
+    let large = response(&"x".repeat(1 << 20));
+    let modes = [
+        ("encoded for every call", PutResponse::EncodeEachCall(large.clone())),
+        ("encoded once", PutResponse::EncodedOnce(Encoded::new(&large).unwrap())),
+    ];
+    for (name, put_response) in modes {
+        let client = client(put_response).await;
+        let started = Instant::now();
+        let mut callers = tokio::task::JoinSet::new();
+        for _ in 0..32 {
+            let mut client = client.clone();
+            callers.spawn(async move {
+                let mut calls = 0;
+                while started.elapsed() < RUN_FOR {
+                    client.put(request("key")).await.unwrap();
+                    calls += 1;
+                }
+                calls
+            });
+        }
+        let mut calls = 0;
+        while let Some(caller) = callers.join_next().await {
+            calls += caller.unwrap();
+        }
+        let per_second = calls as f64 / started.elapsed().as_secs_f64();
+        println!("{name}: {per_second:.0} calls/s, each of 1MiB");
+    }
+}
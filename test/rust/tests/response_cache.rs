@@ -0,0 +1,129 @@
+//! Tests of the client response cache, from the `response_cache` option.
+
+mod common;
+
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::{DemoClient, ResponseCacheConfig};
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+use tonic::transport::Channel;
+
+async fn client(service: &Arc<TestService>) -> DemoClient<Channel> {
+    let channel = connect(serve(DemoServer::from_arc(Arc::clone(service))).await).await;
+    DemoClient::new(channel).with_response_cache(ResponseCacheConfig::default())
+}
+
+#[tokio::test]
+async fn repeated_calls_are_answered_from_the_cache() {
+    let service = Arc::new(TestService::default());
+    let mut client = client(&service).await;
+    for _ in 0..5 {
+        let response = client.get(request("key")).await.unwrap();
+        assert_eq!(response.get_ref().value().to_string(), "key");
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), 1);
+    let stats = client.response_cache_stats().unwrap();
+    assert_eq!((stats.hits, stats.misses, stats.entries), (4, 1, 1));
+}
+
+#[tokio::test]
+async fn calls_with_other_metadata_miss() {
+    let service = Arc::new(TestService::default());
+    let mut client = client(&service).await;
+    for user in ["alice", "bob", "alice"] {
+        let mut request = tonic::Request::new(request("key"));
+        request.metadata_mut().insert("authorization", user.parse().unwrap());
+        client.get(request).await.unwrap();
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), 2);
+}
+
+#[tokio::test]
+async fn errors_are_not_cached() {
+    let service = Arc::new(TestService::default());
+    let mut client = client(&service).await;
+    for _ in 0..2 {
+        client.get(request(common::FAIL)).await.unwrap_err();
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), 2);
+}
+
+/// Draws keys `0..n` with probability proportional to `1 / (rank + 1)^s`.
+struct Zipf {
+    cumulative: Vec<f64>,
+    state: u64,
+}
+
+impl Zipf {
+    fn new(n: usize, s: f64, seed: u64) -> Self {
+        let mut total = 0.0;
+        let cumulative = (0..n)
+            .map(|rank| {
+                total += 1.0 / ((rank + 1) as f64).powf(s);
+                total
+            })
+            .collect();
+        Self { cumulative, state: seed | 1 }
+    }
+
+    fn next(&mut self) -> usize {
+        // xorshift64*, which is plenty for picking keys.
+        self.state ^= self.state >> 12;
+        self.state ^= self.state << 25;
+        self.state ^= self.state >> 27;
+        let random = self.state.wrapping_mul(0x2545_f491_4f6c_dd1d) >> 11;
+        let target = random as f64 / (1u64 << 53) as f64 * self.cumulative.last().unwrap();
+        self.cumulative.partition_point(|&weight| weight < target)
+    }
+}
+
+/// Load test: callers draw keys from a Zipfian distribution, with and
+/// without the cache, against a backend that takes 1ms per call. Run with
+/// `cargo test --release --test response_cache -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn zipfian_keys_hit_the_cache() {
+    const KEYS: usize = 10_000;
+    const CALLERS: usize = 64;
+    const CALLS_PER_CALLER: usize = 500;
+    for (name, cached) in [("uncached", false), ("cached", true)] {
+        let service = Arc::new(TestService::with_delay(Duration::from_millis(1)));
+        let channel = connect(serve(DemoServer::from_arc(Arc::clone(&service))).await).await;
+        let mut client = DemoClient::new(channel);
+        if cached {
+            client = client.with_response_cache(ResponseCacheConfig::default());
+        }
+        let started = Instant::now();
+        let mut callers = tokio::task::JoinSet::new();
+        for caller in 0..CALLERS {
+            let mut client = client.clone();
+            callers.spawn(async move {
+                let mut keys = Zipf::new(KEYS, 1.0, caller as u64 + 1);
+                let mut latencies = Vec::with_capacity(CALLS_PER_CALLER);
+                for _ in 0..CALLS_PER_CALLER {
+                    let key = keys.next().to_string();
+                    let call = Instant::now();
+                    client.get(request(&key)).await.unwrap();
+                    latencies.push(call.elapsed());
+                }
+                latencies
+            });
+        }
+        let mut latencies: Vec<Duration> = Vec::new();
+        while let Some(caller) = callers.join_next().await {
+            latencies.extend(caller.unwrap());
+        }
+        let elapsed = started.elapsed();
+        println!(
+            "{name}: {:.0} calls/s, p50 {:?}, p99 {:?}, {} backend calls, {:?}",
+            latencies.len() as f64 / elapsed.as_secs_f64(),
+            common::quantile(&mut latencies, 0.5),
+            common::quantile(&mut latencies, 0.99),
+            service.gets.load(Ordering::Relaxed),
+            client.response_cache_stats(),
+        );
+    }
+}
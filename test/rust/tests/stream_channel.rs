@@ -0,0 +1,103 @@
+//! Tests of the bounded `<method>_channel()` streams, from the
+//! `stream_buffer` method option.
+
+mod common;
+
+use std::sync::Arc;
+use std::time::Instant;
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::{
+    stream_channel, upload_channel, DemoClient, StreamGauge,
+};
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+use tokio::sync::mpsc::error::TrySendError;
+
+#[tokio::test]
+async fn upload_through_a_bounded_channel() {
+    let addr = serve(DemoServer::new(TestService::default())).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    let (sender, receiver) = upload_channel();
+    let gauge = Arc::clone(sender.gauge());
+    let producer = tokio::spawn(async move {
+        for i in 0..1000 {
+            sender.send(request(&i.to_string())).await.unwrap();
+        }
+    });
+    let response = client.upload(receiver).await.unwrap();
+    producer.await.unwrap();
+    assert_eq!(response.get_ref().value().to_string(), "1000");
+    assert_eq!(gauge.sent(), 1000);
+    assert_eq!(gauge.queued(), 0);
+}
+
+#[tokio::test]
+async fn try_send_rejects_when_full() {
+    let (sender, receiver) = stream_channel(2, Arc::new(StreamGauge::default()));
+    sender.try_send(1).unwrap();
+    sender.try_send(2).unwrap();
+    assert!(matches!(sender.try_send(3), Err(TrySendError::Full(3))));
+    assert_eq!((sender.gauge().queued(), sender.gauge().rejected()), (2, 1));
+    drop(receiver);
+    assert_eq!(sender.gauge().queued(), 0);
+    assert!(matches!(sender.try_send(4), Err(TrySendError::Closed(4))));
+    assert_eq!(sender.send(5).await.unwrap_err().0, 5);
+    assert_eq!(sender.gauge().sent(), 2);
+}
+
+#[tokio::test(flavor = "multi_thread")]
+async fn queued_never_exceeds_the_buffer() {
+    use tokio_stream::StreamExt;
+    let (sender, mut receiver) = stream_channel(4, Arc::new(StreamGauge::default()));
+    let gauge = Arc::clone(sender.gauge());
+    let consumer = tokio::spawn(async move { while receiver.next().await.is_some() {} });
+    let watcher = {
+        let gauge = Arc::clone(&gauge);
+        tokio::spawn(async move {
+            let mut most = 0;
+            // Until both halves of the channel are dropped.
+            while Arc::strong_count(&gauge) > 2 {
+                most = most.max(gauge.queued());
+                tokio::task::yield_now().await;
+            }
+            most
+        })
+    };
+    for i in 0..100_000 {
+        sender.send(i).await.unwrap();
+    }
+    drop(sender);
+    consumer.await.unwrap();
+    // A message is counted before the receiver can take it, and uncounted
+    // just after, so the count may pass the buffer by the one in hand but
+    // never wraps below zero.
+    assert!(watcher.await.unwrap() <= 5);
+    assert_eq!(gauge.queued(), 0);
+}
+
+/// Benchmark: messages/s of an upload fed through channels of several
+/// sizes. Run with
+/// `cargo test --release --test stream_channel -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn upload_throughput_by_buffer_size() {
+    const MESSAGES: usize = 200_000;
+    let addr = serve(DemoServer::new(TestService::default())).await;
+    let mut client = DemoClient::new(connect(addr).await);
+    for capacity in [1, 8, 64, 512] {
+        let (sender, receiver) = stream_channel(capacity, Arc::new(StreamGauge::default()));
+        let started = Instant::now();
+        let producer = tokio::spawn(async move {
+            for i in 0..MESSAGES {
+                sender.send(request(&i.to_string())).await.unwrap();
+            }
+        });
+        let response = client.upload(receiver).await.unwrap();
+        producer.await.unwrap();
+        assert_eq!(response.get_ref().value().to_string(), MESSAGES.to_string());
+        println!(
+            "buffer of {capacity}: {:.0} messages/s",
+            MESSAGES as f64 / started.elapsed().as_secs_f64()
+        );
+    }
+}
@@ -0,0 +1,133 @@
+//! Tests of `serve_per_core`, from the `thread_per_core` option.
+
+#![cfg(unix)]
+
+mod common;
+
+use std::net::SocketAddr;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::DemoClient;
+use rust_grpc_generator_tests::full::demo_server::{serve_per_core, DemoServer};
+
+/// A loopback address that was free a moment ago.
+fn free_addr() -> SocketAddr {
+    std::net::TcpListener::bind("127.0.0.1:0").unwrap().local_addr().unwrap()
+}
+
+/// Starts `serve_per_core` on `threads` threads sharing `service`.
+async fn serve_sharded(service: &Arc<TestService>, threads: usize) -> SocketAddr {
+    let addr = free_addr();
+    let service = Arc::clone(service);
+    std::thread::spawn(move || {
+        serve_per_core(addr, threads, move || DemoServer::from_arc(Arc::clone(&service)))
+    });
+    // Wait for the listeners.
+    while tokio::net::TcpStream::connect(addr).await.is_err() {
+        tokio::time::sleep(Duration::from_millis(5)).await;
+    }
+    addr
+}
+
+#[test]
+fn zero_threads_is_an_error() {
+    let result = serve_per_core(free_addr(), 0, || DemoServer::new(TestService::default()));
+    assert!(result.is_err());
+}
+
+#[test]
+fn port_zero_is_an_error() {
+    let addr: SocketAddr = "127.0.0.1:0".parse().unwrap();
+    let result = serve_per_core(addr, 2, || DemoServer::new(TestService::default()));
+    assert!(result.is_err());
+}
+
+#[test]
+fn a_taken_address_is_an_error() {
+    let taken = std::net::TcpListener::bind("127.0.0.1:0").unwrap();
+    let addr = taken.local_addr().unwrap();
+    let result = serve_per_core(addr, 2, || DemoServer::new(TestService::default()));
+    assert!(result.is_err());
+}
+
+#[tokio::test]
+async fn serves_connections_on_every_thread() {
+    let service = Arc::new(TestService::default());
+    let addr = serve_sharded(&service, 4).await;
+    let mut calls = tokio::task::JoinSet::new();
+    for i in 0..32 {
+        calls.spawn(async move {
+            let mut client = DemoClient::new(connect(addr).await);
+            let response = client.get(request(&i.to_string())).await.unwrap();
+            assert_eq!(response.get_ref().value().to_string(), i.to_string());
+        });
+    }
+    while let Some(call) = calls.join_next().await {
+        call.unwrap();
+    }
+    assert_eq!(service.gets.load(Ordering::Relaxed), 32);
+}
+
+/// Load test: many connections to a server on a work-stealing runtime, then
+/// to `serve_per_core` with as many threads. Run with
+/// `cargo test --release --test thread_per_core -- --ignored --nocapture`.
+#[test]
+#[ignore]
+fn per_core_versus_work_stealing() {
+    const CONNECTIONS: usize = 64;
+    const CALLS_PER_CONNECTION: usize = 2000;
+    let threads = std::thread::available_parallelism().map_or(1, |n| n.get());
+    // The clients get a runtime of their own, so that both servers compete
+    // with them alike.
+    let clients = tokio::runtime::Runtime::new().unwrap();
+    for per_core in [false, true] {
+        let addr = if per_core {
+            clients.block_on(serve_sharded(&Arc::new(TestService::default()), threads))
+        } else {
+            let (addr_sender, addr_receiver) = std::sync::mpsc::channel();
+            std::thread::spawn(move || {
+                let runtime = tokio::runtime::Builder::new_multi_thread()
+                    .worker_threads(threads)
+                    .enable_all()
+                    .build()
+                    .unwrap();
+                runtime.block_on(async {
+                    addr_sender.send(serve(DemoServer::new(TestService::default())).await).unwrap();
+                    std::future::pending::<()>().await
+                })
+            });
+            addr_receiver.recv().unwrap()
+        };
+        let (elapsed, mut latencies) = clients.block_on(async {
+            let started = Instant::now();
+            let mut connections = tokio::task::JoinSet::new();
+            for _ in 0..CONNECTIONS {
+                connections.spawn(async move {
+                    let mut client = DemoClient::new(connect(addr).await);
+                    let mut latencies = Vec::with_capacity(CALLS_PER_CONNECTION);
+                    for _ in 0..CALLS_PER_CONNECTION {
+                        let call = Instant::now();
+                        client.get(request("key")).await.unwrap();
+                        latencies.push(call.elapsed());
+                    }
+                    latencies
+                });
+            }
+            let mut latencies: Vec<Duration> = Vec::new();
+            while let Some(connection) = connections.join_next().await {
+                latencies.extend(connection.unwrap());
+            }
+            (started.elapsed(), latencies)
+        });
+        println!(
+            "{}: {:.0} calls/s, p50 {:?}, p99 {:?}",
+            if per_core { "serve_per_core" } else { "work-stealing" },
+            latencies.len() as f64 / elapsed.as_secs_f64(),
+            common::quantile(&mut latencies, 0.5),
+            common::quantile(&mut latencies, 0.99),
+        );
+    }
+}
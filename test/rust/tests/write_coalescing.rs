@@ -0,0 +1,67 @@
+//! Tests of write coalescing, from the `write_coalescing` option.
+
+mod common;
+
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use common::{connect, request, serve, TestService};
+use rust_grpc_generator_tests::full::demo_client::{CoalescingPolicy, DemoClient};
+use rust_grpc_generator_tests::full::demo_server::DemoServer;
+use rust_grpc_generator_tests::full::Request;
+
+/// `count` requests whose payload is `size` bytes.
+fn requests(count: usize, size: usize) -> impl tokio_stream::Stream<Item = Request> {
+    let mut message = request("key");
+    message.set_payload(&*vec![7u8; size]);
+    tokio_stream::iter(std::iter::repeat(message).take(count))
+}
+
+#[tokio::test]
+async fn coalesced_requests_all_arrive() {
+    let channel = connect(serve(DemoServer::new(TestService::default())).await).await;
+    let mut client = DemoClient::new(channel).with_write_coalescing(CoalescingPolicy::default());
+    let response = client.upload(requests(1000, 64)).await.unwrap();
+    assert_eq!(response.get_ref().value().to_string(), "1000");
+}
+
+#[tokio::test]
+async fn a_held_response_is_released_after_the_delay() {
+    let server = DemoServer::new(TestService::default()).with_write_coalescing(CoalescingPolicy {
+        max_messages: 64,
+        max_delay: Duration::from_millis(5),
+    });
+    let mut client = DemoClient::new(connect(serve(server).await).await);
+    let mut watch = client.watch(request("key")).await.unwrap().into_inner();
+    // The server sends one message every 10ms, far fewer than
+    // `max_messages`, so each is released once `max_delay` has passed.
+    let started = Instant::now();
+    for _ in 0..3 {
+        let message = watch.message().await.unwrap().unwrap();
+        assert_eq!(message.value().to_string(), "key");
+    }
+    assert!(started.elapsed() < Duration::from_secs(1));
+}
+
+/// Load test: streams 64-byte messages with and without coalescing. Run
+/// with `cargo test --release --test write_coalescing -- --ignored --nocapture`.
+#[tokio::test(flavor = "multi_thread")]
+#[ignore]
+async fn small_message_throughput() {
+    const MESSAGES: usize = 1_000_000;
+    let addr = serve(DemoServer::new(TestService::default())).await;
+    for policy in [None, Some(CoalescingPolicy::default())] {
+        let mut client = DemoClient::new(connect(addr).await);
+        if let Some(policy) = policy {
+            client = client.with_write_coalescing(policy);
+        }
+        let started = Instant::now();
+        client.upload(requests(MESSAGES, 64)).await.unwrap();
+        let elapsed = started.elapsed();
+        println!(
+            "{}: {:.0} messages/s",
+            if policy.is_some() { "coalesced" } else { "uncoalesced" },
+            MESSAGES as f64 / elapsed.as_secs_f64(),
+        );
+    }
+}
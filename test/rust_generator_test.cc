@@ -0,0 +1,795 @@
+/*
+ * Copyright 2025 The gRPC Authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/rust_generator.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <google/protobuf/compiler/rust/context.h>
+#include <google/protobuf/compiler/rust/naming.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/text_format.h>
+#include <gtest/gtest.h>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+
+namespace rust_grpc_generator {
+namespace {
+
+namespace protobuf = google::protobuf;
+namespace rust = google::protobuf::compiler::rust;
+
+using ::testing::HasSubstr;
+using ::testing::Not;
+
+const protobuf::ServiceDescriptor *FixtureService() {
+  const protobuf::FileDescriptor *file =
+      protobuf::DescriptorPool::generated_pool()->FindFileByName(
+          "test/fixture.proto");
+  return file == nullptr ? nullptr : file->FindServiceByName("Demo");
+}
+
+// A service without options, in test/plain.proto.
+const protobuf::ServiceDescriptor *PlainService() {
+  const protobuf::FileDescriptor *file =
+      protobuf::DescriptorPool::generated_pool()->FindFileByName(
+          "test/plain.proto");
+  return file == nullptr ? nullptr : file->FindServiceByName("Plain");
+}
+
+// Generates the code of `service`, set up like the plugin does.
+std::string Generate(const protobuf::ServiceDescriptor *service,
+                     const GeneratorOptions &options) {
+  std::string output;
+  {
+    protobuf::io::StringOutputStream stream(&output);
+    protobuf::io::Printer printer(&stream);
+    absl::StatusOr<rust::Options> opts =
+        rust::Options::Parse("experimental-codegen=enabled,kernel=upb");
+    EXPECT_TRUE(opts.ok()) << opts.status();
+    std::vector<const protobuf::FileDescriptor *> files = {service->file()};
+    absl::flat_hash_map<std::string, std::string> import_path_to_crate_name;
+    rust::RustGeneratorContext generator_context(&files,
+                                                 &import_path_to_crate_name);
+    rust::Context ctx(&*opts, &generator_context, &printer,
+                      {rust::RustInternalModuleName(*service->file())});
+    GenerateService(ctx, service, options);
+  }
+  return output;
+}
+
+std::string GenerateWith(
+    const std::vector<std::pair<std::string, std::string>> &parameters) {
+  GeneratorOptions options;
+  std::string error;
+  EXPECT_TRUE(ParseGeneratorOptions(parameters, &options, &error)) << error;
+  return Generate(FixtureService(), options);
+}
+
+// Drops all whitespace, so that checks on the output do not depend on how it
+// is indented or wrapped.
+std::string Squash(absl::string_view code) {
+  std::string squashed;
+  for (char c : code) {
+    if (!absl::ascii_isspace(static_cast<unsigned char>(c))) {
+      squashed.push_back(c);
+    }
+  }
+  return squashed;
+}
+
+// The lines of `code` without their indentation, and without blank lines.
+std::vector<std::string> TrimmedLines(absl::string_view code) {
+  std::vector<std::string> lines;
+  for (absl::string_view line : absl::StrSplit(code, '\n')) {
+    line = absl::StripAsciiWhitespace(line);
+    if (!line.empty()) {
+      lines.emplace_back(line);
+    }
+  }
+  return lines;
+}
+
+// Matches generated code that contains `code`, ignoring whitespace.
+MATCHER_P(Emits, code, "") {
+  return Squash(arg).find(Squash(code)) != std::string::npos;
+}
+
+TEST(ParseGeneratorOptionsTest, BareKeyEnablesTheFeature) {
+  GeneratorOptions options;
+  std::string error;
+  ASSERT_TRUE(ParseGeneratorOptions({{"pool_client", ""}}, &options, &error));
+  EXPECT_TRUE(options.pool_client);
+  EXPECT_FALSE(options.load_reports);
+}
+
+TEST(ParseGeneratorOptionsTest, AcceptsTrueAndFalse) {
+  GeneratorOptions options;
+  std::string error;
+  ASSERT_TRUE(ParseGeneratorOptions(
+      {{"pool_client", "true"}, {"pool_client", "false"}, {"hedging", "true"}},
+      &options, &error));
+  EXPECT_FALSE(options.pool_client);
+  EXPECT_TRUE(options.hedging);
+}
+
+TEST(ParseGeneratorOptionsTest, RejectsOtherValues) {
+  GeneratorOptions options;
+  std::string error;
+  EXPECT_FALSE(
+      ParseGeneratorOptions({{"pool_client", "yes"}}, &options, &error));
+  EXPECT_THAT(error, HasSubstr("pool_client"));
+}
+
+TEST(ParseGeneratorOptionsTest, IgnoresTheProtobufOptions) {
+  GeneratorOptions options;
+  std::string error;
+  EXPECT_TRUE(ParseGeneratorOptions(
+      {{"experimental-codegen", "enabled"}, {"kernel", "upb"}}, &options,
+      &error));
+}
+
+TEST(ValidateServiceTest, AcceptsTheFixture) {
+  const protobuf::ServiceDescriptor *service = FixtureService();
+  ASSERT_NE(service, nullptr);
+  std::string error;
+  EXPECT_TRUE(ValidateService(service, &error)) << error;
+}
+
+// Builds a file with the messages of the fixture and a service with the
+// methods in `methods`, given as `MethodDescriptorProto`s in text format.
+class InvalidServiceTest : public ::testing::Test {
+protected:
+  InvalidServiceTest() : pool_(protobuf::DescriptorPool::generated_pool()) {}
+
+  const protobuf::ServiceDescriptor *
+  BuildService(const std::vector<std::string> &methods) {
+    protobuf::FileDescriptorProto file;
+    ++files_;
+    file.set_name(absl::StrCat("invalid_", files_, ".proto"));
+    file.set_package("grpc.rust.test");
+    file.set_syntax("proto3");
+    file.add_dependency("grpc/rust/options.proto");
+    file.add_dependency("test/messages.proto");
+    protobuf::ServiceDescriptorProto *service = file.add_service();
+    service->set_name(absl::StrCat("Invalid", files_));
+    for (const std::string &method : methods) {
+      EXPECT_TRUE(protobuf::TextFormat::ParseFromString(method,
+                                                        service->add_method()))
+          << method;
+    }
+    const protobuf::FileDescriptor *built = pool_.BuildFile(file);
+    EXPECT_NE(built, nullptr);
+    return built == nullptr ? nullptr : built->service(0);
+  }
+
+  // The error ValidateService reports for the methods, or "" if they are
+  // valid.
+  std::string ValidationError(const std::vector<std::string> &methods) {
+    const protobuf::ServiceDescriptor *service = BuildService(methods);
+    if (service == nullptr) {
+      return "the service does not build";
+    }
+    std::string error;
+    return ValidateService(service, &error) ? "" : error;
+  }
+
+private:
+  protobuf::DescriptorPool pool_;
+  int files_ = 0;
+};
+
+
+// A unary method of the fixture's messages with `options`.
+std::string UnaryMethod(absl::string_view options) {
+  return absl::StrCat(R"pb(
+    name: "Get"
+    input_type: ".grpc.rust.test.Request"
+    output_type: ".grpc.rust.test.Response"
+    options { )pb", options, " }");
+}
+
+TEST_F(InvalidServiceTest, AcceptsAPlainMethod) {
+  EXPECT_EQ(ValidationError({UnaryMethod("")}), "");
+}
+
+TEST_F(InvalidServiceTest, CacheTtl) {
+  EXPECT_EQ(ValidationError({UnaryMethod(R"pb(
+              idempotency_level: NO_SIDE_EFFECTS
+              [grpc.rust.method] { cache_ttl { seconds: 1 } }
+            )pb")}),
+            "");
+  EXPECT_THAT(ValidationError({UnaryMethod(R"pb(
+                idempotency_level: IDEMPOTENT
+                [grpc.rust.method] { cache_ttl { seconds: 1 } }
+              )pb")}),
+              HasSubstr("cache_ttl is only valid on unary methods"));
+  EXPECT_THAT(ValidationError({R"pb(
+                name: "Watch"
+                input_type: ".grpc.rust.test.Request"
+                output_type: ".grpc.rust.test.Response"
+                server_streaming: true
+                options {
+                  idempotency_level: NO_SIDE_EFFECTS
+                  [grpc.rust.method] { cache_ttl { seconds: 1 } }
+                }
+              )pb"}),
+              HasSubstr("cache_ttl is only valid on unary methods"));
+  for (const char *ttl : {"{}", "{ seconds: -1 }", "{ nanos: -1 }",
+                          "{ nanos: 1000000000 }"}) {
+    EXPECT_THAT(ValidationError({UnaryMethod(absl::StrCat(
+                    "idempotency_level: NO_SIDE_EFFECTS "
+                    "[grpc.rust.method] { cache_ttl ",
+                    ttl, " }"))}),
+                HasSubstr("cache_ttl must be positive"))
+        << ttl;
+  }
+}
+
+TEST(GenerateServiceTest, PlainOutputHasOnlyTheClient) {
+  const std::string output = GenerateWith({});
+  EXPECT_THAT(output, Emits("pub mod demo_client {"));
+  EXPECT_THAT(output, Emits("pub struct DemoClient<T> {"));
+  EXPECT_THAT(output, Not(Emits("PoolClient")));
+  EXPECT_THAT(output, Not(Emits("pub mod demo_server")));
+  EXPECT_THAT(output, Not(Emits("BatchingClient")));
+}
+
+// Without options, the code is the client alone, line for line as in
+// test/plain.rs.
+TEST(GenerateServiceTest, PlainOutputMatchesTheGolden) {
+  ASSERT_NE(PlainService(), nullptr);
+  std::ifstream file("test/plain.rs");
+  ASSERT_TRUE(file.is_open());
+  std::stringstream golden;
+  golden << file.rdbuf();
+  EXPECT_EQ(TrimmedLines(Generate(PlainService(), GeneratorOptions())),
+            TrimmedLines(golden.str()));
+}
+
+TEST(GenerateServiceTest, Batching) {
+  const std::string output = GenerateWith({{"batching", ""}});
+  EXPECT_THAT(output, Emits("pub struct DemoBatchingClient<T> {"));
+  EXPECT_THAT(output, Emits("get: Batcher<super::Request, super::Response>,"));
+  EXPECT_THAT(output, Emits("let response = "
+                            "client.batch_get(batch).await?.into_inner();"));
+}
+
+TEST(GenerateServiceTest, ServerOption) {
+  const std::string output = GenerateWith({{"server", ""}});
+  EXPECT_THAT(output, Emits("pub mod demo_server {"));
+  EXPECT_THAT(output, Emits("pub trait Demo:"));
+  EXPECT_THAT(output, Emits("pub struct DemoServer<T> {"));
+}
+
+TEST(GenerateServiceTest, ServerOnlyOptionsEmitTheServer) {
+  for (const char *option : {"thread_per_core", "deadline_propagation",
+                             "cancellation", "codel", "fair_scheduling",
+                             "memoization"}) {
+    EXPECT_THAT(GenerateWith({{option, ""}}), Emits("pub mod demo_server {"))
+        << option;
+  }
+  EXPECT_THAT(GenerateWith({{"server", "false"}, {"pool_client", ""}}),
+              Not(Emits("pub mod demo_server")));
+}
+
+TEST(GenerateServiceTest, LoadReports) {
+  const std::string output =
+      GenerateWith({{"server", ""}, {"pool_client", ""}, {"load_reports", ""}});
+  EXPECT_THAT(output, Emits("pub struct LoadReport {"));
+  EXPECT_THAT(output, Emits("PowerOfTwoChoices,"));
+  EXPECT_THAT(output, Emits("pub fn with_load_reporter<F>("));
+  // Streaming calls carry the report in their headers, and the pool client
+  // records it for them too.
+  EXPECT_THAT(output, Emits(R"rs(
+    let mut response = response.await?;
+    response.headers_mut().extend(guard.report());
+  )rs"));
+  EXPECT_THAT(output, Emits(R"rs(
+    let result = client.watch(request).await;
+    self.record_load(index, &result);
+  )rs"));
+}
+
+TEST(GenerateServiceTest, Hedging) {
+  const std::string output = GenerateWith({{"hedging", ""}});
+  EXPECT_THAT(output,
+              Emits("pub fn with_hedging(mut self, policy: HedgingPolicy)"));
+  // Only idempotent methods are hedged.
+  EXPECT_THAT(output, Emits("async fn hedged_get("));
+  EXPECT_THAT(output, Emits("async fn hedged_put("));
+  EXPECT_THAT(output, Not(Emits("async fn hedged_batch_get(")));
+  // A winning hedge and a failure leave the latency window alone.
+  EXPECT_THAT(output, Emits(R"rs(
+    result = &mut second => match result {
+        Ok(_) => result,
+  )rs"));
+  EXPECT_THAT(output, Emits(R"rs(
+    if result.is_ok() {
+        window.record(started.elapsed(), &self.policy);
+    }
+  )rs"));
+  EXPECT_THAT(output, Not(Emits("self.samples.lock().unwrap()")));
+}
+
+TEST(GenerateServiceTest, Coalescing) {
+  const std::string output = GenerateWith({{"coalescing", ""}});
+  EXPECT_THAT(output, Emits("pub fn with_coalescing(mut self) -> Self {"));
+  // Calls are keyed by their request and its metadata.
+  EXPECT_THAT(output,
+              Emits(".map(|encoded| request_key(encoded, req.metadata()))"));
+  EXPECT_THAT(output,
+              Emits("fn request_key(mut key: Vec<u8>, "
+                    "metadata: &tonic::metadata::MetadataMap) -> Bytes {"));
+  // A cancelled leader hands the call over to one follower.
+  EXPECT_THAT(output, Emits("Flight::Shared(shared) => "
+                            "return unshare_result(&shared),"));
+  EXPECT_THAT(output, Emits("if follower.send(Handoff::Lead).is_ok() {"));
+  // Only methods without side effects are coalesced.
+  EXPECT_THAT(output, Emits("async fn call_get("));
+  EXPECT_THAT(output, Not(Emits("async fn call_put(")));
+  EXPECT_THAT(GenerateWith({}), Not(Emits("fn request_key(")));
+}
+
+TEST(GenerateServiceTest, UnaryMultiplexing) {
+  const std::string output =
+      GenerateWith({{"server", ""}, {"unary_multiplexing", ""}});
+  EXPECT_THAT(output, Emits("pub struct DemoMultiplexClient {"));
+  EXPECT_THAT(output,
+              Emits("pub fn with_max_multiplexed_calls(mut self, "
+                    "limit: usize) -> Self {"));
+  // The server runs at most `max_calls` calls, reads as many more to wait
+  // for a slot, and aborts them all when the reply stream is dropped.
+  EXPECT_THAT(output, Emits("let mut calls = tokio::task::JoinSet::new();"));
+  EXPECT_THAT(output, Emits("_ = sender.closed() => return,"));
+  EXPECT_THAT(output,
+              Emits("message = requests.message(), "
+                    "if !ended && waiting.len() < max_calls => message,"));
+  // A call dropped before its reply sends a cancel, which aborts it.
+  EXPECT_THAT(output, Emits(R"rs(
+    if self.shared.pending().calls.remove(&self.id).is_some() {
+        self.shared.cancel(self.id, self.method);
+    }
+  )rs"));
+  EXPECT_THAT(output, Emits(R"rs(
+    } else if let Some(call) = running.remove(&envelope.id) {
+        call.abort();
+    } else {
+        waiting.retain(|call| call.id != envelope.id);
+    }
+  )rs"));
+  // Calls keep the timeout of their method, and wait for room to be sent.
+  EXPECT_THAT(output,
+              Emits("let payload = self.shared.call(1, "
+                    "Bytes::from(payload), Some(PUT_TIMEOUT)).await?;"));
+  EXPECT_THAT(output,
+              Emits("tokio::sync::mpsc::channel(MULTIPLEX_SEND_QUEUE);"));
+  EXPECT_THAT(output, Not(Emits("unbounded_channel")));
+  // Envelopes are decoded by the handler function of their method, which
+  // offloads large BatchGet requests like a call of its own.
+  EXPECT_THAT(output, Emits(R"rs(
+    async fn handle_batch_get<T: Demo>(
+        inner: Arc<T>,
+        executor: Option<ExecutorPool>,
+        request: tonic::Request<Bytes>,
+    ) -> std::result::Result<
+        tonic::Response<super::BatchResponse>, tonic::Status> {
+        let request = decode_offloaded_request(request, 1048576).await?;
+  )rs"));
+  EXPECT_THAT(output, Emits(R"rs(
+    let request = tonic::Request::from_parts(
+        metadata.clone(), tonic::Extensions::default(), payload);
+  )rs"));
+  // Requests that handlers receive decoded are decoded from the envelope.
+  GeneratorOptions options;
+  options.server = true;
+  options.unary_multiplexing = true;
+  EXPECT_THAT(Generate(PlainService(), options), Emits(R"rs(
+    let request = <super::Request as protobuf::Parse>::parse(&payload)
+        .map_err(|_| tonic::Status::invalid_argument(
+            "failed to decode the request"))?;
+    let request = tonic::Request::from_parts(
+        metadata.clone(), tonic::Extensions::default(), request);
+  )rs"));
+  // Dropping the client resets the stream.
+  EXPECT_THAT(output, Emits(R"rs(
+    if let Some(reader) = self.reader.get() {
+        reader.abort();
+    }
+  )rs"));
+  EXPECT_THAT(output, Not(Emits("self.pending.lock().unwrap()")));
+}
+
+TEST(GenerateServiceTest, WriteCoalescing) {
+  const std::string output =
+      GenerateWith({{"server", ""}, {"write_coalescing", ""}});
+  EXPECT_THAT(output, Emits("pub struct CoalescingPolicy {"));
+  // Client-streaming and bidi requests are held back on the client...
+  const std::string coalesce =
+      "let req = req.map(|messages| "
+      "CoalescingStream::new(messages, self.write_coalescing));";
+  EXPECT_THAT(output,
+              Emits(coalesce +
+                    "decode_offloaded_response(self.inner.client_streaming("
+                    "req, path, codec).await?, 4096).await"));
+  EXPECT_THAT(output,
+              Emits(coalesce + "self.inner.streaming(req, path, codec).await"));
+  // ...and streamed responses on the server.
+  EXPECT_THAT(output, Emits("let write_coalescing = self.write_coalescing;"));
+}
+
+TEST(GenerateServiceTest, BatchReceive) {
+  const std::string output =
+      GenerateWith({{"server", ""}, {"batch_receive", ""}});
+  EXPECT_THAT(output, Emits("pub struct BatchReceiver<S, T> {"));
+  EXPECT_THAT(output, Emits(R"rs(
+    pub async fn next_batch(
+        &mut self,
+        max: usize,
+    ) -> std::result::Result<&mut Vec<T>, tonic::Status> {
+        self.batch.clear();
+  )rs"));
+  // Servers receive streamed requests in batches too.
+  EXPECT_THAT(output,
+              Emits("pub use super::demo_client::BatchReceiver;"));
+}
+
+TEST(GenerateServiceTest, StreamChannels) {
+  const std::string output = GenerateWith({});
+  EXPECT_THAT(output, Emits("pub fn upload_channel() -> "
+                            "(StreamSender<super::Request>, "
+                            "StreamReceiver<super::Request>) {"));
+  // A message is counted as queued before the receiver can take it.
+  EXPECT_THAT(output, Emits(R"rs(
+    self.gauge.queued.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+    self.gauge.sent.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+    permit.send(message);
+  )rs"));
+  // Pre-encoded responses are sent through the channel encoded.
+  EXPECT_THAT(GenerateWith({{"server", ""}}),
+              Emits("pub fn watch_channel() -> (StreamSender<"
+                    "std::result::Result<Encoded<super::Response>, "
+                    "tonic::Status>>,"));
+}
+
+TEST(GenerateServiceTest, Offload) {
+  const std::string output = GenerateWith({});
+  // Only methods with an offload threshold decode off the runtime.
+  EXPECT_THAT(output, Emits(R"rs(
+    let codec = OffloadCodec::default();
+    let path =
+        http::uri::PathAndQuery::from_static("/grpc.rust.test.Demo/BatchGet");
+  )rs"));
+  EXPECT_THAT(output, Emits("decode_offloaded_response(self.inner.unary("
+                            "req, path, codec).await?, 1048576).await"));
+  EXPECT_THAT(output, Emits(R"rs(
+    let codec = grpc::codec::ProtoCodec::default();
+    let path = http::uri::PathAndQuery::from_static("/grpc.rust.test.Demo/Get");
+  )rs"));
+  EXPECT_THAT(output, Emits(R"rs(
+    if encoded.len() < threshold {
+        return parse_message(&encoded);
+    }
+    tokio::task::spawn_blocking(move || parse_message(&encoded))
+  )rs"));
+}
+
+TEST(GenerateServiceTest, DecodePipeline) {
+  const std::string output = GenerateWith({{"server", ""}});
+  // Streamed requests are decoded `pipeline_depth` messages ahead of the
+  // handler, on the blocking pool above the offload threshold.
+  EXPECT_THAT(output, Emits("DecodePipeline::new(messages, 4, 4096)"));
+  EXPECT_THAT(output, Emits("DecodePipeline::new(messages, 2, 0)"));
+  EXPECT_THAT(output, Emits(R"rs(
+    while let Ok(slot) = sender.reserve().await {
+  )rs"));
+  EXPECT_THAT(GenerateWith({}), Not(Emits("DecodePipeline::new(")));
+}
+
+TEST(GenerateServiceTest, ThreadPerCore) {
+  const std::string output = GenerateWith({{"thread_per_core", ""}});
+  EXPECT_THAT(output, Emits("pub fn serve_per_core<T, F>("));
+  EXPECT_THAT(output, Emits("socket.set_reuseport(true)?;"));
+  EXPECT_THAT(output, Emits(R"rs(
+    if threads == 0 {
+        return Err("serve_per_core needs at least one thread".into());
+    }
+  )rs"));
+  // Each listener would get an ephemeral port of its own.
+  EXPECT_THAT(output, Emits(R"rs(
+    if addr.port() == 0 {
+        return Err("serve_per_core needs a fixed port, not port 0".into());
+    }
+  )rs"));
+  EXPECT_THAT(GenerateWith({{"server", ""}}), Not(Emits("serve_per_core")));
+}
+
+TEST(GenerateServiceTest, LocalTransport) {
+  const std::string output =
+      GenerateWith({{"server", ""}, {"local_transport", ""}});
+  EXPECT_THAT(output, Emits("pub async fn connect_unix("));
+  EXPECT_THAT(output, Emits("pub async fn serve_unix<T: Demo>("));
+  EXPECT_THAT(output,
+              Emits("let listener = tokio::net::UnixListener::bind(path)?;"));
+  EXPECT_THAT(GenerateWith({{"server", ""}}), Not(Emits("unix")));
+}
+
+TEST(GenerateServiceTest, Deadlines) {
+  const std::string output =
+      GenerateWith({{"server", ""}, {"deadline_propagation", ""}});
+  EXPECT_THAT(output, Emits("pub const PUT_TIMEOUT: std::time::Duration = "
+                            "std::time::Duration::new(1, 500000000);"));
+  // The default gives way to a timeout the caller set.
+  EXPECT_THAT(output, Emits("set_default_timeout(&mut req, PUT_TIMEOUT);"));
+  EXPECT_THAT(output, Emits(R"rs(
+    if !req.metadata().contains_key("grpc-timeout") {
+        req.set_timeout(timeout);
+    }
+  )rs"));
+  EXPECT_THAT(output, Not(Emits("GET_TIMEOUT")));
+  EXPECT_THAT(output, Emits("let request = record_deadline(request);"));
+  EXPECT_THAT(output, Emits("pub fn propagate_deadline<M, N>("));
+  EXPECT_THAT(GenerateWith({{"server", ""}}),
+              Not(Emits("fn propagate_deadline")));
+}
+
+TEST(GenerateServiceTest, Cancellation) {
+  const std::string output = GenerateWith({{"cancellation", ""}});
+  EXPECT_THAT(output, Emits("pub struct CallCancellation("));
+  EXPECT_THAT(output, Emits("let (request, cancel_on_drop) = "
+                            "attach_cancellation(request);"));
+  // Multiplexed calls run through the handler function of their method,
+  // and so are cancelled when they are aborted.
+  const std::string multiplexed = GenerateWith(
+      {{"cancellation", ""}, {"server", ""}, {"unary_multiplexing", ""}});
+  EXPECT_THAT(multiplexed, Emits(R"rs(
+    async fn handle_get<T: Demo>(
+        inner: Arc<T>,
+        request: tonic::Request<Bytes>,
+    ) -> std::result::Result<tonic::Response<super::Response>, tonic::Status> {
+        let (request, cancel_on_drop) = attach_cancellation(request);
+  )rs"));
+  EXPECT_THAT(multiplexed,
+              Emits("let response = handle_get(inner, request).await?;"));
+}
+
+TEST(GenerateServiceTest, AdmissionLimits) {
+  const std::string output =
+      GenerateWith({{"server", ""}, {"unary_multiplexing", ""}});
+  EXPECT_THAT(output, Emits("Admission::new(4, 16),"));
+  EXPECT_THAT(output, Emits(R"rs(
+    let Some(mut admitted) = Admitted::try_new(&self.admission, 2) else {
+        return Box::pin(async move { Ok(overloaded_response()) });
+    };
+  )rs"));
+  // A streamed response holds its admission until it ends.
+  EXPECT_THAT(output, Emits(R"rs(
+    let res = grpc.server_streaming(method, req).await;
+    let res = res.map(|inner| {
+        tonic::body::Body::new(GuardedBody { inner, _guard: admitted })
+    });
+  )rs"));
+  // Multiplexed calls are admitted like calls of their own.
+  EXPECT_THAT(output, Emits(R"rs(
+    let Some(mut admitted) = Admitted::try_new(&state.admission, 2) else {
+        return Err(tonic::Status::resource_exhausted(
+            "too many calls to the method"));
+    };
+    admitted.wait_turn().await;
+  )rs"));
+}
+
+TEST(GenerateServiceTest, Codel) {
+  const std::string output = GenerateWith({{"codel", ""}});
+  EXPECT_THAT(output, Emits(R"rs(
+    let arrival = std::time::Instant::now();
+    if self.codel[0].should_shed(arrival) {
+  )rs"));
+  // The wait ends when the handler starts, on its executor.
+  EXPECT_THAT(output, Emits(R"rs(
+    let handler = async move {
+        codel[2].record(arrival, std::time::Instant::now());
+        <T as Demo>::batch_get(&inner, request).await
+    };
+  )rs"));
+  EXPECT_THAT(output, Emits(R"rs(
+    run_blocking(async move {
+        codel[4].record(arrival, std::time::Instant::now());
+  )rs"));
+  EXPECT_THAT(output, Emits("struct UploadSvc<T: Demo>(pub Arc<T>, "
+                            "Arc<[Codel]>, std::time::Instant);"));
+  // Multiplexed calls are shed and timed with the method's controller.
+  const std::string multiplexed = GenerateWith(
+      {{"codel", ""}, {"server", ""}, {"unary_multiplexing", ""}});
+  EXPECT_THAT(multiplexed, Emits(R"rs(
+    let arrival = std::time::Instant::now();
+    if state.codel[1].should_shed(arrival) {
+  )rs"));
+  EXPECT_THAT(multiplexed,
+              Emits("let response = handle_put(inner, "
+                    "Arc::clone(&state.codel), arrival, request).await?;"));
+}
+
+TEST(GenerateServiceTest, FairScheduling) {
+  const std::string output = GenerateWith(
+      {{"server", ""}, {"fair_scheduling", ""}, {"unary_multiplexing", ""}});
+  EXPECT_THAT(output, Emits(R"rs(
+    assert!(slots > 0, "fair scheduling needs at least one slot");
+  )rs"));
+  EXPECT_THAT(output, Emits("scheduler.acquire(0, 8, tenant).await"));
+  // A streamed response holds its slot until it ends.
+  EXPECT_THAT(output, Emits(R"rs(
+    let res = grpc.server_streaming(method, req).await;
+    let res = res.map(|inner| {
+        tonic::body::Body::new(
+            GuardedBody { inner, _guard: (admitted, fair_turn) })
+    });
+  )rs"));
+  // Multiplexed calls are scheduled as the tenant of their stream.
+  EXPECT_THAT(output, Emits("fair_flow: self.fair_scheduler.as_ref().map("
+                            "|scheduler| (Arc::clone(scheduler), "
+                            "scheduler.tenant(req.headers()))),"));
+  EXPECT_THAT(output, Emits(R"rs(
+    let _fair_turn = match &state.fair_flow {
+        Some((scheduler, tenant)) => Some(
+            Arc::clone(scheduler)
+                .acquire(0, 8, tenant.clone())
+                .await,
+        ),
+  )rs"));
+}
+
+TEST(GenerateServiceTest, AdaptiveConcurrency) {
+  const std::string output = GenerateWith({{"adaptive_concurrency", ""}});
+  // The limits are clamped to the policy, so it is checked up front.
+  EXPECT_THAT(output, Emits(R"rs(
+    pub fn with_adaptive_concurrency(
+        mut self, policy: AdaptiveConcurrencyPolicy) -> Self {
+        policy.validate();
+  )rs"));
+  EXPECT_THAT(output, Emits(R"rs(
+    self.states[index]
+        .lock()
+        .unwrap_or_else(std::sync::PoisonError::into_inner)
+  )rs"));
+  EXPECT_THAT(output, Not(Emits("lock().unwrap()")));
+}
+
+TEST(GenerateServiceTest, Broadcaster) {
+  const std::string output = GenerateWith({{"server", ""}});
+  EXPECT_THAT(output, Emits(R"rs(
+    pub type WatchBroadcaster = Broadcaster<super::Response>;
+  )rs"));
+  // Receives reuse one allocation per subscriber.
+  EXPECT_THAT(output, Emits(R"rs(
+    next: tokio_util::sync::ReusableBoxFuture<'static, Received<M>>,
+  )rs"));
+  EXPECT_THAT(output, Emits("this.next.set(receive_broadcast(receiver));"));
+}
+
+TEST(GenerateServiceTest, Memoization) {
+  const std::string output = GenerateWith({{"memoization", ""}});
+  EXPECT_THAT(output, Emits(R"rs(
+    pub fn with_memoization(
+        mut self,
+        config: ResponseCacheConfig,
+        key_headers: Vec<http::HeaderName>,
+    ) -> Self {
+  )rs"));
+  // The configured headers are part of the key.
+  EXPECT_THAT(output, Emits(R"rs(
+    let key = memoizer.key(request.metadata(), request.get_ref());
+  )rs"));
+  EXPECT_THAT(output, Emits(R"rs(
+    memoizer.call(0, key,
+  )rs"));
+  // Multiplexed calls share the memoizer, and reply with its encoding.
+  EXPECT_THAT(GenerateWith({{"memoization", ""}, {"unary_multiplexing", ""}}),
+              Emits(R"rs(
+                let response =
+                    handle_get(inner, state.memoizer.clone(), request).await?;
+                Ok(response.into_inner().into_bytes())
+              )rs"));
+}
+
+TEST(GenerateServiceTest, ExecutorPool) {
+  const std::string output = GenerateWith({{"server", ""}});
+  // Cores are checked before any thread starts.
+  EXPECT_THAT(output, Emits(".map(CoreSet::of)"));
+  EXPECT_THAT(output, Emits("if core >= libc::CPU_SETSIZE as usize {"));
+  // Workers are counted as they start; later threads are unpinned.
+  EXPECT_THAT(output, Emits(R"rs(
+    if n >= self.workers {
+        // The pool is running by now, with no one to report to; a
+        // thread left on its worker's core is only slower.
+        let _ = self.unpinned.apply();
+        return;
+    }
+  )rs"));
+  // Pinning errors are returned from `new`.
+  EXPECT_THAT(output, Emits(R"rs(
+    if let Some(pinning) = pinning {
+        pinning.wait()?;
+    }
+  )rs"));
+  EXPECT_THAT(output, Emits("return Err(std::io::Error::last_os_error());"));
+  // Multiplexed calls run on the pool of their method too.
+  EXPECT_THAT(GenerateWith({{"server", ""}, {"unary_multiplexing", ""}}),
+              Emits("let response = handle_batch_get(inner, "
+                    "state.executor_pools[2].clone(), request).await?;"));
+}
+
+TEST(GenerateServiceTest, PooledRequest) {
+  const std::string output = GenerateWith({{"server", ""}});
+  EXPECT_THAT(output, Emits(R"rs(
+    static GET_REQUEST_POOL: std::cell::RefCell<RequestPool<super::Request>> =
+        std::cell::RefCell::new(RequestPool::new());
+  )rs"));
+  // A message dropped on another thread goes back to the decoding thread.
+  EXPECT_THAT(output, Emits(R"rs(
+    if Arc::ptr_eq(&pool.returned, &self.home) {
+        pool.give(message.take().unwrap(), len, decoded);
+    }
+  )rs"));
+  EXPECT_THAT(output, Emits(R"rs(
+    if let Some(message) = message {
+        self.home.give(message, len, decoded);
+    }
+  )rs"));
+  EXPECT_THAT(output, Emits(R"rs(
+    let returned = std::mem::take(&mut *self.returned.messages());
+  )rs"));
+}
+
+TEST(GenerateServiceTest, PoolClient) {
+  const std::string output = GenerateWith({{"pool_client", ""}});
+  EXPECT_THAT(output, Emits("pub struct DemoPoolClient<T> {"));
+  EXPECT_THAT(output, Emits("LeastInFlight,"));
+  // Unary calls count as in flight until they return.
+  EXPECT_THAT(output, Emits(R"rs(
+    pub async fn get(
+        &self,
+        request: impl tonic::IntoRequest<)rs"));
+  EXPECT_THAT(output, Emits("let _in_flight = "
+                            "InFlightGuard::new(&self.state, index);"));
+  // Streaming calls count until their response stream is dropped.
+  EXPECT_THAT(output, Emits("tonic::Response<InFlightStream<"));
+  EXPECT_THAT(output, Emits(R"rs(
+    result.map(|response| {
+        response.map(|messages| InFlightStream {
+            inner: messages,
+            _in_flight: in_flight
+        })
+    })
+  )rs"));
+  EXPECT_THAT(output, Not(Emits("PowerOfTwoChoices")));
+}
+
+} // namespace
+} // namespace rust_grpc_generator